@@ -0,0 +1,7 @@
+gcc -Wall -fPIC -fvisibility=hidden -c library.c -o library.o
+# only the encrypter_ functions are exported: the internals of the client are made local to the archive too,
+# so that they don't clash with the symbols of the applications linking it
+objcopy --localize-hidden library.o
+ar rcs libencrypter.a library.o
+gcc -shared library.o -lpthread -o libencrypter.so
+rm library.o
@@ -1,3 +1,7 @@
+#define _GNU_SOURCE			//statx, before any system header (see unix/io.c)
+
+#include "cross/compress.c"
+
 #ifdef _WIN32
 	#include "win/io.c"
 	#include "win/startup.c"
@@ -10,19 +14,51 @@
 
 
 #include "cross/queue.c"
+#include "cross/pool.c"
+#include "cross/admission.c"
 #include "cross/requests.c"
+#include "cross/jobs.c"
+#include "cross/listing.c"
+#include "cross/metadata.c"
+#include "cross/seedlog.c"
+#include "cross/dropfolder.c"
 #include "cross/startup.c"
+#include "cross/reactor.c"
+#include "cross/batch.c"
 
 client_configuration conf;
 
 int main(int argc, char* args[]) {
 
-	//display a welcome message, different if you're running on Unix or Windows
-	welcome_message();
-	
+	//the seed log is compacted without any server
+	if (argc == 2 && strcmp(args[1], "-C") == 0) {
+
+		long before, after;
+
+		if (compact_seed_log(&before, &after) < 0) {
+			printf("\nError: the seed log %s could not be compacted!\n\n", SEED_LOG_FILE);
+			return 1;
+		}
+
+		printf("\nSeed log compacted: %li records, %li kept\n\n", before, after);
+		return 0;
+	}
+
 	//configure application parameters
 	client_read_and_set_arguments(argc, args, &conf);
 
+	//a batch prints nothing but its results
+	if (conf.batch != NULL || conf.action == DIRECTORY_ENC_ACTION || conf.action == DIRECTORY_DEC_ACTION || conf.action == RESTORE_ACTION) {
+		int result = run_batch(&conf);
+		close_seed_log(&client_seed_log);
+		return result;
+	}
+
+	//display a welcome message, different if you're running on Unix or Windows
+	welcome_message();
+
+	printf("\tAddress chosen:\t%s\n\tPort chosen:\t%i\n\n", conf.address, conf.port);
+
 
 	//start action on a parallel thread
 	thread action;
@@ -34,6 +70,7 @@ int main(int argc, char* args[]) {
 
 	//join given action
 	join_thread(&action, NULL);
+	close_seed_log(&client_seed_log);
 
 	//end
 	return 0;	
@@ -0,0 +1,180 @@
+#define ADDRESS_LENGTH		64
+#define ADMISSION_SLOTS		256		//slots of the hash table of the clients
+#define MAX_RETRY_AFTER		60		//max seconds suggested to an overloaded client
+#define DEFAULT_THROUGHPUT	104857600	//100 mb/s, used to guess how long the in-flight bytes will take before anything finished
+
+
+
+/*
+* Structure which counts the requests of a single client which are being served.
+*/
+typedef struct client_count {
+	char address[ADDRESS_LENGTH];
+	int active;
+	struct client_count *next;
+} client_count;
+
+
+/*
+* Structure which defines the limits of the server and what is currently admitted. Requests which would go
+* over a limit are refused with OVERLOAD_MSG and a hint of the seconds to wait before retrying.
+*	-max_inflight:		max bytes of ENCR and DECR requests being served at the same time (0 means no limit)
+*	-max_per_client:	max requests of the same client being served at the same time (0 means no limit)
+*	-inflight:		bytes currently admitted
+*	-clients:		hash table of the clients with admitted requests
+*	-done_bytes, busy_ms:	bytes encrypted and time spent doing it, used to guess the throughput
+*	-rejected:		number of refused requests (connections refused because the queue is full included)
+*	-sem:			mutex semaphore used to access the structure
+*/
+typedef struct {
+	long max_inflight;
+	int max_per_client;
+	long inflight;
+	client_count *clients[ADMISSION_SLOTS];
+	long done_bytes;
+	long busy_ms;
+	long rejected;
+	semaphore sem;
+} admission;
+
+
+
+int start_admission(admission *target) {
+	bzero(target, sizeof(admission));
+	return start_semaphore_ex(&target->sem);
+}
+
+
+unsigned int address_hash(char *address) {
+
+	unsigned int hash = 5381;
+
+	while(*address != '\0')
+		hash = hash * 33 + (unsigned char)*address++;
+
+	return hash % ADMISSION_SLOTS;
+}
+
+
+/*
+* Function used to count a refused request which never reached admit_request (e.g. its connection couldn't be queued).
+*/
+void count_rejected(admission *target) {
+	semaphore_wait(&target->sem);
+	target->rejected++;
+	semaphore_signal(&target->sem);
+}
+
+
+/*
+* Function used to admit a new request.
+* ARGUMENTS:
+*	-target:	the admission of the server
+*	-client:	address of the client which sent the request
+*	-bytes:		bytes which the request will process (0 for requests which don't encrypt anything)
+*	-retry_after:	where the suggested seconds to wait are written if the request is refused
+* RETURN VALUE:
+*	0 if the request is admitted (release_request must be called when it's over), -1 if it is refused
+*/
+int admit_request(admission *target, char *client, long bytes, int *retry_after) {
+
+	if(bytes < 0)
+		bytes = 0;
+
+	semaphore_wait(&target->sem);
+
+	client_count **slot = &target->clients[address_hash(client)];
+	client_count *count = *slot;
+
+	while(count != NULL && strcmp(count->address, client) != 0)
+		count = count->next;
+
+	if(target->max_per_client > 0 && count != NULL && count->active >= target->max_per_client) {
+		target->rejected++;
+		semaphore_signal(&target->sem);
+		*retry_after = 1;
+		return -1;
+	}
+
+	//a request bigger than the limit is still admitted when nothing else is running, or it would never be
+	if(target->max_inflight > 0 && target->inflight > 0 && target->inflight + bytes > target->max_inflight) {
+
+		long throughput = target->busy_ms > 0 ? target->done_bytes * 1000 / target->busy_ms : DEFAULT_THROUGHPUT;
+		long seconds = 1 + (target->inflight + bytes - target->max_inflight) / (throughput > 0 ? throughput : 1);
+
+		target->rejected++;
+		semaphore_signal(&target->sem);
+		*retry_after = seconds > MAX_RETRY_AFTER ? MAX_RETRY_AFTER : (int)seconds;
+		return -1;
+	}
+
+	if(count == NULL) {
+		if((count = (client_count *)malloc(sizeof(client_count))) == NULL) {
+			semaphore_signal(&target->sem);
+			*retry_after = 1;
+			return -1;
+		}
+		snprintf(count->address, ADDRESS_LENGTH, "%s", client);
+		count->active	= 0;
+		count->next	= *slot;
+		*slot		= count;
+	}
+
+	count->active++;
+	target->inflight += bytes;
+
+	semaphore_signal(&target->sem);
+
+	return 0;
+}
+
+
+/*
+* Function used when an admitted request is over.
+* ARGUMENTS:
+*	-target:	the admission of the server
+*	-client:	address of the client which sent the request
+*	-bytes:		bytes given to admit_request
+*	-elapsed:	milliseconds spent serving the request (0 if it isn't an encryption)
+*/
+void release_request(admission *target, char *client, long bytes, long elapsed) {
+
+	if(bytes < 0)
+		bytes = 0;
+
+	semaphore_wait(&target->sem);
+
+	client_count **slot = &target->clients[address_hash(client)];
+
+	while(*slot != NULL && strcmp((*slot)->address, client) != 0)
+		slot = &(*slot)->next;
+
+	if(*slot != NULL && --(*slot)->active == 0) {
+		client_count *to_free = *slot;
+		*slot = to_free->next;
+		free(to_free);
+	}
+
+	target->inflight -= bytes;
+
+	if(elapsed > 0) {
+		target->done_bytes	+= bytes;
+		target->busy_ms		+= elapsed;
+	}
+
+	semaphore_signal(&target->sem);
+}
+
+
+int stop_admission(admission *target) {
+
+	for(int i=0; i<ADMISSION_SLOTS; i++) {
+		while(target->clients[i] != NULL) {
+			client_count *next = target->clients[i]->next;
+			free(target->clients[i]);
+			target->clients[i] = next;
+		}
+	}
+
+	return stop_semaphore(&target->sem);
+}
@@ -0,0 +1,1106 @@
+#define BATCH_NOT_ANSWERED	-1		//status of a command which couldn't be sent or whose answer was lost
+#define BATCH_CONNECT_TRIES	5		//times a connection of a batch is tried before giving up
+#define BATCH_RETRY_WAIT	200		//ms waited before trying a connection again, more at every try
+#define BATCH_IDLE_WAIT		5		//ms a connection without commands waits before looking for them again
+#define BATCH_MAX_QUEUED	1024		//commands read ahead of the connections and queued to the servers, at most
+#define BATCH_RING_POINTS	64		//points of every server on the ring of SHARD_BY_HASH
+#define BATCH_DEFAULT_WEIGHT	65536		//bytes counted for a command whose size is not known
+
+
+/*
+* Structure which defines a command of a batch.
+*	-number:	line of the command in the batch, its results are printed with it
+*	-line:		the command as it was read
+*	-words:		copy of line split in words, the strings of conf point inside it
+*	-conf:		the command, as client_handle_command would read it
+*	-weight:	bytes the command is expected to move (the size of the file for directory jobs)
+*	-lost:		servers (a bit each) which refused the command or couldn't be reached, it's not given to them again
+*	-next:		next command in the same queue
+*/
+typedef struct batch_command {
+	int number;
+	char *line;
+	char *words;
+	client_configuration conf;
+	long weight;
+	int lost;
+	struct batch_command *next;
+} batch_command;
+
+
+/*
+* Structure which defines a server of a batch.
+*	-negotiated:	client_configuration of its connections (address, port and protocol)
+*	-probe:		connection opened to learn the protocol, probed is set until a batch_connection takes it
+*			(an unused v1 connection would keep a v1 listener waiting)
+*	-workers:	connections which still reach the server, commands are given to it only while there are some
+*	-first, last:	commands queued for the server, queued counts them
+*	-outstanding:	weight of the commands queued or sent to the server which are not over yet
+*/
+typedef struct {
+	client_configuration negotiated;
+	io_interface probe;
+	int probed;
+	int workers;
+	batch_command *first;
+	batch_command *last;
+	int queued;
+	long outstanding;
+} batch_server;
+
+
+/*
+* Structure which defines a point of a server on the ring of SHARD_BY_HASH.
+*/
+typedef struct {
+	unsigned int point;
+	int server;
+} batch_point;
+
+
+/*
+* Structure which defines a batch: commands read from a file (or stdin), one per line with the same syntax as
+* the command line ("-e seed path", "-R sort=size", "-t 500 -S"...), executed over several connections at once,
+* to one or more servers sharing the same files. Results are printed on stdout as lines which start with the number
+* of the command and a tab: "n\t-\tline" for every line of the body of an answer, then "n\tstatus\thint\tcommand"
+* when the command is over. status is BATCH_NOT_ANSWERED for commands which no server could answer.
+* Every field but output is protected by sem.
+*	-source:	where the commands are read from, read counts its lines (NULL for directory jobs)
+*	-generated:	commands of a directory job, made before the connections start (see list_batch_directory)
+*	-ended:		set once every command was read
+*	-defaults:	client_configuration given on the command line
+*	-servers:	the servers of the batch, no_servers of them
+*	-ring:		points of the servers sorted, ring_size of them
+*	-queued:	commands in the queues of the servers
+*	-sending:	commands taken by the connections which are not over yet
+*	-window:	commands a v2 connection sends before waiting for the first answer
+*	-failed:	commands which got no answer (protected by output, the mutex of stdout)
+*/
+typedef struct {
+	FILE *source;
+	int read;
+	batch_command *generated;
+	int ended;
+	client_configuration *defaults;
+	batch_server servers[CLIENT_MAX_SERVERS];
+	int no_servers;
+	batch_point ring[CLIENT_MAX_SERVERS * BATCH_RING_POINTS];
+	int ring_size;
+	int queued;
+	int sending;
+	int window;
+	int failed;
+	semaphore sem;
+	semaphore output;
+} batch_run;
+
+
+/*
+* Structure which gives a batch_connection its batch and the index of its server.
+*/
+typedef struct {
+	batch_run *run;
+	int server;
+} batch_worker;
+
+
+/*
+* Structure which keeps the part of the body of the answer to a command which doesn't end with a new line yet.
+*/
+typedef struct {
+	batch_run *run;
+	int number;
+	char *data;
+	int length;
+	int capacity;
+} batch_body;
+
+
+void free_batch_command(batch_command *command) {
+
+	free_client_command(&command->conf);
+	free(command->line);
+	free(command->words);
+	free(command);
+}
+
+
+/*
+* Function used to create a command of a batch, which still has to be parsed.
+* RETURN VALUE:
+*	The command, NULL if there's no memory for it
+*/
+batch_command *make_batch_command(batch_run *run, int number, char *line) {
+
+	batch_command *command = (batch_command *)malloc(sizeof(batch_command));
+
+	if(command == NULL || (command->line = strdup(line)) == NULL || (command->words = strdup(line)) == NULL) {
+		free(command != NULL ? command->line : NULL);
+		free(command);
+		return NULL;
+	}
+
+	command->number		= number;
+	command->weight		= BATCH_DEFAULT_WEIGHT;
+	command->lost		= 0;
+	command->next		= NULL;
+	command->conf		= *run->defaults;
+	command->conf.batch	= NULL;
+	command->conf.action	= 0;
+
+	return command;
+}
+
+
+/*
+* Function used to print the result of a command of a batch. Encryptions are logged like client_handle_command does.
+* ARGUMENTS:
+*	-run:		the batch
+*	-command:	the command which is over
+*	-status:	status answered by the server, BATCH_NOT_ANSWERED if there was none
+*	-hint:		integer sent after the status (e.g. seconds to wait with OVERLOAD_MSG), 0 if none
+*/
+void print_batch_result(batch_run *run, batch_command *command, int status, int hint) {
+
+	semaphore_wait(&run->output);
+
+	printf("%i\t%i\t%i\t%s\n", command->number, status, hint, command->line);
+	fflush(stdout);
+
+	if(status == BATCH_NOT_ANSWERED)
+		run->failed++;
+
+	if((status == FIN_MSG && command->conf.action == ENC_ACTION) || (status == MORE_MSG && command->conf.action == SUBMIT_ENC_ACTION))
+		log_action(command->conf.seed, command->conf.target);
+
+	semaphore_signal(&run->output);
+}
+
+
+/*
+* Function used to print the complete lines of the body of an answer, each one preceded by the number of its command.
+* ARGUMENTS:
+*	-body:		what arrived of the body and wasn't printed yet
+*	-last:		set when the body is over, the last line is printed even without a new line
+*/
+void print_batch_lines(batch_body *body, int last) {
+
+	int start = 0;
+
+	semaphore_wait(&body->run->output);
+
+	for(int i=0; i<body->length; i++) {
+
+		if(body->data[i] != '\n' && (!last || i + 1 < body->length))
+			continue;
+
+		int end = body->data[i] == '\n' ? i : i + 1;
+
+		if(end > start && body->data[end - 1] == '\r')
+			end--;
+
+		printf("%i\t-\t%.*s\n", body->number, end - start, body->data + start);
+		start = i + 1;
+	}
+
+	fflush(stdout);
+
+	semaphore_signal(&body->run->output);
+
+	if(start > 0)
+		memmove(body->data, body->data + start, body->length - start);
+
+	body->length -= start;
+}
+
+
+/*
+* Function given to read_client_answer to print the body of an answer as it arrives (see batch_body).
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int collect_batch_body(void *param, char *source, int length) {
+
+	batch_body *body = (batch_body *)param;
+
+	if(body->length + length > body->capacity) {
+
+		int capacity = body->capacity > 0 ? body->capacity : FRAME_BUFFER_SIZE;
+
+		while(capacity < body->length + length)
+			capacity *= 2;
+
+		char *data = (char *)realloc(body->data, capacity);
+		if(data == NULL)
+			return -1;
+
+		body->data	= data;
+		body->capacity	= capacity;
+	}
+
+	memcpy(body->data + body->length, source, length);
+	body->length += length;
+
+	print_batch_lines(body, 0);
+
+	return 0;
+}
+
+
+/*
+* Function used to read the answer of a command of a batch and to print its body.
+* ARGUMENTS:
+*	-run:		the batch
+*	-command:	the command, whose conf says the protocol of the connection
+*	-server:	the connection the command was sent to
+*	-frame:		buffer of FRAME_BUFFER_SIZE bytes
+*	-expanded:	buffer for compressed frames (see read_data_frame_from_socket)
+*	-response:	where the status of the answer is saved
+*	-hint:		where the integer sent after the status is saved
+* RETURN VALUE:
+*	On success 0 is returned, -1 if the connection broke before the whole answer arrived
+*/
+int receive_batch_answer(batch_run *run, batch_command *command, io_interface *server, char *frame, char **expanded, int *response, int *hint) {
+
+	batch_body body;
+
+	bzero(&body, sizeof(batch_body));
+
+	body.run	= run;
+	body.number	= command->number;
+
+	int result = read_client_answer(&command->conf, server, frame, expanded, collect_batch_body, &body, response, hint);
+
+	if(result == 0)
+		print_batch_lines(&body, 1);
+
+	free(body.data);
+
+	return result;
+}
+
+
+/*
+* Function used to read the next command of a batch: the commands of a directory job first, then the lines of the
+* source. Empty lines and lines starting with # are skipped, commands which are not valid are answered with
+* BATCH_NOT_ANSWERED at once. It must be called holding run->sem.
+* RETURN VALUE:
+*	The command, NULL when the batch is over
+*/
+batch_command *read_batch_command(batch_run *run) {
+
+	char line[SOCK_PACKET_SIZE];
+	batch_command *command = run->generated;
+
+	if(command != NULL) {
+		run->generated	= command->next;
+		command->next	= NULL;
+		return command;
+	}
+
+	while(!run->ended) {
+
+		if(fgets(line, sizeof(line), run->source) == NULL) {
+			run->ended = 1;
+			break;
+		}
+
+		int number = ++run->read;
+		int length = strlen(line);
+
+		while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r' || line[length - 1] == ' ' || line[length - 1] == '\t'))
+			line[--length] = '\0';
+
+		if(length == 0 || line[0] == '#')
+			continue;
+
+		if((command = make_batch_command(run, number, line)) == NULL) {
+			run->ended = 1;
+			break;
+		}
+
+		if(parse_client_command(command->words, &command->conf) == 0)
+			return command;
+
+		print_batch_result(run, command, BATCH_NOT_ANSWERED, 0);
+		free_batch_command(command);
+	}
+
+	return NULL;
+}
+
+
+/*
+* Function used to hash a path on the ring of SHARD_BY_HASH (djb2, then mixed like the finalizer of murmur3).
+*/
+unsigned int ring_hash(const char *source, int length) {
+
+	unsigned int hash = 5381;
+
+	for(int i=0; i<length; i++)
+		hash = hash * 33 + (unsigned char)source[i];
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+
+int compare_batch_points(const void *first, const void *second) {
+
+	unsigned int a = ((batch_point *)first)->point;
+	unsigned int b = ((batch_point *)second)->point;
+
+	return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+
+/*
+* Function used to place BATCH_RING_POINTS points of every server on the ring of SHARD_BY_HASH. They depend only on
+* the address and the port, so a path goes to the same server whatever the order the servers were given in.
+*/
+void build_batch_ring(batch_run *run) {
+
+	char name[SOCK_PACKET_SIZE];
+
+	run->ring_size = 0;
+
+	for(int i=0; i<run->no_servers; i++)
+		for(int j=0; j<BATCH_RING_POINTS; j++) {
+			int length = snprintf(name, sizeof(name), "%s:%i#%i", run->servers[i].negotiated.address, run->servers[i].negotiated.port, j);
+			run->ring[run->ring_size].point		= ring_hash(name, length);
+			run->ring[run->ring_size++].server	= i;
+		}
+
+	qsort(run->ring, run->ring_size, sizeof(batch_point), compare_batch_points);
+}
+
+
+/*
+* Function used to choose the server of a command. With SHARD_BY_HASH, encryptions and decryptions go to the first
+* server after their path on the ring (an encrypted file hashes like its plain version, so both ways go to the same
+* server), the others go to the server with the least outstanding weight. Servers without connections and servers
+* which lost the command are skipped. It must be called holding run->sem.
+* RETURN VALUE:
+*	The index of the server, -1 if no server can take the command
+*/
+int route_batch_command(batch_run *run, batch_command *command) {
+
+	int action = command->conf.action;
+
+	if(run->defaults->shard_mode == SHARD_BY_HASH && action >= ENC_ACTION && action <= SUBMIT_DEC_ACTION) {
+
+		char *path	= command->conf.target;
+		int length	= strlen(path);
+		int suffix	= strlen(ENCR_EXT);
+
+		if(length > suffix && strcmp(path + length - suffix, ENCR_EXT) == 0)
+			length -= suffix;
+
+		unsigned int hash = ring_hash(path, length);
+		int low = 0;
+		int high = run->ring_size;
+
+		//first point not before the hash, the ring wraps around
+		while(low < high) {
+			int middle = (low + high) / 2;
+			if(run->ring[middle].point < hash)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+
+		for(int i=0; i<run->ring_size; i++) {
+			int server = run->ring[(low + i) % run->ring_size].server;
+			if(run->servers[server].workers > 0 && (command->lost & (1 << server)) == 0)
+				return server;
+		}
+
+		return -1;
+	}
+
+	int chosen = -1;
+
+	for(int i=0; i<run->no_servers; i++)
+		if(run->servers[i].workers > 0 && (command->lost & (1 << i)) == 0 && (chosen < 0 || run->servers[i].outstanding < run->servers[chosen].outstanding))
+			chosen = i;
+
+	return chosen;
+}
+
+
+/*
+* Function used to give a command to a server, or to print it with status and hint when no server can take it.
+* It must be called holding run->sem.
+*/
+void dispatch_batch_command(batch_run *run, batch_command *command, int status, int hint) {
+
+	int chosen = route_batch_command(run, command);
+
+	if(chosen < 0) {
+		print_batch_result(run, command, status, hint);
+		free_batch_command(command);
+		return;
+	}
+
+	batch_server *server = &run->servers[chosen];
+
+	command->next = NULL;
+
+	if(server->last != NULL)
+		server->last->next = command;
+	else
+		server->first = command;
+
+	server->last		= command;
+	server->outstanding	+= command->weight;
+	server->queued++;
+	run->queued++;
+}
+
+
+/*
+* Function used to remove the first command from the queue of a server. It must be called holding run->sem.
+*/
+batch_command *pop_batch_command(batch_run *run, batch_server *server) {
+
+	batch_command *command = server->first;
+
+	if((server->first = command->next) == NULL)
+		server->last = NULL;
+
+	command->next = NULL;
+	server->queued--;
+	run->queued--;
+
+	return command;
+}
+
+
+/*
+* Function used by a connection to take its next command: from the queue of its server, which is filled reading
+* the batch, otherwise from the longest queue of another server (so that a slow server is helped by the others).
+* ARGUMENTS:
+*	-run:		the batch
+*	-index:		the server of the connection
+*	-wait:		set to wait for a command while the others are sending theirs, which could be given back
+* RETURN VALUE:
+*	The command, NULL if there's none (when wait is set, once the batch is over)
+*/
+batch_command *take_batch_command(batch_run *run, int index, int wait) {
+
+	batch_server *server = &run->servers[index];
+	batch_command *command = NULL;
+
+	semaphore_wait(&run->sem);
+
+	while(1) {
+
+		while(server->first == NULL && run->queued < BATCH_MAX_QUEUED && (command = read_batch_command(run)) != NULL)
+			dispatch_batch_command(run, command, BATCH_NOT_ANSWERED, 0);
+
+		command = NULL;
+
+		if(server->first != NULL) {
+			command = pop_batch_command(run, server);
+			break;
+		}
+
+		int longest = -1;
+
+		for(int i=0; i<run->no_servers; i++)
+			if(i != index && run->servers[i].first != NULL && (run->servers[i].first->lost & (1 << index)) == 0 &&
+			   (longest < 0 || run->servers[i].queued > run->servers[longest].queued))
+				longest = i;
+
+		if(longest >= 0) {
+			command = pop_batch_command(run, &run->servers[longest]);
+			run->servers[longest].outstanding	-= command->weight;
+			server->outstanding			+= command->weight;
+			break;
+		}
+
+		if(!wait || (run->ended && run->generated == NULL && run->queued == 0 && run->sending == 0))
+			break;
+
+		semaphore_signal(&run->sem);
+		sleep_ms(BATCH_IDLE_WAIT);
+		semaphore_wait(&run->sem);
+	}
+
+	if(command != NULL)
+		run->sending++;
+
+	semaphore_signal(&run->sem);
+
+	return command;
+}
+
+
+/*
+* Function used when a command taken by a connection is over: its result is printed and it's freed.
+*/
+void finish_batch_command(batch_run *run, int index, batch_command *command, int status, int hint) {
+
+	print_batch_result(run, command, status, hint);
+
+	semaphore_wait(&run->sem);
+	run->sending--;
+	run->servers[index].outstanding -= command->weight;
+	semaphore_signal(&run->sem);
+
+	free_batch_command(command);
+}
+
+
+/*
+* Function used when the server of a connection refused a command taken by the connection, or couldn't be reached
+* before it was sent: it's given to another server, or printed with status and hint if there's none left.
+*/
+void retry_batch_command(batch_run *run, int index, batch_command *command, int status, int hint) {
+
+	semaphore_wait(&run->sem);
+
+	run->sending--;
+	run->servers[index].outstanding -= command->weight;
+	command->lost |= 1 << index;
+
+	dispatch_batch_command(run, command, status, hint);
+
+	semaphore_signal(&run->sem);
+}
+
+
+/*
+* Function used when a connection stops: once the last connection of a server stops, the commands queued for it
+* are given to the other servers.
+*/
+void leave_batch_server(batch_run *run, int index) {
+
+	batch_server *server = &run->servers[index];
+
+	semaphore_wait(&run->sem);
+
+	if(--server->workers == 0)
+		while(server->first != NULL) {
+			batch_command *command = pop_batch_command(run, server);
+			server->outstanding -= command->weight;
+			dispatch_batch_command(run, command, BATCH_NOT_ANSWERED, 0);
+		}
+
+	semaphore_signal(&run->sem);
+}
+
+
+/*
+* Function used to open a connection of a batch, waiting a little between the tries.
+* ARGUMENTS:
+*	-conf:		client_configuration of the server, where the protocol of the connection is saved
+*	-server:	where the connection is saved
+* RETURN VALUE:
+*	On success 0 is returned, -1 if the server couldn't be reached BATCH_CONNECT_TRIES times
+*/
+int open_batch_connection(client_configuration *conf, io_interface *server) {
+
+	for(int i=0; i<BATCH_CONNECT_TRIES; i++) {
+
+		int retry_after = 0;
+
+		//old servers refuse the protocol switch, there's no need to ask them every time
+		if(conf->protocol == PROTOCOL_V1 && connect_to_server(conf->address, conf->port, server) == 0) {
+			conf->binary_listings		= 0;
+			conf->compressed_listings	= 0;
+			return 0;
+		}
+
+		if(conf->protocol != PROTOCOL_V1 && client_connect(conf, server, &retry_after) == 0)
+			return 0;
+
+		sleep_ms(retry_after > 0 ? retry_after * 1000L : BATCH_RETRY_WAIT * (i + 1));
+	}
+
+	return -1;
+}
+
+
+/*
+* Function executed by every connection of a batch: up to window commands are sent before reading the first
+* answer, then a new command is sent every time an answer arrives. Connections to a v1 server carry a single
+* command. When a connection breaks, the commands which were waiting for an answer are reported BATCH_NOT_ANSWERED
+* (the server may have executed them) and a new connection is opened. Only the commands refused with OVERLOAD_MSG,
+* and the one taken when the server can't be reached anymore, are given to the other servers. The connection stops
+* once its server can't be reached anymore, or when the batch is over.
+*/
+void *batch_connection(void *params) {
+
+	batch_worker *worker = (batch_worker *)params;
+	batch_run *run = worker->run;
+	int index = worker->server;
+	client_configuration conf;
+	io_interface server;
+	batch_command *first = NULL;
+	batch_command *last = NULL;
+	int connected = 0;
+	int waiting = 0;
+
+	char *message	= (char *)malloc(SOCK_PACKET_SIZE);
+	char *frame	= (char *)malloc(FRAME_BUFFER_SIZE);
+	char *expanded	= NULL;
+
+	semaphore_wait(&run->sem);
+
+	conf = run->servers[index].negotiated;
+
+	if(run->servers[index].probed) {
+		server				= run->servers[index].probe;
+		connected			= 1;
+		run->servers[index].probed	= 0;
+	}
+
+	semaphore_signal(&run->sem);
+
+	while(message != NULL && frame != NULL) {
+
+		//the first command is waited for, the next ones are sent only if they're ready
+		batch_command *pending = waiting == 0 ? take_batch_command(run, index, 1) : NULL;
+
+		if(waiting == 0 && pending == NULL)
+			break;
+
+		//servers close the connections which stay idle for too long
+		if(connected && waiting == 0 && is_connection_closed(&server)) {
+			close_socket(&server);
+			connected = 0;
+		}
+
+		if(!connected && open_batch_connection(&conf, &server) < 0) {
+			retry_batch_command(run, index, pending, BATCH_NOT_ANSWERED, 0);
+			break;
+		}
+
+		connected = 1;
+
+		int window = conf.protocol == PROTOCOL_V2 ? run->window : 1;
+		int broken = 0;
+
+		while(waiting < window && !broken) {
+
+			batch_command *command = pending != NULL ? pending : take_batch_command(run, index, 0);
+
+			pending = NULL;
+
+			if(command == NULL)
+				break;
+
+			//listings are sent as text lines, compressed if the server can
+			command->conf.protocol			= conf.protocol;
+			command->conf.binary_listings		= 0;
+			command->conf.compressed_listings	= conf.compressed_listings;
+
+			format_client_command(&command->conf, message, 0);
+
+			if(last != NULL)
+				last->next = command;
+			else
+				first = command;
+
+			last = command;
+			waiting++;
+
+			if(conf.protocol == PROTOCOL_V1)
+				broken = write_string_to_socket(message, &server) < 0;
+			else
+				broken = write_frame_to_socket(FRAME_CMD, 0, message, strlen(message), &server) < 0;
+		}
+
+		batch_command *command = first;
+		int response = 0;
+		int hint = 0;
+
+		first = command->next;
+		if(first == NULL)
+			last = NULL;
+		command->next = NULL;
+		waiting--;
+
+		if(broken || receive_batch_answer(run, command, &server, frame, &expanded, &response, &hint) < 0) {
+
+			//the server may have executed the commands already, sending them again would encrypt a file twice
+			finish_batch_command(run, index, command, BATCH_NOT_ANSWERED, 0);
+
+			//the answers of the other commands were lost too
+			while(first != NULL) {
+				batch_command *next = first->next;
+				finish_batch_command(run, index, first, BATCH_NOT_ANSWERED, 0);
+				first = next;
+			}
+
+			last		= NULL;
+			waiting		= 0;
+			connected	= 0;
+
+			close_socket(&server);
+			continue;
+		}
+
+		if(conf.protocol == PROTOCOL_V1) {
+			connected = 0;
+			close_socket(&server);
+		}
+
+		if(response == OVERLOAD_MSG)
+			retry_batch_command(run, index, command, response, hint);
+		else
+			finish_batch_command(run, index, command, response, hint);
+	}
+
+	if(connected) {
+		if(conf.protocol == PROTOCOL_V2)
+			write_frame_to_socket(FRAME_END, 0, NULL, 0, &server);
+		close_socket(&server);
+	}
+
+	leave_batch_server(run, index);
+
+	free(message);
+	free(frame);
+	free(expanded);
+
+	return NULL;
+}
+
+
+/*
+* Function given to read_client_answer to keep the whole body of an answer.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int keep_batch_body(void *param, char *source, int length) {
+
+	batch_body *body = (batch_body *)param;
+
+	//one more byte, so that the body can be read as a string
+	if(body->length + length + 1 > body->capacity) {
+
+		int capacity = body->capacity > 0 ? body->capacity : FRAME_BUFFER_SIZE;
+
+		while(capacity < body->length + length + 1)
+			capacity *= 2;
+
+		char *data = (char *)realloc(body->data, capacity);
+		if(data == NULL)
+			return -1;
+
+		body->data	= data;
+		body->capacity	= capacity;
+	}
+
+	memcpy(body->data + body->length, source, length);
+	body->length += length;
+	body->data[body->length] = '\0';
+
+	return 0;
+}
+
+
+/*
+* Function used to turn a directory job into the commands of a batch. The files to encrypt (or decrypt) are listed
+* recursively by a server, with the options given on the command line, biggest first: every one becomes a command
+* weighted by its size, so that the biggest files are spread first and the small ones fill the gaps. A restore (-r)
+* lists the encrypted files whose path starts with its prefix, every one is decrypted with the seed of the last
+* encryption of its plain path found in the seed log (files which were never logged are skipped).
+* ARGUMENTS:
+*	-run:		the batch, whose defaults hold the action, the seed and the options of the listing
+*	-index:		a server which was reached, its probe connection is used
+* RETURN VALUE:
+*	On success 0 is returned, -1 if the listing couldn't be read
+*/
+int list_batch_directory(batch_run *run, int index) {
+
+	batch_server *server = &run->servers[index];
+	client_configuration listing = server->negotiated;
+	int encrypt = run->defaults->action == DIRECTORY_ENC_ACTION;
+	int restore = run->defaults->action == RESTORE_ACTION;
+	char *prefix = restore ? normalize_seed_path(run->defaults->prefix) : NULL;
+	batch_command *last = NULL;
+	seed_index seeds;
+	batch_body body;
+	int response = 0;
+	int hint = 0;
+
+	bzero(&body, sizeof(batch_body));
+
+	char *message	= (char *)malloc(SOCK_PACKET_SIZE);
+	char *frame	= (char *)malloc(FRAME_BUFFER_SIZE);
+	char *options	= (char *)malloc(strlen(run->defaults->target) + 32);
+	char *expanded	= NULL;
+	int result	= -1;
+
+	if(restore && open_seed_index(&seeds) < 0) {
+		fprintf(stderr, "The seed log %s can't be read\n", SEED_LOG_FILE);
+		free(message);
+		free(frame);
+		free(options);
+		return -1;
+	}
+
+	if(message != NULL && frame != NULL && options != NULL) {
+
+		sprintf(options, " type=%s sort=size%s", encrypt ? "plain" : "enc", run->defaults->target);
+
+		listing.action		= LIST_REC_ACTION;
+		listing.target		= options;
+		listing.binary_listings	= 0;
+
+		format_client_command(&listing, message, 0);
+
+		if(listing.protocol == PROTOCOL_V1)
+			result = write_string_to_socket(message, &server->probe);
+		else
+			result = write_frame_to_socket(FRAME_CMD, 0, message, strlen(message), &server->probe);
+
+		if(result == 0)
+			result = read_client_answer(&listing, &server->probe, frame, &expanded, keep_batch_body, &body, &response, &hint);
+	}
+
+	//v1 servers close the connection after the answer
+	if(result < 0 || listing.protocol == PROTOCOL_V1) {
+		close_socket(&server->probe);
+		server->probed = 0;
+	}
+
+	if(result == 0 && response != MORE_MSG)
+		result = -1;
+
+	//every line is "size\t...\t./path", directories have no size
+	for(char *line = body.data; result == 0 && line != NULL && *line != '\0'; ) {
+
+		char *end = strchr(line, '\n');
+		char *next = end != NULL ? end + 1 : NULL;
+
+		if(end != NULL) {
+			if(end > line && end[-1] == '\r')
+				end--;
+			*end = '\0';
+		}
+
+		char *path;
+		long size = strtol(line, &path, 10);
+
+		if(path != line && *path == '\t') {
+
+			while(*path == '\t')
+				path++;
+
+			unsigned int seed = run->defaults->seed;
+			char plain[SEED_MAX_PATH + 1];
+			int length = strlen(path) - strlen(ENCR_EXT);
+
+			//the plain path is the one which was logged when it was encrypted
+			if(restore) {
+
+				if(strncmp(normalize_seed_path(path), prefix, strlen(prefix)) != 0 || length <= 0 || length > SEED_MAX_PATH) {
+					line = next;
+					continue;
+				}
+
+				memcpy(plain, path, length);
+				plain[length] = '\0';
+
+				if(find_seed(&seeds, plain, &seed, NULL) < 0) {
+					fprintf(stderr, "No seed logged for %s, skipped\n", plain);
+					line = next;
+					continue;
+				}
+			}
+
+			char command_line[SOCK_PACKET_SIZE];
+			snprintf(command_line, sizeof(command_line), "%s %u %s", encrypt ? "-e" : "-d", seed, path);
+
+			batch_command *command = make_batch_command(run, ++run->read, command_line);
+
+			if(command == NULL)
+				result = -1;
+			else if(parse_client_command(command->words, &command->conf) < 0) {
+				print_batch_result(run, command, BATCH_NOT_ANSWERED, 0);
+				free_batch_command(command);
+			}
+			else {
+				command->weight = size > 0 ? size : 1;
+
+				if(last != NULL)
+					last->next = command;
+				else
+					run->generated = command;
+
+				last = command;
+			}
+		}
+
+		line = next;
+	}
+
+	if(restore)
+		close_seed_index(&seeds);
+
+	free(body.data);
+	free(message);
+	free(frame);
+	free(options);
+	free(expanded);
+
+	return result;
+}
+
+
+/*
+* Function used by the client to execute a batch (see batch_run), or a directory job (-a, -A and -r). Every server
+* reached gets its own connections: commands are pipelined over conf->connections of them, with at most
+* conf->inflight waiting for an answer; if the server takes a single command per connection, conf->inflight
+* connections are used at once instead. Commands are spread by conf->shard_mode (see route_batch_command).
+* RETURN VALUE:
+*	0 if every command got an answer (whatever it was), otherwise 1
+*/
+int run_batch(client_configuration *conf) {
+
+	batch_run run;
+	int total = 0;
+	int reachable = -1;
+
+	bzero(&run, sizeof(batch_run));
+
+	run.defaults	= conf;
+	run.no_servers	= conf->no_servers;
+	run.ended	= conf->batch == NULL;
+
+	if(conf->batch != NULL && (run.source = strcmp(conf->batch, "-") == 0 ? stdin : fopen(conf->batch, "r")) == NULL) {
+		fprintf(stderr, "Could not open the batch %s!\n\n", conf->batch);
+		return 1;
+	}
+
+	start_semaphore_ex(&run.sem);
+	start_semaphore_ex(&run.output);
+
+	//the first connection to every server tells how the commands can be sent
+	for(int i=0; i<run.no_servers; i++) {
+
+		batch_server *server = &run.servers[i];
+
+		server->negotiated		= *conf;
+		server->negotiated.batch	= NULL;
+		server->negotiated.address	= conf->addresses[i];
+		server->negotiated.port		= conf->ports[i];
+		server->negotiated.protocol	= PROTOCOL_V2;
+
+		if(open_batch_connection(&server->negotiated, &server->probe) < 0) {
+			fprintf(stderr, "Could not connect to %s:%i, the other servers will do its part.\n\n", conf->addresses[i], conf->ports[i]);
+			continue;
+		}
+
+		int count = conf->connections < conf->inflight ? conf->connections : conf->inflight;
+
+		server->probed	= 1;
+		server->workers	= server->negotiated.protocol == PROTOCOL_V2 ? count : conf->inflight;
+		run.window	= (conf->inflight + count - 1) / count;
+		total		+= server->workers;
+
+		if(reachable < 0)
+			reachable = i;
+	}
+
+	if(reachable < 0 || ((conf->action == DIRECTORY_ENC_ACTION || conf->action == DIRECTORY_DEC_ACTION || conf->action == RESTORE_ACTION) && list_batch_directory(&run, reachable) < 0)) {
+
+		if(reachable < 0)
+			fprintf(stderr, "Could not connect to the given servers. Please check the ip for errors and retry.\n\n");
+		else
+			fprintf(stderr, "Could not list the files of the directory job.\n\n");
+
+		for(int i=0; i<run.no_servers; i++)
+			if(run.servers[i].probed)
+				close_socket(&run.servers[i].probe);
+
+		while(run.generated != NULL) {
+			batch_command *next = run.generated->next;
+			free_batch_command(run.generated);
+			run.generated = next;
+		}
+
+		if(run.source != NULL && run.source != stdin)
+			fclose(run.source);
+
+		stop_semaphore(&run.sem);
+		stop_semaphore(&run.output);
+
+		return 1;
+	}
+
+	build_batch_ring(&run);
+
+	thread *threads		= (thread *)malloc(total * sizeof(thread));
+	batch_worker *workers	= (batch_worker *)malloc(total * sizeof(batch_worker));
+	int started = 0;
+
+	for(int i=0; i<run.no_servers; i++)
+		for(int j=run.servers[i].workers; j>0; j--) {
+
+			if(threads != NULL && workers != NULL) {
+				workers[started].run	= &run;
+				workers[started].server	= i;
+			}
+
+			if(threads != NULL && workers != NULL && create_thread(&threads[started], batch_connection, (void *)&workers[started]) == 0)
+				started++;
+			else
+				leave_batch_server(&run, i);
+		}
+
+	//nobody could be started, do it here
+	if(started == 0) {
+
+		batch_worker alone;
+
+		alone.run			= &run;
+		alone.server			= reachable;
+		run.servers[reachable].workers	= 1;
+
+		batch_connection((void *)&alone);
+	}
+
+	for(int i=0; i<started; i++)
+		join_thread(&threads[i], NULL);
+
+	//every connection gave up, what's left can't be sent
+	batch_command *command;
+
+	semaphore_wait(&run.sem);
+
+	while((command = read_batch_command(&run)) != NULL) {
+		print_batch_result(&run, command, BATCH_NOT_ANSWERED, 0);
+		free_batch_command(command);
+	}
+
+	semaphore_signal(&run.sem);
+
+	//servers which got no command
+	for(int i=0; i<run.no_servers; i++)
+		if(run.servers[i].probed) {
+			if(run.servers[i].negotiated.protocol == PROTOCOL_V2)
+				write_frame_to_socket(FRAME_END, 0, NULL, 0, &run.servers[i].probe);
+			close_socket(&run.servers[i].probe);
+		}
+
+	free(threads);
+	free(workers);
+
+	if(run.source != NULL && run.source != stdin)
+		fclose(run.source);
+
+	stop_semaphore(&run.sem);
+	stop_semaphore(&run.output);
+
+	return run.failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,236 @@
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH		4		//shortest match which is worth a sequence
+#define LZ_HASH_BITS		12		//the compressor remembers the last position of 4096 hashes of 4 bytes
+#define LZ_MAX_OFFSET		65535		//matches are at most this many bytes behind
+#define LZ_LAST_LITERALS	5		//the last bytes of a block are always literals
+#define LZ_MATCH_LIMIT		12		//matches don't start in the last bytes of a block
+#define LZ_SKIP_TRIGGER		6		//the compressor looks for matches further apart after 2^6 misses in a row
+
+
+/*
+* Blocks are made of sequences: a token (literals length in the high 4 bits, match length - LZ_MIN_MATCH in the
+* low ones), more literals length bytes if it was 15, the literals, the offset of the match (2 bytes, little
+* endian), more match length bytes if it was 15. Every more length byte is added to the length, the last one is
+* smaller than 255. The last sequence of a block has no match. This is the block format of LZ4, which makes it
+* fast on both sides: there is no entropy coding.
+*/
+
+
+/*
+* Function used to write the extra bytes of a length of a sequence.
+* RETURN VALUE:
+*	The position after them, NULL if they don't fit before end
+*/
+unsigned char *write_lz_length(unsigned char *dest, unsigned char *end, int length) {
+
+	for(; length >= 255; length -= 255) {
+		if(dest >= end)
+			return NULL;
+		*dest++ = 255;
+	}
+
+	if(dest >= end)
+		return NULL;
+
+	*dest++ = (unsigned char)length;
+
+	return dest;
+}
+
+
+/*
+* Function used to write a sequence of a block.
+* ARGUMENTS:
+*	-dest, end:	where the sequence is written and end of the space available
+*	-literals:	bytes written as they are, literals_length of them
+*	-offset:	how many bytes behind the match is, 0 for the last sequence
+*	-match_length:	bytes of the match
+* RETURN VALUE:
+*	The position after the sequence, NULL if it doesn't fit before end
+*/
+unsigned char *write_lz_sequence(unsigned char *dest, unsigned char *end, unsigned char *literals, int literals_length, int offset, int match_length) {
+
+	if(dest >= end)
+		return NULL;
+
+	unsigned char *token = dest++;
+	int extra = offset > 0 ? match_length - LZ_MIN_MATCH : 0;
+
+	*token = (unsigned char)((literals_length < 15 ? literals_length : 15) << 4 | (extra < 15 ? extra : 15));
+
+	if(literals_length >= 15 && (dest = write_lz_length(dest, end, literals_length - 15)) == NULL)
+		return NULL;
+
+	if(end - dest < literals_length)
+		return NULL;
+
+	memcpy(dest, literals, literals_length);
+	dest += literals_length;
+
+	if(offset == 0)
+		return dest;
+
+	if(end - dest < 2)
+		return NULL;
+
+	*dest++ = (unsigned char)(offset & 0xFF);
+	*dest++ = (unsigned char)(offset >> 8);
+
+	if(extra >= 15 && (dest = write_lz_length(dest, end, extra - 15)) == NULL)
+		return NULL;
+
+	return dest;
+}
+
+
+/*
+* Function used to compress a block of bytes. Blocks don't depend on each other: every one of them can be
+* expanded alone with expand_block.
+* ARGUMENTS:
+*	-source:	bytes to compress
+*	-length:	number of bytes to compress
+*	-dest:		where the block is written
+*	-capacity:	size of dest
+* RETURN VALUE:
+*	The length of the block, -1 if it doesn't fit in capacity bytes (e.g. the bytes can't be compressed)
+*/
+int compress_block(char *source, int length, char *dest, int capacity) {
+
+	int table[1 << LZ_HASH_BITS];
+	unsigned char *input	= (unsigned char *)source;
+	unsigned char *output	= (unsigned char *)dest;
+	unsigned char *end	= output + capacity;
+	int anchor		= 0;
+	int position		= 0;
+	int misses		= 0;
+
+	//positions are saved + 1, 0 is an empty slot
+	memset(table, 0, sizeof(table));
+
+	while(position + LZ_MATCH_LIMIT <= length) {
+
+		uint32_t sequence;
+		memcpy(&sequence, input + position, sizeof(sequence));
+
+		unsigned int hash	= (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+		int candidate		= table[hash] - 1;
+
+		table[hash] = position + 1;
+
+		if(candidate < 0 || position - candidate > LZ_MAX_OFFSET || memcmp(input + candidate, input + position, LZ_MIN_MATCH) != 0) {
+			position += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+			continue;
+		}
+
+		int match = LZ_MIN_MATCH;
+
+		while(position + match < length - LZ_LAST_LITERALS && input[candidate + match] == input[position + match])
+			match++;
+
+		if((output = write_lz_sequence(output, end, input + anchor, position - anchor, position - candidate, match)) == NULL)
+			return -1;
+
+		position	+= match;
+		anchor		= position;
+		misses		= 0;
+
+		//lines of a listing often repeat what's right after a match
+		memcpy(&sequence, input + position - 2, sizeof(sequence));
+		table[(sequence * 2654435761U) >> (32 - LZ_HASH_BITS)] = position - 1;
+	}
+
+	if((output = write_lz_sequence(output, end, input + anchor, length - anchor, 0, 0)) == NULL)
+		return -1;
+
+	return (int)(output - (unsigned char *)dest);
+}
+
+
+/*
+* Function used to read the extra bytes of a length of a sequence.
+* RETURN VALUE:
+*	The position after them, NULL if the block ends before them or the length is bigger than limit
+*/
+unsigned char *read_lz_length(unsigned char *source, unsigned char *end, int *length, int limit) {
+
+	unsigned char current;
+
+	do {
+		if(source >= end)
+			return NULL;
+
+		current = *source++;
+		*length += current;
+
+		if(*length > limit)
+			return NULL;
+
+	} while(current == 255);
+
+	return source;
+}
+
+
+/*
+* Function used to expand a block written by compress_block. Blocks come from the network: every length and
+* offset is checked, a broken block never makes it write outside dest.
+* ARGUMENTS:
+*	-source:	the block
+*	-length:	length of the block
+*	-dest:		where the bytes are written
+*	-capacity:	size of dest
+* RETURN VALUE:
+*	The number of bytes written to dest, -1 if the block is broken or they don't fit in capacity bytes
+*/
+int expand_block(char *source, int length, char *dest, int capacity) {
+
+	unsigned char *input	= (unsigned char *)source;
+	unsigned char *end	= input + length;
+	int written		= 0;
+
+	while(input < end) {
+
+		int token		= *input++;
+		int literals_length	= token >> 4;
+		int match		= token & 15;
+
+		if(literals_length == 15 && (input = read_lz_length(input, end, &literals_length, capacity)) == NULL)
+			return -1;
+
+		if(literals_length > end - input || literals_length > capacity - written)
+			return -1;
+
+		memcpy(dest + written, input, literals_length);
+		input	+= literals_length;
+		written	+= literals_length;
+
+		//the last sequence has no match
+		if(input == end)
+			break;
+
+		if(end - input < 2)
+			return -1;
+
+		int offset = input[0] | input[1] << 8;
+		input += 2;
+
+		if(offset == 0 || offset > written)
+			return -1;
+
+		if(match == 15 && (input = read_lz_length(input, end, &match, capacity)) == NULL)
+			return -1;
+
+		match += LZ_MIN_MATCH;
+
+		if(match > capacity - written)
+			return -1;
+
+		//the match can overlap the bytes it's writing (e.g. a run of the same byte)
+		for(int i=0; i<match; i++, written++)
+			dest[written] = dest[written - offset];
+	}
+
+	return written;
+}
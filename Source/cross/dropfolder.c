@@ -0,0 +1,742 @@
+#define DROP_MAX_FOLDERS	16		//directories the server watches for new files, at most
+#define DROP_EVENTS_SIZE	65536		//bytes of events read at once
+#define DROP_TICK		500		//ms the watcher waits for events before checking if it must stop
+#define DROP_BUSY_TICK		50		//ms it waits instead while files wait to be submitted
+#define DROP_BATCH		64		//jobs submitted to the job table at once, at most
+#define DROP_MAX_INFLIGHT	(JOB_TABLE_SIZE / 4)	//jobs of the drop folders in the table, the rest is left to the clients
+#define DROP_MAX_TRIES		10		//times a file which someone else keeps locked is tried
+#define DROP_RETRY_WAIT		100		//ms waited before trying a locked file again, more at every try
+#define DROP_CLIENT		"drop"		//client of the jobs of the drop folders, which share the lanes with the others
+#define DROP_RANDOM		"random"	//seed policy which gives every file its own seed
+#define DROP_SPARED_BUCKETS	1024		//buckets of the files decrypted by requests in the drop folders
+#define DROP_SPARE_WAIT		3600000		//ms a decrypted file is remembered, its event comes as soon as it's written
+#define DROP_KNOWN_BUCKETS	1024		//buckets of the files queued or being encrypted
+
+
+/*
+* Structure which defines a drop folder: every file written (or moved) into it is encrypted.
+*	-path:		absolute path of the directory
+*	-id:		id given by the watcher, -1 once the directory is gone
+*	-random:	set if every file gets its own seed, otherwise they are all encrypted with seed
+*/
+typedef struct {
+	char *path;
+	int id;
+	int random;
+	unsigned int seed;
+} drop_folder;
+
+
+/*
+* Structure which defines a file of a drop folder waiting to be encrypted, it's then the owner of its job.
+*	-path:		absolute path of the file
+*	-tries:		times its job found the file locked, it's not tried again before retry_at
+*	-same_hash:	next known file of its bucket (see know_drop_file)
+*/
+typedef struct drop_file {
+	char *path;
+	drop_folder *folder;
+	int tries;
+	long retry_at;
+	struct drop_box *box;
+	struct drop_file *next;
+	struct drop_file *same_hash;
+} drop_file;
+
+
+/*
+* Structure which defines a file decrypted by a request in a drop folder, whose event must be ignored.
+*/
+typedef struct drop_spared {
+	char *path;
+	long when;
+	struct drop_spared *next;
+} drop_spared;
+
+
+/*
+* Structure which defines the drop folders of the server, watched by their own thread. The names the events bring
+* are collected, then submitted to the job table in batches; every file encrypted is appended to the seed log.
+*	-folders:	the watched directories, count of them
+*	-directory:	absolute path of the working directory, paths inside it are logged relative to it (just like the
+*			client logs them) so that a client started there restores them with -r
+*	-jobs:		job_table the files are encrypted by, bulk_limit is the size which sends them to the bulk lane
+*	-throttle:	bandwidth the encryptions are paced by: no client waits for them, they run in the background class
+*	-first, last:	files waiting to be submitted, only used by the watcher thread
+*	-retry:		files found locked, given back to the watcher thread by the workers
+*	-inflight:	jobs submitted which are not over yet
+*	-known:		every file queued, waiting to be tried again or being encrypted, hashed by path: the events about
+*			them don't queue them twice. Encrypting a file closes it after writing, so it brings one of its own
+*	-waiting:	files waiting to be submitted
+*	-encrypted,
+*	 failed:	files encrypted and files which couldn't be
+*	-log:		seed log the encryptions are appended to
+*	-spared:	files decrypted by requests in the drop folders, which are not encrypted again when they are
+*			written. They are hashed by path, the ones whose event never came are forgotten after DROP_SPARE_WAIT
+*	-sem:		mutex semaphore used to access every field but folders, first and last
+*/
+typedef struct drop_box {
+	drop_folder folders[DROP_MAX_FOLDERS];
+	int count;
+	char *directory;
+	job_table *jobs;
+	long bulk_limit;
+	io_throttle *throttle;
+	watcher watch;
+	random_state random;
+	drop_file *first;
+	drop_file *last;
+	drop_file *retry;
+	int inflight;
+	drop_file *known[DROP_KNOWN_BUCKETS];
+	int waiting;
+	long encrypted;
+	long failed;
+	seed_log log;
+	drop_spared *spared[DROP_SPARED_BUCKETS];
+	int stop;
+	thread updater;
+	semaphore sem;
+} drop_box;
+
+
+void free_drop_file(drop_file *file) {
+	free(file->path);
+	free(file);
+}
+
+
+/*
+* Function used to drop the "." components and the doubled separators of a path, in place: the paths of requests
+* ("dir/./file") are compared with the ones of the drop folders.
+*/
+void normalize_drop_path(char *path) {
+
+	char *read = path;
+	char *write = path;
+
+	while(*read != '\0') {
+
+		if(read[0] == '/' && (read[1] == '/' || (read[1] == '.' && (read[2] == '/' || read[2] == '\0')))) {
+			read += read[1] == '/' ? 1 : 2;
+			continue;
+		}
+
+		*write++ = *read++;
+	}
+
+	//the root stays
+	if(write - path > 1 && write[-1] == '/')
+		write--;
+
+	*write = '\0';
+}
+
+
+/*
+* Function used by the requests which decrypt a file: if the file is in a drop folder, writing its decrypted copy
+* doesn't make it encrypted again.
+* ARGUMENTS:
+*	-box:		the drop folders
+*	-path:		absolute path of the encrypted file
+*/
+void spare_drop_file(drop_box *box, char *path) {
+
+	char *decrypted = strdup(path);
+	int i = box->count;
+
+	if(decrypted == NULL)
+		return;
+
+	normalize_drop_path(decrypted);
+
+	char *name = strrchr(decrypted, '/');
+	int length = strlen(decrypted) - strlen(ENCR_EXT);
+
+	if(name != NULL && length >= 0 && strcmp(decrypted + length, ENCR_EXT) == 0) {
+		for(i=0; i<box->count; i++) {
+			if((int)strlen(box->folders[i].path) == name - decrypted && strncmp(box->folders[i].path, decrypted, name - decrypted) == 0)
+				break;
+		}
+	}
+
+	if(i == box->count) {
+		free(decrypted);
+		return;
+	}
+
+	drop_spared *spared = (drop_spared *)malloc(sizeof(drop_spared));
+
+	if(spared == NULL) {
+		free(decrypted);
+		return;
+	}
+
+	decrypted[length] = '\0';
+
+	spared->path	= decrypted;
+	spared->when	= current_time_ms();
+
+	int bucket = seed_path_hash(decrypted, length) % DROP_SPARED_BUCKETS;
+
+	semaphore_wait(&box->sem);
+
+	spared->next		= box->spared[bucket];
+	box->spared[bucket]	= spared;
+
+	semaphore_signal(&box->sem);
+}
+
+
+/*
+* Function used to add a file to the known files of the drop folders, unless a file with the same path is known
+* already (it's queued, waiting to be tried again or being encrypted) or the file was decrypted by a request (see
+* spare_drop_file, it's then forgotten).
+* RETURN VALUE:
+*	1 if the file was added, 0 if it must not be queued
+*/
+int know_drop_file(drop_box *box, drop_file *file) {
+
+	int found = 0;
+	uint64_t hash = seed_path_hash(file->path, strlen(file->path));
+	int bucket = hash % DROP_SPARED_BUCKETS;
+	long now = current_time_ms();
+
+	semaphore_wait(&box->sem);
+
+	for(drop_file *known = box->known[hash % DROP_KNOWN_BUCKETS]; known != NULL && !found; known = known->same_hash)
+		found = strcmp(known->path, file->path) == 0;
+
+	//the files of the bucket which are found or too old are forgotten
+	for(drop_spared **current = &box->spared[bucket]; *current != NULL;) {
+
+		drop_spared *spared = *current;
+		int matched = !found && strcmp(spared->path, file->path) == 0;
+
+		if(!matched && now - spared->when < DROP_SPARE_WAIT) {
+			current = &spared->next;
+			continue;
+		}
+
+		*current = spared->next;
+		found |= matched;
+
+		free(spared->path);
+		free(spared);
+	}
+
+	if(!found) {
+		file->same_hash				= box->known[hash % DROP_KNOWN_BUCKETS];
+		box->known[hash % DROP_KNOWN_BUCKETS]	= file;
+	}
+
+	semaphore_signal(&box->sem);
+
+	return !found;
+}
+
+
+/*
+* Function used to remove a file from the known files of the drop folders, before it's freed. It must be called
+* holding box->sem.
+*/
+void forget_drop_file(drop_box *box, drop_file *file) {
+
+	drop_file **current = &box->known[seed_path_hash(file->path, strlen(file->path)) % DROP_KNOWN_BUCKETS];
+
+	while(*current != NULL && *current != file)
+		current = &(*current)->same_hash;
+
+	if(*current != NULL)
+		*current = file->same_hash;
+}
+
+
+/*
+* Function used to read the drop folders of the configuration: "directory=seed" or "directory=random", separated
+* by commas. Relative directories are relative to base.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int parse_drop_folders(drop_box *box, char *spec, char *base) {
+
+	char *index = spec;
+
+	while(index != NULL && *index != '\0') {
+
+		char *next = strchr(index, ',');
+		int length = next != NULL ? (int)(next - index) : (int)strlen(index);
+		char *policy = index + length;
+
+		//the seed comes after the last '=' of the folder
+		while(policy > index && *policy != '=')
+			policy--;
+
+		if(box->count == DROP_MAX_FOLDERS || policy == index || policy == index + length - 1)
+			return -1;
+
+		drop_folder *folder = &box->folders[box->count];
+		int size = strlen(base) + length + 2;
+
+		if((folder->path = (char *)malloc(size)) == NULL)
+			return -1;
+
+		if(index[0] == '/')
+			snprintf(folder->path, size, "%.*s", (int)(policy - index), index);
+		else
+			snprintf(folder->path, size, "%s/%.*s", base, (int)(policy - index), index);
+
+		normalize_drop_path(folder->path);
+
+		box->count++;
+
+		folder->id	= -1;
+		folder->random	= strncmp(policy + 1, DROP_RANDOM, strlen(DROP_RANDOM)) == 0;
+		folder->seed	= folder->random ? 0 : (unsigned int)strtoul(policy + 1, (char **)NULL, 10);
+
+		index = next != NULL ? next + 1 : NULL;
+	}
+
+	return box->count > 0 ? 0 : -1;
+}
+
+
+/*
+* Function used to add a file of a drop folder to the ones waiting to be submitted. Hidden files (usually still
+* being copied under a temporary name) and encrypted ones are left alone.
+*/
+void queue_drop_file(drop_box *box, drop_folder *folder, char *name) {
+
+	int length = strlen(name);
+
+	if(name[0] == '.' || (length >= (int)strlen(ENCR_EXT) && strcmp(name + length - strlen(ENCR_EXT), ENCR_EXT) == 0))
+		return;
+
+	drop_file *file = (drop_file *)malloc(sizeof(drop_file));
+	length += strlen(folder->path) + 2;
+
+	if(file == NULL || (file->path = (char *)malloc(length)) == NULL) {
+		free(file);
+		return;
+	}
+
+	snprintf(file->path, length, "%s/%s", folder->path, name);
+
+	file->folder	= folder;
+	file->tries	= 0;
+	file->retry_at	= 0;
+	file->box	= box;
+	file->next	= NULL;
+
+	//a file written again before it's encrypted (or by its own encryption) gives more events
+	if(!know_drop_file(box, file)) {
+		free_drop_file(file);
+		return;
+	}
+
+	if(box->last != NULL)
+		box->last->next = file;
+	else
+		box->first = file;
+
+	box->last = file;
+}
+
+
+/*
+* Function used to queue every file already in a drop folder: the ones dropped while the server was not running,
+* or whose events were lost.
+*/
+void scan_drop_folder(drop_box *box, drop_folder *folder) {
+
+	dir_entry *entries;
+	int count = read_directory(folder->path, &entries);
+
+	if(count < 0)
+		return;
+
+	for(int i=0; i<count; i++) {
+		if(!entries[i].directory)
+			queue_drop_file(box, folder, entries[i].name);
+	}
+
+	free_directory(entries, count);
+}
+
+
+/*
+* Function called by a worker once the job of a file is over: the encryption is logged, a file found locked is
+* given back to the watcher thread to be tried again later.
+*/
+void close_drop_job(job *target) {
+
+	drop_file *file = (drop_file *)target->owner;
+	drop_box *box = file->box;
+	int directory, link;
+	intmax_t size;
+
+	char *logged = target->path;
+	int length = strlen(box->directory);
+
+	if(strncmp(logged, box->directory, length) == 0 && logged[length] == '/')
+		logged += length + 1;
+
+	semaphore_wait(&box->sem);
+
+	box->inflight--;
+
+	if(target->state == JOB_DONE) {
+
+		box->encrypted++;
+
+		if(append_seed_log(&box->log, target->seed, logged) < 0)
+			printf("\tError while trying to log the seed of %s, it's %u\n", target->path, target->seed);
+	}
+	else if(target->state == JOB_BUSY && !box->stop && ++file->tries < DROP_MAX_TRIES) {
+
+		file->retry_at	= current_time_ms() + DROP_RETRY_WAIT * file->tries;
+		file->next	= box->retry;
+		box->retry	= file;
+		file		= NULL;
+	}
+	//a file which is not there anymore was encrypted by a job of an earlier event, or taken away. Files left
+	//untouched by a server which stops are found again when it starts
+	else if(target->state != JOB_CANCELLED && (target->state != JOB_FAILED || stat_entry(target->path, &directory, &link, &size) == 0))
+		box->failed++;
+
+	if(file != NULL)
+		forget_drop_file(box, file);
+
+	semaphore_signal(&box->sem);
+
+	if(file != NULL)
+		free_drop_file(file);
+}
+
+
+/*
+* Function used to submit the files waiting in batches of DROP_BATCH jobs, while the drop folders have less than
+* DROP_MAX_INFLIGHT jobs in the table. What doesn't fit waits for the next call.
+* RETURN VALUE:
+*	1 if files are still waiting (or waiting to be tried again), otherwise 0
+*/
+int submit_drop_files(drop_box *box) {
+
+	long now = current_time_ms();
+
+	semaphore_wait(&box->sem);
+
+	//locked files whose wait is over go back to the queue
+	for(drop_file **current = &box->retry; *current != NULL;) {
+
+		drop_file *file = *current;
+
+		if(file->retry_at > now) {
+			current = &file->next;
+			continue;
+		}
+
+		*current	= file->next;
+		file->next	= NULL;
+
+		if(box->last != NULL)
+			box->last->next = file;
+		else
+			box->first = file;
+
+		box->last = file;
+	}
+
+	int room	= DROP_MAX_INFLIGHT - box->inflight;
+	long bulk_limit	= box->bulk_limit;
+
+	semaphore_signal(&box->sem);
+
+	job *batch[DROP_BATCH];
+	drop_file *owners[DROP_BATCH];
+	int submitted = 0;
+	int count;
+
+	do {
+
+		count = 0;
+
+		while(box->first != NULL && count < DROP_BATCH && count < room) {
+
+			drop_file *file = box->first;
+			int directory, link;
+			intmax_t size;
+
+			//already encrypted by the job of an earlier event, or not a file
+			if(stat_entry(file->path, &directory, &link, &size) < 0 || directory) {
+				if((box->first = file->next) == NULL)
+					box->last = NULL;
+				semaphore_wait(&box->sem);
+				forget_drop_file(box, file);
+				semaphore_signal(&box->sem);
+				free_drop_file(file);
+				continue;
+			}
+
+			drop_folder *folder = file->folder;
+			unsigned int seed = folder->seed;
+
+			if(folder->random)
+				seed = ((unsigned int)next_random(&box->random) << 16) ^ (unsigned int)next_random(&box->random);
+
+			job *new_job = create_job(ENCR, seed, file->path);
+			if(new_job == NULL)
+				break;
+
+			if((box->first = file->next) == NULL)
+				box->last = NULL;
+
+			new_job->lane		= size > bulk_limit ? JOB_LANE_BULK : JOB_LANE_SMALL;
+			new_job->cost		= (long)size;
+			new_job->on_close	= close_drop_job;
+			new_job->control.throttle	= box->throttle;
+			new_job->control.background	= 1;
+			new_job->owner		= file;
+			strcpy(new_job->client, DROP_CLIENT);
+
+			batch[count]	= new_job;
+			owners[count]	= file;
+			count++;
+		}
+
+		if(count == 0)
+			break;
+
+		//counted first, a worker could close a job before submit_jobs returns
+		semaphore_wait(&box->sem);
+
+		box->inflight += count;
+
+		semaphore_signal(&box->sem);
+
+		submitted = submit_jobs(box->jobs, batch, count);
+
+		//the table is full: what's left goes back to the head of the queue, in the same order
+		for(int i=count-1; i>=submitted; i--) {
+			if((owners[i]->next = box->first) == NULL)
+				box->last = owners[i];
+			box->first = owners[i];
+		}
+
+		room -= submitted;
+
+		semaphore_wait(&box->sem);
+
+		box->inflight -= count - submitted;
+
+		semaphore_signal(&box->sem);
+
+	} while(submitted == count && room > 0);
+
+	int waiting = 0;
+
+	for(drop_file *file = box->first; file != NULL; file = file->next)
+		waiting++;
+
+	semaphore_wait(&box->sem);
+	box->waiting = waiting;
+	int retrying = box->retry != NULL;
+	semaphore_signal(&box->sem);
+
+	return waiting > 0 || retrying;
+}
+
+
+/*
+* Function executed by the thread of the drop folders: files already there are queued, then the ones the events
+* bring. Every batch of events is submitted at once, a lost event makes every folder be read again.
+*/
+void *drop_watcher(void *params) {
+
+	drop_box *box = (drop_box *)params;
+	char *events = (char *)malloc(DROP_EVENTS_SIZE);
+
+	if(events == NULL) {
+		printf("\tError while trying to watch the drop folders, new files won't be encrypted\n");
+		return NULL;
+	}
+
+	for(int i=0; i<box->count; i++)
+		scan_drop_folder(box, &box->folders[i]);
+
+	int busy = 0;
+
+	while(!box->stop) {
+
+		busy = submit_drop_files(box);
+
+		int length = read_watcher(&box->watch, events, DROP_EVENTS_SIZE, busy ? DROP_BUSY_TICK : DROP_TICK);
+		int offset = 0;
+		int rescan = 0;
+		watch_event event;
+
+		if(length < 0) {
+			printf("\tThe drop folders can't be watched anymore, new files won't be encrypted\n");
+			break;
+		}
+
+		while(next_watch_event(events, length, &offset, &event)) {
+
+			drop_folder *folder = NULL;
+
+			for(int i=0; i<box->count && folder == NULL; i++) {
+				if(box->folders[i].id == event.id)
+					folder = &box->folders[i];
+			}
+
+			if(event.kind == WATCH_OVERFLOW)
+				rescan = 1;
+			else if(folder == NULL)
+				continue;
+			else if(event.kind == WATCH_GONE) {
+				printf("\tDrop folder %s is gone, it's not watched anymore\n", folder->path);
+				folder->id = -1;
+			}
+			else if((event.kind == WATCH_CREATED || event.kind == WATCH_CHANGED) && event.name != NULL)
+				queue_drop_file(box, folder, event.name);
+		}
+
+		//the queue is read again from the folders
+		if(rescan) {
+
+			while(box->first != NULL) {
+				drop_file *file = box->first;
+				box->first = file->next;
+				semaphore_wait(&box->sem);
+				forget_drop_file(box, file);
+				semaphore_signal(&box->sem);
+				free_drop_file(file);
+			}
+
+			box->last = NULL;
+
+			for(int i=0; i<box->count; i++) {
+				if(box->folders[i].id >= 0)
+					scan_drop_folder(box, &box->folders[i]);
+			}
+		}
+	}
+
+	free(events);
+
+	return NULL;
+}
+
+
+/*
+* Function used to free the drop folders once they are stopped and none of their jobs can run anymore (i.e. the job
+* table is stopped too). The seed log is synced and closed.
+*/
+void free_drop_box(drop_box *box) {
+
+	drop_file *lists[2] = {box->first, box->retry};
+
+	for(int l=0; l<2; l++) {
+		while(lists[l] != NULL) {
+			drop_file *file = lists[l];
+			lists[l] = file->next;
+			free_drop_file(file);
+		}
+	}
+
+	for(int i=0; i<box->count; i++)
+		free(box->folders[i].path);
+
+	for(int i=0; i<DROP_SPARED_BUCKETS; i++) {
+		while(box->spared[i] != NULL) {
+			drop_spared *spared = box->spared[i];
+			box->spared[i] = spared->next;
+			free(spared->path);
+			free(spared);
+		}
+	}
+
+	close_seed_log(&box->log);
+	stop_semaphore(&box->sem);
+
+	free(box->log.file);
+	free(box->directory);
+
+	bzero(box->known, sizeof(box->known));
+
+	box->first	= NULL;
+	box->last	= NULL;
+	box->retry	= NULL;
+	box->count	= 0;
+}
+
+
+/*
+* Function used to start watching the drop folders.
+* ARGUMENTS:
+*	-box:		the drop folders to start
+*	-spec:		the drop folders, see parse_drop_folders
+*	-base:		directory relative folders and the seed log are relative to
+*	-directory:	absolute path of the working directory
+*	-jobs:		job_table which encrypts the files
+*	-bulk_limit:	size which sends a file to the bulk lane
+*	-throttle:	bandwidth the encryptions are paced by
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1 (always on platforms which can't watch directories)
+*/
+int start_drop_box(drop_box *box, char *spec, char *base, char *directory, job_table *jobs, long bulk_limit, io_throttle *throttle) {
+
+	bzero(box, sizeof(drop_box));
+
+	if(start_semaphore_ex(&box->sem) < 0)
+		return -1;
+
+	box->jobs	= jobs;
+	box->bulk_limit	= bulk_limit;
+	box->throttle	= throttle;
+
+	int length = strlen(base) + strlen(SEED_LOG_FILE) + 2;
+
+	if(parse_drop_folders(box, spec, base) < 0) {
+		printf("\tDrop folders must be given as directory=seed|%s[,directory=seed|%s...], at most %i of them\n", DROP_RANDOM, DROP_RANDOM, DROP_MAX_FOLDERS);
+		free_drop_box(box);
+		return -1;
+	}
+
+	if((box->directory = strdup(directory)) == NULL || (box->log.file = (char *)malloc(length)) == NULL || start_watcher(&box->watch) < 0) {
+		free_drop_box(box);
+		return -1;
+	}
+
+	snprintf(box->log.file, length, "%s/%s", base, SEED_LOG_FILE);
+
+	for(int i=0; i<box->count; i++) {
+		if((box->folders[i].id = watch_written_files(&box->watch, box->folders[i].path)) < 0)
+			printf("\tDrop folder %s can't be watched, its files won't be encrypted\n", box->folders[i].path);
+	}
+
+	seed_random(&box->random, (unsigned int)time(NULL) ^ (unsigned int)current_time_ms());
+
+	if(create_thread(&box->updater, drop_watcher, (void *)box) < 0) {
+		stop_watcher(&box->watch);
+		free_drop_box(box);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to stop watching the drop folders. Their jobs can still be running: box must be freed with
+* free_drop_box once the job table is stopped.
+*/
+void stop_drop_box(drop_box *box) {
+
+	semaphore_wait(&box->sem);
+	box->stop = 1;
+	semaphore_signal(&box->sem);
+
+	join_thread(&box->updater, NULL);
+	stop_watcher(&box->watch);
+}
@@ -0,0 +1,752 @@
+//states of a job
+#define JOB_QUEUED		0
+#define JOB_RUNNING		1
+#define JOB_DONE		2
+#define JOB_FAILED		3
+#define JOB_BUSY		4
+#define JOB_CANCELLED		5
+#define JOB_EXPIRED		6		//the deadline given by the client was over before the job could finish
+
+//lanes of the job table: small jobs never wait behind big ones
+#define JOB_LANE_SMALL		0
+#define JOB_LANE_BULK		1
+#define JOB_LANES		2
+
+#define JOB_TABLE_SIZE		1024		//number of jobs remembered by the server, the oldest finished ones are forgotten first
+#define JOB_LINE_LENGTH		128
+#define JOB_MAX_ROUNDS		64		//a single job never costs more than JOB_MAX_ROUNDS quantums of its lane
+
+
+
+/*
+* Function which executes the action of a job, i.e. ENCR or DECR
+*/
+typedef int (*job_action)(int seed, char *target, job_control *control);
+
+
+/*
+* Structure which defines a job submitted to the server. It lives in a job_table and in the queue of its lane until
+* a worker runs it, then it stays in the table (with its result) until its slot is needed by a newer job.
+*	-id:		id returned to the client
+*	-state:		JOB_* state of the job
+*	-action:	function to run and its arguments (seed and absolute path of the target)
+*	-control:	progress of the action, used by STAT and CANC
+*	-lane:		JOB_LANE_* lane which runs the job
+*	-cost:		bytes of the target, used to share the lane between clients
+*	-client:	address of the client which submitted the job
+*	-reply:		set if the client is waiting for the job on reply_to (speaking reply_protocol)
+*	-reply_owner:	if not NULL, the connection of the event loop which owns reply_to
+*	-admitted:	set if the job was admitted by the admission of the table, released when the job is over
+*	-on_close:	if not NULL, called with the job once it won't run anymore (whatever its state), owner is left to it
+*	-submitted, started, finished:	times (current_time_ms) of the events of the job
+*	-waiters:	number of threads waiting for the job to finish on done
+*	-refs:		number of threads (and queues) using the job, it can't be freed until it's zero
+*	-evicted:	set when the job is not in the table anymore, the last one which releases it frees it
+*/
+typedef struct job {
+	int id;
+	int state;
+	job_action action;
+	unsigned int seed;
+	char *path;
+	job_control control;
+	int lane;
+	long cost;
+	char client[ADDRESS_LENGTH];
+	int reply;
+	io_interface reply_to;
+	int reply_protocol;
+	void *reply_owner;
+	int admitted;
+	void (*on_close)(struct job *target);
+	void *owner;
+	long submitted;
+	long started;
+	long finished;
+	int waiters;
+	int refs;
+	int evicted;
+	semaphore done;
+	struct job *next;
+} job;
+
+
+/*
+* Structure which defines the jobs of a single client waiting in a lane. Clients with queued jobs are kept
+* in a circular list and served with a deficit round robin, so that every client gets the same share of bytes.
+*/
+typedef struct client_queue {
+	char address[ADDRESS_LENGTH];
+	job *head;
+	job *tail;
+	long deficit;
+	struct client_queue *prev;
+	struct client_queue *next;
+} client_queue;
+
+
+/*
+* Structure which defines a lane of the job table and the workers reserved to it.
+*	-current:	next client to serve, NULL if nothing is queued
+*	-quantum:	bytes given to a client every time its turn comes
+*	-workers:	threads which run the jobs of the lane, they can be changed while the table runs
+*	-pending:	semaphore which counts the jobs queued in the lane (and the workers asked to leave)
+*	-queued:	jobs queued in the lane, none of the workers took them yet
+*/
+typedef struct {
+	client_queue *current;
+	long quantum;
+	int queued;
+	thread_pool workers;
+	struct job_table *table;
+	semaphore pending;
+} job_lane;
+
+
+/*
+* Structure which defines the table of the jobs of the server and the lanes which run them.
+*	-slots:		jobs of the table, job with id i is saved in slots[i % JOB_TABLE_SIZE]
+*	-lanes:		JOB_LANE_SMALL and JOB_LANE_BULK lanes
+*	-on_reply:	function called by a worker when a job with a reply connection is finished, on_reply_param is given to it
+*	-limits:	admission of the server, which admitted jobs are given back to
+*	-sem:		mutex semaphore used to access every field of the table, of its lanes and of its jobs
+*/
+typedef struct job_table {
+	job *slots[JOB_TABLE_SIZE];
+	job_lane lanes[JOB_LANES];
+	int next_id;
+	int stop;
+	void (*on_reply)(struct job_table *table, job *target);
+	void *on_reply_param;
+	admission *limits;
+	semaphore sem;
+} job_table;
+
+
+
+char *job_state_name(int state) {
+
+	switch(state) {
+		case JOB_QUEUED:	return "QUEUED";
+		case JOB_RUNNING:	return "RUNNING";
+		case JOB_DONE:		return "DONE";
+		case JOB_FAILED:	return "FAILED";
+		case JOB_BUSY:		return "BUSY";
+		case JOB_CANCELLED:	return "CANCELLED";
+		case JOB_EXPIRED:	return "EXPIRED";
+	}
+	return "UNKNOWN";
+}
+
+
+void free_job(job *target) {
+	stop_semaphore(&target->done);
+	free(target->path);
+	free(target);
+}
+
+
+/*
+* Function used to create a new job. Its lane, cost, client and reply can be set before submitting it.
+* ARGUMENTS:
+*	-action:	the action to run
+*	-seed:		seed given to the action
+*	-path:		path given to the action, it should be absolute as the job may run after the working directory changed
+* RETURN VALUE:
+*	The new job, NULL if it could not be allocated
+*/
+job *create_job(job_action action, unsigned int seed, char *path) {
+
+	job *new_job = (job *)malloc(sizeof(job));
+	if(new_job == NULL)
+		return NULL;
+
+	bzero(new_job, sizeof(job));
+
+	if((new_job->path = (char *)malloc(strlen(path) + 1)) == NULL || start_semaphore(&new_job->done, 0, JOB_TABLE_SIZE) < 0) {
+		free(new_job->path);
+		free(new_job);
+		return NULL;
+	}
+
+	strcpy(new_job->path, path);
+	new_job->action		= action;
+	new_job->seed		= seed;
+	new_job->state		= JOB_QUEUED;
+	new_job->lane		= JOB_LANE_SMALL;
+
+	return new_job;
+}
+
+
+/*
+* Function used to stop using a job previously returned by find_job (or taken from a queue).
+*/
+void release_job(job_table *table, job *target) {
+
+	semaphore_wait(&table->sem);
+	int to_free = --target->refs == 0 && target->evicted;
+	semaphore_signal(&table->sem);
+
+	if(to_free)
+		free_job(target);
+}
+
+
+/*
+* Function used to set the final state of a job and wake up everyone waiting for it.
+*/
+void finish_job(job_table *table, job *target, int state) {
+
+	semaphore_wait(&table->sem);
+
+	target->state		= state;
+	target->finished	= current_time_ms();
+
+	int waiters = target->waiters;
+	target->waiters = 0;
+
+	semaphore_signal(&table->sem);
+
+	for(int i=0; i<waiters; i++)
+		semaphore_signal(&target->done);
+}
+
+
+/*
+* Functions used to add a job to a lane and to take the next one, they must be called under the mutex of the table.
+* The next job is chosen with a deficit round robin between the clients of the lane. If the client of the job
+* has nothing queued yet, spare is used as its queue and set to NULL.
+*/
+void lane_push(job_lane *lane, job *target, client_queue **spare) {
+
+	client_queue *client = lane->current;
+
+	//look for the queue of the client, the number of clients waiting at the same time is small
+	if(client != NULL) {
+		do {
+			if(strcmp(client->address, target->client) == 0)
+				break;
+			client = client->next;
+		} while(client != lane->current);
+
+		if(strcmp(client->address, target->client) != 0)
+			client = NULL;
+	}
+
+	//first job of the client, add it at the end of the round
+	if(client == NULL) {
+
+		client = *spare;
+		*spare = NULL;
+
+		bzero(client, sizeof(client_queue));
+		strcpy(client->address, target->client);
+
+		if(lane->current == NULL) {
+			client->prev = client;
+			client->next = client;
+			lane->current = client;
+		}
+		else {
+			client->next = lane->current;
+			client->prev = lane->current->prev;
+			client->prev->next = client;
+			lane->current->prev = client;
+		}
+	}
+
+	target->next = NULL;
+
+	if(client->tail == NULL)
+		client->head = target;
+	else
+		client->tail->next = target;
+	client->tail = target;
+
+	lane->queued++;
+}
+
+job *lane_pop(job_lane *lane) {
+
+	while(lane->current != NULL) {
+
+		client_queue *client = lane->current;
+		job *first = client->head;
+		long cost = first->cost < lane->quantum * JOB_MAX_ROUNDS ? first->cost : lane->quantum * JOB_MAX_ROUNDS;
+
+		//not enough credit, the turn passes to the next client
+		if(cost > client->deficit) {
+			client->deficit += lane->quantum;
+			lane->current = client->next;
+			continue;
+		}
+
+		client->deficit -= cost;
+		client->head = first->next;
+		lane->queued--;
+
+		//nothing else to do for this client: forget it (and its credit)
+		if(client->head == NULL) {
+			if(client->next == client)
+				lane->current = NULL;
+			else {
+				client->prev->next = client->next;
+				client->next->prev = client->prev;
+				lane->current = client->next;
+			}
+			free(client);
+		}
+
+		return first;
+	}
+
+	return NULL;
+}
+
+
+/*
+* Function called once a job taken from a lane won't run anymore: what it was admitted is released and
+* the client waiting for it is answered.
+*/
+void close_job(job_table *table, job *target) {
+
+	if(target->admitted && table->limits != NULL)
+		release_request(table->limits, target->client, target->cost, target->started != 0 ? target->finished - target->started : 0);
+
+	if(target->reply && table->on_reply != NULL)
+		table->on_reply(table, target);
+
+	if(target->on_close != NULL)
+		target->on_close(target);
+}
+
+
+/*
+* Function executed by the workers of a lane: run the queued jobs one by one until the table is stopped.
+*/
+void *job_worker(void *params) {
+
+	pool_thread_conf *conf = (pool_thread_conf *)params;
+	job_lane *lane = (job_lane *)conf->param;
+	job_table *table = lane->table;
+	int index = conf->index;
+
+	free(conf);
+
+	while(1) {
+
+		semaphore_wait(&lane->pending);
+		semaphore_wait(&table->sem);
+
+		if(table->stop || leave_thread_pool(&lane->workers, index)) {
+			semaphore_signal(&table->sem);
+			break;
+		}
+
+		//the reference held by the queue now belongs to this worker
+		job *current = lane_pop(lane);
+
+		if(current == NULL) {
+			semaphore_signal(&table->sem);
+			continue;
+		}
+
+		//cancelled while it was waiting in the queue
+		if(current->state != JOB_QUEUED) {
+			semaphore_signal(&table->sem);
+			close_job(table, current);
+			release_job(table, current);
+			continue;
+		}
+
+		current->state		= JOB_RUNNING;
+		current->started	= current_time_ms();
+
+		semaphore_signal(&table->sem);
+
+		int result = current->action(current->seed, current->path, &current->control);
+
+		finish_job(table, current, result == 0 ? JOB_DONE : result == -2 ? JOB_BUSY : result == XOR_CANCELLED ? JOB_CANCELLED :
+			result == XOR_EXPIRED ? JOB_EXPIRED : JOB_FAILED);
+
+		close_job(table, current);
+		release_job(table, current);
+	}
+
+	return NULL;
+}
+
+
+/*
+* Function used to change the number of workers of the lanes of a running job_table. Workers in excess
+* leave as soon as they finish their current job, queued jobs are not affected.
+* ARGUMENTS:
+*	-table:		the job_table to resize
+*	-small_workers:	number of workers reserved to small jobs
+*	-bulk_workers:	number of workers reserved to big jobs
+*	-quantum:	bytes given to a client at every turn, it should be the size which makes a job big
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int resize_job_table(job_table *table, int small_workers, int bulk_workers, long quantum) {
+
+	int sizes[JOB_LANES];
+	int to_wake[JOB_LANES];
+	int result = 0;
+
+	sizes[JOB_LANE_SMALL]	= small_workers;
+	sizes[JOB_LANE_BULK]	= bulk_workers;
+
+	semaphore_wait(&table->sem);
+
+	for(int l=0; l<JOB_LANES; l++) {
+
+		table->lanes[l].quantum = quantum > 0 ? quantum : 1;
+
+		if((to_wake[l] = resize_thread_pool(&table->lanes[l].workers, sizes[l], job_worker, (void *)&table->lanes[l])) < 0) {
+			to_wake[l] = 0;
+			result = -1;
+		}
+	}
+
+	semaphore_signal(&table->sem);
+
+	for(int l=0; l<JOB_LANES; l++) {
+		for(int i=0; i<to_wake[l]; i++)
+			semaphore_signal(&table->lanes[l].pending);
+	}
+
+	return result;
+}
+
+
+/*
+* Function used to start a job_table and the workers of its lanes.
+* ARGUMENTS:
+*	-table:		the job_table to start
+*	-small_workers:	number of workers reserved to small jobs
+*	-bulk_workers:	number of workers reserved to big jobs
+*	-quantum:	bytes given to a client at every turn, it should be the size which makes a job big
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int start_job_table(job_table *table, int small_workers, int bulk_workers, long quantum) {
+
+	bzero(table, sizeof(job_table));
+
+	table->next_id = 1;
+
+	if(start_semaphore_ex(&table->sem) < 0)
+		return -1;
+
+	for(int l=0; l<JOB_LANES; l++) {
+
+		start_thread_pool(&table->lanes[l].workers);
+		table->lanes[l].table = table;
+
+		if(start_semaphore(&table->lanes[l].pending, 0, JOB_TABLE_SIZE) < 0)
+			return -1;
+	}
+
+	return resize_job_table(table, small_workers, bulk_workers, quantum);
+}
+
+
+/*
+* Function used to cancel a job: if it is still queued it won't run, if it is running it is stopped
+* before its next chunk.
+*/
+void cancel_job(job_table *table, job *target) {
+
+	int waiters = 0;
+
+	semaphore_wait(&table->sem);
+
+	target->control.cancel = 1;
+
+	if(target->state == JOB_QUEUED) {
+		target->state		= JOB_CANCELLED;
+		target->finished	= current_time_ms();
+		waiters			= target->waiters;
+		target->waiters		= 0;
+	}
+
+	semaphore_signal(&table->sem);
+
+	for(int i=0; i<waiters; i++)
+		semaphore_signal(&target->done);
+}
+
+
+/*
+* Function used to stop a job_table: queued jobs are cancelled, running ones are asked to stop (their original
+* files are left untouched) and all the workers are joined. Threads waiting for a job are woken up.
+* Jobs can still be read until free_job_table is called.
+*/
+int stop_job_table(job_table *table) {
+
+	semaphore_wait(&table->sem);
+
+	table->stop = 1;
+
+	for(int i=0; i<JOB_TABLE_SIZE; i++) {
+		if(table->slots[i] != NULL)
+			table->slots[i]->control.cancel = 1;
+	}
+
+	semaphore_signal(&table->sem);
+
+	//workers which already left the pool exit without waiting, the others need a wake up each
+	for(int l=0; l<JOB_LANES; l++) {
+		for(int i=0; i<table->lanes[l].workers.running; i++)
+			semaphore_signal(&table->lanes[l].pending);
+	}
+
+	for(int l=0; l<JOB_LANES; l++)
+		stop_thread_pool(&table->lanes[l].workers);
+
+	//nothing runs anymore, what is still queued is cancelled and its waiting client answered
+	for(int l=0; l<JOB_LANES; l++) {
+
+		job *current;
+
+		while((current = lane_pop(&table->lanes[l])) != NULL) {
+			cancel_job(table, current);
+			close_job(table, current);
+			release_job(table, current);
+		}
+	}
+
+	for(int i=0; i<JOB_TABLE_SIZE; i++) {
+		if(table->slots[i] != NULL)
+			cancel_job(table, table->slots[i]);
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to free a job_table stopped with stop_job_table, once nobody else is using it.
+*/
+int free_job_table(job_table *table) {
+
+	for(int i=0; i<JOB_TABLE_SIZE; i++) {
+		if(table->slots[i] != NULL)
+			free_job(table->slots[i]);
+	}
+
+	for(int l=0; l<JOB_LANES; l++)
+		stop_semaphore(&table->lanes[l].pending);
+
+	stop_semaphore(&table->sem);
+
+	return 0;
+}
+
+
+/*
+* Function used to put a job in the table and in the queue of its lane, it must be called under the mutex of the table.
+* RETURN VALUE:
+*	On success the id of the job is returned, otherwise -1 (the table is stopped or full of unfinished jobs).
+*	evicted is set to the job which left the table and must be freed, if any
+*/
+int insert_job(job_table *table, job *new_job, client_queue **spare, job **evicted) {
+
+	int id = table->next_id;
+	job *old = table->slots[id % JOB_TABLE_SIZE];
+
+	*evicted = NULL;
+
+	//the slot is still used by a job which didn't finish, the table is full
+	if(table->stop || (old != NULL && old->state <= JOB_RUNNING))
+		return -1;
+
+	if(old != NULL) {
+		old->evicted = 1;
+		if(old->refs == 0)
+			*evicted = old;
+	}
+
+	new_job->submitted	= current_time_ms();
+	new_job->refs		= 1;		//reference of the queue
+
+	table->next_id++;
+	new_job->id = id;
+	table->slots[id % JOB_TABLE_SIZE] = new_job;
+
+	lane_push(&table->lanes[new_job->lane], new_job, spare);
+
+	return id;
+}
+
+
+/*
+* Function used to add a job created with create_job to the queue of its lane. If it can't be submitted
+* the job is freed.
+* RETURN VALUE:
+*	On success the id of the job is returned, otherwise -1 (also when the table is full of unfinished jobs)
+*/
+int submit_job(job_table *table, job *new_job) {
+
+	job *old;
+
+	//allocated out of the mutex section, in case this is the first job of its client
+	client_queue *spare = (client_queue *)malloc(sizeof(client_queue));
+	if(spare == NULL) {
+		free_job(new_job);
+		return -1;
+	}
+
+	semaphore_wait(&table->sem);
+	int id = insert_job(table, new_job, &spare, &old);
+	semaphore_signal(&table->sem);
+
+	if(id < 0)
+		free_job(new_job);
+	else
+		semaphore_signal(&table->lanes[new_job->lane].pending);
+
+	if(old != NULL)
+		free_job(old);
+
+	free(spare);
+
+	return id;
+}
+
+
+/*
+* Function used to submit many jobs of the same client at once (e.g. the files found by a drop folder), taking
+* the mutex of the table and waking the workers once for all of them. Jobs are submitted in order until the table
+* is full: the ones which can't be submitted are freed.
+* RETURN VALUE:
+*	The number of jobs submitted, the first ones of jobs
+*/
+int submit_jobs(job_table *table, job **jobs, int count) {
+
+	client_queue *spares[JOB_LANES];
+	int pushed[JOB_LANES];
+	job *evicted = NULL;
+	job *old;
+	int submitted = 0;
+	int limit = count;
+
+	//a queue for each lane is enough, the jobs have the same client
+	for(int l=0; l<JOB_LANES; l++) {
+		spares[l] = (client_queue *)malloc(sizeof(client_queue));
+		pushed[l] = 0;
+	}
+
+	semaphore_wait(&table->sem);
+
+	for(int l=0; l<JOB_LANES; l++) {
+		if(spares[l] == NULL)
+			limit = 0;
+	}
+
+	while(submitted < limit && insert_job(table, jobs[submitted], &spares[jobs[submitted]->lane], &old) >= 0) {
+
+		pushed[jobs[submitted]->lane]++;
+		submitted++;
+
+		//evicted jobs were taken from their lanes long ago, next is free again
+		if(old != NULL) {
+			old->next = evicted;
+			evicted = old;
+		}
+	}
+
+	semaphore_signal(&table->sem);
+
+	for(int l=0; l<JOB_LANES; l++) {
+		for(int i=0; i<pushed[l]; i++)
+			semaphore_signal(&table->lanes[l].pending);
+		free(spares[l]);
+	}
+
+	while(evicted != NULL) {
+		old = evicted;
+		evicted = evicted->next;
+		free_job(old);
+	}
+
+	for(int i=submitted; i<count; i++)
+		free_job(jobs[i]);
+
+	return submitted;
+}
+
+
+/*
+* Function used to know how many jobs wait in a lane because every worker of the lane is busy.
+*/
+int lane_backlog(job_table *table, int lane) {
+
+	semaphore_wait(&table->sem);
+	int queued = table->lanes[lane].queued;
+	semaphore_signal(&table->sem);
+
+	return queued;
+}
+
+
+/*
+* Function used to find a job by its id. The returned job must be given back with release_job.
+* RETURN VALUE:
+*	The job with the given id, NULL if the table doesn't remember it
+*/
+job *find_job(job_table *table, int id) {
+
+	if(id <= 0)
+		return NULL;
+
+	semaphore_wait(&table->sem);
+
+	job *found = table->slots[id % JOB_TABLE_SIZE];
+
+	if(found != NULL && found->id == id)
+		found->refs++;
+	else
+		found = NULL;
+
+	semaphore_signal(&table->sem);
+
+	return found;
+}
+
+
+/*
+* Function used to wait until the given job is finished (whatever its final state is).
+*/
+void wait_job(job_table *table, job *target) {
+
+	semaphore_wait(&table->sem);
+
+	int running = target->state <= JOB_RUNNING;
+	if(running)
+		target->waiters++;
+
+	semaphore_signal(&table->sem);
+
+	if(running)
+		semaphore_wait(&target->done);
+}
+
+
+/*
+* Function used to write the status of a job as a single line:
+*	id	state	processed_bytes	total_bytes	throughput (bytes per second)
+* RETURN VALUE:
+*	The number of chars written
+*/
+int format_job(job *target, char *out, int length) {
+
+	long end	= target->finished != 0 ? target->finished : current_time_ms();
+	long elapsed	= target->started != 0 ? end - target->started : 0;
+	long processed	= target->control.processed;
+
+	return snprintf(out, length, "%i\t%s\t%ld\t%ld\t%ld\r\n", target->id, job_state_name(target->state),
+		processed, target->control.total, elapsed > 0 ? processed * 1000 / elapsed : 0);
+}
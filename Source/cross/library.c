@@ -0,0 +1,410 @@
+#define LIBRARY_MAX_QUEUED	(1 << 30)	//commands waiting for a connection of an encrypter_client, at most
+
+
+/*
+* Structure which defines a command submitted to an encrypter_client (see encrypter.h).
+*	-conf:		the command (see parse_client_command), its strings point inside words
+*	-on_data, on_done, param:	given to encrypter_submit
+*	-body, length, capacity:	the body of the answer, kept when there's no on_data
+*	-status, hint:	how the command ended, visible once over is set (protected by sem)
+*	-released:	set by encrypter_release while the command is not over (protected by sem)
+*	-finished:	signalled once the command is over, encrypter_wait waits for it
+*	-next:		next command waiting for a connection
+*/
+struct encrypter_call {
+	client_configuration conf;
+	char *words;
+	encrypter_data_callback on_data;
+	encrypter_done_callback on_done;
+	void *param;
+	char *body;
+	int length;
+	int capacity;
+	int status;
+	int hint;
+	int over;
+	int released;
+	semaphore sem;
+	semaphore finished;
+	struct encrypter_call *next;
+};
+
+
+/*
+* Structure which defines a client of the library: a pool of threads, each one with its own connection to the server.
+*	-defaults:	address and port of the server, copied by every command
+*	-workers:	threads of the pool, connections of them
+*	-first, last:	commands waiting for a connection (protected by sem), queued counts them
+*/
+struct encrypter_client {
+	client_configuration defaults;
+	thread *workers;
+	int connections;
+	encrypter_call *first;
+	encrypter_call *last;
+	semaphore sem;
+	semaphore queued;
+};
+
+
+void free_encrypter_call(encrypter_call *call) {
+
+	free_client_command(&call->conf);
+	free(call->words);
+	free(call->body);
+	stop_semaphore(&call->sem);
+	stop_semaphore(&call->finished);
+	free(call);
+}
+
+
+/*
+* Function used to end a command: on_done is called, then encrypter_wait returns. The call is freed here if it
+* was released while it was running.
+*/
+void finish_encrypter_call(encrypter_call *call, int status, int hint) {
+
+	semaphore_wait(&call->sem);
+	call->status	= status;
+	call->hint	= hint;
+	semaphore_signal(&call->sem);
+
+	if(call->on_done != NULL)
+		call->on_done(call->param, call);
+
+	semaphore_wait(&call->sem);
+
+	int released	= call->released;
+	call->over	= 1;
+
+	semaphore_signal(&call->finished);
+	semaphore_signal(&call->sem);
+
+	if(released)
+		free_encrypter_call(call);
+}
+
+
+/*
+* Function given to read_client_answer: the body goes to on_data, or is kept by the call.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int receive_encrypter_body(void *param, char *source, int length) {
+
+	encrypter_call *call = (encrypter_call *)param;
+
+	if(call->on_data != NULL)
+		return call->on_data(call->param, source, length) < 0 ? -1 : 0;
+
+	//one more byte, so that text bodies can be read as a string
+	if(call->length + length + 1 > call->capacity) {
+
+		int capacity = call->capacity > 0 ? call->capacity : FRAME_BUFFER_SIZE;
+
+		while(capacity < call->length + length + 1)
+			capacity *= 2;
+
+		char *body = (char *)realloc(call->body, capacity);
+
+		if(body == NULL) {
+			call->status = ENCRYPTER_NO_MEMORY;
+			return -1;
+		}
+
+		call->body	= body;
+		call->capacity	= capacity;
+	}
+
+	memcpy(call->body + call->length, source, length);
+	call->length += length;
+	call->body[call->length] = '\0';
+
+	return 0;
+}
+
+
+/*
+* Function executed by every thread of an encrypter_client: commands are taken from the queue and sent over the
+* connection of the thread, which is opened again when the server closed it. encrypter_close wakes every thread
+* once more than the queued commands, a thread which finds the queue empty stops.
+*/
+void *encrypter_connection(void *params) {
+
+	encrypter_client *client = (encrypter_client *)params;
+	client_configuration conf = client->defaults;
+	io_interface server;
+	int connected = 0;
+
+	char *message	= (char *)malloc(SOCK_PACKET_SIZE);
+	char *frame	= (char *)malloc(FRAME_BUFFER_SIZE);
+	char *expanded	= NULL;
+
+	while(1) {
+
+		semaphore_wait(&client->queued);
+		semaphore_wait(&client->sem);
+
+		encrypter_call *call = client->first;
+
+		if(call != NULL && (client->first = call->next) == NULL)
+			client->last = NULL;
+
+		semaphore_signal(&client->sem);
+
+		if(call == NULL)
+			break;
+
+		if(message == NULL || frame == NULL) {
+			finish_encrypter_call(call, ENCRYPTER_NO_MEMORY, 0);
+			continue;
+		}
+
+		//servers close the connections which stay idle for too long
+		if(connected && is_connection_closed(&server)) {
+			close_socket(&server);
+			connected = 0;
+		}
+
+		int retry_after = 0;
+
+		if(!connected && client_connect(&conf, &server, &retry_after) < 0) {
+			finish_encrypter_call(call, retry_after > 0 ? ENCRYPTER_OVERLOADED : ENCRYPTER_UNREACHABLE, retry_after);
+			continue;
+		}
+
+		connected = 1;
+
+		//listings are asked as text lines, compressed if the server can
+		call->conf.protocol		= conf.protocol;
+		call->conf.binary_listings	= 0;
+		call->conf.compressed_listings	= conf.compressed_listings;
+
+		format_client_command(&call->conf, message, 0);
+
+		int response = 0;
+		int hint = 0;
+		int result;
+
+		if(conf.protocol == PROTOCOL_V1)
+			result = write_string_to_socket(message, &server);
+		else
+			result = write_frame_to_socket(FRAME_CMD, 0, message, strlen(message), &server);
+
+		if(result == 0)
+			result = read_client_answer(&call->conf, &server, frame, &expanded, receive_encrypter_body, call, &response, &hint);
+
+		//a broken connection can't be used anymore, v1 servers close it after every answer
+		if(result < 0 || conf.protocol == PROTOCOL_V1) {
+			close_socket(&server);
+			connected = 0;
+		}
+
+		if(result < 0)
+			finish_encrypter_call(call, call->status == ENCRYPTER_NO_MEMORY ? ENCRYPTER_NO_MEMORY : ENCRYPTER_LOST, 0);
+		else
+			finish_encrypter_call(call, response, hint);
+	}
+
+	if(connected) {
+		if(conf.protocol == PROTOCOL_V2)
+			write_frame_to_socket(FRAME_END, 0, NULL, 0, &server);
+		close_socket(&server);
+	}
+
+	free(message);
+	free(frame);
+	free(expanded);
+
+	return NULL;
+}
+
+
+/*
+* Function used to create a client of the server at address:port, with connections threads. Writing to a connection
+* which the server closed fails with EPIPE: no signal handler is installed, the process is left as it was.
+*/
+encrypter_client *encrypter_open(const char *address, int port, int connections) {
+
+	encrypter_client *client = (encrypter_client *)calloc(1, sizeof(encrypter_client));
+
+	if(connections < 1)
+		connections = 1;
+
+	if(client == NULL || (client->defaults.address = strdup(address)) == NULL || (client->workers = (thread *)malloc(connections * sizeof(thread))) == NULL) {
+		if(client != NULL)
+			free(client->defaults.address);
+		free(client);
+		return NULL;
+	}
+
+	client->defaults.port = port;
+
+	if(start_semaphore_ex(&client->sem) < 0 || start_semaphore(&client->queued, 0, LIBRARY_MAX_QUEUED) < 0) {
+		free(client->defaults.address);
+		free(client->workers);
+		free(client);
+		return NULL;
+	}
+
+	while(client->connections < connections && create_thread(&client->workers[client->connections], encrypter_connection, (void *)client) == 0)
+		client->connections++;
+
+	if(client->connections == 0) {
+		encrypter_close(client);
+		return NULL;
+	}
+
+	return client;
+}
+
+
+void encrypter_close(encrypter_client *client) {
+
+	for(int i=0; i<client->connections; i++)
+		semaphore_signal(&client->queued);
+
+	for(int i=0; i<client->connections; i++)
+		join_thread(&client->workers[i], NULL);
+
+	stop_semaphore(&client->sem);
+	stop_semaphore(&client->queued);
+
+	free(client->defaults.address);
+	free(client->workers);
+	free(client);
+}
+
+
+/*
+* Function used to submit a command to a client. Invalid commands are over before it returns.
+*/
+encrypter_call *encrypter_submit(encrypter_client *client, const char *command, encrypter_data_callback on_data, encrypter_done_callback on_done, void *param) {
+
+	encrypter_call *call = (encrypter_call *)calloc(1, sizeof(encrypter_call));
+
+	if(call == NULL || (call->words = strdup(command)) == NULL) {
+		free(call);
+		return NULL;
+	}
+
+	if(start_semaphore_ex(&call->sem) < 0 || start_semaphore(&call->finished, 0, 1) < 0) {
+		free(call->words);
+		free(call);
+		return NULL;
+	}
+
+	call->conf		= client->defaults;
+	call->on_data		= on_data;
+	call->on_done		= on_done;
+	call->param		= param;
+
+	if(parse_client_command(call->words, &call->conf) < 0) {
+		finish_encrypter_call(call, ENCRYPTER_INVALID, 0);
+		return call;
+	}
+
+	semaphore_wait(&client->sem);
+
+	if(client->last != NULL)
+		client->last->next = call;
+	else
+		client->first = call;
+
+	client->last = call;
+
+	semaphore_signal(&client->sem);
+	semaphore_signal(&client->queued);
+
+	return call;
+}
+
+
+int encrypter_poll(encrypter_call *call) {
+
+	semaphore_wait(&call->sem);
+	int status = call->over ? call->status : ENCRYPTER_PENDING;
+	semaphore_signal(&call->sem);
+
+	return status;
+}
+
+
+int encrypter_wait(encrypter_call *call) {
+
+	//the next encrypter_wait must not block
+	semaphore_wait(&call->finished);
+	semaphore_signal(&call->finished);
+
+	return encrypter_poll(call);
+}
+
+
+int encrypter_hint(encrypter_call *call) {
+
+	semaphore_wait(&call->sem);
+	int hint = call->over ? call->hint : 0;
+	semaphore_signal(&call->sem);
+
+	return hint;
+}
+
+
+const char *encrypter_body(encrypter_call *call, int *length) {
+
+	semaphore_wait(&call->sem);
+	int over = call->over;
+	semaphore_signal(&call->sem);
+
+	*length = over ? call->length : 0;
+
+	return over ? call->body : NULL;
+}
+
+
+void encrypter_release(encrypter_call *call) {
+
+	semaphore_wait(&call->sem);
+
+	int over	= call->over;
+	call->released	= 1;
+
+	semaphore_signal(&call->sem);
+
+	//a command which is running is freed by finish_encrypter_call
+	if(over)
+		free_encrypter_call(call);
+}
+
+
+const char *encrypter_status_string(int status) {
+
+	switch(status) {
+		case ENCRYPTER_PENDING:
+			return "not over yet";
+		case ENCRYPTER_DONE:
+			return "executed";
+		case ENCRYPTER_NOT_MODIFIED:
+			return "nothing changed";
+		case ENCRYPTER_BODY:
+			return "executed, answered with a body";
+		case ENCRYPTER_FAILED:
+			return "the server couldn't execute it";
+		case ENCRYPTER_BUSY:
+			return "the file is being used by someone else";
+		case ENCRYPTER_OVERLOADED:
+			return "the server is overloaded";
+		case ENCRYPTER_TIMEOUT:
+			return "not executed before its deadline";
+		case ENCRYPTER_INVALID:
+			return "not a valid command";
+		case ENCRYPTER_UNREACHABLE:
+			return "the server couldn't be reached";
+		case ENCRYPTER_LOST:
+			return "the connection broke before the whole answer arrived";
+		case ENCRYPTER_NO_MEMORY:
+			return "no memory for the answer";
+		default:
+			return "unknown status";
+	}
+}
@@ -0,0 +1,1096 @@
+#define LISTING_ANY		0		//types of files a listing can be limited to
+#define LISTING_ENCRYPTED	1		//files whose name ends with ENCR_EXT
+#define LISTING_PLAIN		2		//files whose name doesn't
+#define SORT_NONE		0		//files are listed as they're found
+#define SORT_NAME		1		//by path
+#define SORT_SIZE		2		//biggest files first, then by path
+#define LISTING_NEXT		"next"		//first word of the last line of a page which is not the last one
+
+
+
+/*
+* Structure which defines a file kept by a sorted listing.
+*	-path:		path of the file, as given to accept_listing_entry
+*	-depth:		depth of the file, 1 for the files of the listed directory
+*/
+typedef struct {
+	char *path;
+	int directory;
+	intmax_t size;
+	long mtime;
+	int mode;
+	int depth;
+} listing_entry;
+
+
+/*
+* Structure which defines the options given to LSTF or LSTR ("LSTR key=value key=value ..."), evaluated while
+* the directories are read. Its filter is given to the listing functions.
+*	-glob:		only files whose name matches it are listed (* ? and [] like a shell), NULL for all
+*	-min_size:	only files at least this big are listed (directories are not), 0 for all
+*	-type:		LISTING_ANY, LISTING_ENCRYPTED or LISTING_PLAIN (directories are not listed unless it's LISTING_ANY)
+*	-sort:		SORT_NONE, SORT_NAME or SORT_SIZE
+*	-top:		only the first top files of the sorted listing are sent, followed by a LISTING_NEXT line with the
+*			cursor to give with after= to get the next ones. 0 for all
+*	-after:		only the files which come after it in the sorted listing are sent (cursor of a previous page)
+*	-recursive:	set for LSTR
+*	-compress:	set when the client can read compressed frames and asked for them
+*	-token:		set when the client wants a generation line before the files, with the token to give to CHNG
+*			for the changes after the listing (see list_from_cache). Text listings only
+*	-entries:	files kept by a sorted listing: a heap with the last one on top while top is given. Protected by
+*			sem, as the directories of LSTR are read by several threads
+*	-more:		set when some file was left out because of top
+*/
+typedef struct {
+	listing_filter filter;
+	char *glob;
+	intmax_t min_size;
+	int type;
+	int sort;
+	int top;
+	listing_entry after;
+	int has_after;
+	int recursive;
+	int compress;
+	int token;
+	listing_entry *entries;
+	int count;
+	int capacity;
+	int more;
+	semaphore sem;
+} listing_query;
+
+
+
+/*
+* Function used to match one character against a [] class of a glob, pattern points to the '['.
+* RETURN VALUE:
+*	1 if the character matches, 0 if it doesn't, -1 if the class is not closed. end is set to what follows it
+*/
+int match_glob_class(char *pattern, char c, char **end) {
+
+	char *index = pattern + 1;
+	int negate = *index == '!' || *index == '^';
+	int found = 0;
+
+	if(negate)
+		index++;
+
+	//a ']' right after the '[' is part of the class
+	do {
+		if(*index == '\0')
+			return -1;
+
+		if(index[1] == '-' && index[2] != ']' && index[2] != '\0') {
+			if(c >= index[0] && c <= index[2])
+				found = 1;
+			index += 3;
+		}
+		else if(*index++ == c)
+			found = 1;
+	}
+	while(*index != ']');
+
+	*end = index + 1;
+
+	return found != negate;
+}
+
+
+/*
+* Function used to know if a name matches a glob (* ? and [] like a shell). Backtracks only to the last '*',
+* so that it's never slower than the length of the pattern times the length of the name.
+* RETURN VALUE:
+*	1 if name matches pattern, otherwise 0
+*/
+int match_glob(char *pattern, char *name) {
+
+	char *star = NULL;
+	char *star_name = NULL;
+
+	while(*name != '\0') {
+
+		char *next = pattern + 1;
+		int matched = 0;
+
+		if(*pattern == '*') {
+			star		= ++pattern;
+			star_name	= name;
+			continue;
+		}
+
+		if(*pattern == '[')
+			matched = match_glob_class(pattern, *name, &next);
+		else if(*pattern != '\0')
+			matched = *pattern == '?' || *pattern == *name;
+
+		//an unclosed class is a plain '['
+		if(matched < 0) {
+			matched	= *name == '[';
+			next	= pattern + 1;
+		}
+
+		if(matched) {
+			pattern = next;
+			name++;
+		}
+		else if(star != NULL) {
+			pattern	= star;
+			name	= ++star_name;
+		}
+		else
+			return 0;
+	}
+
+	while(*pattern == '*')
+		pattern++;
+
+	return *pattern == '\0';
+}
+
+
+int compare_by_name(const void *first, const void *second) {
+	return strcmp(((listing_entry *)first)->path, ((listing_entry *)second)->path);
+}
+
+int compare_by_size(const void *first, const void *second) {
+
+	listing_entry *a = (listing_entry *)first;
+	listing_entry *b = (listing_entry *)second;
+
+	if(a->size != b->size)
+		return a->size > b->size ? -1 : 1;
+
+	return strcmp(a->path, b->path);
+}
+
+
+/*
+* Functions used to keep the files of a listing with top in a heap: the file which would be listed last is on top,
+* so that a better one can take its place.
+*/
+void sift_listing_up(listing_entry *heap, int index, int (*compare)(const void *, const void *)) {
+
+	while(index > 0 && compare(&heap[(index - 1) / 2], &heap[index]) < 0) {
+		listing_entry temp		= heap[index];
+		heap[index]			= heap[(index - 1) / 2];
+		heap[(index - 1) / 2]		= temp;
+		index				= (index - 1) / 2;
+	}
+}
+
+void sift_listing_down(listing_entry *heap, int count, int index, int (*compare)(const void *, const void *)) {
+
+	while(1) {
+
+		int largest = index;
+
+		for(int child = index * 2 + 1; child <= index * 2 + 2 && child < count; child++) {
+			if(compare(&heap[child], &heap[largest]) > 0)
+				largest = child;
+		}
+
+		if(largest == index)
+			return;
+
+		listing_entry temp	= heap[index];
+		heap[index]		= heap[largest];
+		heap[largest]		= temp;
+		index			= largest;
+	}
+}
+
+
+/*
+* Function given as accept to the listing functions: tells if a file must be listed. Files of sorted listings are
+* kept here instead, to be sent by finish_listing_query.
+*/
+int accept_listing_entry(void *param, int directory, intmax_t size, long mtime, int mode, int depth, char *path) {
+
+	listing_query *query = (listing_query *)param;
+	char *name = path + strlen(path);
+
+	while(name > path && name[-1] != '/' && name[-1] != '\\')
+		name--;
+
+	if(query->glob != NULL && !match_glob(query->glob, name))
+		return 0;
+
+	if(directory && (query->min_size > 0 || query->type != LISTING_ANY))
+		return 0;
+
+	if(!directory && size < query->min_size)
+		return 0;
+
+	if(query->type != LISTING_ANY) {
+
+		int length = strlen(name);
+		int encrypted = length >= (int)strlen(ENCR_EXT) && strcmp(name + length - strlen(ENCR_EXT), ENCR_EXT) == 0;
+
+		if(encrypted != (query->type == LISTING_ENCRYPTED))
+			return 0;
+	}
+
+	if(query->sort == SORT_NONE)
+		return 1;
+
+	int (*compare)(const void *, const void *) = query->sort == SORT_SIZE ? compare_by_size : compare_by_name;
+	listing_entry entry;
+
+	entry.path	= path;
+	entry.directory	= directory;
+	entry.size	= directory ? 0 : size;
+	entry.mtime	= mtime;
+	entry.mode	= mode;
+	entry.depth	= depth;
+
+	//files of the pages already sent
+	if(query->has_after && compare(&entry, &query->after) <= 0)
+		return 0;
+
+	semaphore_wait(&query->sem);
+
+	//the heap is full: the file takes the place of the last one if it comes before it
+	if(query->top > 0 && query->count == query->top) {
+
+		query->more = 1;
+
+		if(compare(&entry, &query->entries[0]) < 0 && (entry.path = strdup(path)) != NULL) {
+			free(query->entries[0].path);
+			query->entries[0] = entry;
+			sift_listing_down(query->entries, query->count, 0, compare);
+		}
+
+		semaphore_signal(&query->sem);
+		return 0;
+	}
+
+	if(query->count == query->capacity) {
+
+		int capacity = query->capacity > 0 ? query->capacity * 2 : 256;
+
+		if(query->top > 0 && capacity > query->top)
+			capacity = query->top;
+
+		listing_entry *entries = (listing_entry *)realloc(query->entries, capacity * sizeof(listing_entry));
+
+		if(entries == NULL) {
+			semaphore_signal(&query->sem);
+			return 0;
+		}
+
+		query->entries	= entries;
+		query->capacity	= capacity;
+	}
+
+	if((entry.path = strdup(path)) != NULL) {
+		query->entries[query->count++] = entry;
+		if(query->top > 0)
+			sift_listing_up(query->entries, query->count - 1, compare);
+	}
+
+	semaphore_signal(&query->sem);
+
+	return 0;
+}
+
+
+/*
+* Function used to write the cursor of the next page: "after=" followed by the size and the path of a file in hex,
+* so that it's a single word. Text listings put it in a LISTING_NEXT line, binary ones in a LISTING_RECORD_NEXT
+* record (its flags, the length of the cursor and the cursor).
+* RETURN VALUE:
+*	The length of the line or of the record
+*/
+int format_listing_cursor(char *dest, listing_entry *entry, int format) {
+
+	//the cursor is written where a text line has it, then moved after the header of the record if needed
+	char *cursor = dest + strlen(LISTING_NEXT) + 1;
+	int length = sprintf(cursor, "after=%jx.", (uintmax_t)entry->size);
+
+	for(unsigned char *index = (unsigned char *)entry->path; *index != '\0'; index++)
+		length += sprintf(cursor + length, "%02x", *index);
+
+	if(format == LISTING_BINARY) {
+
+		char header[16];
+		int header_length = 0;
+
+		header[header_length++] = LISTING_RECORD_NEXT;
+		header_length += write_varint(header + header_length, (uint64_t)length);
+
+		memmove(dest + header_length, cursor, length);
+		memcpy(dest, header, header_length);
+
+		return header_length + length;
+	}
+
+	memcpy(dest, LISTING_NEXT "\t", strlen(LISTING_NEXT) + 1);
+
+	return strlen(LISTING_NEXT) + 1 + length + sprintf(cursor + length, "\r\n");
+}
+
+
+/*
+* Function used to write the first bytes of a binary listing: LISTING_MAGIC, LISTING_VERSION and the fields
+* of its records.
+* RETURN VALUE:
+*	The number of bytes written
+*/
+int format_listing_header(char *dest, int fields) {
+
+	memcpy(dest, LISTING_MAGIC, strlen(LISTING_MAGIC));
+
+	dest[strlen(LISTING_MAGIC)]	= LISTING_VERSION;
+	dest[strlen(LISTING_MAGIC) + 1]	= (char)fields;
+
+	return strlen(LISTING_MAGIC) + 2;
+}
+
+
+/*
+* Function given as finish to the listing functions: sends the files of a sorted listing, followed by the cursor
+* of the next page if some file was left out. Binary records are not sent depth-first, so they carry their whole
+* path, minus what it shares with the previous one.
+*/
+int finish_listing_query(void *param, out_stream *target) {
+
+	listing_query *query = (listing_query *)param;
+	char *previous = "";
+
+	if(query->sort == SORT_NONE)
+		return 0;
+
+	qsort(query->entries, query->count, sizeof(listing_entry), query->sort == SORT_SIZE ? compare_by_size : compare_by_name);
+
+	for(int i=0; i<query->count; i++) {
+
+		listing_entry *entry = &query->entries[i];
+		//room for the line and for a cursor, which writes the path in hex
+		char *line = (char *)malloc(LISTING_SIZE_WIDTH + LISTING_RECORD_SIZE + entry->depth + strlen(entry->path) * 3 + 64);
+		int length;
+
+		if(line == NULL)
+			return -1;
+
+		if(query->filter.format == LISTING_BINARY) {
+
+			int shared = 0;
+
+			while(previous[shared] != '\0' && previous[shared] == entry->path[shared])
+				shared++;
+
+			length		= format_listing_record(line, query->filter.fields, entry->directory ? LISTING_RECORD_DIRECTORY : 0, entry->size, entry->mtime, entry->mode, 0, shared, entry->path + shared);
+			previous	= entry->path;
+		}
+		else if(query->recursive)
+			length = format_listing_line(line, entry->directory, entry->size, entry->depth + 1, ".", entry->path);
+		else
+			length = format_listing_line(line, entry->directory, entry->size, 2, "", entry->path);
+
+		//the last line of a page tells where the next one starts
+		if(query->more && i == query->count - 1)
+			length += format_listing_cursor(line + length, entry, query->filter.format);
+
+		int result = stream_write(target, line, length);
+
+		free(line);
+
+		if(result < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to read a cursor written by format_listing_cursor.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int parse_listing_cursor(char *cursor, listing_entry *entry) {
+
+	char *dot = strchr(cursor, '.');
+	uintmax_t size;
+
+	if(dot == NULL || sscanf(cursor, "%jx", &size) != 1 || strlen(dot + 1) % 2 != 0)
+		return -1;
+
+	int length = strlen(dot + 1) / 2;
+
+	if((entry->path = (char *)malloc(length + 1)) == NULL)
+		return -1;
+
+	for(int i=0; i<length; i++) {
+
+		unsigned int byte;
+
+		if(sscanf(dot + 1 + i * 2, "%2x", &byte) != 1) {
+			free(entry->path);
+			entry->path = NULL;
+			return -1;
+		}
+
+		entry->path[i] = (char)byte;
+	}
+
+	entry->path[length]	= '\0';
+	entry->size		= (intmax_t)size;
+
+	return 0;
+}
+
+
+void free_listing_query(listing_query *query) {
+
+	for(int i=0; i<query->count; i++)
+		free(query->entries[i].path);
+
+	free(query->entries);
+	free(query->after.path);
+	stop_semaphore(&query->sem);
+}
+
+
+/*
+* Function used to read the options of a listing request: glob=pattern, min=bytes, depth=levels, type=enc|plain,
+* sort=name|size, top=files, after=cursor, format=text|bin, fields=mtime|mode|mtime,mode (binary listings only),
+* compress=lz|none and token=yes|no (text listings only), separated by spaces. top and after sort by name when no sort is given.
+* The options are modified while parsing them, glob points inside them.
+* ARGUMENTS:
+*	-query:		the query to initialize, must be freed with free_listing_query on success
+*	-options:	the options, "" for none
+*	-recursive:	set for LSTR
+* RETURN VALUE:
+*	On success 0 is returned, -1 if an option is not valid
+*/
+int parse_listing_query(listing_query *query, char *options, int recursive) {
+
+	bzero(query, sizeof(listing_query));
+
+	query->recursive		= recursive;
+	query->filter.accept		= accept_listing_entry;
+	query->filter.finish		= finish_listing_query;
+	query->filter.param		= (void *)query;
+
+	if(start_semaphore_ex(&query->sem) < 0)
+		return -1;
+
+	//listeners parse at the same time, so strtok can't be used
+	while(*options != '\0') {
+
+		char *option	= options;
+		char *end	= strchr(options, ' ');
+		char *value;
+		int valid	= 1;
+
+		if(end != NULL)
+			*end = '\0';
+
+		options = end != NULL ? end + 1 : option + strlen(option);
+
+		if(*option == '\0')
+			continue;
+
+		if((value = strchr(option, '=')) != NULL)
+			*value++ = '\0';
+
+		if(value == NULL)
+			valid = 0;
+		else if(strcmp(option, "glob") == 0)
+			query->glob = value;
+		else if(strcmp(option, "min") == 0)
+			valid = sscanf(value, "%jd", &query->min_size) == 1 && query->min_size >= 0;
+		else if(strcmp(option, "depth") == 0)
+			valid = (query->filter.max_depth = (int)strtol(value, NULL, 10)) > 0;
+		else if(strcmp(option, "type") == 0 && strcmp(value, "enc") == 0)
+			query->type = LISTING_ENCRYPTED;
+		else if(strcmp(option, "type") == 0 && strcmp(value, "plain") == 0)
+			query->type = LISTING_PLAIN;
+		else if(strcmp(option, "sort") == 0 && strcmp(value, "name") == 0)
+			query->sort = SORT_NAME;
+		else if(strcmp(option, "sort") == 0 && strcmp(value, "size") == 0)
+			query->sort = SORT_SIZE;
+		else if(strcmp(option, "top") == 0)
+			valid = (query->top = (int)strtol(value, NULL, 10)) > 0;
+		else if(strcmp(option, "format") == 0 && strcmp(value, "text") == 0)
+			query->filter.format = LISTING_TEXT;
+		else if(strcmp(option, "format") == 0 && strcmp(value, "bin") == 0)
+			query->filter.format = LISTING_BINARY;
+		else if(strcmp(option, "fields") == 0 && strcmp(value, "mtime") == 0)
+			query->filter.fields = LISTING_FIELD_MTIME;
+		else if(strcmp(option, "fields") == 0 && strcmp(value, "mode") == 0)
+			query->filter.fields = LISTING_FIELD_MODE;
+		else if(strcmp(option, "fields") == 0 && (strcmp(value, "mtime,mode") == 0 || strcmp(value, "mode,mtime") == 0))
+			query->filter.fields = LISTING_FIELD_MTIME | LISTING_FIELD_MODE;
+		else if(strcmp(option, "compress") == 0 && strcmp(value, "lz") == 0)
+			query->compress = 1;
+		else if(strcmp(option, "compress") == 0 && strcmp(value, "none") == 0)
+			query->compress = 0;
+		else if(strcmp(option, "token") == 0 && strcmp(value, "yes") == 0)
+			query->token = 1;
+		else if(strcmp(option, "token") == 0 && strcmp(value, "no") == 0)
+			query->token = 0;
+		else if(strcmp(option, "after") == 0 && query->after.path == NULL)
+			valid = (query->has_after = parse_listing_cursor(value, &query->after) == 0);
+		else
+			valid = 0;
+
+		if(!valid) {
+			free_listing_query(query);
+			return -1;
+		}
+	}
+
+	if(query->sort == SORT_NONE && (query->top > 0 || query->has_after))
+		query->sort = SORT_NAME;
+
+	//text lines have no room for them
+	if(query->filter.format == LISTING_TEXT)
+		query->filter.fields = 0;
+
+	//records have no room for the generation line
+	if(query->filter.format == LISTING_BINARY && query->token) {
+		free_listing_query(query);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used by the client to read a varint of a binary listing.
+* RETURN VALUE:
+*	The number of bytes read, 0 if the varint is not all in source yet, -1 if it's not valid
+*/
+int read_varint(char *source, int length, uint64_t *value) {
+
+	*value = 0;
+
+	for(int i=0; i<10; i++) {
+
+		if(i == length)
+			return 0;
+
+		*value |= (uint64_t)(source[i] & 0x7F) << (i * 7);
+
+		if(!(source[i] & 0x80))
+			return i + 1;
+	}
+
+	return -1;
+}
+
+
+/*
+* Structure used by the client to print a binary listing just like the text one.
+*	-recursive:	set if it's the listing of LSTR
+*	-fields:	LISTING_FIELD_ flags of the records, from the header of the listing
+*	-directories:	path of the last directory received at every depth ("" for the listed one), count of them
+*	-previous:	path of the last depth 0 record
+*/
+typedef struct {
+	int recursive;
+	int fields;
+	char **directories;
+	int count;
+	char *previous;
+} listing_printer;
+
+
+/*
+* Function used by the client to print a record of a binary listing (see format_listing_record).
+* RETURN VALUE:
+*	The length of the record, 0 if it's not all in source yet, -1 if it's not valid
+*/
+int print_listing_record(listing_printer *printer, char *source, int length) {
+
+	uint64_t depth, shared = 0, size = 0, mtime = 0, mode = 0, name_length;
+	int flags = (unsigned char)source[0];
+	int offset = 1;
+	int read;
+
+	if(length < 1)
+		return 0;
+
+	//the cursor of the next page
+	if(flags & LISTING_RECORD_NEXT) {
+
+		if((read = read_varint(source + offset, length - offset, &name_length)) <= 0)
+			return read;
+
+		offset += read;
+
+		if(name_length > (uint64_t)(length - offset))
+			return 0;
+
+		printf("%s\t%.*s\r\n", LISTING_NEXT, (int)name_length, source + offset);
+
+		return offset + (int)name_length;
+	}
+
+	uint64_t *numbers[6] = { &depth, &shared, &size, &mtime, &mode, &name_length };
+
+	for(int i=0; i<6; i++) {
+
+		//only what the record has is read
+		if((i == 1 && depth != 0) || (i == 2 && (flags & LISTING_RECORD_DIRECTORY)) ||
+			(i == 3 && !(printer->fields & LISTING_FIELD_MTIME)) || (i == 4 && !(printer->fields & LISTING_FIELD_MODE)))
+			continue;
+
+		if((read = read_varint(source + offset, length - offset, numbers[i])) <= 0)
+			return read;
+
+		offset += read;
+	}
+
+	if(name_length > (uint64_t)(length - offset))
+		return 0;
+
+	int directory = (flags & LISTING_RECORD_DIRECTORY) != 0;
+	char *parent = depth == 0 ? printer->previous : depth <= (uint64_t)printer->count ? printer->directories[depth - 1] : NULL;
+
+	if(parent == NULL || (depth == 0 && shared > strlen(parent)))
+		return -1;
+
+	int parent_length = depth == 0 ? (int)shared : (int)strlen(parent);
+	char *path = (char *)malloc(parent_length + name_length + 2);
+
+	if(path == NULL)
+		return -1;
+
+	//files below the listed directory are in the last directory received one level up
+	memcpy(path, parent, parent_length);
+	if(depth > 0)
+		path[parent_length++] = '/';
+	memcpy(path + parent_length, source + offset, name_length);
+	path[parent_length + name_length] = '\0';
+
+	char *name = path + parent_length;
+	int tabs = 2;
+
+	if(depth == 0 && printer->recursive) {
+		tabs = 1;
+		for(char *index = path; *index != '\0'; index++)
+			tabs += *index == '/';
+	}
+	else if(printer->recursive)
+		tabs = (int)depth + 1;
+
+	char *line = (char *)malloc(LISTING_SIZE_WIDTH + 24 + tabs + strlen(path) + 4);
+
+	if(line == NULL) {
+		free(path);
+		return -1;
+	}
+
+	if((printer->fields & LISTING_FIELD_MODE) && !(flags & LISTING_RECORD_PARENT))
+		printf("%06o\t", (unsigned int)mode);
+	if((printer->fields & LISTING_FIELD_MTIME) && !(flags & LISTING_RECORD_PARENT))
+		printf("%lld\t", (long long)mtime);
+
+	int line_length = printer->recursive ?
+		format_listing_line(line, directory, (intmax_t)size, tabs, ".", path) :
+		format_listing_line(line, directory, (intmax_t)size, tabs, "", depth == 0 ? path : name);
+
+	//directories which are only sent because of their files are not printed
+	if(!(flags & LISTING_RECORD_PARENT))
+		fwrite(line, 1, line_length, stdout);
+
+	free(line);
+
+	//remember where the files of the next depth are
+	if(depth == 0) {
+		free(printer->previous);
+		printer->previous = path;
+	}
+	else if(directory && depth <= (uint64_t)printer->count) {
+
+		if(depth == (uint64_t)printer->count) {
+
+			char **directories = (char **)realloc(printer->directories, (printer->count + 1) * sizeof(char *));
+
+			if(directories == NULL) {
+				free(path);
+				return -1;
+			}
+
+			printer->directories = directories;
+			printer->directories[printer->count++] = NULL;
+		}
+
+		free(printer->directories[depth]);
+		printer->directories[depth] = path;
+	}
+	else
+		free(path);
+
+	return offset + (int)name_length;
+}
+
+
+/*
+* Function used by the client to receive a binary listing and print it just like the text one. Binary listings
+* are only sent with frames.
+* ARGUMENTS:
+*	-source:	io_interface socket of the server
+*	-recursive:	set if it's the listing of LSTR
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int receive_binary_listing(io_interface *source, int recursive) {
+
+	listing_printer printer;
+	frame_header header;
+	int capacity = FRAME_BUFFER_SIZE * 2;
+	int pending = 0;
+	int started = 0;
+	int result = -1;
+	char *frame = (char *)malloc(FRAME_BUFFER_SIZE);
+	char *expanded = NULL;
+	char *payload;
+	char *buffer = (char *)malloc(capacity);
+
+	bzero(&printer, sizeof(listing_printer));
+
+	printer.recursive	= recursive;
+	printer.directories	= (char **)malloc(sizeof(char *));
+	printer.previous	= strdup("");
+
+	if(printer.directories != NULL && (printer.directories[0] = strdup("")) != NULL)
+		printer.count = 1;
+
+	int ready = frame != NULL && buffer != NULL && printer.count == 1 && printer.previous != NULL;
+
+	while(ready && read_data_frame_from_socket(&header, frame, &expanded, &payload, source) == 0) {
+
+		if(header.type == FRAME_END) {
+			result = pending == 0 && started ? 0 : -1;
+			break;
+		}
+
+		if(header.type != FRAME_DATA)
+			continue;
+
+		//a record may continue in the next frame: keep what's left of this one
+		if(pending + header.length > capacity) {
+
+			char *bigger = (char *)realloc(buffer, pending + header.length);
+			if(bigger == NULL)
+				break;
+
+			buffer		= bigger;
+			capacity	= pending + header.length;
+		}
+
+		memcpy(buffer + pending, payload, header.length);
+		pending += header.length;
+
+		int offset = 0;
+
+		if(!started && pending >= (int)strlen(LISTING_MAGIC) + 2) {
+
+			if(memcmp(buffer, LISTING_MAGIC, strlen(LISTING_MAGIC)) != 0 || buffer[strlen(LISTING_MAGIC)] != LISTING_VERSION)
+				break;
+
+			printer.fields	= buffer[strlen(LISTING_MAGIC) + 1];
+			offset		= strlen(LISTING_MAGIC) + 2;
+			started		= 1;
+
+			printf("\n%s%sSize (in bytes):\tFile name:\n\n", printer.fields & LISTING_FIELD_MODE ? "Mode:\t" : "",
+				printer.fields & LISTING_FIELD_MTIME ? "Modified:\t" : "");
+		}
+
+		int read = 0;
+
+		while(started && offset < pending && (read = print_listing_record(&printer, buffer + offset, pending - offset)) > 0)
+			offset += read;
+
+		if(read < 0)
+			break;
+
+		memmove(buffer, buffer + offset, pending - offset);
+		pending -= offset;
+	}
+
+	printf("\n");
+
+	for(int i=0; i<printer.count; i++)
+		free(printer.directories[i]);
+
+	free(printer.directories);
+	free(printer.previous);
+	free(buffer);
+	free(frame);
+	free(expanded);
+
+	return result;
+}
+
+
+#define USAGE_SLOTS		1024		//slots of the hash table of the directories of a DU request
+#define USAGE_COUNT_WIDTH	10		//characters of the files column of a DU line
+
+
+/*
+* Structure which defines the totals of a directory of a DU request.
+*	-path:		path of the directory relative to the listed one, "" for the listed one
+*	-depth:		depth of the directory, 0 for the listed one
+*	-own_size,
+*	 own_files:	bytes and files directly in it (and in its subdirectories deeper than the request)
+*	-size, files:	bytes and files in it and below it
+*/
+typedef struct usage_entry {
+	char *path;
+	int depth;
+	intmax_t own_size;
+	long own_files;
+	intmax_t size;
+	long files;
+	struct usage_entry *next;
+} usage_entry;
+
+
+/*
+* Structure which defines a DU request ("DU depth"): its filter is given to the listing functions, which walk the
+* whole tree (in parallel for LSTR) while files are added to the totals of their directory. Directories deeper than
+* depth are added to their ancestor at depth, so that only the directories which are sent are kept.
+*	-slots:		hash table of the directories, count of them (protected by sem)
+*/
+typedef struct {
+	listing_filter filter;
+	int depth;
+	usage_entry *slots[USAGE_SLOTS];
+	int count;
+	semaphore sem;
+} usage_query;
+
+
+unsigned int hash_usage_path(char *path, int length) {
+
+	unsigned int hash = 5381;
+
+	for(int i=0; i<length; i++)
+		hash = hash * 33 + (unsigned char)path[i];
+
+	return hash % USAGE_SLOTS;
+}
+
+
+/*
+* Function used to get the totals of a directory of a DU request, which are created if they're not there yet.
+* Called with the mutex of the query held.
+* ARGUMENTS:
+*	-path, length:	path of the directory
+*	-depth:		its depth
+* RETURN VALUE:
+*	The totals, NULL if they couldn't be created
+*/
+usage_entry *find_usage_entry(usage_query *query, char *path, int length, int depth) {
+
+	unsigned int slot = hash_usage_path(path, length);
+
+	for(usage_entry *current = query->slots[slot]; current != NULL; current = current->next) {
+		if((int)strlen(current->path) == length && memcmp(current->path, path, length) == 0)
+			return current;
+	}
+
+	usage_entry *entry = (usage_entry *)malloc(sizeof(usage_entry));
+
+	if(entry == NULL || (entry->path = (char *)malloc(length + 1)) == NULL) {
+		free(entry);
+		return NULL;
+	}
+
+	memcpy(entry->path, path, length);
+	entry->path[length]	= '\0';
+	entry->depth		= depth;
+	entry->own_size		= 0;
+	entry->own_files	= 0;
+	entry->next		= query->slots[slot];
+
+	query->slots[slot] = entry;
+	query->count++;
+
+	return entry;
+}
+
+
+/*
+* Function used to know how many bytes of a path are its first components.
+* RETURN VALUE:
+*	The length of the first components of path ("/a/b" for 2 components of "/a/b/c/d")
+*/
+int usage_path_prefix(char *path, int components) {
+
+	int length = 0;
+
+	for(int found = 0; path[length] != '\0'; length++) {
+		if((path[length] == '/' || path[length] == '\\') && found++ == components)
+			break;
+	}
+
+	return length;
+}
+
+
+/*
+* Function given as accept to the listing functions by a DU request: the file is added to the totals of its
+* directory (or of its ancestor at the depth of the request), nothing is listed.
+*/
+int accept_usage_entry(void *param, int directory, intmax_t size, long mtime, int mode, int depth, char *path) {
+
+	usage_query *query = (usage_query *)param;
+
+	//the directory of a file at depth d is at depth d - 1, "" being the listed one
+	int parent_depth	= depth - 1 < query->depth ? depth - 1 : query->depth;
+	int parent_length	= usage_path_prefix(path, parent_depth);
+
+	semaphore_wait(&query->sem);
+
+	usage_entry *parent = find_usage_entry(query, path, parent_length, parent_depth);
+
+	if(parent != NULL && !directory) {
+		parent->own_size += size;
+		parent->own_files++;
+	}
+
+	//empty directories are sent too
+	if(directory && depth <= query->depth)
+		find_usage_entry(query, path, strlen(path), depth);
+
+	semaphore_signal(&query->sem);
+
+	return 0;
+}
+
+
+/*
+* Function used to sort the directories of a DU request depth-first: separators come before any other character.
+*/
+int compare_usage_entries(const void *first, const void *second) {
+
+	unsigned char *a = (unsigned char *)(*(usage_entry **)first)->path;
+	unsigned char *b = (unsigned char *)(*(usage_entry **)second)->path;
+
+	for(; *a != '\0' && *a == *b; a++, b++);
+
+	int x = *a == '/' || *a == '\\' ? 1 : *a;
+	int y = *b == '/' || *b == '\\' ? 1 : *b;
+
+	return x - y;
+}
+
+
+/*
+* Function given as finish to the listing functions by a DU request: the totals of every directory are added to
+* its ancestors, then a line is sent for every directory, depth-first: its size right aligned on LISTING_SIZE_WIDTH
+* characters, its files right aligned on USAGE_COUNT_WIDTH characters, then tabs and its path.
+*/
+int finish_usage_query(void *param, out_stream *target) {
+
+	usage_query *query = (usage_query *)param;
+	usage_entry **entries = (usage_entry **)malloc((query->count > 0 ? query->count : 1) * sizeof(usage_entry *));
+	int count = 0;
+
+	if(entries == NULL)
+		return -1;
+
+	for(int i=0; i<USAGE_SLOTS; i++) {
+		for(usage_entry *current = query->slots[i]; current != NULL; current = current->next) {
+			current->size		= 0;
+			current->files		= 0;
+			entries[count++]	= current;
+		}
+	}
+
+	//every directory is at most query->depth levels below the listed one
+	for(int i=0; i<count; i++) {
+		for(int level=entries[i]->depth; level>=0; level--) {
+
+			usage_entry *ancestor = find_usage_entry(query, entries[i]->path, usage_path_prefix(entries[i]->path, level), level);
+
+			if(ancestor == NULL)
+				continue;
+
+			ancestor->size		+= entries[i]->own_size;
+			ancestor->files		+= entries[i]->own_files;
+		}
+	}
+
+	qsort(entries, count, sizeof(usage_entry *), compare_usage_entries);
+
+	int result = 0;
+
+	for(int i=0; i<count && result == 0; i++) {
+
+		char *line = (char *)malloc(LISTING_SIZE_WIDTH + USAGE_COUNT_WIDTH + 48 + entries[i]->depth + strlen(entries[i]->path));
+
+		if(line == NULL) {
+			result = -1;
+			break;
+		}
+
+		int length = sprintf(line, "%*jd\t%*ld", LISTING_SIZE_WIDTH, entries[i]->size, USAGE_COUNT_WIDTH, entries[i]->files);
+
+		for(int j=0; j<=entries[i]->depth; j++)
+			line[length++] = '\t';
+
+		length += sprintf(line + length, ".%s\r\n", entries[i]->path);
+
+		result = stream_write(target, line, length);
+
+		free(line);
+	}
+
+	free(entries);
+
+	return result;
+}
+
+
+void free_usage_query(usage_query *query) {
+
+	for(int i=0; i<USAGE_SLOTS; i++) {
+		while(query->slots[i] != NULL) {
+			usage_entry *next = query->slots[i]->next;
+			free(query->slots[i]->path);
+			free(query->slots[i]);
+			query->slots[i] = next;
+		}
+	}
+
+	stop_semaphore(&query->sem);
+}
+
+
+/*
+* Function used to initialize a DU request.
+* ARGUMENTS:
+*	-query:		the query to initialize, must be freed with free_usage_query on success
+*	-depth:		deepest directories sent, 0 for the listed one only
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int start_usage_query(usage_query *query, int depth) {
+
+	bzero(query, sizeof(usage_query));
+
+	query->depth		= depth;
+	query->filter.accept	= accept_usage_entry;
+	query->filter.finish	= finish_usage_query;
+	query->filter.param	= (void *)query;
+
+	if(start_semaphore_ex(&query->sem) < 0)
+		return -1;
+
+	//the listed directory is sent even if it's empty
+	if(find_usage_entry(query, "", 0, 0) == NULL) {
+		stop_semaphore(&query->sem);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,1168 @@
+#define META_MAGIC		"LSTC"		//first bytes of a saved cache
+#define META_VERSION		1
+#define META_DIRECTORY		1		//flags of a saved file
+#define META_LINK		2
+#define META_TICK		500		//ms the updater waits for events before checking if it must stop
+#define META_SAVE_INTERVAL	60000		//ms between two saves of a cache which changed
+#define META_EVENTS_SIZE	65536		//bytes of events read at once
+#define META_JOURNAL_LENGTH	8192		//changes remembered to answer CHNG requests, older generations get a full listing
+#define JOURNAL_ADDED		'+'
+#define JOURNAL_REMOVED		'-'		//removing a directory removes everything below it
+#define JOURNAL_CHANGED		'*'
+#define JOURNAL_LINE_LENGTH	64		//length of a change line without its path
+
+
+
+/*
+* Structure which defines a file of the metadata cache.
+*	-name:		name of the file
+*	-directory:	set if the file is a directory, link if it's a symbolic link (links are never descended)
+*	-size:		size of the file
+*	-id:		id of the watch of the directory, -1 if it's not watched
+*	-children:	files of the directory, sorted by name
+*/
+typedef struct meta_node {
+	char *name;
+	int directory;
+	int link;
+	intmax_t size;
+	int id;
+	struct meta_node *parent;
+	struct meta_node **children;
+	int count;
+	int capacity;
+} meta_node;
+
+
+/*
+* Structure which defines a change of the cache, the generation of the cache after it happened.
+*	-kind:		JOURNAL_ADDED, JOURNAL_REMOVED or JOURNAL_CHANGED
+*	-path:		path of the file, relative to the working directory (e.g. "./dir/file")
+*/
+typedef struct {
+	long generation;
+	int kind;
+	int directory;
+	intmax_t size;
+	char *path;
+} journal_entry;
+
+
+/*
+* Structure which defines a copy in memory of the names, types and sizes of the files of the working directory,
+* kept current by watching every directory. It's filled (or loaded from file and checked again) by its own
+* thread, which then applies what the watcher reports. Listings are served from it once it's ready.
+*	-root:		the working directory
+*	-path:		absolute path of the working directory
+*	-file:		where the cache is saved, so that a restart can use it at once
+*	-watched:	node of every watch id, watched_size of them
+*	-ready:		set when the cache can be used for listings
+*	-stop:		set to stop the updater
+*	-dirty:		set if the cache changed since it was saved at saved
+*	-sem:		mutex semaphore used to access the tree: only the updater changes it, listings read it
+*	-users:		listings using the cache, retiring is set when its owner waits on idle for them to finish
+*			(both protected by the mutex of the owner, see use_listing_cache)
+*	-epoch:		when the cache was started, generations of another cache (or of a restarted server) are not valid
+*	-generation:	number of changes since the cache was ready
+*	-journal:	the last journal_count changes (META_JOURNAL_LENGTH at most) starting from journal_start, every
+*			change after generation forgotten is in it. Protected by sem
+*/
+typedef struct {
+	meta_node *root;
+	char *path;
+	char *file;
+	watcher watch;
+	meta_node **watched;
+	int watched_size;
+	int ready;
+	int stop;
+	int dirty;
+	long saved;
+	thread updater;
+	semaphore sem;
+	int users;
+	int retiring;
+	semaphore idle;
+	long epoch;
+	long generation;
+	long forgotten;
+	journal_entry *journal;
+	int journal_start;
+	int journal_count;
+} metadata_cache;
+
+
+/*
+* Structure which keeps the writes of a listing made under the mutex of the cache, so that they are sent to the
+* client after releasing it: a slow client must not stop the updater. Every write is saved as its length followed
+* by its bytes, so that they are replayed just as they were made.
+*/
+typedef struct {
+	char *data;
+	long length;
+	long capacity;
+} meta_snapshot;
+
+
+
+meta_node *create_meta_node(meta_node *parent, char *name, int directory, int link, intmax_t size) {
+
+	meta_node *target = (meta_node *)malloc(sizeof(meta_node));
+	if(target == NULL)
+		return NULL;
+
+	bzero(target, sizeof(meta_node));
+
+	if((target->name = strdup(name)) == NULL) {
+		free(target);
+		return NULL;
+	}
+
+	target->parent		= parent;
+	target->directory	= directory;
+	target->link		= link;
+	target->size		= size;
+	target->id		= -1;
+
+	return target;
+}
+
+
+/*
+* Function used to free a node and everything below it, their directories are not watched anymore.
+*/
+void free_meta_node(metadata_cache *cache, meta_node *target) {
+
+	for(int i=0; i<target->count; i++)
+		free_meta_node(cache, target->children[i]);
+
+	if(target->id >= 0 && target->id < cache->watched_size && cache->watched[target->id] == target) {
+		forget_directory(&cache->watch, target->id);
+		cache->watched[target->id] = NULL;
+	}
+
+	free(target->children);
+	free(target->name);
+	free(target);
+}
+
+
+/*
+* Function used to look for a file in a directory of the cache.
+* RETURN VALUE:
+*	The index of the file, or -(index where it should be)-1 if it's not there
+*/
+int find_meta_child(meta_node *target, char *name) {
+
+	int low = 0;
+	int high = target->count - 1;
+
+	while(low <= high) {
+
+		int middle = (low + high) / 2;
+		int compare = strcmp(target->children[middle]->name, name);
+
+		if(compare == 0)
+			return middle;
+
+		if(compare < 0)
+			low = middle + 1;
+		else
+			high = middle - 1;
+	}
+
+	return -low - 1;
+}
+
+
+int insert_meta_child(meta_node *target, meta_node *child, int index) {
+
+	if(target->count == target->capacity) {
+
+		int capacity = target->capacity > 0 ? target->capacity * 2 : 16;
+		meta_node **children = (meta_node **)realloc(target->children, capacity * sizeof(meta_node *));
+
+		if(children == NULL)
+			return -1;
+
+		target->children = children;
+		target->capacity = capacity;
+	}
+
+	memmove(target->children + index + 1, target->children + index, (target->count - index) * sizeof(meta_node *));
+	target->children[index] = child;
+	target->count++;
+
+	return 0;
+}
+
+
+void remove_meta_child(metadata_cache *cache, meta_node *target, int index) {
+
+	free_meta_node(cache, target->children[index]);
+
+	memmove(target->children + index, target->children + index + 1, (target->count - index - 1) * sizeof(meta_node *));
+	target->count--;
+}
+
+
+/*
+* Function used to get the absolute path of a file of the cache, followed by name if it's not NULL.
+* RETURN VALUE:
+*	The path, which must be freed, NULL on error
+*/
+char *meta_node_path(metadata_cache *cache, meta_node *target, char *name) {
+
+	int length = strlen(cache->path) + (name != NULL ? strlen(name) + 1 : 0) + 1;
+
+	for(meta_node *current = target; current->parent != NULL; current = current->parent)
+		length += strlen(current->name) + 1;
+
+	char *path = (char *)malloc(length);
+	if(path == NULL)
+		return NULL;
+
+	//written backwards, from the name up to the working directory
+	char *index = path + length - 1;
+	*index = '\0';
+
+	if(name != NULL) {
+		index -= strlen(name);
+		memcpy(index, name, strlen(name));
+		*--index = '/';
+	}
+
+	for(meta_node *current = target; current->parent != NULL; current = current->parent) {
+		index -= strlen(current->name);
+		memcpy(index, current->name, strlen(current->name));
+		*--index = '/';
+	}
+
+	memcpy(path, cache->path, strlen(cache->path));
+
+	return path;
+}
+
+
+/*
+* Function used to start watching a directory of the cache.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int watch_meta_node(metadata_cache *cache, meta_node *target, char *path) {
+
+	int id = watch_directory(&cache->watch, path);
+
+	if(id < 0)
+		return -1;
+
+	if(id >= cache->watched_size) {
+
+		int size = cache->watched_size > 0 ? cache->watched_size : 1024;
+
+		while(size <= id)
+			size *= 2;
+
+		meta_node **watched = (meta_node **)realloc(cache->watched, size * sizeof(meta_node *));
+		if(watched == NULL) {
+			forget_directory(&cache->watch, id);
+			return -1;
+		}
+
+		bzero(watched + cache->watched_size, (size - cache->watched_size) * sizeof(meta_node *));
+
+		cache->watched		= watched;
+		cache->watched_size	= size;
+	}
+
+	cache->watched[id]	= target;
+	target->id		= id;
+
+	return 0;
+}
+
+
+/*
+* Function used to remember a change of the cache, called with the mutex of the cache held. Changes found while the
+* cache is filled are not remembered: nobody could have a generation before them.
+* ARGUMENTS:
+*	-cache:		the cache
+*	-kind:		JOURNAL_ADDED, JOURNAL_REMOVED or JOURNAL_CHANGED
+*	-parent:	directory of the file
+*	-child:		the file (for JOURNAL_REMOVED, before it's freed)
+*/
+void record_change(metadata_cache *cache, int kind, meta_node *parent, meta_node *child) {
+
+	if(!cache->ready)
+		return;
+
+	char *path = meta_node_path(cache, parent, child->name);
+	int skip = strlen(cache->path);
+
+	//nothing can be said anymore about generations before this one
+	if(path == NULL) {
+		cache->forgotten = ++cache->generation;
+		return;
+	}
+
+	//the absolute path becomes "./relative/path"
+	path[skip - 1] = '.';
+	memmove(path, path + skip - 1, strlen(path + skip - 1) + 1);
+
+	journal_entry *entry;
+
+	if(cache->journal_count == META_JOURNAL_LENGTH) {
+		entry = &cache->journal[cache->journal_start];
+		cache->forgotten	= entry->generation;
+		cache->journal_start	= (cache->journal_start + 1) % META_JOURNAL_LENGTH;
+		free(entry->path);
+	}
+	else
+		entry = &cache->journal[(cache->journal_start + cache->journal_count++) % META_JOURNAL_LENGTH];
+
+	entry->generation	= ++cache->generation;
+	entry->kind		= kind;
+	entry->directory	= child->directory;
+	entry->size		= child->size;
+	entry->path		= path;
+}
+
+
+int compare_dir_entries(const void *first, const void *second) {
+	return strcmp(((dir_entry *)first)->name, ((dir_entry *)second)->name);
+}
+
+
+/*
+* Function used to make a directory of the cache (and everything below it) match the disk. The directory is watched
+* before it's read, so that nothing which changes while it's read is lost. Called only by the updater.
+* ARGUMENTS:
+*	-cache:		the cache
+*	-target:	the directory
+*	-path:		absolute path of the directory
+* RETURN VALUE:
+*	On success 0 is returned, -1 if a directory couldn't be watched (the cache can't be kept current)
+*/
+int sync_meta_node(metadata_cache *cache, meta_node *target, char *path) {
+
+	int directory, link;
+	intmax_t size;
+
+	//a directory which disappeared in the meantime is not an error, its parent will be told
+	if(target->id < 0 && watch_meta_node(cache, target, path) < 0)
+		return stat_entry(path, &directory, &link, &size) < 0 ? 0 : -1;
+
+	dir_entry *entries = NULL;
+	int count = read_directory(path, &entries);
+
+	//the directory went away, its parent will be told
+	if(count < 0)
+		count = 0;
+
+	qsort(entries, count, sizeof(dir_entry), compare_dir_entries);
+
+	semaphore_wait(&cache->sem);
+
+	meta_node **children = count > 0 ? (meta_node **)malloc(count * sizeof(meta_node *)) : NULL;
+	int kept = 0;
+	int old = 0;
+
+	//both lists are sorted by name: merge them
+	for(int i=0; i<count; i++) {
+
+		while(old < target->count && strcmp(target->children[old]->name, entries[i].name) < 0) {
+			record_change(cache, JOURNAL_REMOVED, target, target->children[old]);
+			free_meta_node(cache, target->children[old++]);
+		}
+
+		meta_node *child = NULL;
+
+		if(old < target->count && strcmp(target->children[old]->name, entries[i].name) == 0) {
+
+			child = target->children[old++];
+
+			if(child->directory != entries[i].directory || child->link != entries[i].link) {
+				record_change(cache, JOURNAL_REMOVED, target, child);
+				free_meta_node(cache, child);
+				child = NULL;
+			}
+			//the size of a directory says nothing about its files
+			else if(child->size != entries[i].size && !child->directory) {
+				child->size = entries[i].size;
+				record_change(cache, JOURNAL_CHANGED, target, child);
+			}
+		}
+
+		if(child == NULL) {
+
+			if((child = create_meta_node(target, entries[i].name, entries[i].directory, entries[i].link, entries[i].size)) == NULL)
+				continue;
+
+			record_change(cache, JOURNAL_ADDED, target, child);
+		}
+
+		child->size = entries[i].size;
+
+		if(children != NULL)
+			children[kept++] = child;
+		else
+			free_meta_node(cache, child);
+	}
+
+	while(old < target->count) {
+		record_change(cache, JOURNAL_REMOVED, target, target->children[old]);
+		free_meta_node(cache, target->children[old++]);
+	}
+
+	free(target->children);
+
+	target->children	= children;
+	target->count		= kept;
+	target->capacity	= count;
+	cache->dirty		= 1;
+
+	semaphore_signal(&cache->sem);
+
+	free_directory(entries, count);
+
+	//only this thread changes the tree, the subdirectories can be read without the mutex
+	for(int i=0; i<target->count; i++) {
+
+		meta_node *child = target->children[i];
+
+		if(!child->directory || child->link)
+			continue;
+
+		char *child_path = meta_node_path(cache, child, NULL);
+
+		if(child_path == NULL)
+			continue;
+
+		int result = sync_meta_node(cache, child, child_path);
+
+		free(child_path);
+
+		if(result < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to apply to the cache something reported by the watcher.
+* RETURN VALUE:
+*	On success 0 is returned, -1 if the cache can't be kept current anymore
+*/
+int apply_watch_event(metadata_cache *cache, watch_event *event) {
+
+	if(event->kind == WATCH_OVERFLOW)
+		return sync_meta_node(cache, cache->root, cache->path);
+
+	if(event->id < 0 || event->id >= cache->watched_size || cache->watched[event->id] == NULL)
+		return 0;
+
+	meta_node *target = cache->watched[event->id];
+
+	//the directory itself is gone, its parent removes it from the cache
+	if(event->kind == WATCH_GONE) {
+		cache->watched[event->id]	= NULL;
+		target->id			= -1;
+		return 0;
+	}
+
+	if(event->name == NULL)
+		return 0;
+
+	char *path = meta_node_path(cache, target, event->name);
+	if(path == NULL)
+		return 0;
+
+	int directory;
+	int link;
+	intmax_t size;
+	int exists = event->kind != WATCH_DELETED && stat_entry(path, &directory, &link, &size) == 0;
+	meta_node *created = NULL;
+
+	semaphore_wait(&cache->sem);
+
+	int index = find_meta_child(target, event->name);
+
+	//a file which changed type is replaced, just like a removed and created one
+	if(index >= 0 && (!exists || target->children[index]->directory != directory || target->children[index]->link != link)) {
+		record_change(cache, JOURNAL_REMOVED, target, target->children[index]);
+		remove_meta_child(cache, target, index);
+		index = -index - 1;
+	}
+
+	if(exists && index >= 0) {
+
+		meta_node *child = target->children[index];
+
+		if(child->size != size && !child->directory) {
+			child->size = size;
+			record_change(cache, JOURNAL_CHANGED, target, child);
+		}
+
+		child->size = size;
+	}
+	else if(exists && (created = create_meta_node(target, event->name, directory, link, size)) != NULL) {
+
+		if(insert_meta_child(target, created, -index - 1) < 0) {
+			free_meta_node(cache, created);
+			created = NULL;
+		}
+		else
+			record_change(cache, JOURNAL_ADDED, target, created);
+	}
+
+	cache->dirty = 1;
+
+	semaphore_signal(&cache->sem);
+
+	int result = 0;
+
+	//a new directory may already have files
+	if(created != NULL && created->directory && !created->link)
+		result = sync_meta_node(cache, created, path);
+
+	free(path);
+
+	return result;
+}
+
+
+/*
+* Functions used to save the cache to a file and to load it. A file is saved as its flags, its size, the length of
+* its name and its name, followed by the number of its files and by its files if it's a directory. Numbers are
+* saved as varints (7 bits at a time, the 8th bit set if more bytes follow).
+*/
+int put_varint(FILE *target, uint64_t value) {
+
+	unsigned char bytes[10];
+	int length = 0;
+
+	do {
+		bytes[length] = value & 0x7F;
+		value >>= 7;
+		if(value != 0)
+			bytes[length] |= 0x80;
+		length++;
+	}
+	while(value != 0);
+
+	return fwrite(bytes, 1, length, target) == (size_t)length ? 0 : -1;
+}
+
+int get_varint(FILE *source, uint64_t *value) {
+
+	*value = 0;
+
+	for(int shift=0; shift<64; shift+=7) {
+
+		int byte = fgetc(source);
+		if(byte == EOF)
+			return -1;
+
+		*value |= (uint64_t)(byte & 0x7F) << shift;
+
+		if(!(byte & 0x80))
+			return 0;
+	}
+
+	return -1;
+}
+
+int save_meta_node(FILE *target, meta_node *node) {
+
+	int length = strlen(node->name);
+
+	if(fputc((node->directory ? META_DIRECTORY : 0) | (node->link ? META_LINK : 0), target) == EOF ||
+		put_varint(target, (uint64_t)node->size) < 0 || put_varint(target, length) < 0 ||
+		fwrite(node->name, 1, length, target) != (size_t)length)
+		return -1;
+
+	if(!node->directory)
+		return 0;
+
+	if(put_varint(target, node->count) < 0)
+		return -1;
+
+	for(int i=0; i<node->count; i++) {
+		if(save_meta_node(target, node->children[i]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+meta_node *load_meta_node(metadata_cache *cache, FILE *source, meta_node *parent) {
+
+	uint64_t size, length, count = 0;
+	int flags = fgetc(source);
+
+	if(flags == EOF || get_varint(source, &size) < 0 || get_varint(source, &length) < 0 || length > 4096)
+		return NULL;
+
+	char name[4097];
+
+	if(fread(name, 1, length, source) != length)
+		return NULL;
+
+	name[length] = '\0';
+
+	meta_node *node = create_meta_node(parent, name, (flags & META_DIRECTORY) != 0, (flags & META_LINK) != 0, (intmax_t)size);
+
+	if(node == NULL || !node->directory)
+		return node;
+
+	if(get_varint(source, &count) < 0 || count > INT32_MAX || (count > 0 && (node->children = (meta_node **)malloc(count * sizeof(meta_node *))) == NULL)) {
+		free(node->name);
+		free(node);
+		return NULL;
+	}
+
+	node->capacity = (int)count;
+
+	for(uint64_t i=0; i<count; i++) {
+
+		meta_node *child = load_meta_node(cache, source, node);
+
+		//nothing loaded is watched yet, so it can just be freed
+		if(child == NULL) {
+			free_meta_node(cache, node);
+			return NULL;
+		}
+
+		node->children[node->count++] = child;
+	}
+
+	return node;
+}
+
+
+/*
+* Function used to save the cache, to a temporary file first so that a crash never leaves half a cache.
+* Called only by the updater, so the tree doesn't change while it's saved.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int save_metadata_cache(metadata_cache *cache) {
+
+	char *temporary = (char *)malloc(strlen(cache->file) + 5);
+	if(temporary == NULL)
+		return -1;
+
+	sprintf(temporary, "%s.tmp", cache->file);
+
+	FILE *target = fopen(temporary, "wb");
+	int result = -1;
+
+	if(target != NULL) {
+
+		int length = strlen(cache->path);
+
+		result = fwrite(META_MAGIC, 1, strlen(META_MAGIC), target) == strlen(META_MAGIC) && fputc(META_VERSION, target) != EOF &&
+			put_varint(target, length) == 0 && fwrite(cache->path, 1, length, target) == (size_t)length &&
+			save_meta_node(target, cache->root) == 0 ? 0 : -1;
+
+		if(fclose(target) != 0 || result < 0 || replace_file(temporary, cache->file) < 0) {
+			remove(temporary);
+			result = -1;
+		}
+	}
+
+	free(temporary);
+
+	if(result == 0) {
+		cache->dirty = 0;
+		cache->saved = current_time_ms();
+	}
+
+	return result;
+}
+
+
+/*
+* Function used to load the cache saved by save_metadata_cache, if it was saved for the same directory.
+* RETURN VALUE:
+*	The root of the cache, NULL if there's no valid cache
+*/
+meta_node *load_metadata_cache(metadata_cache *cache) {
+
+	FILE *source = fopen(cache->file, "rb");
+	if(source == NULL)
+		return NULL;
+
+	char magic[4];
+	uint64_t length;
+	meta_node *root = NULL;
+	char *path = NULL;
+
+	if(fread(magic, 1, sizeof(magic), source) == sizeof(magic) && memcmp(magic, META_MAGIC, sizeof(magic)) == 0 &&
+		fgetc(source) == META_VERSION && get_varint(source, &length) == 0 && length == strlen(cache->path) &&
+		(path = (char *)malloc(length)) != NULL && fread(path, 1, length, source) == length &&
+		memcmp(path, cache->path, length) == 0)
+		root = load_meta_node(cache, source, NULL);
+
+	free(path);
+	fclose(source);
+
+	return root;
+}
+
+
+/*
+* Function executed by the updater of a cache: the cache is loaded (and used at once) or filled, checked against
+* the disk, then kept current with the events of the watcher until the cache is stopped.
+*/
+void *metadata_updater(void *params) {
+
+	metadata_cache *cache = (metadata_cache *)params;
+	char *events = (char *)malloc(META_EVENTS_SIZE);
+	meta_node *root = load_metadata_cache(cache);
+
+	if(root != NULL) {
+		printf("\tMetadata cache loaded from %s, checking it against the disk...\n", cache->file);
+		semaphore_wait(&cache->sem);
+		cache->root	= root;
+		cache->ready	= 1;
+		semaphore_signal(&cache->sem);
+	}
+	else if((cache->root = create_meta_node(NULL, "", 1, 0, 0)) == NULL) {
+		free(events);
+		return NULL;
+	}
+
+	long started = current_time_ms();
+
+	if(events == NULL || sync_meta_node(cache, cache->root, cache->path) < 0) {
+		printf("\tThe metadata cache can't watch every directory of %s, listings will read the disk\n", cache->path);
+		semaphore_wait(&cache->sem);
+		cache->ready = 0;
+		semaphore_signal(&cache->sem);
+		free(events);
+		return NULL;
+	}
+
+	semaphore_wait(&cache->sem);
+	cache->ready = 1;
+	semaphore_signal(&cache->sem);
+
+	printf("\tMetadata cache of %s ready in %ld ms\n", cache->path, current_time_ms() - started);
+
+	while(!cache->stop) {
+
+		int length = read_watcher(&cache->watch, events, META_EVENTS_SIZE, META_TICK);
+		int offset = 0;
+		int result = length < 0 ? -1 : 0;
+		watch_event event;
+
+		while(result == 0 && next_watch_event(events, length, &offset, &event))
+			result = apply_watch_event(cache, &event);
+
+		if(result < 0) {
+			printf("\tThe metadata cache of %s can't be kept current anymore, listings will read the disk\n", cache->path);
+			semaphore_wait(&cache->sem);
+			cache->ready = 0;
+			semaphore_signal(&cache->sem);
+			break;
+		}
+
+		if(cache->dirty && current_time_ms() - cache->saved >= META_SAVE_INTERVAL)
+			save_metadata_cache(cache);
+	}
+
+	if(cache->ready && cache->dirty)
+		save_metadata_cache(cache);
+
+	free(events);
+
+	return NULL;
+}
+
+
+/*
+* Function used to start the metadata cache of a directory.
+* ARGUMENTS:
+*	-cache:		the cache to start
+*	-directory:	absolute path of the directory
+*	-file:		where the cache is saved
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1 (always on platforms which can't watch directories)
+*/
+int start_metadata_cache(metadata_cache *cache, char *directory, char *file) {
+
+	bzero(cache, sizeof(metadata_cache));
+
+	if(start_watcher(&cache->watch) < 0)
+		return -1;
+
+	cache->path	= strdup(directory);
+	cache->file	= strdup(file);
+	cache->journal	= (journal_entry *)malloc(META_JOURNAL_LENGTH * sizeof(journal_entry));
+
+	if(cache->path == NULL || cache->file == NULL || cache->journal == NULL || start_semaphore_ex(&cache->sem) < 0 || start_semaphore(&cache->idle, 0, 1) < 0) {
+		free(cache->path);
+		free(cache->file);
+		free(cache->journal);
+		stop_watcher(&cache->watch);
+		return -1;
+	}
+
+	cache->saved = current_time_ms();
+	cache->epoch = (long)time(NULL) * 1000 + cache->saved % 1000;
+
+	if(create_thread(&cache->updater, metadata_updater, (void *)cache) < 0) {
+		free(cache->path);
+		free(cache->file);
+		free(cache->journal);
+		stop_semaphore(&cache->sem);
+		stop_watcher(&cache->watch);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to stop a cache, which is saved first. Nobody must be listing from it.
+*/
+void stop_metadata_cache(metadata_cache *cache) {
+
+	cache->stop = 1;
+	join_thread(&cache->updater, NULL);
+
+	if(cache->root != NULL)
+		free_meta_node(cache, cache->root);
+
+	stop_watcher(&cache->watch);
+	stop_semaphore(&cache->sem);
+	stop_semaphore(&cache->idle);
+
+	for(int i=0; i<cache->journal_count; i++)
+		free(cache->journal[(cache->journal_start + i) % META_JOURNAL_LENGTH].path);
+
+	free(cache->journal);
+	free(cache->watched);
+	free(cache->path);
+	free(cache->file);
+}
+
+
+/*
+* Function used to write the line of a change: its kind, the size of the file ("-" for directories) and its path,
+* separated by tabs.
+* RETURN VALUE:
+*	The length of the line
+*/
+int format_change_line(char *dest, int kind, int directory, intmax_t size, char *prefix, char *path) {
+
+	if(directory)
+		return sprintf(dest, "%c\t-\t%s%s\r\n", kind, prefix, path);
+
+	return sprintf(dest, "%c\t%jd\t%s%s\r\n", kind, size, prefix, path);
+}
+
+
+/*
+* Inner function used to list a directory of the cache, scroll down for the real one. If kind is not 0 every
+* file is written as a change of that kind (see format_change_line) instead of as a listing line.
+*/
+int list_meta_node(meta_node *node, out_stream *target, int recursive, int depth, char **path, int *capacity, int length, char **line, int kind, listing_filter *filter) {
+
+	for(int i=0; i<node->count; i++) {
+
+		meta_node *child = node->children[i];
+		int name_length = strlen(child->name);
+
+		//room for the path of the file and for its line
+		if(length + name_length + 2 > *capacity) {
+
+			int new_capacity = *capacity * 2 + name_length + 2;
+			char *new_path = (char *)realloc(*path, new_capacity);
+			char *new_line = new_path != NULL ? (char *)realloc(*line, new_capacity + LISTING_SIZE_WIDTH + 24 + new_capacity / 2 + 4) : NULL;
+
+			if(new_path != NULL)
+				*path = new_path;
+			if(new_line == NULL)
+				return -1;
+
+			*line		= new_line;
+			*capacity	= new_capacity;
+		}
+
+		(*path)[length] = '/';
+		memcpy(*path + length + 1, child->name, name_length + 1);
+
+		//depth counts the tabs of the lines, the files of the working directory have two
+		int listed = filter == NULL || filter->accept(filter->param, child->directory, child->size, 0, 0, depth - 1, recursive ? *path : child->name);
+		int line_length;
+
+		int descend = recursive && child->directory && !child->link && (filter == NULL || filter->max_depth == 0 || depth - 1 < filter->max_depth);
+
+		//binary records of files only say which directory they're in: directories which are not listed are sent anyway
+		if(filter != NULL && filter->format == LISTING_BINARY && (listed || descend))
+			line_length = format_listing_record(*line, 0, (child->directory ? LISTING_RECORD_DIRECTORY : 0) | (listed ? 0 : LISTING_RECORD_PARENT),
+				child->size, 0, 0, depth - 1, 0, child->name);
+		else if(!listed)
+			line_length = 0;
+		else if(kind != 0)
+			line_length = format_change_line(*line, kind, child->directory, child->size, ".", *path);
+		else if(recursive)
+			line_length = format_listing_line(*line, child->directory, child->size, depth, ".", *path);
+		else
+			line_length = format_listing_line(*line, child->directory, child->size, depth, "", child->name);
+
+		if(line_length > 0 && stream_write(target, *line, line_length) < 0)
+			return -1;
+
+		if(!descend)
+			continue;
+
+		if(list_meta_node(child, target, recursive, depth + 1, path, capacity, length + name_length + 1, line, kind, filter) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function given to the out_stream of a snapshot, see meta_snapshot.
+*/
+int meta_snapshot_sink(void *param, char *source, int length) {
+
+	meta_snapshot *snapshot = (meta_snapshot *)param;
+
+	if(snapshot->length + (long)sizeof(int) + length > snapshot->capacity) {
+
+		long capacity = snapshot->capacity * 2 + sizeof(int) + length;
+		char *data = (char *)realloc(snapshot->data, capacity);
+
+		if(data == NULL)
+			return -1;
+
+		snapshot->data		= data;
+		snapshot->capacity	= capacity;
+	}
+
+	memcpy(snapshot->data + snapshot->length, &length, sizeof(int));
+	memcpy(snapshot->data + snapshot->length + sizeof(int), source, length);
+	snapshot->length += sizeof(int) + length;
+
+	return 0;
+}
+
+
+/*
+* Function used to make an out_stream which saves what it's given in a snapshot instead of sending it.
+*/
+void start_meta_snapshot(meta_snapshot *snapshot, out_stream *copy, out_stream *target) {
+
+	bzero(snapshot, sizeof(meta_snapshot));
+	bzero(copy, sizeof(out_stream));
+
+	copy->target		= target->target;
+	copy->protocol		= PROTOCOL_V1;
+	copy->sink		= meta_snapshot_sink;
+	copy->sink_param	= snapshot;
+}
+
+
+/*
+* Function used to send the writes saved by a snapshot to the real out_stream of the request, then free it.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int send_meta_snapshot(meta_snapshot *snapshot, out_stream *target) {
+
+	int result = 0;
+
+	for(long offset=0; offset<snapshot->length && result == 0; ) {
+
+		int length;
+
+		memcpy(&length, snapshot->data + offset, sizeof(int));
+
+		result	= stream_write(target, snapshot->data + offset + sizeof(int), length);
+		offset	+= sizeof(int) + length;
+	}
+
+	free(snapshot->data);
+
+	return result;
+}
+
+
+/*
+* Function used to list the working directory from the cache, just like LSTF (or LSTR if recursive is set) would.
+* Files are listed sorted by name and links to directories are not descended.
+* ARGUMENTS:
+*	-cache:		the cache
+*	-target:	the out_stream which results want to be written to
+*	-recursive:	set to list every subdirectory too
+*	-filter:	what the listing must contain, NULL for everything
+*	-token:		set to write a "generation<TAB>token" line first: CHNG with that token answers the changes made
+*			after the listing, as it's taken under the same mutex
+* RETURN VALUE:
+*	On success 0 is returned and the listing is finished, -1 if the cache is not ready or the filter asks for
+*	fields it doesn't have (nothing was written)
+*/
+int list_from_cache(metadata_cache *cache, out_stream *target, int recursive, listing_filter *filter, int token) {
+
+	if(filter != NULL && filter->fields != 0)
+		return -1;
+
+	meta_snapshot snapshot;
+	out_stream copy;
+	int capacity = 4096;
+	char *path = (char *)malloc(capacity);
+	char *line = (char *)malloc(capacity * 2 + LISTING_SIZE_WIDTH + 24);
+
+	if(path == NULL || line == NULL) {
+		free(path);
+		free(line);
+		return -1;
+	}
+
+	semaphore_wait(&cache->sem);
+
+	if(!cache->ready) {
+		semaphore_signal(&cache->sem);
+		free(path);
+		free(line);
+		return -1;
+	}
+
+	start_meta_snapshot(&snapshot, &copy, target);
+
+	int result = 0;
+
+	if(token)
+		result = stream_write(&copy, line, sprintf(line, "generation\t%ld.%ld\r\n", cache->epoch, cache->generation));
+
+	path[0] = '\0';
+	if(result == 0)
+		result = list_meta_node(cache->root, &copy, recursive, 2, &path, &capacity, 0, &line, 0, filter);
+
+	semaphore_signal(&cache->sem);
+
+	free(path);
+	free(line);
+
+	if(send_meta_snapshot(&snapshot, target) < 0)
+		result = -1;
+
+	if(filter != NULL && result == 0)
+		filter->finish(filter->param, target);
+
+	stream_finish(target);
+
+	return 0;
+}
+
+
+/*
+* Function used to read a generation token ("epoch.generation") given by a client.
+* RETURN VALUE:
+*	The generation, or -1 if the token was not given by this cache (then only a full listing can be sent)
+*/
+long parse_generation_token(metadata_cache *cache, char *token) {
+
+	long epoch, generation;
+
+	if(token == NULL || sscanf(token, "%ld.%ld", &epoch, &generation) != 2 || epoch != cache->epoch || generation < 0)
+		return -1;
+
+	return generation;
+}
+
+
+/*
+* Function used to know if the working directory changed since a generation token, before answering a CHNG request.
+* RETURN VALUE:
+*	-1 if the cache is not ready, 0 if nothing changed since token, otherwise 1
+*/
+int changed_since(metadata_cache *cache, char *token) {
+
+	semaphore_wait(&cache->sem);
+
+	long generation = parse_generation_token(cache, token);
+	int result = !cache->ready ? -1 : generation == cache->generation ? 0 : 1;
+
+	semaphore_signal(&cache->sem);
+
+	return result;
+}
+
+
+/*
+* Function used to answer a CHNG request: a "generation<TAB>token<TAB>changes" line followed by every change after
+* the given token (see format_change_line), in the order they happened. When the changes were forgotten or the
+* token is not valid, the line ends with "full" instead and every file of the working directory is sent as added.
+* The cache must have been ready (see changed_since), the listing is finished.
+* ARGUMENTS:
+*	-cache:		the cache
+*	-target:	the out_stream which results want to be written to
+*	-token:		the generation token sent by the client, NULL or "0" for a full listing
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int list_changes_from_cache(metadata_cache *cache, out_stream *target, char *token) {
+
+	meta_snapshot snapshot;
+	out_stream copy;
+	int capacity = 4096;
+	char *path = (char *)malloc(capacity);
+	char *line = (char *)malloc(capacity * 2 + LISTING_SIZE_WIDTH + 24);
+	int result = 0;
+
+	if(path == NULL || line == NULL) {
+		free(path);
+		free(line);
+		return -1;
+	}
+
+	semaphore_wait(&cache->sem);
+
+	start_meta_snapshot(&snapshot, &copy, target);
+
+	long generation	= parse_generation_token(cache, token);
+	int full	= generation < cache->forgotten || generation > cache->generation;
+	int length	= sprintf(line, "generation\t%ld.%ld\t%s\r\n", cache->epoch, cache->generation, full ? "full" : "changes");
+
+	if(stream_write(&copy, line, length) < 0)
+		result = -1;
+	else if(full) {
+		path[0] = '\0';
+		result = list_meta_node(cache->root, &copy, 1, 0, &path, &capacity, 0, &line, JOURNAL_ADDED, NULL);
+	}
+	else {
+		//the changes after generation are the last ones of the journal
+		for(int i=cache->journal_count - (cache->generation - generation); i<cache->journal_count && result == 0; i++) {
+
+			journal_entry *entry = &cache->journal[(cache->journal_start + i) % META_JOURNAL_LENGTH];
+			char *change = (char *)malloc(strlen(entry->path) + JOURNAL_LINE_LENGTH);
+
+			if(change == NULL || stream_write(&copy, change, format_change_line(change, entry->kind, entry->directory, entry->size, "", entry->path)) < 0)
+				result = -1;
+
+			free(change);
+		}
+	}
+
+	semaphore_signal(&cache->sem);
+
+	free(path);
+	free(line);
+
+	if(send_meta_snapshot(&snapshot, target) < 0)
+		result = -1;
+
+	stream_finish(target);
+
+	return result;
+}
@@ -0,0 +1,166 @@
+#define POOL_FREE		0		//slot without a thread
+#define POOL_RUNNING		1		//slot of a running thread
+#define POOL_RETIRED		2		//slot of a thread which left the pool and still has to be joined
+
+
+/*
+* Structure which defines a pool of threads which can be resized while its threads are running.
+* Every field is protected by the mutex of the owner of the pool, which must be held to call the
+* functions below (except stop_thread_pool).
+*	-threads:	threads of the pool, a thread always keeps the same slot
+*	-states:	POOL_FREE, POOL_RUNNING or POOL_RETIRED for every slot
+*	-size:		number of slots of threads and states
+*	-running:	number of slots in POOL_RUNNING
+*	-retiring:	threads which have been asked to leave the pool and didn't yet
+*/
+typedef struct {
+	thread *threads;
+	int *states;
+	int size;
+	int running;
+	int retiring;
+} thread_pool;
+
+
+/*
+* Structure given to every thread of a pool when it's started, the thread must free it.
+*	-param:		parameter given to resize_thread_pool
+*	-index:		slot of the thread, which it gives to leave_thread_pool
+*/
+typedef struct {
+	void *param;
+	int index;
+} pool_thread_conf;
+
+
+/*
+* Function used to initialize an empty pool.
+*/
+void start_thread_pool(thread_pool *target) {
+	bzero(target, sizeof(thread_pool));
+}
+
+
+/*
+* Function used to know how many threads of the pool will keep running.
+*/
+int active_threads(thread_pool *target) {
+	return target->running - target->retiring;
+}
+
+
+/*
+* Function used to change the number of threads of a pool. New threads are started at once, while
+* threads in excess are only asked to leave: the caller must wake up as many threads as returned,
+* they will leave the pool as soon as they call leave_thread_pool.
+* Threads which already left are joined here.
+* ARGUMENTS:
+*	-target:	the pool to resize
+*	-size:		number of threads which the pool should have
+*	-startup:	function started by the new threads, it receives a pool_thread_conf
+*	-param:		parameter saved in the pool_thread_conf of the new threads
+* RETURN VALUE:
+*	The number of threads to wake up, -1 if the new threads could not be started
+*/
+int resize_thread_pool(thread_pool *target, int size, void *(startup)(void *), void *param) {
+
+	//retired threads already released the mutex, joining them won't block for long
+	for(int i=0; i<target->size; i++) {
+		if(target->states[i] == POOL_RETIRED) {
+			join_thread(&target->threads[i], NULL);
+			target->states[i] = POOL_FREE;
+		}
+	}
+
+	int active = active_threads(target);
+
+	if(size < active) {
+		target->retiring += active - size;
+		return active - size;
+	}
+
+	if(target->running + size - active > target->size) {
+
+		int new_size		= target->running + size - active;
+		thread *threads		= (thread *)realloc(target->threads, new_size * sizeof(thread));
+
+		if(threads == NULL)
+			return -1;
+
+		target->threads = threads;
+
+		int *states = (int *)realloc(target->states, new_size * sizeof(int));
+
+		if(states == NULL)
+			return -1;
+
+		for(int i=target->size; i<new_size; i++)
+			states[i] = POOL_FREE;
+
+		target->states	= states;
+		target->size	= new_size;
+	}
+
+	for(int i=0; i<target->size && active < size; i++) {
+
+		if(target->states[i] != POOL_FREE)
+			continue;
+
+		pool_thread_conf *conf = (pool_thread_conf *)malloc(sizeof(pool_thread_conf));
+		if(conf == NULL)
+			return -1;
+
+		conf->param	= param;
+		conf->index	= i;
+
+		if(create_thread(&target->threads[i], startup, (void *)conf) < 0) {
+			free(conf);
+			return -1;
+		}
+
+		target->states[i] = POOL_RUNNING;
+		target->running++;
+		active++;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function called by a thread of the pool every time it's woken up, to know if it was asked to leave.
+* ARGUMENTS:
+*	-target:	the pool of the thread
+*	-index:		slot of the thread
+* RETURN VALUE:
+*	1 if the thread left the pool and must exit, otherwise 0
+*/
+int leave_thread_pool(thread_pool *target, int index) {
+
+	if(target->retiring == 0)
+		return 0;
+
+	target->retiring--;
+	target->running--;
+	target->states[index] = POOL_RETIRED;
+
+	return 1;
+}
+
+
+/*
+* Function used to join every thread of a pool and free it. The threads must have been asked to exit
+* and the mutex of the pool must NOT be held, as they may need it to exit.
+*/
+void stop_thread_pool(thread_pool *target) {
+
+	for(int i=0; i<target->size; i++) {
+		if(target->states[i] != POOL_FREE)
+			join_thread(&target->threads[i], NULL);
+	}
+
+	free(target->threads);
+	free(target->states);
+
+	bzero(target, sizeof(thread_pool));
+}
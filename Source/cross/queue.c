@@ -1,11 +1,15 @@
 typedef struct io_interface_node{
 	io_interface current;
+	int protocol;		//PROTOCOL_V1 for new connections, PROTOCOL_V2 for connections which already switched to frames
+	long queued;		//time (in ms) when the node was enqueued
+	struct connection *conn;	//connection of the event loop whose request must be executed, NULL for a blocking connection
 	struct io_interface_node *next;
 } io_interface_node;
 
 typedef struct {
 	io_interface_node *head;
 	io_interface_node *tail;
+	int length;
 } io_interface_queue;
 
 
@@ -13,6 +17,8 @@ typedef struct {
 
 int enqueue(io_interface_queue *queue, io_interface_node *node) {
 
+	node->queued = current_time_ms();
+
 	if (queue->head == NULL) {
 		queue->head = node;
 		queue->tail = node;
@@ -25,6 +31,8 @@ int enqueue(io_interface_queue *queue, io_interface_node *node) {
 		queue->tail->next = NULL;
 	}
 
+	queue->length++;
+
 	return 0;
 }
 
@@ -34,10 +42,94 @@ io_interface_node *dequeue(io_interface_queue *queue) {
 
 		io_interface_node *to_ret = queue->head;
 		queue->head = queue->head->next;
+		queue->length--;
 
 		return to_ret;
 	}
 	else {
 		return NULL;
 	}
-}
\ No newline at end of file
+}
+
+
+/*
+* Structure which defines a pool of buffers of the same size, so that requests don't need to allocate
+* a new buffer every time they read from a socket. Free buffers are chained using their first bytes,
+* so no extra node is ever allocated.
+*	-head:		first free buffer
+*	-size:		size of every buffer of the pool
+*	-free_count:	number of free buffers currently kept by the pool
+*	-max_free:	max number of free buffers kept by the pool, the others are freed when released
+*	-sem:		mutex semaphore used to access the pool
+*/
+typedef struct {
+	char *head;
+	int size;
+	int free_count;
+	int max_free;
+	semaphore sem;
+} buffer_pool;
+
+
+int start_buffer_pool(buffer_pool *pool, int size, int max_free) {
+
+	pool->head		= NULL;
+	pool->size		= size < (int)sizeof(char *) ? (int)sizeof(char *) : size;
+	pool->free_count	= 0;
+	pool->max_free		= max_free;
+
+	return start_semaphore_ex(&pool->sem);
+}
+
+char *acquire_buffer(buffer_pool *pool) {
+
+	char *to_ret = NULL;
+
+	semaphore_wait(&pool->sem);
+
+	if(pool->head != NULL) {
+		to_ret = pool->head;
+		pool->head = *(char **)to_ret;
+		pool->free_count--;
+	}
+
+	semaphore_signal(&pool->sem);
+
+	//pool is empty, allocate a new buffer which will be added to the pool when released
+	if(to_ret == NULL)
+		to_ret = malloc(pool->size);
+
+	return to_ret;
+}
+
+void release_buffer(buffer_pool *pool, char *buffer) {
+
+	if(buffer == NULL)
+		return;
+
+	semaphore_wait(&pool->sem);
+
+	if(pool->free_count < pool->max_free) {
+		*(char **)buffer = pool->head;
+		pool->head = buffer;
+		pool->free_count++;
+		buffer = NULL;
+	}
+
+	semaphore_signal(&pool->sem);
+
+	free(buffer);
+}
+
+int stop_buffer_pool(buffer_pool *pool) {
+
+	while(pool->head != NULL) {
+		char *next = *(char **)pool->head;
+		free(pool->head);
+		pool->head = next;
+	}
+
+	pool->free_count = 0;
+
+	return stop_semaphore(&pool->sem);
+}
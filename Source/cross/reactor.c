@@ -0,0 +1,921 @@
+#define REACTOR_EVENTS		256		//sockets handled by every call to poller_wait
+#define MAX_CONNECTIONS		65536		//connections kept open by the event loop, the others are refused
+#define SPOOL_MEMORY_LIMIT	262144		//bytes of a response kept in memory, the rest goes to a temporary file
+
+#define CONN_READING		0		//the event loop is reading a request
+#define CONN_WORKING		1		//a listener is executing the request
+#define CONN_WRITING		2		//the event loop is sending the response
+
+#define WHEEL_SLOTS		512		//slots of the timer wheel, each one covers WHEEL_TICK ms
+#define WHEEL_TICK		100
+
+#define DEADLINE_READ		0		//the request didn't arrive in time
+#define DEADLINE_WRITE		1		//the client didn't read the response
+#define DEADLINE_TOTAL		2		//the connection was open for too long
+
+
+/*
+* Structure which defines a timer of a timer_wheel.
+*	-expires:	time (in ms, see current_time_ms) when the timer expires
+*	-slot:		slot of the wheel where the timer is, -1 if it's not scheduled
+*	-owner:		what the timer belongs to
+*/
+typedef struct wheel_timer {
+	long expires;
+	int slot;
+	void *owner;
+	struct wheel_timer *prev;
+	struct wheel_timer *next;
+} wheel_timer;
+
+
+/*
+* Structure which defines a hashed timer wheel: a timer is kept in the slot of the first tick at or after its
+* expiry, so scheduling and cancelling it doesn't depend on how many timers there are. Timers which expire more
+* than WHEEL_SLOTS ticks later stay in their slot until the wheel has turned enough times.
+*	-slots:		list of timers of every slot
+*	-current:	last tick which was processed
+*/
+typedef struct {
+	wheel_timer *slots[WHEEL_SLOTS];
+	long current;
+} timer_wheel;
+
+
+/*
+* Structure which keeps the response of a request until the client reads it, so that the listener which
+* executed it doesn't have to wait for a slow client. The first SPOOL_MEMORY_LIMIT bytes are kept in
+* memory, the others in a temporary file.
+*	-data:		bytes kept in memory, length of them are used
+*	-file:		temporary file with the following file_length bytes, NULL if not needed
+*	-sent:		bytes already sent to the client
+*/
+typedef struct {
+	char *data;
+	int length;
+	int capacity;
+	FILE *file;
+	long file_length;
+	long sent;
+} spool;
+
+
+/*
+* Structure which defines a connection served by the event loop.
+*	-sock:		the non-blocking socket of the client
+*	-protocol:	PROTOCOL_V1 until the client switches to frames
+*	-state:		CONN_* state of the connection
+*	-events:	POLL_* events the poller is watching, 0 if the socket is not in the poller
+*	-close_after:	set if the connection must be closed once the response is sent
+*	-in:		bytes of the request read so far (in_length of them), NULL while nothing is being read
+*	-request:	the request given to the listener, a string inside in
+*	-out:		the response of the request
+*	-owner:		the event loop of the connection
+*	-prev, next:	list of every connection of the event loop
+*	-next_done:	list of the connections whose response is ready
+*	-started:	when the connection was accepted
+*	-arrived:	when the whole request was read
+*	-deadline:	timer of the next deadline of the connection, whose kind is DEADLINE_*
+*/
+typedef struct connection {
+	io_interface sock;
+	int protocol;
+	int state;
+	int events;
+	int close_after;
+	char *in;
+	int in_length;
+	char *request;
+	spool out;
+	struct reactor *owner;
+	struct connection *prev;
+	struct connection *next;
+	struct connection *next_done;
+	long started;
+	long arrived;
+	wheel_timer deadline;
+	int deadline_kind;
+} connection;
+
+
+/*
+* Structure which defines the event loop of the server. It is run by a single thread, which accepts the
+* connections, reads the requests and sends the responses without ever blocking. Requests are executed by
+* the listeners, which give the connection back with finish_connection.
+*	-poll:		poller of the listening socket and of the connections
+*	-server:	the listening socket
+*	-listeners:	listener_job of the listeners which execute the requests
+*	-all:		every open connection
+*	-done:		connections whose response is ready (protected by sem)
+*	-buffer:	FRAME_BUFFER_SIZE bytes used to send the part of a response kept in a file
+*	-timers:	deadlines of the connections which are not being served by a listener
+*	-read_timeout:	ms given to a client to send a whole request (0 means no limit)
+*	-write_timeout:	ms a client can stay without reading anything of a response (0 means no limit)
+*	-total_timeout:	ms a connection can stay open (0 means no limit)
+*/
+typedef struct reactor {
+	poller poll;
+	io_interface *server;
+	listener_job *listeners;
+	connection *all;
+	connection *done;
+	int connections;
+	char *buffer;
+	timer_wheel timers;
+	long read_timeout;
+	long write_timeout;
+	long total_timeout;
+	semaphore sem;
+} reactor;
+
+
+/*
+* Function used to initialize an empty timer wheel.
+*/
+void start_timer_wheel(timer_wheel *target) {
+	bzero(target, sizeof(timer_wheel));
+	target->current = current_time_ms() / WHEEL_TICK;
+}
+
+
+/*
+* Function used to remove a timer from its wheel, if it's scheduled.
+*/
+void cancel_timer(timer_wheel *target, wheel_timer *timer) {
+
+	if(timer->slot < 0)
+		return;
+
+	if(timer->prev != NULL)
+		timer->prev->next = timer->next;
+	else
+		target->slots[timer->slot] = timer->next;
+
+	if(timer->next != NULL)
+		timer->next->prev = timer->prev;
+
+	timer->slot = -1;
+}
+
+
+/*
+* Function used to schedule a timer, or to move it if it's already scheduled. A timer which should
+* already be expired expires at the next tick.
+*/
+void schedule_timer(timer_wheel *target, wheel_timer *timer, long expires) {
+
+	cancel_timer(target, timer);
+
+	//rounded up: the slot of the tick expires falls in is processed before expires, the timer would wait a whole turn
+	long tick = (expires + WHEEL_TICK - 1) / WHEEL_TICK;
+	if(tick <= target->current)
+		tick = target->current + 1;
+
+	timer->expires	= expires;
+	timer->slot	= (int)(tick % WHEEL_SLOTS);
+	timer->prev	= NULL;
+	timer->next	= target->slots[timer->slot];
+
+	if(timer->next != NULL)
+		timer->next->prev = timer;
+
+	target->slots[timer->slot] = timer;
+}
+
+
+/*
+* Function used to turn the wheel up to the current time.
+* ARGUMENTS:
+*	-target:	the wheel
+*	-now:		the current time in ms
+* RETURN VALUE:
+*	The list (linked with next) of the timers which expired, they are not scheduled anymore
+*/
+wheel_timer *advance_timer_wheel(timer_wheel *target, long now) {
+
+	wheel_timer *expired = NULL;
+	long last = now / WHEEL_TICK;
+
+	//after a whole turn every slot has been checked already
+	if(last - target->current > WHEEL_SLOTS)
+		target->current = last - WHEEL_SLOTS;
+
+	while(target->current < last) {
+
+		target->current++;
+
+		wheel_timer *timer = target->slots[target->current % WHEEL_SLOTS];
+
+		while(timer != NULL) {
+
+			wheel_timer *next = timer->next;
+
+			if(timer->expires <= now) {
+				cancel_timer(target, timer);
+				timer->next = expired;
+				expired = timer;
+			}
+
+			timer = next;
+		}
+	}
+
+	return expired;
+}
+
+
+/*
+* Function used to add bytes at the end of a spool.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int spool_write(spool *target, char *source, int length) {
+
+	if(target->file == NULL && target->length + length <= SPOOL_MEMORY_LIMIT) {
+
+		if(target->length + length > target->capacity) {
+
+			int capacity = target->capacity > 0 ? target->capacity : 4096;
+
+			while(capacity < target->length + length)
+				capacity *= 2;
+
+			if(capacity > SPOOL_MEMORY_LIMIT)
+				capacity = SPOOL_MEMORY_LIMIT;
+
+			char *data = (char *)realloc(target->data, capacity);
+			if(data == NULL)
+				return -1;
+
+			target->data		= data;
+			target->capacity	= capacity;
+		}
+
+		memcpy(target->data + target->length, source, length);
+		target->length += length;
+
+		return 0;
+	}
+
+	//once the file is used everything else goes there, so that bytes keep their order
+	if(target->file == NULL && (target->file = tmpfile()) == NULL)
+		return -1;
+
+	if(fseek(target->file, 0, SEEK_END) != 0 || fwrite(source, 1, length, target->file) != (size_t)length)
+		return -1;
+
+	target->file_length += length;
+
+	return 0;
+}
+
+
+/*
+* Function used to get the next bytes of a spool which must be sent.
+* ARGUMENTS:
+*	-target:	the spool
+*	-buffer:	buffer of size bytes used for the bytes kept in the file
+*	-data:		where the pointer to the bytes is saved
+* RETURN VALUE:
+*	The number of bytes at *data, 0 if everything was sent, -1 on error
+*/
+int spool_peek(spool *target, char *buffer, int size, char **data) {
+
+	if(target->sent < target->length) {
+		*data = target->data + target->sent;
+		return target->length - (int)target->sent;
+	}
+
+	long offset = target->sent - target->length;
+
+	if(target->file == NULL || offset >= target->file_length)
+		return 0;
+
+	if(fseek(target->file, offset, SEEK_SET) != 0)
+		return -1;
+
+	size_t result = fread(buffer, 1, size, target->file);
+
+	if(result == 0)
+		return -1;
+
+	*data = buffer;
+	return (int)result;
+}
+
+
+/*
+* Function used to empty a spool and free its memory.
+*/
+void spool_reset(spool *target) {
+
+	if(target->file != NULL)
+		fclose(target->file);
+
+	free(target->data);
+
+	bzero(target, sizeof(spool));
+}
+
+
+/*
+* Function given to the out_stream of a request to save its response in the spool of the connection. Whoever
+* writes the response owns the connection, so while the spool is empty the bytes are sent at once: the client
+* gets the first batches of a long response while it's still being written, only what it can't take yet waits.
+*/
+int connection_sink(void *param, char *source, int length) {
+
+	connection *conn = (connection *)param;
+
+	if(conn->out.length == 0 && conn->out.file == NULL) {
+
+		int written = write_available(source, length, &conn->sock);
+
+		if(written < 0)
+			return -1;
+
+		source += written;
+		length -= written;
+
+		if(length == 0)
+			return 0;
+	}
+
+	return spool_write(&conn->out, source, length);
+}
+
+
+/*
+* Function used to change the events the poller is watching for a connection. With 0 the socket is removed
+* from the poller, otherwise a hang up would be reported while nobody can handle it.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int watch_connection(reactor *target, connection *conn, int events) {
+
+	if(conn->events == events)
+		return 0;
+
+	int result;
+
+	if(events == 0)
+		result = poller_forget(&target->poll, &conn->sock);
+	else
+		result = poller_watch(&target->poll, &conn->sock, events, (void *)conn, conn->events != 0);
+
+	conn->events = events;
+
+	return result;
+}
+
+
+/*
+* Function used to schedule the next deadline of a connection: the read or write timeout counted from now,
+* or the end of its total time if it comes first. No timer is left if none of them is set.
+* ARGUMENTS:
+*	-target:	the reactor of the connection
+*	-conn:		the connection
+*	-kind:		DEADLINE_READ or DEADLINE_WRITE
+*/
+void arm_deadline(reactor *target, connection *conn, int kind) {
+
+	long now	= current_time_ms();
+	long timeout	= kind == DEADLINE_READ ? target->read_timeout : target->write_timeout;
+	long expires	= timeout > 0 ? now + timeout : 0;
+
+	if(target->total_timeout > 0 && (expires == 0 || conn->started + target->total_timeout < expires)) {
+		expires	= conn->started + target->total_timeout;
+		kind	= DEADLINE_TOTAL;
+	}
+
+	if(expires == 0) {
+		cancel_timer(&target->timers, &conn->deadline);
+		return;
+	}
+
+	conn->deadline_kind = kind;
+	schedule_timer(&target->timers, &conn->deadline, expires);
+}
+
+
+/*
+* Function used to close a connection of the event loop and free it.
+*/
+void close_connection(reactor *target, connection *conn) {
+
+	listener_job *conf = target->listeners;
+
+	cancel_timer(&target->timers, &conn->deadline);
+	watch_connection(target, conn, 0);
+	close_socket(&conn->sock);
+
+	semaphore_wait(conf->sem);
+	conf->stats.connections--;
+	semaphore_signal(conf->sem);
+
+	if(conn->prev != NULL)
+		conn->prev->next = conn->next;
+	else
+		target->all = conn->next;
+
+	if(conn->next != NULL)
+		conn->next->prev = conn->prev;
+
+	target->connections--;
+
+	spool_reset(&conn->out);
+	free(conn->in);
+	free(conn);
+}
+
+
+/*
+* Function used to send as much as possible of the response of a connection. When everything is sent the
+* connection is closed or goes back to reading the next request.
+*/
+void write_connection(reactor *target, connection *conn) {
+
+	while(1) {
+
+		char *data;
+		int available = spool_peek(&conn->out, target->buffer, FRAME_BUFFER_SIZE, &data);
+
+		if(available < 0) {
+			close_connection(target, conn);
+			return;
+		}
+
+		if(available == 0)
+			break;
+
+		int written = write_available(data, available, &conn->sock);
+
+		if(written < 0) {
+			close_connection(target, conn);
+			return;
+		}
+
+		conn->out.sent += written;
+
+		//the client is slow, wait until it can take more. The write timeout starts again whenever it takes something
+		if(written < available) {
+			if(written > 0)
+				arm_deadline(target, conn, DEADLINE_WRITE);
+			if(watch_connection(target, conn, POLL_WRITE) < 0)
+				close_connection(target, conn);
+			return;
+		}
+	}
+
+	spool_reset(&conn->out);
+
+	if(conn->close_after) {
+		close_connection(target, conn);
+		return;
+	}
+
+	conn->state = CONN_READING;
+	arm_deadline(target, conn, DEADLINE_READ);
+
+	if(watch_connection(target, conn, POLL_READ) < 0)
+		close_connection(target, conn);
+}
+
+
+/*
+* Function used to start sending a response prepared by the event loop itself.
+*/
+void reply_connection(reactor *target, connection *conn) {
+
+	free(conn->in);
+	conn->in		= NULL;
+	conn->in_length		= 0;
+	conn->state		= CONN_WRITING;
+
+	arm_deadline(target, conn, DEADLINE_WRITE);
+	write_connection(target, conn);
+}
+
+
+/*
+* Function used when a whole request was read: the protocol switch is answered at once, anything else is
+* given to the listeners.
+*/
+void start_request(reactor *target, connection *conn) {
+
+	listener_job *conf = target->listeners;
+
+	if(conn->protocol == PROTOCOL_V1 && strncmp(PROTO_REQ " ", conn->request, strlen(PROTO_REQ) + 1) == 0) {
+
+		out_stream out;
+		out.target	= &conn->sock;
+		out.protocol	= PROTOCOL_V1;
+		out.sink	= connection_sink;
+		out.sink_param	= conn;
+		out.batch	= NULL;
+
+		int version = parse_int(conn->request + strlen(PROTO_REQ) + 1);
+
+		//v3 clients speak v2 and can ask for binary listings
+		if(version >= PROTOCOL_V2) {
+			stream_status(&out, PROTO_MSG);
+			stream_status(&out, version >= PROTOCOL_V4 ? PROTOCOL_V4 : version);
+			conn->protocol		= PROTOCOL_V2;
+			conn->close_after	= 0;
+		}
+		else {
+			stream_status(&out, ERR_MSG);
+			conn->close_after	= 1;
+		}
+
+		reply_connection(target, conn);
+		return;
+	}
+
+	io_interface_node *temp;
+
+	conn->arrived = current_time_ms();
+
+	if((temp = malloc(sizeof(io_interface_node))) == NULL) {
+		close_connection(target, conn);
+		return;
+	}
+
+	//the socket is not watched while the request runs, the listener gives the connection back when it's done.
+	//Deadlines don't apply to the listener, so the timer is only scheduled again when the response is ready
+	conn->state		= CONN_WORKING;
+	conn->close_after	= conn->protocol == PROTOCOL_V1;
+	watch_connection(target, conn, 0);
+	cancel_timer(&target->timers, &conn->deadline);
+
+	temp->current	= conn->sock;
+	temp->protocol	= conn->protocol;
+	temp->conn	= conn;
+
+	semaphore_wait(conf->sem);
+	enqueue(conf->queue, temp);
+	semaphore_signal(conf->sem);
+	semaphore_signal(conf->rr);
+}
+
+
+/*
+* Function used to read what is available of the request of a connection. PROTOCOL_V1 requests end with
+* the string terminator, PROTOCOL_V2 ones are frames: only the bytes of the current frame are read.
+*/
+void read_connection(reactor *target, connection *conn) {
+
+	if(conn->protocol == PROTOCOL_V1) {
+
+		if(conn->in == NULL && (conn->in = (char *)malloc(SOCK_PACKET_SIZE)) == NULL) {
+			close_connection(target, conn);
+			return;
+		}
+
+		int result = read_available(conn->in + conn->in_length, SOCK_PACKET_SIZE - conn->in_length, &conn->sock);
+
+		if(result < 0) {
+			close_connection(target, conn);
+			return;
+		}
+
+		char *end = (char *)memchr(conn->in + conn->in_length, '\0', result);
+		conn->in_length += result;
+
+		if(end == NULL) {
+			if(conn->in_length == SOCK_PACKET_SIZE)
+				close_connection(target, conn);
+			return;
+		}
+
+		conn->request = conn->in;
+		start_request(target, conn);
+		return;
+	}
+
+	if(conn->in == NULL && (conn->in = (char *)malloc(FRAME_HEADER_SIZE + 1)) == NULL) {
+		close_connection(target, conn);
+		return;
+	}
+
+	uint32_t length = 0;
+
+	if(conn->in_length >= FRAME_HEADER_SIZE) {
+		memcpy(&length, conn->in + 4, sizeof(length));
+		length = ntohl(length);
+	}
+
+	int needed = conn->in_length < FRAME_HEADER_SIZE ? FRAME_HEADER_SIZE - conn->in_length : FRAME_HEADER_SIZE + (int)length - conn->in_length;
+	int result = read_available(conn->in + conn->in_length, needed, &conn->sock);
+
+	if(result < 0) {
+		close_connection(target, conn);
+		return;
+	}
+
+	conn->in_length += result;
+
+	//the header is complete, make room for the payload
+	if(conn->in_length == FRAME_HEADER_SIZE && result > 0) {
+
+		memcpy(&length, conn->in + 4, sizeof(length));
+		length = ntohl(length);
+
+		char *in;
+
+		if(length > FRAME_BUFFER_SIZE || (in = (char *)realloc(conn->in, FRAME_HEADER_SIZE + length + 1)) == NULL) {
+			close_connection(target, conn);
+			return;
+		}
+
+		conn->in = in;
+	}
+
+	if(conn->in_length < FRAME_HEADER_SIZE || conn->in_length < FRAME_HEADER_SIZE + (int)length)
+		return;
+
+	conn->in[conn->in_length] = '\0';
+
+	switch((unsigned char)conn->in[0]) {
+
+		case FRAME_END:
+			close_connection(target, conn);
+			break;
+
+		case FRAME_CMD:
+			conn->request = conn->in + FRAME_HEADER_SIZE;
+			start_request(target, conn);
+			break;
+
+		default: {
+			out_stream out;
+			out.target	= &conn->sock;
+			out.protocol	= PROTOCOL_V2;
+			out.sink	= connection_sink;
+			out.sink_param	= conn;
+			out.batch	= NULL;
+
+			stream_status(&out, ERR_MSG);
+			reply_connection(target, conn);
+		}
+	}
+}
+
+
+/*
+* Function used to accept every waiting connection. Connections are refused if too many requests are
+* already waiting for a listener or if the event loop has too many connections.
+*/
+void accept_connections(reactor *target, int max_queued) {
+
+	listener_job *conf = target->listeners;
+	io_interface accepted;
+
+	while(accept_from_sock(target->server, &accepted) == 0) {
+
+		semaphore_wait(conf->sem);
+		int queued = conf->queue->length;
+		int active = active_threads(&conf->listeners);
+		semaphore_signal(conf->sem);
+
+		if(queued >= max_queued || target->connections >= MAX_CONNECTIONS) {
+			refuse_connection(conf, &accepted, queued, active);
+			continue;
+		}
+
+		connection *conn = (connection *)malloc(sizeof(connection));
+
+		if(conn == NULL || set_non_blocking(&accepted) < 0) {
+			free(conn);
+			close_socket(&accepted);
+			continue;
+		}
+
+		bzero(conn, sizeof(connection));
+
+		conn->sock		= accepted;
+		conn->protocol		= PROTOCOL_V1;
+		conn->state		= CONN_READING;
+		conn->owner		= target;
+		conn->started		= current_time_ms();
+		conn->deadline.slot	= -1;
+		conn->deadline.owner	= conn;
+
+		if(watch_connection(target, conn, POLL_READ) < 0) {
+			close_socket(&accepted);
+			free(conn);
+			continue;
+		}
+
+		conn->next = target->all;
+		if(target->all != NULL)
+			target->all->prev = conn;
+		target->all = conn;
+
+		target->connections++;
+
+		semaphore_wait(conf->sem);
+		conf->stats.connections++;
+		semaphore_signal(conf->sem);
+
+		arm_deadline(target, conn, DEADLINE_READ);
+	}
+}
+
+
+/*
+* Function used to add a listening socket to the event loop. The socket must be hosted with host_server.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int reactor_listen(reactor *target, io_interface *server) {
+
+	if(start_listening(server) < 0 || poller_watch(&target->poll, server, POLL_READ, (void *)target, 0) < 0)
+		return -1;
+
+	target->server = server;
+
+	return 0;
+}
+
+
+/*
+* Function used to start the event loop of the server.
+* ARGUMENTS:
+*	-target:	the reactor to start
+*	-server:	the listening socket, created with host_server
+*	-listeners:	listener_job of the listeners which will execute the requests
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1 (always on platforms without a poller)
+*/
+int start_reactor(reactor *target, io_interface *server, listener_job *listeners) {
+
+	bzero(target, sizeof(reactor));
+
+	target->listeners = listeners;
+	start_timer_wheel(&target->timers);
+
+	if((target->buffer = (char *)malloc(FRAME_BUFFER_SIZE)) == NULL)
+		return -1;
+
+	if(start_poller(&target->poll) < 0) {
+		free(target->buffer);
+		return -1;
+	}
+
+	if(start_semaphore_ex(&target->sem) < 0 || reactor_listen(target, server) < 0) {
+		stop_poller(&target->poll);
+		free(target->buffer);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to set the deadlines of the connections, they apply to the deadlines scheduled from now on.
+* ARGUMENTS:
+*	-target:	the reactor
+*	-read:		seconds given to a client to send a whole request
+*	-write:		seconds a client can stay without reading anything of a response
+*	-total:		seconds a connection can stay open
+*	(0 means no limit for every one of them)
+*/
+void set_reactor_deadlines(reactor *target, int read, int write, int total) {
+	target->read_timeout	= (long)read * 1000;
+	target->write_timeout	= (long)write * 1000;
+	target->total_timeout	= (long)total * 1000;
+}
+
+
+/*
+* Function used to close the connections whose deadline expired, counting them in the statistics of
+* the listeners.
+*/
+void expire_connections(reactor *target) {
+
+	listener_job *conf = target->listeners;
+	wheel_timer *expired = advance_timer_wheel(&target->timers, current_time_ms());
+
+	while(expired != NULL) {
+
+		connection *conn = (connection *)expired->owner;
+		expired = expired->next;
+
+		semaphore_wait(conf->sem);
+		if(conn->deadline_kind == DEADLINE_READ)
+			conf->stats.expired_read++;
+		else if(conn->deadline_kind == DEADLINE_WRITE)
+			conf->stats.expired_write++;
+		else
+			conf->stats.expired_total++;
+		semaphore_signal(conf->sem);
+
+		close_connection(target, conn);
+	}
+}
+
+
+/*
+* Function used to run the event loop once: ready sockets are served, then the connections given back
+* by the listeners start sending their response and the connections whose deadline expired are closed.
+* ARGUMENTS:
+*	-target:	the reactor
+*	-timeout:	milliseconds to wait at most for a socket
+*	-max_queued:	requests waiting for a listener over which new connections are refused
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int run_reactor(reactor *target, int timeout, int max_queued) {
+
+	poll_event events[REACTOR_EVENTS];
+	int count = poller_wait(&target->poll, events, REACTOR_EVENTS, timeout);
+
+	for(int i=0; i<count; i++) {
+
+		if(events[i].data == (void *)target) {
+			accept_connections(target, max_queued);
+			continue;
+		}
+
+		connection *conn = (connection *)events[i].data;
+
+		if(conn->state == CONN_READING && (events[i].events & POLL_READ))
+			read_connection(target, conn);
+		else if(conn->state == CONN_WRITING && (events[i].events & POLL_WRITE))
+			write_connection(target, conn);
+	}
+
+	semaphore_wait(&target->sem);
+	connection *done = target->done;
+	target->done = NULL;
+	semaphore_signal(&target->sem);
+
+	while(done != NULL) {
+
+		connection *conn = done;
+		done = done->next_done;
+
+		free(conn->in);
+		conn->in		= NULL;
+		conn->in_length		= 0;
+		conn->state		= CONN_WRITING;
+
+		arm_deadline(target, conn, DEADLINE_WRITE);
+		write_connection(target, conn);
+	}
+
+	expire_connections(target);
+
+	return count < 0 ? -1 : 0;
+}
+
+
+/*
+* Function used by a listener (or a job) to give a connection back to its event loop once the response
+* of its request is in the spool.
+*/
+void finish_connection(connection *target) {
+
+	reactor *owner = target->owner;
+
+	semaphore_wait(&owner->sem);
+	target->next_done = owner->done;
+	owner->done = target;
+	semaphore_signal(&owner->sem);
+
+	poller_wake(&owner->poll);
+}
+
+
+/*
+* Function used by a listener to execute the request of a connection of the event loop.
+*/
+void serve_connection(connection *target, listener_job *conf) {
+
+	out_stream out;
+	out.target	= &target->sock;
+	out.protocol	= target->protocol;
+	out.sink	= connection_sink;
+	out.sink_param	= target;
+	out.batch	= NULL;
+
+	if(execute_request(target->request, &out, conf, target->arrived) != REQUEST_HANDED_OFF)
+		finish_connection(target);
+}
+
+
+/*
+* Function used to stop the event loop and close every connection. Listeners and jobs must be stopped
+* before, so that nobody is using the connections anymore.
+*/
+void stop_reactor(reactor *target) {
+
+	while(target->all != NULL)
+		close_connection(target, target->all);
+
+	stop_poller(&target->poll);
+	stop_semaphore(&target->sem);
+	free(target->buffer);
+}
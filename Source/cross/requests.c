@@ -3,154 +3,441 @@
 #define ENCR_EXT		"_enc"
 
 
-int XOR_file_parallel(unsigned int seed, char *path, mapped_file *source, char *out) {
+#define XOR_MAX_THREADS		8
+#define XOR_CANCELLED		-3
+#define XOR_EXPIRED		-4
+#define XOR_SLICE		65536		//bytes a single thread XORs before checking if it must stop (a multiple of 4)
 
+#define THROTTLE_SLICE		50		//ms a throttled encryption sleeps at once, then it checks if it must stop
+#define THROTTLE_BURST		100		//ms of bandwidth a bucket saves while nothing moves, at most
 
-	int file_size = source->size;
-	int no_threads = file_size/SINGLE_THREAD_FILE_LIMIT;
 
-	thread *jobs = (thread *)malloc(sizeof(thread) * no_threads);
-	if(jobs == NULL)
-		return -1;
+/*
+* Structure which defines a token bucket of I/O bandwidth: rate bytes per second (0 means no limit). Bytes moved
+* when there are no tokens left are taken anyway, tokens goes negative and they wait until it's back to zero: who
+* comes next waits behind them.
+*/
+typedef struct {
+	long rate;
+	long tokens;
+	long last;
+} token_bucket;
 
-	XOR_job *params = (XOR_job *)malloc(sizeof(XOR_job) * no_threads);
-	if(params == NULL) {
-		free(jobs);
-		return -1;
-	}
-	
-	char *temp = (char *)malloc(file_size);
-	if(temp == NULL) {
-		free(jobs);
-		free(params);
-		return -1;
+
+/*
+* Structure which defines the I/O bandwidth given to the encryptions of the server, in bytes read plus bytes
+* written per second. Rates can be changed while the encryptions run, they follow at their next chunk.
+*	-total:		shared by every encryption
+*	-background:	shared by the encryptions of the background class, which take from total too
+*	-job_rate:	given to every single encryption, 0 means no limit
+*	-sem:		mutex semaphore used to access the fields
+*/
+typedef struct {
+	token_bucket total;
+	token_bucket background;
+	long job_rate;
+	semaphore sem;
+} io_throttle;
+
+
+/*
+* Structure used to follow an encryption while it's running. Can be given to XOR_file by who wants to know
+* how much work has been done or to stop it:
+*	-total:		number of bytes to process, set by XOR_file
+*	-processed:	number of bytes already processed
+*	-cancel:	set it to 1 to stop the encryption before its next chunk, the original file is left untouched
+*	-deadline:	time (see current_time_ms) after which the result isn't wanted anymore, the encryption stops
+*			just like if it was cancelled (0 means no deadline)
+*	-throttle:	bandwidth of the server the encryption is paced by, NULL if it's not
+*	-background:	set for the background class: its I/O has the lowest priority and it's paced by its share too
+*	-own:		bucket of the encryption alone, refilled at the job_rate of throttle
+*/
+typedef struct {
+	long total;
+	long processed;
+	int cancel;
+	long deadline;
+	io_throttle *throttle;
+	int background;
+	token_bucket own;
+} job_control;
+
+
+/*
+* Function used to know if the deadline of a job_control (which can be NULL) is over.
+*/
+int deadline_expired(job_control *control) {
+	return control != NULL && control->deadline != 0 && current_time_ms() >= control->deadline;
+}
+
+
+/*
+* Function used to take bytes from a token bucket, under its mutex.
+* RETURN VALUE:
+*	The ms to wait before moving them
+*/
+long take_tokens(token_bucket *bucket, long bytes, long now) {
+
+	if(bucket->rate <= 0) {
+		bucket->tokens	= 0;
+		bucket->last	= now;
+		return 0;
 	}
 
-	for(int i=0; i<no_threads; i++) {
+	long burst = bucket->rate / 1000 * THROTTLE_BURST;
+
+	//a bucket which was not used for a while is full
+	if(bucket->last == 0 || now - bucket->last > 1000 * 60)
+		bucket->tokens = burst;
+	else
+		bucket->tokens += (long)((double)(now - bucket->last) * bucket->rate / 1000);
+
+	if(bucket->tokens > burst)
+		bucket->tokens = burst;
+
+	bucket->last	= now;
+	bucket->tokens	-= bytes;
+
+	return bucket->tokens >= 0 ? 0 : (long)((double)-bucket->tokens * 1000 / bucket->rate);
+}
+
+
+/*
+* Function used to take the bandwidth of bytes moved by an encryption from the buckets of its job_control. The own
+* bucket is not protected: calls for the same job_control must not happen at the same time.
+* RETURN VALUE:
+*	The ms to wait before moving them (see throttle_wait)
+*/
+long throttle_io(job_control *control, long bytes) {
+
+	if(control == NULL || control->throttle == NULL)
+		return 0;
 
-		int start_index = i * SINGLE_THREAD_FILE_LIMIT;
+	io_throttle *throttle = control->throttle;
+	long now = current_time_ms();
+	long wait, other;
 
-		params[i].source = source->id + start_index;
-		params[i].target = temp + start_index;
-		params[i].length = SINGLE_THREAD_FILE_LIMIT;
-		params[i].seed   = seed;
+	semaphore_wait(&throttle->sem);
+
+	wait = take_tokens(&throttle->total, bytes, now);
+
+	if(control->background && (other = take_tokens(&throttle->background, bytes, now)) > wait)
+		wait = other;
+
+	control->own.rate = throttle->job_rate;
+
+	semaphore_signal(&throttle->sem);
+
+	if((other = take_tokens(&control->own, bytes, now)) > wait)
+		wait = other;
+
+	return wait;
+}
+
+
+/*
+* Function used to wait what throttle_io asked, in slices: an encryption which is cancelled or expires meanwhile
+* stops waiting.
+* RETURN VALUE:
+*	0 once the wait is over, XOR_CANCELLED or XOR_EXPIRED if the encryption must stop
+*/
+int throttle_wait(job_control *control, long wait) {
 
-		if(create_thread(&jobs[i], XOR_task, (void *)&params[i]) < 0)
-			return -1;
+	while(wait > 0) {
 
+		if(control->cancel)
+			return XOR_CANCELLED;
+		if(deadline_expired(control))
+			return XOR_EXPIRED;
+
+		sleep_ms(wait < THROTTLE_SLICE ? wait : THROTTLE_SLICE);
+		wait -= THROTTLE_SLICE;
 	}
 
-	//and last one with smaller index! (this will be done by this thread. Just call XOR_task here)
+	return 0;
+}
 
-	unsigned int this_seed = seed;
 
-	XOR_job job;
-	job.source = source->id + (SINGLE_THREAD_FILE_LIMIT * no_threads);
-	job.target = temp + (SINGLE_THREAD_FILE_LIMIT * no_threads);
-	job.length = source->size % SINGLE_THREAD_FILE_LIMIT;
-	job.seed   = this_seed;
+/*
+* Function used to change the bandwidth of a running io_throttle (0 means no limit).
+*/
+void set_io_throttle(io_throttle *throttle, long total_rate, long background_rate, long job_rate) {
 
-	XOR_task((void *)&job);
+	semaphore_wait(&throttle->sem);
 
-	for(int i=0; i<no_threads; i++)
-		join_thread(&jobs[i], NULL);
+	throttle->total.rate		= total_rate;
+	throttle->background.rate	= background_rate;
+	throttle->job_rate		= job_rate;
 
-	//save new file
-	FILE *new_file = fopen(out, "ab");
+	semaphore_signal(&throttle->sem);
+}
 
-	if (new_file == NULL) {
 
-		unmap_file_from_memory(source);
+/*
+* Function used to start an io_throttle.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int start_io_throttle(io_throttle *throttle, long total_rate, long background_rate, long job_rate) {
 
-		free(temp);
-		free(jobs);
-		free(params);
+	bzero(throttle, sizeof(io_throttle));
 
+	if(start_semaphore_ex(&throttle->sem) < 0)
 		return -1;
+
+	set_io_throttle(throttle, total_rate, background_rate, job_rate);
+
+	return 0;
+}
+
+
+void stop_io_throttle(io_throttle *throttle) {
+	stop_semaphore(&throttle->sem);
+}
+
+
+/*
+* Structure shared by the threads of XOR_file_parallel. Every thread claims the next chunk of
+* SINGLE_THREAD_FILE_LIMIT bytes under sem, until every chunk is done or the encryption is cancelled.
+*/
+typedef struct {
+	mapped_file *source;
+	mapped_file *target;
+	unsigned int seed;
+	long next_chunk;
+	long chunks;
+	int cancelled;
+	int expired;
+	job_control *control;
+	semaphore sem;
+} XOR_shared;
+
+
+/*
+* Function executed by every thread of XOR_file_parallel.
+*/
+void *XOR_worker(void *params) {
+
+	XOR_shared *shared = (XOR_shared *)params;
+	XOR_job job;
+	long done = 0;
+
+	//the I/O priority belongs to the thread, every helper takes the one of the class
+	if(shared->control != NULL && shared->control->background)
+		set_background_io(1);
+
+	while(1) {
+
+		semaphore_wait(&shared->sem);
+
+		//account the chunk done in the previous iteration and check if someone asked to stop or gave up waiting
+		if(shared->control != NULL) {
+			shared->control->processed += done;
+			if(shared->control->cancel)
+				shared->cancelled = 1;
+			else if(!shared->cancelled && deadline_expired(shared->control))
+				shared->cancelled = shared->expired = 1;
+		}
+
+		if(shared->cancelled || shared->next_chunk >= shared->chunks) {
+			semaphore_signal(&shared->sem);
+			break;
+		}
+
+		long start = shared->next_chunk * SINGLE_THREAD_FILE_LIMIT;
+		shared->next_chunk++;
+
+		//every chunk starts again from the seed, just like the first one
+		job.source = shared->source->id + start;
+		job.target = shared->target->id + start;
+		job.length = shared->source->size - start < SINGLE_THREAD_FILE_LIMIT ? (int)(shared->source->size - start) : SINGLE_THREAD_FILE_LIMIT;
+		job.seed   = shared->seed;
+
+		//the chunk is read and written, the own bucket of the job is only used under sem
+		long wait = throttle_io(shared->control, 2L * job.length);
+
+		semaphore_signal(&shared->sem);
+
+		int stopped = throttle_wait(shared->control, wait);
+
+		if(stopped != 0) {
+			semaphore_wait(&shared->sem);
+			shared->cancelled = 1;
+			shared->expired |= stopped == XOR_EXPIRED;
+			semaphore_signal(&shared->sem);
+			break;
+		}
+
+		XOR_task((void *)&job);
+
+		done = job.length;
 	}
 
-	//write the new file
-	fwrite(temp, 1, source->size, new_file);
+	return NULL;
+}
 
-	//close new file and free allocated space
-	fclose(new_file);
-	unmap_file_from_memory(source);
-	free(temp);
-	free(jobs);
-	free(params);
 
-	//delete the old file
-	if(delete_file(path) < 0)
+/*
+* Function used to encrypt a mapped file bigger than SINGLE_THREAD_FILE_LIMIT: the file is split in chunks
+* which are XORed by at most XOR_MAX_THREADS threads (this one included).
+* RETURN VALUE:
+*	On success 0 is returned, XOR_CANCELLED if control asked to stop, XOR_EXPIRED if its deadline is over, otherwise -1
+*/
+int XOR_file_parallel(unsigned int seed, mapped_file *source, mapped_file *target, job_control *control) {
+
+	XOR_shared shared;
+
+	shared.source		= source;
+	shared.target		= target;
+	shared.seed		= seed;
+	shared.next_chunk	= 0;
+	shared.chunks		= (source->size + SINGLE_THREAD_FILE_LIMIT - 1) / SINGLE_THREAD_FILE_LIMIT;
+	shared.cancelled	= 0;
+	shared.expired		= 0;
+	shared.control		= control;
+
+	if(start_semaphore_ex(&shared.sem) < 0)
 		return -1;
-	
-	return 0;
+
+	int no_threads = shared.chunks - 1 < XOR_MAX_THREADS - 1 ? (int)shared.chunks - 1 : XOR_MAX_THREADS - 1;
+
+	thread jobs[XOR_MAX_THREADS];
+	int started = 0;
+
+	//if a thread can't be created just go on with the ones already started
+	while(started < no_threads && create_thread(&jobs[started], XOR_worker, (void *)&shared) == 0)
+		started++;
+
+	//this thread works too
+	XOR_worker((void *)&shared);
+
+	for(int i=0; i<started; i++)
+		join_thread(&jobs[i], NULL);
+
+	stop_semaphore(&shared.sem);
+
+	if(shared.expired)
+		return XOR_EXPIRED;
+
+	return shared.cancelled ? XOR_CANCELLED : 0;
 }
 
 
 /*
-* Function used to encrypt a given file and save the result of the encryption.
+* Function used to XOR a mapped file into another mapped file of the same size, which can be the source itself.
 * ARGUMENTS:
 *	-seed:		int used to generate the random numbers which will be XORed with the bytes of the file
-*	-path:		char location of the file which wants to be encrypted
-*	-out:		char location where the encrypted file wants to be saved
+*	-source:	the mapped file to encrypt
+*	-target:	where the result is written
+*	-control:	job_control used to follow the encryption and to pace it (can be NULL)
 * RETURN VALUE:
-*	On success 0 is returned, otherwise -1
+*	On success 0 is returned, XOR_CANCELLED or XOR_EXPIRED if it was stopped through control, otherwise -1
 */
-int XOR_file(unsigned int seed, char *path, char *out) {
+int XOR_mapped(unsigned int seed, mapped_file *source, mapped_file *target, job_control *control) {
 
-	//map file to memory
-	mapped_file source;
+	if(control != NULL)
+		control->total = source->size;
 
+	int background = control != NULL && control->background && set_background_io(1) == 0;
 	int result;
 
-	//carefully check what map_file_to_memory returns! if it is -2 it's not a real error: it means
-	//that the file could not be locked and this should be treated corretly!
-	if ((result = map_file_to_memory(path, &source)) < 0)
-		return result;
+	if(source->size > SINGLE_THREAD_FILE_LIMIT)
+		result = XOR_file_parallel(seed, source, target, control);
+	else {
 
-	if(source.size > SINGLE_THREAD_FILE_LIMIT)
-		return XOR_file_parallel(seed, path, &source, out);
+		//set random seed
+		random_state state;
+		seed_random(&state, seed);
 
-	//allocate space for output files
-	char* temp = (char *)malloc(source.size);
-	
-	//set random seed
-	srand(seed);
+		result = 0;
 
-	//XOR all bytes of the files
-	for(int i=0; i<source.size; i+=4) {
-		
-		int r = rand();
-		char* rand_chr = (char *)&r;
+		//XOR all bytes of the files, a slice at a time so that even small files stop when they are cancelled or expire
+		for(long start=0; start<source->size && result == 0; start+=XOR_SLICE) {
 
-		for(int j=0; j<4; j++) {
+			long end = source->size - start < XOR_SLICE ? source->size : start + XOR_SLICE;
 
-			if(i + j >= source.size)
+			if(control != NULL && control->cancel)
+				result = XOR_CANCELLED;
+			else if(deadline_expired(control))
+				result = XOR_EXPIRED;
+			else if((result = throttle_wait(control, throttle_io(control, 2L * (end - start)))) != 0)
 				break;
+			else {
 
-			temp[i+j] = source.id[i+j] ^ rand_chr[j];
-		}
+				for(long i=start; i<end; i+=4) {
 
+					int r = next_random(&state);
+					char* rand_chr = (char *)&r;
+
+					for(int j=0; j<4; j++) {
+
+						if(i + j >= end)
+							break;
+
+						target->id[i+j] = source->id[i+j] ^ rand_chr[j];
+					}
+
+				}
+
+				if(control != NULL)
+					control->processed = end;
+			}
+		}
 	}
 
-	//save new file
-	FILE *new_file = fopen(out, "ab");
+	if(background)
+		set_background_io(0);
 
-	if (new_file == NULL) {
+	return result;
+}
 
-		unmap_file_from_memory(&source);
-		free(temp);
 
+/*
+* Function used to encrypt a given file and save the result of the encryption.
+* ARGUMENTS:
+*	-seed:		int used to generate the random numbers which will be XORed with the bytes of the file
+*	-path:		char location of the file which wants to be encrypted
+*	-out:		char location where the encrypted file wants to be saved
+*	-control:	job_control used to follow the encryption (can be NULL)
+* RETURN VALUE:
+*	On success 0 is returned, XOR_CANCELLED if it was stopped through control, XOR_EXPIRED if the deadline
+*	of control is over (the file is left untouched in both cases), otherwise -1
+*/
+int XOR_file(unsigned int seed, char *path, char *out, job_control *control) {
+
+	//map file to memory
+	mapped_file source;
+	mapped_file target;
+
+	int result;
+
+	//nobody is waiting for the result anymore, don't even start
+	if(deadline_expired(control))
+		return XOR_EXPIRED;
+
+	//carefully check what map_file_to_memory returns! if it is -2 it's not a real error: it means
+	//that the file could not be locked and this should be treated corretly!
+	if ((result = map_file_to_memory(path, &source)) < 0)
+		return result;
+
+	//create the new file with the same size, so that it can be written directly. A file which is already there is
+	//never overwritten: the request fails and only what was created here is deleted below
+	if (create_mapped_file(out, source.size, &target) < 0) {
+		unmap_file_from_memory(&source);
 		return -1;
 	}
 
-	//write the new file
-	fwrite(temp, 1, source.size, new_file);
+	result = XOR_mapped(seed, &source, &target, control);
 
-	//close new file and free allocated space
-	fclose(new_file);
+	//close both files
+	unmap_file_from_memory(&target);
 	unmap_file_from_memory(&source);
-	free(temp);
+
+	//something went wrong, drop the new file and leave the old one where it is
+	if(result < 0) {
+		delete_file(out);
+		return result;
+	}
 
 	//delete the old file
 	if(delete_file(path) < 0)
@@ -160,12 +447,103 @@ int XOR_file(unsigned int seed, char *path, char *out) {
 }
 
 
-int ENCR(int seed, char *target) {
+/*
+* Function used to encrypt (or decrypt, it's the same XOR) a file handed over already open by a local client into
+* the output file the client created for the result. The files are read and written with plain positioned I/O, a
+* chunk at a time: the client still has them and can change them meanwhile, which fails the request instead of
+* crashing the server like a mapping would. The result is the same as XOR_file's. Deleting the file which isn't
+* wanted anymore is left to the client.
+* ARGUMENTS:
+*	-seed:		int used to generate the random numbers which will be XORed with the bytes of the file
+*	-file:		the open file, it's closed here
+*	-output:	the open file where the result is written, it's closed here
+*	-control:	job_control used to follow the encryption (can be NULL)
+* RETURN VALUE:
+*	On success 0 is returned, XOR_CANCELLED or XOR_EXPIRED if it was stopped through control, -2 if the file is
+*	locked by someone else, otherwise -1
+*/
+int XOR_open_file(unsigned int seed, io_interface *file, io_interface *output, job_control *control) {
+
+	long size = open_file_size(file);
+	char *buffer = NULL;
+	int result;
+
+	if(deadline_expired(control))
+		result = XOR_EXPIRED;
+	else if((result = lock_file(file)) == 0 && (size < 0 || (buffer = (char *)malloc(SINGLE_THREAD_FILE_LIMIT)) == NULL))
+		result = -1;
+
+	if(result == 0 && control != NULL)
+		control->total = size;
+
+	int background = result == 0 && control != NULL && control->background && set_background_io(1) == 0;
+
+	for(long start=0; start<size && result == 0; start+=SINGLE_THREAD_FILE_LIMIT) {
+
+		long length = size - start < SINGLE_THREAD_FILE_LIMIT ? size - start : SINGLE_THREAD_FILE_LIMIT;
+		random_state state;
+
+		if(control != NULL && control->cancel)
+			result = XOR_CANCELLED;
+		else if(deadline_expired(control))
+			result = XOR_EXPIRED;
+		else if((result = throttle_wait(control, throttle_io(control, 2L * length))) != 0)
+			break;
+		//a file which got shorter meanwhile can't be encrypted
+		else if(read_file_at(file, buffer, length, start) != length)
+			result = -1;
+		else {
+
+			//the same numbers as XOR_mapped: a single stream for small files, the chunks of XOR_file_parallel for the others
+			if(size > SINGLE_THREAD_FILE_LIMIT) {
+
+				XOR_job job;
+
+				job.source	= buffer;
+				job.target	= buffer;
+				job.length	= (int)length;
+				job.seed	= seed;
+
+				XOR_task((void *)&job);
+			}
+			else {
+
+				seed_random(&state, seed);
+
+				for(long i=0; i<length; i+=4) {
+
+					int r = next_random(&state);
+					char* rand_chr = (char *)&r;
+
+					for(int j=0; j<4 && i + j < length; j++)
+						buffer[i+j] ^= rand_chr[j];
+				}
+			}
+
+			if(write_file_at(output, buffer, length, start) < 0)
+				result = -1;
+			else if(control != NULL)
+				control->processed = start + length;
+		}
+	}
+
+	if(background)
+		set_background_io(0);
+
+	free(buffer);
+	close_interface(file);
+	close_interface(output);
+
+	return result;
+}
+
+
+int ENCR(int seed, char *target, job_control *control) {
 
 	char *outfile = malloc(strlen(target)+strlen(ENCR_EXT)+1);
 	snprintf(outfile, strlen(target)+strlen(ENCR_EXT)+1, "%s%s", target, ENCR_EXT);
 
-	int result = XOR_file(seed, target, outfile);
+	int result = XOR_file(seed, target, outfile, control);
 
 	free(outfile);
 	
@@ -173,21 +551,23 @@ int ENCR(int seed, char *target) {
 }
 
 
-int DECR(int seed, char *target) {
+int DECR(int seed, char *target, job_control *control) {
 
 	//allocate space for input file string and copy the path to it
 	char *outfile = malloc(strlen(target)+1);
 	snprintf(outfile, strlen(target)+1,  "%s", target);
 
 	//verify if file is encrypted
-	char *extension = outfile+strlen(outfile)-4;
-	if(strcmp(extension, ENCR_EXT) != 0)
+	char *extension = outfile+strlen(outfile)-strlen(ENCR_EXT);
+	if(strlen(outfile) < strlen(ENCR_EXT) || strcmp(extension, ENCR_EXT) != 0) {
+		free(outfile);
 		return -1;
+	}
 
 	//drop the extension
 	*extension = '\0';
 	
-	int result = XOR_file(seed, target, outfile);
+	int result = XOR_file(seed, target, outfile, control);
 
 	free(outfile);
 	
@@ -0,0 +1,678 @@
+#define SEED_LOG_FILE		"client.seeds"		//binary log of the encryptions of the client, appended only
+#define SEED_INDEX_FILE		"client.seeds.index"	//hash index of SEED_LOG_FILE, rebuilt from the log when it's missing
+#define SEED_COMPACT_FILE	"client.seeds.compact"	//log being written by compact_seed_log
+#define SEED_OLD_LOG_FILE	"client.log"		//text log of the older clients, its lines are imported into the log
+#define SEED_IMPORTED_FILE	"client.log.imported"	//SEED_OLD_LOG_FILE once it was imported
+#define SEED_LOCK_EXT		".lock"			//added to the path of the log: held shared by appenders, exclusive by compact_seed_log
+#define SEED_RECORD_MAGIC	0x53454544		//first field of every record of the log
+#define SEED_INDEX_MAGIC	0x53494458		//first field of the index
+#define SEED_MAX_PATH		4096			//bytes of the path of a record, at most
+#define SEED_SYNC_RECORDS	64			//records appended before the log is synced to the disk
+#define SEED_SYNC_WAIT		1000			//ms after which the next append syncs the records waiting for it
+#define SEED_INDEX_SLOTS	1024			//slots of a new index, it doubles once 3/4 of them are used
+#define SEED_LOCK_WAIT		10			//ms waited when another client is using the index
+#define SEED_LOCK_TRIES		1000			//times the index is tried before giving up
+
+
+/*
+* Structure which defines a record of the seed log, followed by the length bytes of its path. Records are only
+* appended, so the last record of a path has the seed of its last encryption.
+*	-magic:		SEED_RECORD_MAGIC
+*	-seed:		seed of the encryption
+*	-time:		when the encryption was answered, in seconds since the epoch (0 if it was imported from SEED_OLD_LOG_FILE)
+*	-length:	bytes of the path, which is saved without the leading "./"
+*	-check:		hash of the other fields and of the path: a record cut by a crash doesn't match it
+*/
+typedef struct {
+	uint32_t magic;
+	uint32_t seed;
+	int64_t time;
+	uint32_t length;
+	uint32_t check;
+} seed_record;
+
+
+/*
+* Structure which defines the header of the index, which is followed by its slots.
+*	-magic:		SEED_INDEX_MAGIC
+*	-slots:		slots of the index (a power of two), count of them are used
+*	-indexed:	bytes of the log already in the index, the records after them are added when the index is opened
+*/
+typedef struct {
+	uint32_t magic;
+	uint32_t slots;
+	uint32_t count;
+	uint32_t unused;
+	int64_t indexed;
+} seed_index_header;
+
+
+/*
+* Structure which defines a slot of the index: where the last record of a path is, and what it says. Empty slots
+* have hash 0. Paths are told apart by their 64 bit hash, lookups compare the path of the record too.
+*/
+typedef struct {
+	uint64_t hash;
+	int64_t offset;
+	int64_t time;
+	uint32_t seed;
+	uint32_t unused;
+} seed_slot;
+
+
+/*
+* Structure which defines an open index: the file is mapped and locked, so that a single client updates it at once.
+*/
+typedef struct {
+	mapped_file file;
+	seed_index_header *header;
+	seed_slot *slots;
+	FILE *log;
+} seed_index;
+
+
+/*
+* Structure which defines the log a client appends to. Every record is written at once, so that clients appending
+* at the same time don't mix them, but the disk is synced only every SEED_SYNC_RECORDS records (or SEED_SYNC_WAIT ms).
+*	-file:		path of the log, SEED_LOG_FILE (in the working directory) if it's NULL
+*	-target:	the log, NULL until the first record
+*	-lock:		the lock of the log (see SEED_LOCK_EXT), open if has_lock is set
+*	-unsynced:	records not synced yet, the first one was written at first_unsynced
+*/
+typedef struct {
+	char *file;
+	FILE *target;
+	io_interface lock;
+	int has_lock;
+	int unsynced;
+	long first_unsynced;
+} seed_log;
+
+
+/*
+* Function used to skip the "./" which listings put before the paths, so that a path is logged and found the same
+* way whatever the command which encrypted it.
+*/
+char *normalize_seed_path(char *path) {
+
+	while(path[0] == '.' && (path[1] == '/' || path[1] == '\\'))
+		path += 2;
+
+	return strcmp(path, ".") == 0 ? path + 1 : path;
+}
+
+
+/*
+* Function used to hash a path of the log (FNV-1a, 0 is left for the empty slots).
+*/
+uint64_t seed_path_hash(char *path, int length) {
+
+	uint64_t hash = 14695981039346656037ULL;
+
+	for(int i=0; i<length; i++) {
+		hash ^= (unsigned char)path[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash != 0 ? hash : 1;
+}
+
+
+uint32_t seed_record_check(seed_record *record, char *path) {
+
+	uint64_t hash = seed_path_hash(path, record->length);
+
+	hash ^= ((uint64_t)record->seed << 32) ^ (uint64_t)record->time ^ record->length;
+	hash *= 1099511628211ULL;
+
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+
+/*
+* Function used to get the log ready for the next record: its lock is held shared, so that compact_seed_log can't
+* replace it meanwhile, and it's opened again if compact_seed_log replaced it since the last record.
+* RETURN VALUE:
+*	On success 0 is returned (the lock must be released with unlock_file), otherwise -1
+*/
+int lock_seed_log(seed_log *log) {
+
+	char *file = log->file != NULL ? log->file : SEED_LOG_FILE;
+	char lock[SEED_MAX_PATH + sizeof(SEED_LOCK_EXT)];
+
+	if(!log->has_lock && (snprintf(lock, sizeof(lock), "%s%s", file, SEED_LOCK_EXT) >= (int)sizeof(lock) || open_lock_file(lock, &log->lock) < 0))
+		return -1;
+
+	log->has_lock = 1;
+
+	if(wait_file_lock(&log->lock, 0) < 0)
+		return -1;
+
+	//compact_seed_log copied every record of the old log, the next ones go to the new one
+	if(log->target != NULL && !same_file_stream(log->target, file)) {
+
+		if(log->unsynced > 0)
+			sync_file_stream(log->target);
+
+		fclose(log->target);
+
+		log->target	= NULL;
+		log->unsynced	= 0;
+	}
+
+	if(log->target == NULL && (log->target = fopen(file, "ab")) == NULL) {
+		unlock_file(&log->lock);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to append a record to the log.
+* ARGUMENTS:
+*	-log:		the log, opened by the first record
+*	-seed:		seed of the encryption
+*	-path:		path which was encrypted, as it was sent to the server
+*	-when:		time of the record, in seconds since the epoch
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int write_seed_record(seed_log *log, unsigned int seed, char *path, int64_t when) {
+
+	char record[sizeof(seed_record) + SEED_MAX_PATH];
+	seed_record *header = (seed_record *)record;
+
+	path = normalize_seed_path(path);
+
+	if(strlen(path) > SEED_MAX_PATH || lock_seed_log(log) < 0)
+		return -1;
+
+	header->magic	= SEED_RECORD_MAGIC;
+	header->seed	= seed;
+	header->time	= when;
+	header->length	= strlen(path);
+
+	memcpy(record + sizeof(seed_record), path, header->length);
+	header->check	= seed_record_check(header, path);
+
+	int result = 0;
+
+	//a single write, clients which append at the same time don't mix their records
+	if(fwrite(record, sizeof(seed_record) + header->length, 1, log->target) != 1 || fflush(log->target) != 0)
+		result = -1;
+
+	long now = current_time_ms();
+
+	if(result == 0 && log->unsynced++ == 0)
+		log->first_unsynced = now;
+
+	if(result == 0 && (log->unsynced >= SEED_SYNC_RECORDS || now - log->first_unsynced >= SEED_SYNC_WAIT)) {
+		log->unsynced = 0;
+		result = sync_file_stream(log->target);
+	}
+
+	unlock_file(&log->lock);
+
+	return result;
+}
+
+
+/*
+* Function used to append the encryption of a path to the log.
+* ARGUMENTS:
+*	-log:		the log, opened by the first record
+*	-seed:		seed of the encryption
+*	-path:		path which was encrypted, as it was sent to the server
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int append_seed_log(seed_log *log, unsigned int seed, char *path) {
+	return write_seed_record(log, seed, path, (int64_t)time(NULL));
+}
+
+
+/*
+* Function used to sync and close the log, records appended later open it again.
+*/
+void close_seed_log(seed_log *log) {
+
+	if(log->has_lock)
+		close_interface(&log->lock);
+
+	log->has_lock = 0;
+
+	if(log->target == NULL)
+		return;
+
+	if(log->unsynced > 0)
+		sync_file_stream(log->target);
+
+	fclose(log->target);
+
+	log->target	= NULL;
+	log->unsynced	= 0;
+}
+
+
+/*
+* Function used to import the lines of SEED_OLD_LOG_FILE ("seed\tpath", written by the clients before the seed log)
+* into the log, so that the files they encrypted can be restored too. Its records have time 0: they never take the
+* place of a logged encryption of the same path. Once imported, the old log is renamed SEED_IMPORTED_FILE.
+* RETURN VALUE:
+*	On success (or if there's nothing to import) 0 is returned, otherwise -1
+*/
+int import_old_seed_log() {
+
+	char line[SEED_MAX_PATH + 16];
+	unsigned int seed;
+	seed_log log;
+	int result = 0;
+
+	FILE *old = fopen(SEED_OLD_LOG_FILE, "r");
+
+	if(old == NULL)
+		return 0;
+
+	bzero(&log, sizeof(seed_log));
+
+	while(result == 0 && fgets(line, sizeof(line), old) != NULL) {
+
+		char *path = strchr(line, '\t');
+
+		if(path == NULL || sscanf(line, "%u", &seed) != 1)
+			continue;
+
+		path++;
+		path[strcspn(path, "\r\n")] = '\0';
+
+		if(*path != '\0')
+			result = write_seed_record(&log, seed, path, 0);
+	}
+
+	fclose(old);
+	close_seed_log(&log);
+
+	if(result == 0)
+		result = replace_file(SEED_OLD_LOG_FILE, SEED_IMPORTED_FILE);
+
+	return result;
+}
+
+
+/*
+* Function used to read a record of the log.
+* ARGUMENTS:
+*	-log:		the log
+*	-offset:	where the record starts
+*	-record:	where the record is saved
+*	-path:		buffer of SEED_MAX_PATH+1 bytes where the path is saved
+* RETURN VALUE:
+*	On success 0 is returned, -1 if there's no complete record at offset
+*/
+int read_seed_record(FILE *log, long offset, seed_record *record, char *path) {
+
+	if(fseek(log, offset, SEEK_SET) != 0 || fread(record, sizeof(seed_record), 1, log) != 1)
+		return -1;
+
+	if(record->magic != SEED_RECORD_MAGIC || record->length > SEED_MAX_PATH || fread(path, 1, record->length, log) != record->length)
+		return -1;
+
+	path[record->length] = '\0';
+
+	return record->check == seed_record_check(record, path) ? 0 : -1;
+}
+
+
+/*
+* Function used to find the first complete record of the log which starts at offset or after it. A record cut by a
+* crash is skipped once records were appended after it; at the end of the log it could still be being written, so
+* it's never skipped there.
+* RETURN VALUE:
+*	The offset of the record, -1 if there's none
+*/
+long next_seed_record(FILE *log, long offset, seed_record *record, char *path) {
+
+	uint32_t magic;
+
+	if(read_seed_record(log, offset, record, path) == 0)
+		return offset;
+
+	for(long next = offset + 1; fseek(log, next, SEEK_SET) == 0 && fread(&magic, sizeof(uint32_t), 1, log) == 1; next++)
+		if(magic == SEED_RECORD_MAGIC && read_seed_record(log, next, record, path) == 0)
+			return next;
+
+	return -1;
+}
+
+
+/*
+* Function used to save the last record of a path in the slots of an index.
+*/
+void put_seed_slot(seed_index_header *header, seed_slot *slots, uint64_t hash, int64_t offset, int64_t time, uint32_t seed) {
+
+	uint32_t mask = header->slots - 1;
+	uint32_t i = (uint32_t)hash & mask;
+
+	while(slots[i].hash != 0 && slots[i].hash != hash)
+		i = (i + 1) & mask;
+
+	//the imported records are older than every other one, wherever they are in the log
+	if(slots[i].hash == hash && time == 0 && slots[i].time != 0)
+		return;
+
+	if(slots[i].hash == 0)
+		header->count++;
+
+	slots[i].hash	= hash;
+	slots[i].offset	= offset;
+	slots[i].time	= time;
+	slots[i].seed	= seed;
+}
+
+
+/*
+* Function used to create an empty index of the given slots, mapped and locked. The index is built from the log:
+* an old file at path (not valid, or left by a grow which didn't finish) is replaced.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int create_seed_index(seed_index *index, char *path, uint32_t slots) {
+
+	delete_file(path);
+
+	if(create_mapped_file(path, sizeof(seed_index_header) + (long)slots * sizeof(seed_slot), &index->file) < 0)
+		return -1;
+
+	bzero(index->file.id, index->file.size);
+
+	index->header		= (seed_index_header *)index->file.id;
+	index->slots		= (seed_slot *)(index->file.id + sizeof(seed_index_header));
+	index->header->magic	= SEED_INDEX_MAGIC;
+	index->header->slots	= slots;
+
+	return 0;
+}
+
+
+/*
+* Function used to double the slots of an index: the slots are copied to a new file, which then takes the place
+* of the old one.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1 (the index is not changed)
+*/
+int grow_seed_index(seed_index *index) {
+
+	char path[sizeof(SEED_INDEX_FILE) + 8];
+	seed_index bigger;
+
+	snprintf(path, sizeof(path), "%s.new", SEED_INDEX_FILE);
+
+	if(create_seed_index(&bigger, path, index->header->slots * 2) < 0)
+		return -1;
+
+	for(uint32_t i=0; i<index->header->slots; i++)
+		if(index->slots[i].hash != 0)
+			put_seed_slot(bigger.header, bigger.slots, index->slots[i].hash, index->slots[i].offset, index->slots[i].time, index->slots[i].seed);
+
+	bigger.header->indexed = index->header->indexed;
+
+	unmap_file_from_memory(&index->file);
+	unmap_file_from_memory(&bigger.file);
+
+	if(replace_file(path, SEED_INDEX_FILE) < 0 || map_file_to_memory(SEED_INDEX_FILE, &index->file) < 0)
+		return -1;
+
+	index->header	= (seed_index_header *)index->file.id;
+	index->slots	= (seed_slot *)(index->file.id + sizeof(seed_index_header));
+
+	return 0;
+}
+
+
+/*
+* Function used to add to the index the records appended to the log after it was last opened. If the log is shorter
+* than what was indexed (it was replaced) the index is emptied and built again.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int update_seed_index(seed_index *index) {
+
+	char path[SEED_MAX_PATH + 1];
+	seed_record record;
+
+	fseek(index->log, 0, SEEK_END);
+
+	if(ftell(index->log) < index->header->indexed) {
+		bzero(index->slots, (long)index->header->slots * sizeof(seed_slot));
+		index->header->count	= 0;
+		index->header->indexed	= 0;
+	}
+
+	long offset = (long)index->header->indexed;
+
+	while((offset = next_seed_record(index->log, offset, &record, path)) >= 0) {
+
+		if((index->header->count + 1) * 4 >= index->header->slots * 3 && grow_seed_index(index) < 0)
+			return -1;
+
+		put_seed_slot(index->header, index->slots, seed_path_hash(path, record.length), offset, record.time, record.seed);
+
+		offset += sizeof(seed_record) + record.length;
+		index->header->indexed = offset;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to open the index of the log, waiting while another client uses it. It's created if it's missing
+* or not valid, then the records it doesn't know yet are added.
+* RETURN VALUE:
+*	On success 0 is returned, -1 if there's no log or the index can't be used
+*/
+int open_seed_index(seed_index *index) {
+
+	int result = -2;
+
+	bzero(index, sizeof(seed_index));
+
+	import_old_seed_log();
+
+	if((index->log = fopen(SEED_LOG_FILE, "rb")) == NULL)
+		return -1;
+
+	for(int i=0; i<SEED_LOCK_TRIES && (result = map_file_to_memory(SEED_INDEX_FILE, &index->file)) == -2; i++)
+		sleep_ms(SEED_LOCK_WAIT);
+
+	if(result == 0) {
+
+		index->header	= (seed_index_header *)index->file.id;
+		index->slots	= (seed_slot *)(index->file.id + sizeof(seed_index_header));
+
+		if(index->file.size < (long)sizeof(seed_index_header) || index->header->magic != SEED_INDEX_MAGIC ||
+		   index->file.size != (long)sizeof(seed_index_header) + (long)index->header->slots * (long)sizeof(seed_slot)) {
+			unmap_file_from_memory(&index->file);
+			result = -1;
+		}
+	}
+
+	//a new index is created and mapped again, so that it's locked like an old one
+	if(result == -1 && (create_seed_index(index, SEED_INDEX_FILE, SEED_INDEX_SLOTS) < 0 || unmap_file_from_memory(&index->file) < 0 ||
+	   (result = map_file_to_memory(SEED_INDEX_FILE, &index->file)) < 0)) {
+		fclose(index->log);
+		return -1;
+	}
+
+	if(result < 0) {
+		fclose(index->log);
+		return -1;
+	}
+
+	index->header	= (seed_index_header *)index->file.id;
+	index->slots	= (seed_slot *)(index->file.id + sizeof(seed_index_header));
+
+	if(update_seed_index(index) < 0) {
+		unmap_file_from_memory(&index->file);
+		fclose(index->log);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+void close_seed_index(seed_index *index) {
+
+	unmap_file_from_memory(&index->file);
+	fclose(index->log);
+}
+
+
+/*
+* Function used to find the seed of the last encryption of a path.
+* ARGUMENTS:
+*	-index:		the open index
+*	-path:		the path, as it was sent to the server
+*	-seed:		where the seed is saved
+*	-when:		where the time of the encryption is saved (seconds since the epoch), can be NULL
+* RETURN VALUE:
+*	0 if the path was found, otherwise -1
+*/
+int find_seed(seed_index *index, char *path, unsigned int *seed, long *when) {
+
+	char logged[SEED_MAX_PATH + 1];
+	seed_record record;
+
+	path = normalize_seed_path(path);
+
+	uint64_t hash = seed_path_hash(path, strlen(path));
+	uint32_t mask = index->header->slots - 1;
+
+	for(uint32_t i = (uint32_t)hash & mask; index->slots[i].hash != 0; i = (i + 1) & mask) {
+
+		if(index->slots[i].hash != hash)
+			continue;
+
+		if(read_seed_record(index->log, (long)index->slots[i].offset, &record, logged) < 0 || strcmp(logged, path) != 0)
+			return -1;
+
+		*seed = index->slots[i].seed;
+		if(when != NULL)
+			*when = (long)index->slots[i].time;
+
+		return 0;
+	}
+
+	return -1;
+}
+
+
+int compare_seed_offsets(const void *first, const void *second) {
+
+	int64_t a = *(int64_t *)first;
+	int64_t b = *(int64_t *)second;
+
+	return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+
+/*
+* Function used to compact the log: only the last record of every path is kept, in the order they were appended,
+* then the index is built again. Records appended by other clients while it runs are kept too: the lock of the log
+* is held exclusive while the last ones are copied and the log is replaced, then the clients append to the new one.
+* ARGUMENTS:
+*	-before:	where the number of records of the old log is saved
+*	-after:		where the number of records of the new log is saved
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1 (the log is not changed)
+*/
+int compact_seed_log(long *before, long *after) {
+
+	char path[SEED_MAX_PATH + 1];
+	seed_record record;
+	seed_index index;
+	io_interface lock;
+
+	*before	= 0;
+	*after	= 0;
+
+	if(open_lock_file(SEED_LOG_FILE SEED_LOCK_EXT, &lock) < 0)
+		return -1;
+
+	if(open_seed_index(&index) < 0) {
+		close_interface(&lock);
+		return -1;
+	}
+
+	int64_t *offsets = (int64_t *)malloc(((long)index.header->count + 1) * sizeof(int64_t));
+	FILE *target = fopen(SEED_COMPACT_FILE, "wb");
+	long count = 0;
+	int result = offsets != NULL && target != NULL ? 0 : -1;
+
+	for(uint32_t i=0; result == 0 && i<index.header->slots; i++)
+		if(index.slots[i].hash != 0)
+			offsets[count++] = index.slots[i].offset;
+
+	qsort(offsets, count, sizeof(int64_t), compare_seed_offsets);
+
+	for(long i=0; result == 0 && i<count; i++)
+		if(read_seed_record(index.log, (long)offsets[i], &record, path) < 0 ||
+		   fwrite(&record, sizeof(seed_record), 1, target) != 1 || fwrite(path, 1, record.length, target) != record.length)
+			result = -1;
+
+	//no client appends from now on, until the new log took the place of this one
+	if(result == 0 && wait_file_lock(&lock, 1) < 0)
+		result = -1;
+
+	for(long offset = 0; result == 0 && (offset = next_seed_record(index.log, offset, &record, path)) >= 0; offset += sizeof(seed_record) + record.length)
+		(*before)++;
+
+	//what was appended meanwhile is moved as it is
+	for(long offset = (long)index.header->indexed; result == 0 && (offset = next_seed_record(index.log, offset, &record, path)) >= 0; offset += sizeof(seed_record) + record.length) {
+		if(fwrite(&record, sizeof(seed_record), 1, target) != 1 || fwrite(path, 1, record.length, target) != record.length)
+			result = -1;
+		count++;
+	}
+
+	if(target != NULL && (fflush(target) != 0 || sync_file_stream(target) < 0))
+		result = -1;
+
+	if(target != NULL)
+		fclose(target);
+
+	free(offsets);
+
+	//open files can't be replaced on every system
+	fclose(index.log);
+
+	//the index is still locked: it's emptied, then it reads the new log from the start
+	if(result == 0 && replace_file(SEED_COMPACT_FILE, SEED_LOG_FILE) == 0) {
+
+		close_interface(&lock);
+
+		if((index.log = fopen(SEED_LOG_FILE, "rb")) == NULL) {
+			unmap_file_from_memory(&index.file);
+			return -1;
+		}
+
+		bzero(index.slots, (long)index.header->slots * sizeof(seed_slot));
+		index.header->count	= 0;
+		index.header->indexed	= 0;
+
+		result = update_seed_index(&index);
+		*after = count;
+	}
+	else {
+		close_interface(&lock);
+		delete_file(SEED_COMPACT_FILE);
+		unmap_file_from_memory(&index.file);
+		return -1;
+	}
+
+	close_seed_index(&index);
+
+	return result;
+}
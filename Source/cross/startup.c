@@ -5,27 +5,76 @@
 #define LIST_REC_ACTION 	2
 #define ENC_ACTION		3
 #define DEC_ACTION		4
-
-
-#define LSTF_REQ		"LSTF"
+#define SUBMIT_ENC_ACTION	5
+#define SUBMIT_DEC_ACTION	6
+#define STATUS_ACTION		7
+#define WAIT_ACTION		8
+#define CANCEL_ACTION		9
+#define STATS_ACTION		10
+#define CHANGES_ACTION		11
+#define USAGE_ACTION		12
+#define DIRECTORY_ENC_ACTION	13		//every plain file is encrypted by a batch (see run_batch), not a request
+#define DIRECTORY_DEC_ACTION	14		//every encrypted file is decrypted by a batch
+#define RESTORE_ACTION		15		//every encrypted file under a prefix is decrypted by a batch, with the seeds of the seed log
+
+
+#define LSTF_REQ		"LSTF"		//"LSTF options", options are optional (see parse_listing_query)
 #define LSTR_REQ		"LSTR"
 #define ENCR_REQ		"ENCR"
 #define DECR_REQ		"DECR"
+#define PROTO_REQ		"PROT"		//"PROT version options", asks the server to switch to a newer wire format
+#define SUBM_REQ		"SUBM"		//"SUBM ENCR seed path", runs the request as a job and answers with its id at once
+#define STAT_REQ		"STAT"		//"STAT id", status of a job. Without an id, statistics of the server
+#define WAIT_REQ		"WAIT"		//"WAIT id", status of a job once it's finished
+#define CANC_REQ		"CANC"		//"CANC id", stops a job
+#define TIME_REQ		"TIME"		//"TIME ms request", the client gives up on the request ms after it arrives
+#define CHNG_REQ		"CHNG"		//"CHNG token", files changed since the generation token of a previous CHNG
+#define DU_REQ			"DU"		//"DU depth", recursive size and files of the directories down to depth (1 if not given)
+#define PEER_REQ		"PEER"		//"PEER request", an ENCR or a DECR offloaded by a peer: executed here, never offloaded again
+#define BGND_REQ		"BGND"		//"BGND request", an ENCR or a DECR (or its SUBM) executed in the background class
 
 
 #define FIN_MSG			200
 #define MORE_MSG 		300
 #define ERR_MSG			400
 #define BUSY_MSG		500
+#define PROTO_MSG		210		//protocol switch accepted, followed by the version that will be used
+#define OVERLOAD_MSG		600		//request refused because the server is overloaded, followed by the seconds to wait before retrying
+#define TIMEOUT_MSG		700		//request dropped because its deadline was over, the target was left untouched
+#define NOT_MODIFIED_MSG	220		//nothing changed since the generation token given with CHNG_REQ
 
 
 #define LISTEN_MAX_TRIES	6 
 
-#define CLIENT_LOG_FILE		"client.log"
 #define DEFAULT_CONF		"server.conf"
 #define DEFAULT_THREADS_NO	4
+#define DEFAULT_JOBS_NO		2
+#define DEFAULT_SMALL_JOBS_NO	2
+#define DEFAULT_BULK_LIMIT	16777216	//16 mb, bigger files are encrypted by the bulk lane
+#define DEFAULT_MAX_QUEUED	1024		//connections waiting for a listener, the others are refused
+#define DEFAULT_MAX_THREADS	64		//listeners started at most by the autoscaler
+#define DEFAULT_SCALE_WAIT	100		//ms waited by the oldest queued connection which makes the listeners grow
+#define DEFAULT_IDLE_TIMEOUT	30		//seconds after which listeners which were not needed are stopped
+#define DEFAULT_READ_TIMEOUT	30		//seconds given to a client to send a whole request
+#define DEFAULT_WRITE_TIMEOUT	60		//seconds a client can stay without reading anything of a response
+#define CHANGES_RETRY		1		//seconds a CHNG request waits for a metadata cache which is being filled
+#define DEFAULT_USAGE_DEPTH	1		//deepest directories answered to a DU request without a depth
+#define DEFAULT_OFFLOAD_DEPTH	4		//connections waiting for a listener which make the server offload to its peers
+#define PEER_CONNECT_TIMEOUT	2000		//ms a peer can take to accept an offloaded request
+#define PEER_ANSWER_TIMEOUT	300000		//ms a peer can take to answer a request without a deadline (5 minutes)
+#define MAX_PEERS		16		//servers sharing the same files which requests can be offloaded to
+#define DEFAULT_BATCH_INFLIGHT	8		//commands of a batch sent and not yet answered, at most
+#define DEFAULT_BATCH_CONNECTIONS	2		//connections a batch pipelines its commands over
+#define CLIENT_MAX_ARGS		64		//words of a command of a batch or of the client library
+#define CLIENT_MAX_SERVERS	16		//servers a batch can spread its commands over
+#define SHARD_BY_HASH		0		//commands of a batch with a path go to the server which owns its hash
+#define SHARD_BY_BYTES		1		//commands of a batch go to the server with the fewest bytes outstanding
+#define CLIENT_USAGE		"Usage method: \n\n\t%s server_address:port[,address:port...] [-t ms] [-B] [-m hash|bytes] [-L local socket] [-l [options] | -R [options] | -e seed path | -d seed path | -E seed path | -D seed path | -s job | -w job | -x job | -S | -g generation | -u [depth] | -a seed [options] | -A seed [options] | -r prefix [options] | -b file [-j in-flight] [-k connections] ]\n\t%s -C\n\n"
+#define STATS_LENGTH		1024
+#define REQUEST_HANDED_OFF	1		//the connection now belongs to a job, the listener must not close it
 #define MAX_PATH_LENGTH		4096
 #define DEFAULT_PORT		8888
+#define LOCAL_CLIENT		"local"		//address the admission gives to the clients of the local socket
 
 
 
@@ -38,7 +87,27 @@
 typedef struct {
 	int port;
 	int no_threads;
+	int max_threads;
+	long scale_wait;
+	int idle_timeout;
+	int read_timeout;
+	int write_timeout;
+	int total_timeout;
+	int no_jobs;
+	int no_small_jobs;
+	long bulk_limit;
+	int max_queued;
+	long max_inflight;
+	int max_per_client;
 	char *directory;
+	char *cache_file;
+	char *peers;
+	int offload_depth;
+	char *local_socket;
+	char *drop_folders;
+	long total_rate;
+	long background_rate;
+	long job_rate;
 	int run;
 	int restart;
 	char *starting_directory;
@@ -57,16 +126,89 @@ typedef struct {
 	int action;
 	char *target;
 	unsigned int seed;
+	int job_id;
+	int protocol;
+	int deadline;
+	int background;
+	int binary_listings;
+	int compressed_listings;
+	int depth;
+	char *batch;
+	int inflight;
+	int connections;
+	char **addresses;
+	int *ports;
+	int no_servers;
+	int shard_mode;
+	char *prefix;
+	char *local_socket;
 } client_configuration;
 
 
 
+/*
+* Structure which counts what happened to the connections of the server.
+*	-connections:		connections currently open
+*	-expired_read:		connections closed because a request didn't arrive in time
+*	-expired_write:		connections closed because the client didn't read the response
+*	-expired_total:		connections closed because they were open for too long
+*	-local:			requests of the local socket, executed on the file the client handed over
+*/
+typedef struct {
+	long connections;
+	long expired_read;
+	long expired_write;
+	long expired_total;
+	long local;
+} connection_stats;
+
+
+
+/*
+* Structure which defines the peers of the server: other servers sharing the same files (under the same relative
+* paths), which execute the ENCR and DECR requests of this one when it's overloaded (see offload_request).
+*	-addresses, ports:	where the peers are, count of them
+*	-next:		peer tried first by the next offload, so that they take turns
+*	-depth:		connections waiting for a listener which make the server overloaded
+*	-offloaded:	requests executed by the peers
+*/
+typedef struct {
+	char addresses[MAX_PEERS][ADDRESS_LENGTH];
+	int ports[MAX_PEERS];
+	int count;
+	int next;
+	int depth;
+	long offloaded;
+} peer_list;
+
+
+
 /*
 * Structure which defines a listener job configuration. Io contains:
 *	-queue:		pointer to a queue of interfaces. A main thread should accept some calls, write it on this queue
 *			and one or more listener threads will read from it
 *	-rr: 		pointer to an integer which counts the remaining requests
 *	-sem:		mutex semaphore to coordinate multi-thread access to the two variables just described
+*	-listeners:	threads which serve the queue, protected by *sem so that they can be changed by a reload
+*	-stop:		set when every listener must exit
+*	-min_listeners,
+*	 max_listeners:	bounds of the listeners started by the autoscaler, protected by *sem
+*	-scale_wait:	ms waited by the oldest queued connection which makes the autoscaler start new listeners
+*	-idle_timeout:	ms after which the autoscaler stops the listeners which were not needed
+*	-busy:		listeners serving a connection, peak_busy is the highest value since window_start (all protected by *sem)
+*	-stats:		what happened to the connections, protected by *sem
+*	-directory:	absolute path of the working directory, protected by *sem. Requests resolve their paths against
+*			the directory they find when they start, so that a reload only affects the new ones
+*	-buffers:	pool of FRAME_BUFFER_SIZE+1 buffers used to read the requests (it has its own mutex)
+*	-jobs:		job_table which runs the submitted jobs (it has its own mutex)
+*	-bulk_limit:	size (in bytes) which makes an ENCR or a DECR big: it is sent to the bulk lane of jobs
+*	-limits:	admission of the server, every request must be admitted before being executed (it has its own mutex)
+*	-cache:		metadata cache of the working directory which serves the listings, NULL if it's not used. The
+*			pointer is protected by *sem, the cache has its own mutex (see use_listing_cache)
+*	-peers:		servers the requests are offloaded to when this one is overloaded, protected by *sem
+*	-drops:		drop folders of the server, NULL if there are none. The pointer is protected by *sem, the drop
+*			folders have their own mutex
+*	-throttle:	bandwidth the encryptions are paced by (it has its own mutex)
 *
 * ACCESS TO THIS POINTERS SHOULD ALWAYS BE UNDER A MUTEX SECTION! Use *sem to see if access is allowed and *rr to wait for queue to be filled!
 */
@@ -74,10 +216,35 @@ typedef struct {
 	io_interface_queue		*queue;
 	semaphore			*rr;
 	semaphore			*sem;
-	int 				*restart;
+	thread_pool			listeners;
+	int 				stop;
+	int				min_listeners;
+	int				max_listeners;
+	long				scale_wait;
+	long				idle_timeout;
+	int				busy;
+	int				peak_busy;
+	long				window_start;
+	connection_stats		stats;
+	char				directory[MAX_PATH_LENGTH];
+	buffer_pool			*buffers;
+	job_table			*jobs;
+	long				bulk_limit;
+	admission			*limits;
+	metadata_cache			*cache;
+	peer_list			peers;
+	drop_box			*drops;
+	io_throttle			*throttle;
 } listener_job;
 
 
+//connections of the event loop (see reactor.c), their requests are executed by the listeners
+struct connection;
+void serve_connection(struct connection *target, listener_job *conf);
+void finish_connection(struct connection *target);
+int connection_sink(void *param, char *source, int length);
+
+
 
 /*
 * Function used to parse a string to an integer. Implementation for both Linux and Windows.
@@ -103,8 +270,11 @@ unsigned int parse_int_unsigned(char *source) {
 }
 
 
+seed_log client_seed_log;
+
 /*
-* Function used to log a client encrypt request to the given file.
+* Function used to log a client encrypt request to the seed log (see append_seed_log). The log stays open until
+* close_seed_log, callers must not log from more threads at once.
 * ARGUMENTS:
 *	-seed:		seed of the encrypt action used
 *	-path:		path of the encrypted target
@@ -113,19 +283,7 @@ unsigned int parse_int_unsigned(char *source) {
 */
 int log_action(unsigned int seed, char *path) {
 
-	FILE *log = fopen(CLIENT_LOG_FILE, "a");
-
-	if(log == NULL)
-		return -1;
-
-	if(fprintf(log, "%10u\t%s\n", seed, path) < 0)
-		return -1;
-
-	if(fclose(log) < 0)
-		return -1;
-
-	return 0;
-
+	return append_seed_log(&client_seed_log, seed, path);
 }
 
 /*
@@ -220,10 +378,74 @@ int read_from_file(char *file, server_configuration *target) {
 			case 'n':
 				target->no_threads = parse_int(line + 1);
 				break;
+			case 'm':
+				target->max_threads = parse_int(line + 1);
+				break;
+			case 'w':
+				target->scale_wait = strtol(line + 1, (char **)NULL, 10);
+				break;
+			case 'k':
+				target->idle_timeout = parse_int(line + 1);
+				break;
+			case 'r':
+				target->read_timeout = parse_int(line + 1);
+				break;
+			case 'o':
+				target->write_timeout = parse_int(line + 1);
+				break;
+			case 't':
+				target->total_timeout = parse_int(line + 1);
+				break;
+			case 'j':
+				target->no_jobs = parse_int(line + 1);
+				break;
+			case 'i':
+				target->no_small_jobs = parse_int(line + 1);
+				break;
+			case 'b':
+				target->bulk_limit = strtol(line + 1, (char **)NULL, 10);
+				break;
+			case 'q':
+				target->max_queued = parse_int(line + 1);
+				break;
+			case 'f':
+				target->max_inflight = strtol(line + 1, (char **)NULL, 10);
+				break;
+			case 'u':
+				target->max_per_client = parse_int(line + 1);
+				break;
 			case 'c':
 				target->directory = malloc(MAX_PATH_LENGTH);
 				strcpy(target->directory, line+2);
 				break;
+			case 'a':
+				target->cache_file = malloc(MAX_PATH_LENGTH);
+				strcpy(target->cache_file, line+2);
+				break;
+			case 'P':
+				target->peers = malloc(MAX_PATH_LENGTH);
+				strcpy(target->peers, line+2);
+				break;
+			case 'O':
+				target->offload_depth = parse_int(line + 1);
+				break;
+			case 'L':
+				target->local_socket = malloc(MAX_PATH_LENGTH);
+				strcpy(target->local_socket, line+2);
+				break;
+			case 'W':
+				target->drop_folders = malloc(MAX_PATH_LENGTH);
+				strcpy(target->drop_folders, line+2);
+				break;
+			case 'T':
+				target->total_rate = strtol(line + 1, (char **)NULL, 10);
+				break;
+			case 'B':
+				target->background_rate = strtol(line + 1, (char **)NULL, 10);
+				break;
+			case 'J':
+				target->job_rate = strtol(line + 1, (char **)NULL, 10);
+				break;
 		}
 	}
 	
@@ -247,8 +469,8 @@ int server_read_and_set_arguments(int argc, char *args[], server_configuration *
 	if(target->restart) {
 
 		if(chdir(target->starting_directory) < 0) {
-			printf("There was an error while trying to restart: could not read starting directory.\nApplication will now close...\n\n");
-			exit(1);
+			printf("There was an error while trying to reload: could not read starting directory, the current configuration is kept.\n\n");
+			return -1;
 		}
 		//set to zero restart variable (as restart is actually happening)
 		target->restart = 0;
@@ -256,21 +478,84 @@ int server_read_and_set_arguments(int argc, char *args[], server_configuration *
 		server_configuration conf_from_file;
 		conf_from_file.port = 0;
 		conf_from_file.no_threads = 0;
+		conf_from_file.max_threads = 0;
+		conf_from_file.scale_wait = 0;
+		conf_from_file.idle_timeout = 0;
+		conf_from_file.read_timeout = 0;
+		conf_from_file.write_timeout = 0;
+		conf_from_file.total_timeout = 0;
+		conf_from_file.no_jobs = 0;
+		conf_from_file.no_small_jobs = 0;
+		conf_from_file.bulk_limit = 0;
+		conf_from_file.max_queued = 0;
+		conf_from_file.max_inflight = 0;
+		conf_from_file.max_per_client = 0;
 		conf_from_file.directory = 0;
+		conf_from_file.cache_file = 0;
+		conf_from_file.peers = 0;
+		conf_from_file.offload_depth = 0;
+		conf_from_file.local_socket = 0;
+		conf_from_file.drop_folders = 0;
+		conf_from_file.total_rate = 0;
+		conf_from_file.background_rate = 0;
+		conf_from_file.job_rate = 0;
 
 		if (read_from_file(DEFAULT_CONF, &conf_from_file) < 0) {
-			printf("Could not read configuration file when restarting!\nApplication will now close...\n\n");
-			exit(1);
+			printf("Could not read configuration file when reloading, the current configuration is kept.\n\n");
+			return -1;
 		}
 
 		if(conf_from_file.port != 0)
 			target->port = conf_from_file.port;
 		if(conf_from_file.no_threads != 0)
 			target->no_threads = conf_from_file.no_threads;
+		if(conf_from_file.max_threads != 0)
+			target->max_threads = conf_from_file.max_threads;
+		if(conf_from_file.scale_wait != 0)
+			target->scale_wait = conf_from_file.scale_wait;
+		if(conf_from_file.idle_timeout != 0)
+			target->idle_timeout = conf_from_file.idle_timeout;
+		if(conf_from_file.read_timeout != 0)
+			target->read_timeout = conf_from_file.read_timeout;
+		if(conf_from_file.write_timeout != 0)
+			target->write_timeout = conf_from_file.write_timeout;
+		if(conf_from_file.total_timeout != 0)
+			target->total_timeout = conf_from_file.total_timeout;
+		if(target->max_threads < target->no_threads)
+			target->max_threads = target->no_threads;
+		if(conf_from_file.no_jobs != 0)
+			target->no_jobs = conf_from_file.no_jobs;
+		if(conf_from_file.no_small_jobs != 0)
+			target->no_small_jobs = conf_from_file.no_small_jobs;
+		if(conf_from_file.bulk_limit != 0)
+			target->bulk_limit = conf_from_file.bulk_limit;
+
+		//limits are always taken from the file on restart, so that they can be removed too
+		target->max_queued	= conf_from_file.max_queued != 0 ? conf_from_file.max_queued : DEFAULT_MAX_QUEUED;
+		target->max_inflight	= conf_from_file.max_inflight;
+		target->max_per_client	= conf_from_file.max_per_client;
 		if(conf_from_file.directory != 0) {
 			free(target->directory);
 			target->directory = conf_from_file.directory;
 		}
+		if(conf_from_file.cache_file != 0) {
+			free(target->cache_file);
+			target->cache_file = conf_from_file.cache_file;
+		}
+
+		//like the limits, peers are always taken from the file so that offloading can be turned off
+		free(target->peers);
+		target->peers		= conf_from_file.peers;
+		target->offload_depth	= conf_from_file.offload_depth != 0 ? conf_from_file.offload_depth : DEFAULT_OFFLOAD_DEPTH;
+
+		//like the limits, the bandwidth is always taken from the file so that it can be lifted
+		target->total_rate	= conf_from_file.total_rate;
+		target->background_rate	= conf_from_file.background_rate;
+		target->job_rate	= conf_from_file.job_rate;
+
+		//the local socket is hosted and the drop folders are watched once at startup
+		free(conf_from_file.local_socket);
+		free(conf_from_file.drop_folders);
 
 	}
 	//this is actually the first time the application is starting, so give priority to args and then read from file
@@ -291,6 +576,26 @@ int server_read_and_set_arguments(int argc, char *args[], server_configuration *
 		int directory_set 	= 0;
 		int port_set		= 0;
 		int no_threads_set 	= 0;
+		int no_jobs_set		= 0;
+		int no_small_jobs_set	= 0;
+		int bulk_limit_set	= 0;
+		int max_queued_set	= 0;
+		int max_threads_set	= 0;
+		int scale_wait_set	= 0;
+		int idle_timeout_set	= 0;
+		int read_timeout_set	= 0;
+		int write_timeout_set	= 0;
+		int total_timeout_set	= 0;
+		int max_inflight_set	= 0;
+		int max_per_client_set	= 0;
+		int cache_file_set	= 0;
+		int peers_set		= 0;
+		int offload_depth_set	= 0;
+		int local_socket_set	= 0;
+		int drop_folders_set	= 0;
+		int total_rate_set	= 0;
+		int background_rate_set	= 0;
+		int job_rate_set	= 0;
 		
 		while (read_arguments < argc) {
 	                
@@ -329,8 +634,196 @@ int server_read_and_set_arguments(int argc, char *args[], server_configuration *
 				no_threads_set = 1;	
 				read_arguments += 2;
 			}
+			else if (strcmp(args[read_arguments], "-j") == 0) {
+
+				target->no_jobs = parse_int(args[read_arguments+1]);
+
+				printf("\tNumber of job workers set to:\t\t\t\t%i\n", target->no_jobs);
+
+				no_jobs_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-i") == 0) {
+
+				target->no_small_jobs = parse_int(args[read_arguments+1]);
+
+				printf("\tNumber of small job workers set to:\t\t\t%i\n", target->no_small_jobs);
+
+				no_small_jobs_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-b") == 0) {
+
+				target->bulk_limit = strtol(args[read_arguments+1], (char **)NULL, 10);
+
+				printf("\tBulk limit set to:\t\t\t\t\t%ld bytes\n", target->bulk_limit);
+
+				bulk_limit_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-m") == 0) {
+
+				target->max_threads = parse_int(args[read_arguments+1]);
+
+				printf("\tMax number of threads set to:\t\t\t\t%i\n", target->max_threads);
+
+				max_threads_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-w") == 0) {
+
+				target->scale_wait = strtol(args[read_arguments+1], (char **)NULL, 10);
+
+				printf("\tQueue wait which adds threads set to:\t\t\t%ld ms\n", target->scale_wait);
+
+				scale_wait_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-k") == 0) {
+
+				target->idle_timeout = parse_int(args[read_arguments+1]);
+
+				printf("\tIdle timeout of threads set to:\t\t\t\t%i s\n", target->idle_timeout);
+
+				idle_timeout_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-r") == 0) {
+
+				target->read_timeout = parse_int(args[read_arguments+1]);
+
+				printf("\tRead timeout of connections set to:\t\t\t%i s\n", target->read_timeout);
+
+				read_timeout_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-o") == 0) {
+
+				target->write_timeout = parse_int(args[read_arguments+1]);
+
+				printf("\tWrite timeout of connections set to:\t\t\t%i s\n", target->write_timeout);
+
+				write_timeout_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-t") == 0) {
+
+				target->total_timeout = parse_int(args[read_arguments+1]);
+
+				printf("\tTotal timeout of connections set to:\t\t\t%i s\n", target->total_timeout);
+
+				total_timeout_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-q") == 0) {
+
+				target->max_queued = parse_int(args[read_arguments+1]);
+
+				printf("\tMax queued connections set to:\t\t\t\t%i\n", target->max_queued);
+
+				max_queued_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-f") == 0) {
+
+				target->max_inflight = strtol(args[read_arguments+1], (char **)NULL, 10);
+
+				printf("\tMax in-flight bytes set to:\t\t\t\t%ld\n", target->max_inflight);
+
+				max_inflight_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-u") == 0) {
+
+				target->max_per_client = parse_int(args[read_arguments+1]);
+
+				printf("\tMax requests per client set to:\t\t\t\t%i\n", target->max_per_client);
+
+				max_per_client_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-a") == 0) {
+
+				target->cache_file = malloc(MAX_PATH_LENGTH);
+
+				strncpy(target->cache_file, args[read_arguments+1], (size_t)MAX_PATH_LENGTH-1);
+
+				printf("\tMetadata cache saved to:\t\t\t\t%s\n", target->cache_file);
+
+				cache_file_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-P") == 0) {
+
+				target->peers = malloc(MAX_PATH_LENGTH);
+
+				strncpy(target->peers, args[read_arguments+1], (size_t)MAX_PATH_LENGTH-1);
+
+				printf("\tPeers set to:\t\t\t\t\t\t%s\n", target->peers);
+
+				peers_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-O") == 0) {
+
+				target->offload_depth = parse_int(args[read_arguments+1]);
+
+				printf("\tQueued connections which offload to peers set to:\t%i\n", target->offload_depth);
+
+				offload_depth_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-L") == 0) {
+
+				target->local_socket = malloc(MAX_PATH_LENGTH);
+
+				strncpy(target->local_socket, args[read_arguments+1], (size_t)MAX_PATH_LENGTH-1);
+
+				printf("\tLocal socket set to:\t\t\t\t\t%s\n", target->local_socket);
+
+				local_socket_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-W") == 0) {
+
+				target->drop_folders = malloc(MAX_PATH_LENGTH);
+
+				strncpy(target->drop_folders, args[read_arguments+1], (size_t)MAX_PATH_LENGTH-1);
+
+				printf("\tDrop folders set to:\t\t\t\t\t%s\n", target->drop_folders);
+
+				drop_folders_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-T") == 0) {
+
+				target->total_rate = strtol(args[read_arguments+1], (char **)NULL, 10);
+
+				printf("\tBandwidth of the server set to:\t\t\t\t%ld bytes/s\n", target->total_rate);
+
+				total_rate_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-B") == 0) {
+
+				target->background_rate = strtol(args[read_arguments+1], (char **)NULL, 10);
+
+				printf("\tBandwidth of background jobs set to:\t\t\t%ld bytes/s\n", target->background_rate);
+
+				background_rate_set = 1;
+				read_arguments += 2;
+			}
+			else if (strcmp(args[read_arguments], "-J") == 0) {
+
+				target->job_rate = strtol(args[read_arguments+1], (char **)NULL, 10);
+
+				printf("\tBandwidth of every job set to:\t\t\t\t%ld bytes/s\n", target->job_rate);
+
+				job_rate_set = 1;
+				read_arguments += 2;
+			}
 			else {
-				printf("Unexpected parameter, expected arguments: \n\n\t%s [ -c directory | -n threads | -p port ]\n\n", args[0]);
+				printf("Unexpected parameter, expected arguments: \n\n\t%s [ -c directory | -n threads | -m max threads | -w scale wait ms | -k idle timeout s | -r read timeout s | -o write timeout s | -t total timeout s | -j job workers | -i small job workers | -b bulk limit | -q max queued | -f max in-flight bytes | -u max per client | -a metadata cache file | -P peer:port[,peer:port...] | -O offload depth | -L local socket | -W folder=seed|random[,folder=seed|random...] | -T server bytes/s | -B background bytes/s | -J job bytes/s | -p port ]\n\n", args[0]);
 				exit(1);
 			}
 		}
@@ -338,7 +831,27 @@ int server_read_and_set_arguments(int argc, char *args[], server_configuration *
 		server_configuration conf_from_file;
 		conf_from_file.port = 0;
 		conf_from_file.no_threads = 0;
+		conf_from_file.max_threads = 0;
+		conf_from_file.scale_wait = 0;
+		conf_from_file.idle_timeout = 0;
+		conf_from_file.read_timeout = 0;
+		conf_from_file.write_timeout = 0;
+		conf_from_file.total_timeout = 0;
+		conf_from_file.no_jobs = 0;
+		conf_from_file.no_small_jobs = 0;
+		conf_from_file.bulk_limit = 0;
+		conf_from_file.max_queued = 0;
+		conf_from_file.max_inflight = 0;
+		conf_from_file.max_per_client = 0;
 		conf_from_file.directory = 0;
+		conf_from_file.cache_file = 0;
+		conf_from_file.peers = 0;
+		conf_from_file.offload_depth = 0;
+		conf_from_file.local_socket = 0;
+		conf_from_file.drop_folders = 0;
+		conf_from_file.total_rate = 0;
+		conf_from_file.background_rate = 0;
+		conf_from_file.job_rate = 0;
 
 		read_from_file(DEFAULT_CONF, &conf_from_file);
 
@@ -381,185 +894,1831 @@ int server_read_and_set_arguments(int argc, char *args[], server_configuration *
 				printf("\tNumber of threads not chosen, using default value:\t%i\n", DEFAULT_THREADS_NO);
 			}
 		}
+		if(!no_jobs_set) {
+			if(conf_from_file.no_jobs != 0) {
+				target->no_jobs = conf_from_file.no_jobs;
+				printf("\tNumber of job workers read from configuration file: \t%i\n", target->no_jobs);
+			}
+			else {
+				target->no_jobs = DEFAULT_JOBS_NO;
+				printf("\tNumber of job workers not chosen, using default value:\t%i\n", DEFAULT_JOBS_NO);
+			}
+		}
+		if(!no_small_jobs_set) {
+			if(conf_from_file.no_small_jobs != 0) {
+				target->no_small_jobs = conf_from_file.no_small_jobs;
+				printf("\tNumber of small job workers read from configuration file: %i\n", target->no_small_jobs);
+			}
+			else {
+				target->no_small_jobs = DEFAULT_SMALL_JOBS_NO;
+				printf("\tNumber of small job workers not chosen, using default value: %i\n", DEFAULT_SMALL_JOBS_NO);
+			}
+		}
+		if(!bulk_limit_set) {
+			if(conf_from_file.bulk_limit != 0) {
+				target->bulk_limit = conf_from_file.bulk_limit;
+				printf("\tBulk limit read from configuration file:\t\t%ld bytes\n", target->bulk_limit);
+			}
+			else {
+				target->bulk_limit = DEFAULT_BULK_LIMIT;
+				printf("\tBulk limit not chosen, using default value:\t\t%i bytes\n", DEFAULT_BULK_LIMIT);
+			}
+		}
+		if(!max_threads_set)
+			target->max_threads = conf_from_file.max_threads != 0 ? conf_from_file.max_threads : DEFAULT_MAX_THREADS;
+		if(target->max_threads < target->no_threads)
+			target->max_threads = target->no_threads;
+		if(!scale_wait_set)
+			target->scale_wait = conf_from_file.scale_wait != 0 ? conf_from_file.scale_wait : DEFAULT_SCALE_WAIT;
+		if(!idle_timeout_set)
+			target->idle_timeout = conf_from_file.idle_timeout != 0 ? conf_from_file.idle_timeout : DEFAULT_IDLE_TIMEOUT;
+
+		printf("\tListeners: from %i to %i, added after %ld ms of queue wait, removed after %i s of idle time\n",
+			target->no_threads, target->max_threads, target->scale_wait, target->idle_timeout);
+
+		if(!read_timeout_set)
+			target->read_timeout = conf_from_file.read_timeout != 0 ? conf_from_file.read_timeout : DEFAULT_READ_TIMEOUT;
+		if(!write_timeout_set)
+			target->write_timeout = conf_from_file.write_timeout != 0 ? conf_from_file.write_timeout : DEFAULT_WRITE_TIMEOUT;
+		if(!total_timeout_set)
+			target->total_timeout = conf_from_file.total_timeout;
+
+		printf("\tConnections: %i s to send a request, %i s without reading a response, %i s in total (0 means no limit)\n",
+			target->read_timeout, target->write_timeout, target->total_timeout);
+
+		if(!max_queued_set)
+			target->max_queued = conf_from_file.max_queued != 0 ? conf_from_file.max_queued : DEFAULT_MAX_QUEUED;
+		if(!max_inflight_set)
+			target->max_inflight = conf_from_file.max_inflight;
+		if(!max_per_client_set)
+			target->max_per_client = conf_from_file.max_per_client;
+
+		if(!cache_file_set)
+			target->cache_file = conf_from_file.cache_file;
+
+		if(target->cache_file != NULL)
+			printf("\tListings are served from a metadata cache saved to %s\n", target->cache_file);
+
+		if(!peers_set)
+			target->peers = conf_from_file.peers;
+		if(!offload_depth_set)
+			target->offload_depth = conf_from_file.offload_depth != 0 ? conf_from_file.offload_depth : DEFAULT_OFFLOAD_DEPTH;
+
+		if(target->peers != NULL)
+			printf("\tRequests are offloaded to %s when %i connections wait for a listener\n", target->peers, target->offload_depth);
+
+		if(!local_socket_set)
+			target->local_socket = conf_from_file.local_socket;
+		else
+			free(conf_from_file.local_socket);
+
+		if(target->local_socket != NULL)
+			printf("\tClients of this host can hand over their files on %s\n", target->local_socket);
+
+		if(!drop_folders_set)
+			target->drop_folders = conf_from_file.drop_folders;
+		else
+			free(conf_from_file.drop_folders);
+
+		if(target->drop_folders != NULL)
+			printf("\tFiles written to %s are encrypted as they arrive\n", target->drop_folders);
+
+		printf("\tLimits: %i queued connections, %ld in-flight bytes, %i requests per client (0 means no limit)\n",
+			target->max_queued, target->max_inflight, target->max_per_client);
+
+		if(!total_rate_set)
+			target->total_rate = conf_from_file.total_rate;
+		if(!background_rate_set)
+			target->background_rate = conf_from_file.background_rate;
+		if(!job_rate_set)
+			target->job_rate = conf_from_file.job_rate;
+
+		printf("\tBandwidth: %ld bytes/s for the server, %ld for background jobs, %ld for every job (0 means no limit)\n",
+			target->total_rate, target->background_rate, target->job_rate);
 
 		printf("\n");
 	}
 	return 0;
 }
 
+/*
+* Function used by the client to put the options of a listing ("glob=*.txt", "sort=size"...) in a single string,
+* each one preceded by a space, so that they can follow the request.
+* RETURN VALUE:
+*	The string, "" if there are no options (NULL if there's no memory for it)
+*/
+char *join_listing_options(char *options[], int count) {
+
+	int length = 1;
+
+	for(int i=0; i<count; i++)
+		length += strlen(options[i]) + 1;
+
+	char *joined = (char *)malloc(length);
+
+	if(joined == NULL)
+		return NULL;
+
+	joined[0] = '\0';
+
+	for(int i=0; i<count; i++) {
+		strcat(joined, " ");
+		strcat(joined, options[i]);
+	}
+
+	return joined;
+}
+
+/*
+* Function used to read the action of the client and its arguments (e.g. "-e seed path"), as given on the
+* command line or on a line of a batch.
+* ARGUMENTS:
+*	-args:		the action and its arguments
+*	-count:		number of strings in args
+*	-target:	client_configuration where the action is saved
+* RETURN VALUE:
+*	On success 0 is returned, -1 if the action is not valid
+*/
+int client_parse_action(char *args[], int count, client_configuration *target) {
+
+	if(count >= 1 && (strcmp(args[0], "-l") == 0 || strcmp(args[0], "-R") == 0)) {
+		target->action	= strcmp(args[0], "-l") == 0 ? LIST_ACTION : LIST_REC_ACTION;
+		target->target	= join_listing_options(args + 1, count - 1);
+		if(target->target == NULL)
+			return -1;
+	}
+	else if(count == 3 && strcmp(args[0], "-e") == 0) {
+		target->action	= ENC_ACTION;
+		target->seed	= parse_int_unsigned(args[1]);
+		target->target	= args[2];
+	}
+	else if(count == 3 && strcmp(args[0], "-d") == 0) {
+		target->action	= DEC_ACTION;
+		target->seed	= parse_int_unsigned(args[1]);
+		target->target	= args[2];
+	}
+	else if(count == 3 && strcmp(args[0], "-E") == 0) {
+		target->action	= SUBMIT_ENC_ACTION;
+		target->seed	= parse_int_unsigned(args[1]);
+		target->target	= args[2];
+	}
+	else if(count == 3 && strcmp(args[0], "-D") == 0) {
+		target->action	= SUBMIT_DEC_ACTION;
+		target->seed	= parse_int_unsigned(args[1]);
+		target->target	= args[2];
+	}
+	else if(count == 2 && strcmp(args[0], "-s") == 0) {
+		target->action	= STATUS_ACTION;
+		target->job_id	= parse_int(args[1]);
+	}
+	else if(count == 2 && strcmp(args[0], "-w") == 0) {
+		target->action	= WAIT_ACTION;
+		target->job_id	= parse_int(args[1]);
+	}
+	else if(count == 2 && strcmp(args[0], "-x") == 0) {
+		target->action	= CANCEL_ACTION;
+		target->job_id	= parse_int(args[1]);
+	}
+	else if(count == 1 && strcmp(args[0], "-S") == 0) {
+		target->action	= STATS_ACTION;
+	}
+	else if(count == 2 && strcmp(args[0], "-g") == 0) {
+		target->action	= CHANGES_ACTION;
+		target->target	= args[1];
+	}
+	else if((count == 1 || count == 2) && strcmp(args[0], "-u") == 0) {
+		target->action	= USAGE_ACTION;
+		target->depth	= count == 2 ? parse_int(args[1]) : DEFAULT_USAGE_DEPTH;
+	}
+	else if(count >= 2 && (strcmp(args[0], "-a") == 0 || strcmp(args[0], "-A") == 0)) {
+		target->action	= strcmp(args[0], "-a") == 0 ? DIRECTORY_ENC_ACTION : DIRECTORY_DEC_ACTION;
+		target->seed	= parse_int_unsigned(args[1]);
+		target->target	= join_listing_options(args + 2, count - 2);
+		if(target->target == NULL)
+			return -1;
+	}
+	else if(count >= 2 && strcmp(args[0], "-r") == 0) {
+		target->action	= RESTORE_ACTION;
+		target->prefix	= args[1];
+		target->target	= join_listing_options(args + 2, count - 2);
+		if(target->target == NULL)
+			return -1;
+	}
+	else
+		return -1;
+
+	return 0;
+}
+
 int client_read_and_set_arguments(int argc, char* args[], client_configuration *target) {
 
-	if(argc < 2) {
-		printf("Usage method: \n\n\t%s server_address:port [-l | -R | -e seed path | -d seed path ]\n\n", args[0]);
+	if(argc < 3) {
+		printf(CLIENT_USAGE, args[0], args[0]);
 		exit(1);
 	}
 
-	char *fullstring = args[1];
-	char *tp_index = strchr(fullstring, ':');
+	//several servers sharing the same files can be given, separated by commas
+	char *server = args[1];
+	int no_servers = 1;
+
+	for(char *comma = strchr(server, ','); comma != NULL; comma = strchr(comma + 1, ','))
+		no_servers++;
 
-	if(tp_index == NULL) {
-		printf("\nError: %s is not a valid address!\n\nExpected format:\n\n\t address:port\n\n", fullstring);
+	target->addresses	= (char **)malloc(no_servers * sizeof(char *));
+	target->ports		= (int *)malloc(no_servers * sizeof(int));
+
+	if(target->addresses == NULL || target->ports == NULL || no_servers > CLIENT_MAX_SERVERS) {
+		printf("\nError: at most %i servers can be given!\n\n", CLIENT_MAX_SERVERS);
 		exit(1);
 	}
 
-	//split the string to identify address and port by replacing : with string termination character
-	*tp_index = '\0';
-	target->address = fullstring;
-	target->port = parse_int(tp_index+1);
+	while(server != NULL) {
 
-	printf("\tAddress chosen:\t%s\n\tPort chosen:\t%i\n\n", target->address, target->port);
-	
-	
-	int read_arguments = 2;
+		char *next = strchr(server, ',');
+		if(next != NULL)
+			*next++ = '\0';
 
-		if(argc == 3 && strcmp(args[read_arguments], "-l") == 0) {
-			target->action	= LIST_ACTION;
-		}
-		else if(argc == 3 && strcmp(args[read_arguments], "-R") == 0) {
-			target->action	= LIST_REC_ACTION;
-		}
-		else if(argc == 5 && strcmp(args[read_arguments], "-e") == 0) {
-			target->action	= ENC_ACTION;
-			target->seed	= parse_int_unsigned(args[read_arguments+1]);
-			target->target	= args[read_arguments+2];
+		char *tp_index = strchr(server, ':');
+
+		if(tp_index == NULL) {
+			printf("\nError: %s is not a valid address!\n\nExpected format:\n\n\t address:port\n\n", server);
+			exit(1);
 		}
-		else if(argc == 5 && strcmp(args[read_arguments], "-d") == 0) {
-			target->action	= DEC_ACTION;
-			target->seed	= parse_int_unsigned(args[read_arguments+1]);
-			target->target	= args[read_arguments+2];
+
+		//split the string to identify address and port by replacing : with string termination character
+		*tp_index = '\0';
+		target->addresses[target->no_servers]	= server;
+		target->ports[target->no_servers++]	= parse_int(tp_index+1);
+
+		server = next;
+	}
+
+	target->address	= target->addresses[0];
+	target->port	= target->ports[0];
+
+	//without -m the commands of a batch go to the least loaded server
+	target->shard_mode = SHARD_BY_BYTES;
+
+	int read_arguments = 2;
+
+	//the deadline, the background class, the sharding of batches and the local socket are optional and come before the action
+	while(argc - read_arguments > 2 && (strcmp(args[read_arguments], "-t") == 0 || strcmp(args[read_arguments], "-m") == 0 ||
+		strcmp(args[read_arguments], "-L") == 0 || strcmp(args[read_arguments], "-B") == 0)) {
+
+		//the only one without a value
+		if(strcmp(args[read_arguments], "-B") == 0) {
+			target->background = 1;
+			read_arguments++;
+			continue;
 		}
-		else {
-			printf("Usage method: \n\n\t%s server_address:port [-l | -R | -e seed path | -d seed path ]\n\n", args[0]);
+
+		if(strcmp(args[read_arguments], "-t") == 0)
+			target->deadline = parse_int(args[read_arguments+1]);
+		else if(strcmp(args[read_arguments], "-L") == 0)
+			target->local_socket = args[read_arguments+1];
+		else if(strcmp(args[read_arguments+1], "hash") == 0 || strcmp(args[read_arguments+1], "bytes") == 0)
+			target->shard_mode = strcmp(args[read_arguments+1], "hash") == 0 ? SHARD_BY_HASH : SHARD_BY_BYTES;
+		else
+			break;
+
+		read_arguments += 2;
+	}
+
+	int remaining = argc - read_arguments;
+
+	//commands of a batch are read from a file, or from stdin with "-"
+	if(remaining >= 2 && strcmp(args[read_arguments], "-b") == 0) {
+
+		target->batch		= args[read_arguments+1];
+		target->inflight	= DEFAULT_BATCH_INFLIGHT;
+		target->connections	= DEFAULT_BATCH_CONNECTIONS;
+
+		for(int i=read_arguments+2; i<argc; i+=2) {
+			if(i + 1 < argc && strcmp(args[i], "-j") == 0 && (target->inflight = parse_int(args[i+1])) > 0)
+				continue;
+			if(i + 1 < argc && strcmp(args[i], "-k") == 0 && (target->connections = parse_int(args[i+1])) > 0)
+				continue;
+			printf(CLIENT_USAGE, args[0], args[0]);
 			exit(1);
 		}
 
-	if (argc == 2) {
-		printf("Usage method: \n\n\t%s server_address:port [-l | -R | -e seed path | -d seed path ]\n\n", args[0]);
+		return 0;
+	}
+
+	if(client_parse_action(args + read_arguments, remaining, target) < 0) {
+		printf(CLIENT_USAGE, args[0], args[0]);
 		exit(1);
 	}
 
+	//directory jobs and restores are run as batches
+	target->inflight	= DEFAULT_BATCH_INFLIGHT;
+	target->connections	= DEFAULT_BATCH_CONNECTIONS;
+
 	return 0;
 }
 
 
 /*
-* Function used by the client to handle a request given by a client_configuration
+* Function used to free what parse_client_command allocated for a client_configuration.
 */
-int client_handle_command(client_configuration *target, io_interface *server) {
-
-	char *message = malloc(SOCK_PACKET_SIZE);
+void free_client_command(client_configuration *target) {
 
-	switch(target->action) {
+	//listing options are joined in a new string
+	if(target->action == LIST_ACTION || target->action == LIST_REC_ACTION || target->action == DIRECTORY_ENC_ACTION || target->action == DIRECTORY_DEC_ACTION ||
+	   target->action == RESTORE_ACTION)
+		free(target->target);
 
-		case LIST_ACTION:
-			write_string_to_socket(LSTF_REQ, server);
-			break;
-		case LIST_REC_ACTION:
-			write_string_to_socket(LSTR_REQ, server);
-			break;
-		case ENC_ACTION:
-			sprintf(message, "%s %i %s", ENCR_REQ, target->seed, target->target);
-			write_string_to_socket(message, server);
-			break;
-		case DEC_ACTION:
-			sprintf(message, "%s %i %s", DECR_REQ, target->seed, target->target);
-			write_string_to_socket(message, server);
-			break;
-		default:
-			printf("Selected action not recognized!\nApplication will now close...\n\n");
-			exit(0);
+	target->action = 0;
+}
 
 
-	}
+/*
+* Function used to skip the options which can come before the action of a command: "-t ms" and "-B", in any order.
+* ARGUMENTS:
+*	-args, count:	words of the command
+*	-target:	client_configuration where the options are saved, NULL to only skip them
+* RETURN VALUE:
+*	The index of the first word of the action
+*/
+int parse_command_options(char **args, int count, client_configuration *target) {
+
+	int first = 0;
+
+	while(1) {
+
+		if(count >= first + 2 && strcmp(args[first], "-t") == 0) {
+			if(target != NULL)
+				target->deadline = parse_int(args[first + 1]);
+			first += 2;
+		}
+		else if(count >= first + 1 && strcmp(args[first], "-B") == 0) {
+			if(target != NULL)
+				target->background = 1;
+			first++;
+		}
+		else
+			return first;
+	}
+}
+
+
+/*
+* Function used to read a command written like the arguments of the client ("-e 1234 my file.txt", "-t 500 -S", "-B -e 1 file"...),
+* for batches and the client library. The path of an encryption is the rest of the line, so that it can contain
+* spaces. The command is split in words in place: the strings of target point inside it.
+* ARGUMENTS:
+*	-command:	the command, modified while parsing it
+*	-target:	client_configuration where the action is saved, its deadline is changed only if "-t ms" is given
+*			and its class only if "-B" is
+* RETURN VALUE:
+*	On success 0 is returned (free_client_command must be called), -1 if the command is not valid
+*/
+int parse_client_command(char *command, client_configuration *target) {
+
+	char *args[CLIENT_MAX_ARGS];
+	int count = 0;
+	int first = 0;
+
+	while(*command != '\0' && count < CLIENT_MAX_ARGS) {
+
+		while(*command == ' ' || *command == '\t')
+			command++;
+
+		if(*command == '\0')
+			break;
+
+		//like on the command line, a deadline and the class can come before the action
+		first = parse_command_options(args, count, NULL);
+
+		if(count == first + 2 && strlen(args[first]) == 2 && strchr("edED", args[first][1]) != NULL) {
+			args[count++] = command;
+			break;
+		}
+
+		args[count++] = command;
+
+		while(*command != '\0' && *command != ' ' && *command != '\t')
+			command++;
+
+		if(*command != '\0')
+			*command++ = '\0';
+	}
+
+	if(count == CLIENT_MAX_ARGS)
+		return -1;
+
+	first = parse_command_options(args, count, target);
+
+	if(client_parse_action(args + first, count - first, target) < 0)
+		return -1;
+
+	//directory jobs are batches themselves, they can only be given on the command line
+	if(target->action == DIRECTORY_ENC_ACTION || target->action == DIRECTORY_DEC_ACTION || target->action == RESTORE_ACTION) {
+		free_client_command(target);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used by the client to ask the server to switch to the v2 protocol. Servers which don't know PROTO_REQ
+* answer with something different from PROTO_MSG: in that case the connection can't be used anymore and
+* the client must connect again and speak v1. Servers which can send binary listings answer PROTOCOL_V3, those which
+* can also compress them PROTOCOL_V4.
+* RETURN VALUE:
+*	PROTOCOL_V4, PROTOCOL_V3 or PROTOCOL_V2 if the server accepted the switch, PROTOCOL_V1 otherwise (-1 if the connection
+*	is broken, or if the server is overloaded: *retry_after is then set to the seconds to wait)
+*/
+int client_negotiate_protocol(io_interface *server, int *retry_after) {
+
+	char message[32];
+	int response;
+	int version;
+
+	snprintf(message, sizeof(message), "%s %i frames", PROTO_REQ, PROTOCOL_V4);
+
+	if(write_string_to_socket(message, server) < 0)
+		return -1;
+
+	if(read_int_from_socket(&response, server) < 0)
+		return PROTOCOL_V1;
+
+	//the connection was refused before the request was even read
+	if(response == OVERLOAD_MSG) {
+		if(read_int_from_socket(retry_after, server) < 0 || *retry_after < 1)
+			*retry_after = 1;
+		return -1;
+	}
+
+	if(response != PROTO_MSG)
+		return PROTOCOL_V1;
+
+	if(read_int_from_socket(&version, server) < 0)
+		return -1;
+
+	return version >= PROTOCOL_V2 && version <= PROTOCOL_V4 ? version : PROTOCOL_V1;
+}
+
+
+/*
+* Function used by the client to write the request of a client_configuration.
+* ARGUMENTS:
+*	-target:	the client_configuration with the action
+*	-message:	buffer of SOCK_PACKET_SIZE bytes where the request is written
+*	-binary:	set to ask for a binary listing
+* RETURN VALUE:
+*	On success 0 is returned, -1 if the action is not known
+*/
+int format_client_command(client_configuration *target, char *message, int binary) {
+
+	int offset = 0;
+
+	//compressed frames are expanded as they arrive, the options given by the user come after and can turn it off
+	char *options = target->compressed_listings ? (binary ? " format=bin compress=lz" : " compress=lz") : (binary ? " format=bin" : "");
+
+	//the server drops the request if it can't be done in time
+	if(target->deadline > 0)
+		offset = snprintf(message + offset, SOCK_PACKET_SIZE - offset, "%s %i ", TIME_REQ, target->deadline);
+
+	//the server paces the encryptions of the background class and lowers the priority of their I/O
+	if(target->background && (target->action == ENC_ACTION || target->action == DEC_ACTION || target->action == SUBMIT_ENC_ACTION ||
+		target->action == SUBMIT_DEC_ACTION))
+		offset += snprintf(message + offset, SOCK_PACKET_SIZE - offset, "%s ", BGND_REQ);
+
+	switch(target->action) {
+
+		case LIST_ACTION:
+			snprintf(message + offset, SOCK_PACKET_SIZE - offset, "%s%s%s", LSTF_REQ, options, target->target);
+			break;
+		case LIST_REC_ACTION:
+			snprintf(message + offset, SOCK_PACKET_SIZE - offset, "%s%s%s", LSTR_REQ, options, target->target);
+			break;
+		case ENC_ACTION:
+			snprintf(message + offset, SOCK_PACKET_SIZE - offset, "%s %u %s", ENCR_REQ, target->seed, target->target);
+			break;
+		case DEC_ACTION:
+			snprintf(message + offset, SOCK_PACKET_SIZE - offset, "%s %u %s", DECR_REQ, target->seed, target->target);
+			break;
+		case SUBMIT_ENC_ACTION:
+			snprintf(message + offset, SOCK_PACKET_SIZE - offset, "%s %s %u %s", SUBM_REQ, ENCR_REQ, target->seed, target->target);
+			break;
+		case SUBMIT_DEC_ACTION:
+			snprintf(message + offset, SOCK_PACKET_SIZE - offset, "%s %s %u %s", SUBM_REQ, DECR_REQ, target->seed, target->target);
+			break;
+		case STATUS_ACTION:
+			snprintf(message + offset, SOCK_PACKET_SIZE - offset, "%s %i", STAT_REQ, target->job_id);
+			break;
+		case WAIT_ACTION:
+			snprintf(message + offset, SOCK_PACKET_SIZE - offset, "%s %i", WAIT_REQ, target->job_id);
+			break;
+		case CANCEL_ACTION:
+			snprintf(message + offset, SOCK_PACKET_SIZE - offset, "%s %i", CANC_REQ, target->job_id);
+			break;
+		case STATS_ACTION:
+			snprintf(message + offset, SOCK_PACKET_SIZE - offset, "%s", STAT_REQ);
+			break;
+		case CHANGES_ACTION:
+			snprintf(message + offset, SOCK_PACKET_SIZE - offset, "%s %s", CHNG_REQ, target->target);
+			break;
+		case USAGE_ACTION:
+			snprintf(message + offset, SOCK_PACKET_SIZE - offset, "%s %i", DU_REQ, target->depth);
+			break;
+		default:
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used by the client to name the output of an ENCR or a DECR executed through the local socket like the
+* server would: path_enc once encrypted, path without ENCR_EXT once decrypted.
+* ARGUMENTS:
+*	-target:	the command
+*	-dest:		buffer of MAX_PATH_LENGTH + sizeof(ENCR_EXT) bytes where the name is saved
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int local_output_name(client_configuration *target, char *dest) {
+
+	int length = strlen(target->target);
+
+	if(length >= MAX_PATH_LENGTH)
+		return -1;
+
+	strcpy(dest, target->target);
+
+	if(target->action == ENC_ACTION)
+		strcat(dest, ENCR_EXT);
+	else
+		dest[length - strlen(ENCR_EXT)] = '\0';
+
+	return 0;
+}
+
+
+/*
+* Function used by the client to handle a request given by a client_configuration
+*/
+int client_handle_command(client_configuration *target, io_interface *server) {
+
+	char *message = malloc(SOCK_PACKET_SIZE);
+
+	//listings are decoded here, unless the text format was asked explicitly (the generation line is text only)
+	int binary = target->binary_listings && (target->action == LIST_ACTION || target->action == LIST_REC_ACTION) &&
+		strstr(target->target, "format=text") == NULL && strstr(target->target, "token=yes") == NULL;
+
+	if(format_client_command(target, message, binary) < 0) {
+		printf("Selected action not recognized!\nApplication will now close...\n\n");
+		exit(0);
+	}
+
+	int response = 0;
+	int hint = 0;
+
+	//the server encrypts the open file into an output created here, then the one which isn't wanted is deleted
+	if(target->protocol == PROTOCOL_LOCAL) {
+
+		char name[MAX_PATH_LENGTH + sizeof(ENCR_EXT)];
+		io_interface file;
+		io_interface output;
+
+		if(local_output_name(target, name) < 0 || open_file(target->target, &file) < 0) {
+			printf("The file %s could not be opened, please check it exists and can be written...\n\nApplication will now close...\n\n", target->target);
+			free(message);
+			return -1;
+		}
+
+		//a file which is already there is never overwritten
+		if(create_new_file(name, &output) < 0) {
+			printf("The file %s could not be created, please check it doesn't exist already...\n\nApplication will now close...\n\n", name);
+			close_interface(&file);
+			free(message);
+			return -1;
+		}
+
+		write_file_to_socket(message, &file, &output, server);
+		close_interface(&file);
+		close_interface(&output);
+
+		read_int_from_socket(&response, server);
+		if(response == OVERLOAD_MSG)
+			read_int_from_socket(&hint, server);
+
+		if(response != FIN_MSG)
+			delete_file(name);
+		else if(delete_file(target->target) < 0)
+			printf("The file was encrypted to %s, but %s could not be deleted!\n\n", name, target->target);
+	}
+	else if(target->protocol == PROTOCOL_V1) {
+		write_string_to_socket(message, server);
+		read_int_from_socket(&response, server);
+		if(response == OVERLOAD_MSG)
+			read_int_from_socket(&hint, server);
+	}
+	else {
+		frame_header header;
+		int32_t status[2];
+
+		write_frame_to_socket(FRAME_CMD, 0, message, strlen(message), server);
+
+		if(read_frame_from_socket(&header, (char *)status, sizeof(status), server) == 0 && header.type == FRAME_STATUS) {
+			response = ntohl(status[0]);
+			if(header.length == sizeof(status))
+				hint = ntohl(status[1]);
+		}
+	}
+	
+	switch(response) {
+		case FIN_MSG:
+			printf("Command sent and correctly executed!\n\nApplication will now close, have a good day!\n\n");
+			if(target->action == ENC_ACTION)
+				log_action(target->seed, target->target);
+			break;
+		case MORE_MSG:
+			//jobs are answered with a single status line: id, state, processed bytes, total bytes, bytes per second.
+			//Statistics of the server are "name value" lines, changes are a generation line and "kind size path" lines,
+			//disk usage is a "size files path" line for every directory
+			if(target->action >= SUBMIT_ENC_ACTION) {
+				if(target->action == SUBMIT_ENC_ACTION)
+					log_action(target->seed, target->target);
+				if(print_body_from_socket(server, target->protocol) < 0)
+					printf("Connection aborted from server. Message received may be incomplete...\n");
+				break;
+			}
+			printf("Action sent and correctly received!\nReceiving message from server...\n\n");
+			//send_ack(server);
+			if ((binary ? receive_binary_listing(server, target->action == LIST_REC_ACTION) : LST_receive(server, target->protocol)) < 0) {
+				printf("Connection aborted from server. Message received may be incomplete...\n");
+			}
+			break;
+		case ERR_MSG:
+			printf("Action sent but something went wrong on the server-side.\nPlease check if the given command is correct and then retry...\n\n");
+			break;
+		case BUSY_MSG:
+			printf("Action sent but not executed: the file you have chosen to encrypt is currently being used by someone else...\n\nApplication will now close, have a good day!\n\n");
+			break;
+		case OVERLOAD_MSG:
+			printf("Action sent but not executed: the server is overloaded, please retry in %i seconds...\n\nApplication will now close, have a good day!\n\n", hint);
+			break;
+		case TIMEOUT_MSG:
+			printf("Action sent but not executed in time: the server dropped it and the file was left untouched...\n\nApplication will now close, have a good day!\n\n");
+			break;
+		case NOT_MODIFIED_MSG:
+			printf("Nothing changed since generation %s\n\nApplication will now close, have a good day!\n\n", target->target);
+			break;
+		default:
+			printf("The server responded with an uknown message response: %i\nServer are you ok?\n\nApplication will now close, have a good day!\n\n", response);
+	}
+
+	//tell the server that this connection won't send anything else
+	if(target->protocol == PROTOCOL_V2)
+		write_frame_to_socket(FRAME_END, 0, NULL, 0, server);
+
+	free(message);
+	return 0;
+}
+
+
+/*
+* Function used by batches and the client library to read the answer to a command which was just sent. The body
+* of MORE_MSG answers is given to consume as it arrives: frames are expanded and the FINISH_MESSAGE of v1
+* servers is removed.
+* ARGUMENTS:
+*	-target:	the command, its protocol is the one of the connection
+*	-server:	the connection the command was sent to
+*	-frame:		buffer of FRAME_BUFFER_SIZE bytes
+*	-expanded:	buffer for compressed frames (see read_data_frame_from_socket), the caller frees it
+*	-consume:	function which receives every part of the body with param, it returns -1 to stop reading
+*	-response:	where the status of the answer is saved
+*	-hint:		where the integer sent after the status is saved (e.g. seconds to wait with OVERLOAD_MSG), 0 if none
+* RETURN VALUE:
+*	0 if the whole answer arrived, -1 if the connection broke (or consume failed) before
+*/
+int read_client_answer(client_configuration *target, io_interface *server, char *frame, char **expanded, int (*consume)(void *param, char *source, int length), void *param, int *response, int *hint) {
+
+	*hint = 0;
+
+	if(target->protocol == PROTOCOL_V1) {
+
+		int finish = strlen(FINISH_MESSAGE);
+		int kept = 0;
+		int result;
+
+		if(read_int_from_socket(response, server) < 0)
+			return -1;
+
+		if(*response == OVERLOAD_MSG)
+			read_int_from_socket(hint, server);
+
+		if(*response != MORE_MSG)
+			return 0;
+
+		//v1 servers close the connection after the body, its last bytes are kept until then
+		while((result = read_some_from_socket(frame + kept, FRAME_BUFFER_SIZE - kept, server)) > 0) {
+
+			int length = kept + result;
+
+			kept = length < finish ? length : finish;
+
+			if(length > kept && consume(param, frame, length - kept) < 0)
+				return -1;
+
+			memmove(frame, frame + length - kept, kept);
+		}
+
+		return result == 0 && kept == finish && memcmp(frame, FINISH_MESSAGE, finish) == 0 ? 0 : -1;
+	}
+
+	frame_header header;
+	int32_t status[2];
+	char *payload;
+	int result;
+
+	if(read_frame_from_socket(&header, (char *)status, sizeof(status), server) < 0 || header.type != FRAME_STATUS || header.length < (int)sizeof(int32_t))
+		return -1;
+
+	*response = ntohl(status[0]);
+	if(header.length == sizeof(status))
+		*hint = ntohl(status[1]);
+
+	if(*response != MORE_MSG)
+		return 0;
+
+	while((result = read_data_frame_from_socket(&header, frame, expanded, &payload, server)) == 0 && header.type != FRAME_END) {
+		if(header.type == FRAME_DATA && consume(param, payload, header.length) < 0)
+			return -1;
+	}
+
+	return result;
+}
+
+
+/*
+* Function used to split a "VERB seed path" request in its parts. The request is modified while parsing it.
+* RETURN VALUE:
+*	On success 0 is returned and verb, seed and path are correctly set, otherwise -1
+*/
+int parse_request(char *received, char **verb, unsigned int *seed, char **path) {
+
+	char *sp1 = strchr(received, ' ');
+	if(sp1 == NULL)
+		return -1;
+
+	char *sp2 = strchr(sp1 + 1, ' ');
+	if(sp2 == NULL)
+		return -1;
+
+	*sp1 = '\0';
+	*sp2 = '\0';
+
+	*verb	= received;
+	*seed	= parse_int_unsigned(sp1 + 1);
+	*path	= sp2 + 1;
+
+	return 0;
+}
+
+
+/*
+* Function used to find the action (ENCR or DECR) of a request verb.
+* RETURN VALUE:
+*	The action of the verb, NULL if it's not recognized
+*/
+job_action find_action(char *verb) {
+
+	if(strcmp(ENCR_REQ, verb) == 0)
+		return ENCR;
+	if(strcmp(DECR_REQ, verb) == 0)
+		return DECR;
+	return NULL;
+}
+
+
+/*
+* Function used to resolve the path of a request against the working directory of the listeners.
+* ARGUMENTS:
+*	-conf:		listener_job of the thread which is serving the request
+*	-path:		path received with the request, relative paths are resolved
+*	-dest:		buffer of at least MAX_PATH_LENGTH * 2 bytes where the absolute path is saved
+*/
+void resolve_request_path(listener_job *conf, char *path, char *dest) {
+
+	if(path[0] == '/' || path[0] == '\\' || (path[0] != '\0' && path[1] == ':')) {
+		snprintf(dest, MAX_PATH_LENGTH * 2, "%s", path);
+		return;
+	}
+
+	semaphore_wait(conf->sem);
+	snprintf(dest, MAX_PATH_LENGTH * 2, "%s/%s", conf->directory, path);
+	semaphore_signal(conf->sem);
+}
+
+
+/*
+* Functions used by a listener to take the metadata cache of the listeners while it lists from it,
+* so that it can't be stopped in the meantime. use_listing_cache returns NULL if there's no cache.
+*/
+metadata_cache *use_listing_cache(listener_job *conf) {
+
+	semaphore_wait(conf->sem);
+
+	metadata_cache *cache = conf->cache;
+	if(cache != NULL)
+		cache->users++;
+
+	semaphore_signal(conf->sem);
+
+	return cache;
+}
+
+void release_listing_cache(listener_job *conf, metadata_cache *cache) {
+
+	if(cache == NULL)
+		return;
+
+	semaphore_wait(conf->sem);
+
+	cache->users--;
+	if(cache->users == 0 && cache->retiring)
+		semaphore_signal(&cache->idle);
+
+	semaphore_signal(conf->sem);
+}
+
+
+/*
+* Function used to change the metadata cache of the listeners. The old one is returned once no listing
+* uses it anymore, so that it can be stopped.
+* ARGUMENTS:
+*	-conf:		listener_job of the listeners
+*	-cache:		the new cache, NULL to read the disk for every listing
+* RETURN VALUE:
+*	The old cache, NULL if there was none
+*/
+metadata_cache *set_listing_cache(listener_job *conf, metadata_cache *cache) {
+
+	semaphore_wait(conf->sem);
+
+	metadata_cache *old = conf->cache;
+	conf->cache = cache;
+
+	if(old == NULL || old->users == 0) {
+		semaphore_signal(conf->sem);
+		return old;
+	}
+
+	old->retiring = 1;
+
+	semaphore_signal(conf->sem);
+	semaphore_wait(&old->idle);
+
+	return old;
+}
+
+
+/*
+* Function used to change the working directory of the listeners. Requests already started keep the old one.
+* ARGUMENTS:
+*	-conf:		listener_job of the listeners
+*	-directory:	the new directory, relative paths are resolved against the current working directory
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1 and the directory is not changed
+*/
+int set_listener_directory(listener_job *conf, char *directory) {
+
+	char *full_path = malloc(MAX_PATH_LENGTH);
+
+	if(full_path == NULL)
+		return -1;
+
+	if(chdir(directory) < 0 || getcwd(full_path, MAX_PATH_LENGTH) == 0) {
+		free(full_path);
+		return -1;
+	}
+
+	semaphore_wait(conf->sem);
+	strcpy(conf->directory, full_path);
+	semaphore_signal(conf->sem);
+
+	free(full_path);
+
+	return 0;
+}
+
+
+/*
+* Function used before decrypting the file of a request: its decrypted copy must not be encrypted again if it's
+* written to a drop folder (see spare_drop_file).
+*/
+void spare_decrypted_file(listener_job *conf, job_action action, char *full_path) {
+
+	if(action != DECR)
+		return;
+
+	semaphore_wait(conf->sem);
+	drop_box *drops = conf->drops;
+	semaphore_signal(conf->sem);
+
+	if(drops != NULL)
+		spare_drop_file(drops, full_path);
+}
+
+
+/*
+* Function used to create the job of an ENCR or DECR request. The job is sent to the bulk lane if its
+* target is bigger than bulk_limit, to the small one otherwise.
+* RETURN VALUE:
+*	The new job, NULL if it could not be created
+*/
+job *create_request_job(job_action action, unsigned int seed, char *path, out_stream *out, listener_job *conf) {
+
+	//jobs may run after the working directory changed, save the absolute path of the target
+	char *full_path = malloc(MAX_PATH_LENGTH * 2);
+	if(full_path == NULL)
+		return NULL;
+
+	resolve_request_path(conf, path, full_path);
+
+	job *new_job = create_job(action, seed, full_path);
+
+	free(full_path);
+
+	if(new_job == NULL)
+		return NULL;
+
+	new_job->cost = file_size(new_job->path);
+	new_job->lane = new_job->cost > conf->bulk_limit ? JOB_LANE_BULK : JOB_LANE_SMALL;
+	new_job->control.throttle = conf->throttle;
+	peer_address(out->target, new_job->client, ADDRESS_LENGTH);
+
+	spare_decrypted_file(conf, action, new_job->path);
+
+	return new_job;
+}
+
+
+/*
+* Function used to translate the final state of a job in the message which answers its request.
+*/
+int job_message(int state) {
+
+	switch(state) {
+		case JOB_DONE:	return FIN_MSG;
+		case JOB_BUSY:	return BUSY_MSG;
+		case JOB_EXPIRED:	return TIMEOUT_MSG;
+	}
+	return ERR_MSG;
+}
+
+
+/*
+* Function called by a job worker when a job which took the connection of a request is finished:
+* the client is answered, then the connection is closed (v1) or given back to the listeners (v2).
+*/
+void reply_to_request(job_table *table, job *target) {
+
+	out_stream out;
+	out.target	= &target->reply_to;
+	out.protocol	= target->reply_protocol;
+	out.sink	= NULL;
+	out.batch	= NULL;
+
+	//the event loop sends the answer and keeps the connection
+	if(target->reply_owner != NULL) {
+		out.sink	= connection_sink;
+		out.sink_param	= target->reply_owner;
+
+		stream_status(&out, job_message(target->state));
+		finish_connection((struct connection *)target->reply_owner);
+		return;
+	}
+
+	stream_status(&out, job_message(target->state));
+
+	if(target->reply_protocol == PROTOCOL_V2) {
+
+		int given_back = 0;
+
+		//on_reply_param is cleared under the mutex of the table before listeners are stopped
+		semaphore_wait(&table->sem);
+
+		listener_job *listeners = (listener_job *)table->on_reply_param;
+		io_interface_node *temp;
+
+		if(listeners != NULL && (temp = malloc(sizeof(io_interface_node))) != NULL) {
+
+			temp->current	= target->reply_to;
+			temp->protocol	= PROTOCOL_V2;
+			temp->conn	= NULL;
+
+			semaphore_wait(listeners->sem);
+			enqueue(listeners->queue, temp);
+			semaphore_signal(listeners->sem);
+			semaphore_signal(listeners->rr);
+
+			given_back = 1;
+		}
+
+		semaphore_signal(&table->sem);
+
+		if(given_back)
+			return;
+	}
+
+	close_socket(&target->reply_to);
+}
+
+
+/*
+* Function used by the server to answer a STAT request without a job id, with MORE_MSG followed by
+* a "name<TAB>value" line for every statistic of the server.
+*/
+void execute_stats_request(out_stream *out, listener_job *conf) {
+
+	char lines[STATS_LENGTH];
+	int length;
+
+	semaphore_wait(conf->sem);
+
+	length = snprintf(lines, STATS_LENGTH,
+		"listeners\t%i\r\nbusy\t%i\r\nqueued\t%i\r\nconnections\t%ld\r\n"
+		"expired_read\t%ld\r\nexpired_write\t%ld\r\nexpired_total\t%ld\r\noffloaded\t%ld\r\nlocal\t%ld\r\n",
+		active_threads(&conf->listeners), conf->busy, conf->queue->length, conf->stats.connections,
+		conf->stats.expired_read, conf->stats.expired_write, conf->stats.expired_total, conf->peers.offloaded, conf->stats.local);
+
+	semaphore_signal(conf->sem);
+
+	semaphore_wait(&conf->limits->sem);
+
+	length += snprintf(lines + length, STATS_LENGTH - length, "rejected\t%ld\r\ninflight_bytes\t%ld\r\n",
+		conf->limits->rejected, conf->limits->inflight);
+
+	semaphore_signal(&conf->limits->sem);
+
+	semaphore_wait(conf->sem);
+	drop_box *drops = conf->drops;
+	semaphore_signal(conf->sem);
+
+	if(drops != NULL) {
+
+		semaphore_wait(&drops->sem);
+
+		length += snprintf(lines + length, STATS_LENGTH - length, "dropped\t%ld\r\ndrop_failed\t%ld\r\ndrop_waiting\t%d\r\ndrop_inflight\t%d\r\n",
+			drops->encrypted, drops->failed, drops->waiting, drops->inflight);
+
+		semaphore_signal(&drops->sem);
+	}
+
+	if(conf->throttle != NULL) {
+
+		semaphore_wait(&conf->throttle->sem);
+
+		length += snprintf(lines + length, STATS_LENGTH - length, "rate_total\t%ld\r\nrate_background\t%ld\r\nrate_job\t%ld\r\n",
+			conf->throttle->total.rate, conf->throttle->background.rate, conf->throttle->job_rate);
+
+		semaphore_signal(&conf->throttle->sem);
+	}
+
+	stream_status(out, MORE_MSG);
+	stream_write(out, lines, length);
+	stream_finish(out);
+}
+
+
+/*
+* Function used by the server to answer a CHNG request from the metadata cache: NOT_MODIFIED_MSG if nothing changed
+* since the token, otherwise MORE_MSG followed by the changes (see list_changes_from_cache). Without a cache ERR_MSG
+* is sent, while the cache is being filled OVERLOAD_MSG asks the client to retry.
+*/
+void execute_changes_request(char *token, out_stream *out, listener_job *conf, char *client) {
+
+	int retry_after;
+
+	if(admit_request(conf->limits, client, 0, &retry_after) < 0) {
+		stream_status_hint(out, OVERLOAD_MSG, retry_after);
+		return;
+	}
+
+	metadata_cache *cache = use_listing_cache(conf);
+	int changed = cache != NULL ? changed_since(cache, token) : -1;
+
+	if(cache == NULL)
+		stream_status(out, ERR_MSG);
+	else if(changed < 0)
+		stream_status_hint(out, OVERLOAD_MSG, CHANGES_RETRY);
+	else if(changed == 0)
+		stream_status(out, NOT_MODIFIED_MSG);
+	else {
+		char *batch = acquire_buffer(conf->buffers);
+
+		stream_status(out, MORE_MSG);
+		stream_start_batch(out, batch, FRAME_BUFFER_SIZE);
+
+		list_changes_from_cache(cache, out, token);
+
+		stream_end_batch(out);
+
+		if(batch != NULL)
+			release_buffer(conf->buffers, batch);
+	}
+
+	release_listing_cache(conf, cache);
+
+	release_request(conf->limits, client, 0, 0);
+}
+
+
+/*
+* Function used by the server to answer a DU request: MORE_MSG followed by the size and the files of every
+* directory down to depth (see finish_usage_query). The totals are computed from the metadata cache when it's
+* ready, otherwise the tree is walked like LSTR does, with several threads.
+*/
+void execute_usage_request(int depth, out_stream *out, listener_job *conf, char *client) {
+
+	int retry_after;
+	usage_query query;
+
+	if(depth < 0 || start_usage_query(&query, depth) < 0) {
+		stream_status(out, ERR_MSG);
+		return;
+	}
+
+	if(admit_request(conf->limits, client, 0, &retry_after) < 0) {
+		free_usage_query(&query);
+		stream_status_hint(out, OVERLOAD_MSG, retry_after);
+		return;
+	}
+
+	char *directory = malloc(MAX_PATH_LENGTH * 2);
+
+	if(directory == NULL) {
+		free_usage_query(&query);
+		release_request(conf->limits, client, 0, 0);
+		stream_status(out, ERR_MSG);
+		return;
+	}
+
+	resolve_request_path(conf, ".", directory);
+
+	char *batch = acquire_buffer(conf->buffers);
+
+	stream_status(out, MORE_MSG);
+	stream_start_batch(out, batch, FRAME_BUFFER_SIZE);
+
+	metadata_cache *cache = use_listing_cache(conf);
+
+	if(cache == NULL || list_from_cache(cache, out, 1, &query.filter, 0) < 0)
+		LSTR(directory, out, &query.filter);
+
+	release_listing_cache(conf, cache);
+
+	stream_end_batch(out);
+
+	if(batch != NULL)
+		release_buffer(conf->buffers, batch);
+
+	free(directory);
+	free_usage_query(&query);
+
+	release_request(conf->limits, client, 0, 0);
+}
+
+
+/*
+* Function used by the server to handle a request about jobs (SUBM, STAT, WAIT, CANC). Every one of them is
+* answered with MORE_MSG and the status line of the job (see format_job), or ERR_MSG if the job doesn't exist.
+* Submitted jobs expire at deadline (0 means never), they run in the background class if background is set.
+*/
+void execute_job_request(char *received, out_stream *out, listener_job *conf, long deadline, int background) {
+
+	char line[JOB_LINE_LENGTH];
+	int id;
+
+	if(strncmp(SUBM_REQ " ", received, strlen(SUBM_REQ) + 1) == 0) {
+
+		char *verb;
+		char *path;
+		unsigned int seed;
+		job_action action;
+
+		if(parse_request(received + strlen(SUBM_REQ) + 1, &verb, &seed, &path) < 0 || (action = find_action(verb)) == NULL) {
+			stream_status(out, ERR_MSG);
+			return;
+		}
+
+		job *new_job = create_request_job(action, seed, path, out, conf);
+		int retry_after;
+
+		if(new_job != NULL && admit_request(conf->limits, new_job->client, new_job->cost, &retry_after) < 0) {
+			free_job(new_job);
+			stream_status_hint(out, OVERLOAD_MSG, retry_after);
+			return;
+		}
+
+		if(new_job == NULL) {
+			stream_status(out, BUSY_MSG);
+			return;
+		}
+
+		char client[ADDRESS_LENGTH];
+		long cost = new_job->cost;
+
+		strcpy(client, new_job->client);
+
+		new_job->admitted		= 1;
+		new_job->control.deadline	= deadline;
+		new_job->control.background	= background;
+
+		//the job was freed, what it was admitted must be given back here
+		if((id = submit_job(conf->jobs, new_job)) < 0) {
+			release_request(conf->limits, client, cost, 0);
+			stream_status(out, BUSY_MSG);
+			return;
+		}
+	}
+	else
+		id = parse_int(received + strlen(STAT_REQ) + 1);
+
+	job *target = find_job(conf->jobs, id);
+
+	if(target == NULL) {
+		stream_status(out, ERR_MSG);
+		return;
+	}
+
+	if(strncmp(WAIT_REQ, received, strlen(WAIT_REQ)) == 0)
+		wait_job(conf->jobs, target);
+	else if(strncmp(CANC_REQ, received, strlen(CANC_REQ)) == 0)
+		cancel_job(conf->jobs, target);
+
+	int length = format_job(target, line, JOB_LINE_LENGTH);
+
+	release_job(conf->jobs, target);
+
+	stream_status(out, MORE_MSG);
+	stream_write(out, line, length);
+	stream_finish(out);
+}
+
+
+/*
+* Function used to change the peers of the listeners. The requests being offloaded keep the old ones.
+* ARGUMENTS:
+*	-conf:		listener_job of the listeners
+*	-peers:		"address:port[,address:port...]", NULL for none
+*	-depth:		connections waiting for a listener which make the server offload to its peers
+* RETURN VALUE:
+*	On success 0 is returned, -1 if a peer is not valid (the peers are not changed)
+*/
+int set_listener_peers(listener_job *conf, char *peers, int depth) {
+
+	peer_list parsed;
+	char *index = peers;
+
+	bzero(&parsed, sizeof(peer_list));
+
+	while(index != NULL && *index != '\0') {
+
+		char *next = strchr(index, ',');
+		char *colon = strchr(index, ':');
+		int length = next != NULL ? (int)(next - index) : (int)strlen(index);
+
+		if(parsed.count == MAX_PEERS || colon == NULL || (next != NULL && colon > next) || colon - index >= ADDRESS_LENGTH)
+			return -1;
+
+		snprintf(parsed.addresses[parsed.count], ADDRESS_LENGTH, "%.*s", (int)(colon - index), index);
+
+		if((parsed.ports[parsed.count++] = parse_int(colon + 1)) <= 0 || length == 0)
+			return -1;
+
+		index = next != NULL ? next + 1 : NULL;
+	}
+
+	semaphore_wait(conf->sem);
+
+	parsed.offloaded	= conf->peers.offloaded;
+	parsed.depth		= depth;
+	conf->peers		= parsed;
+
+	semaphore_signal(conf->sem);
+
+	return 0;
+}
+
+
+/*
+* Function used to execute an ENCR or a DECR on a peer when the server is overloaded: at least peers.depth connections
+* wait for a listener, or the target is big and every worker of the bulk lane is busy. Peers take turns, the first
+* one which takes the request executes it: those which can't be reached or are overloaded too are skipped, but once
+* the request was written it's never sent again (the peer may have executed it even if its answer was lost). Peers
+* are asked with PEER_REQ over a v1 connection, so that they never offload the request again.
+* ARGUMENTS:
+*	-conf:		listener_job of the thread which is executing the request
+*	-verb:		ENCR_REQ or DECR_REQ
+*	-seed:		seed of the request
+*	-path:		path of the request as the client sent it, peers resolve it against their own directory
+*	-size:		size of the target
+*	-deadline:	time (see current_time_ms) after which the client doesn't want the result anymore, 0 if none
+*	-background:	set if the request is in the background class, the peer keeps it there
+* RETURN VALUE:
+*	The status answered by the peer (ERR_MSG if its answer was lost), -1 if the request must be executed here
+*/
+int offload_request(listener_job *conf, char *verb, unsigned int seed, char *path, long size, long deadline, int background) {
+
+	char request[SOCK_PACKET_SIZE];
+	peer_list peers;
+
+	semaphore_wait(conf->sem);
+
+	int overloaded	= conf->peers.count > 0 && conf->queue->length >= conf->peers.depth;
+	peers		= conf->peers;
+
+	if(conf->peers.count > 0)
+		conf->peers.next = (conf->peers.next + 1) % conf->peers.count;
+
+	semaphore_signal(conf->sem);
+
+	if(peers.count == 0 || (!overloaded && (size <= conf->bulk_limit || lane_backlog(conf->jobs, JOB_LANE_BULK) == 0)))
+		return -1;
+
+	for(int i=0; i<peers.count; i++) {
+
+		int index = (peers.next + i) % peers.count;
+		int offset = 0;
+		int status = -1;
+		int hint;
+		io_interface peer;
+
+		//the peer must give up when the client does
+		if(deadline != 0) {
+
+			long left = deadline - current_time_ms();
 
-	int response;
-	read_int_from_socket(&response, server);
-	
-	switch(response) {
-		case FIN_MSG:
-			printf("Command sent and correctly executed!\n\nApplication will now close, have a good day!\n\n");
-			if(target->action == ENC_ACTION)
-				log_action(target->seed, target->target);
-			break;
-		case MORE_MSG:
-			printf("Action sent and correctly received!\nReceiving message from server...\n\n");
-			//send_ack(server);
-			if (LST_receive(server) < 0) {
-				printf("Connection aborted from server. Message received may be incomplete...\n");
-			}
-			break;
-		case ERR_MSG:
-			printf("Action sent but something went wrong on the server-side.\nPlease check if the given command is correct and then retry...\n\n");
-			break;
-		case BUSY_MSG:
-			printf("Action sent but not executed: the file you have chosen to encrypt is currently being used by someone else...\n\nApplication will now close, have a good day!\n\n");
-			break;
-		default:
-			printf("The server responded with an uknown message response: %i\nServer are you ok?\n\nApplication will now close, have a good day!\n\n", response);
+			if(left <= 0)
+				return TIMEOUT_MSG;
+
+			offset = snprintf(request, sizeof(request), "%s %ld ", TIME_REQ, left);
+		}
+
+		if(background)
+			offset += snprintf(request + offset, sizeof(request) - offset, "%s ", BGND_REQ);
+
+		snprintf(request + offset, sizeof(request) - offset, "%s %s %u %s", PEER_REQ, verb, seed, path);
+
+		if(connect_to_server_timeout(peers.addresses[index], peers.ports[index], PEER_CONNECT_TIMEOUT, &peer) < 0)
+			continue;
+
+		//the peer answers when the request is over, it gives up on its own when the deadline expires
+		set_socket_timeouts(&peer, deadline != 0 ? deadline - current_time_ms() + PEER_CONNECT_TIMEOUT : PEER_ANSWER_TIMEOUT, PEER_CONNECT_TIMEOUT);
+
+		if(write_string_to_socket(request, &peer) < 0) {
+			close_socket(&peer);
+			continue;
+		}
+
+		if(read_int_from_socket(&status, &peer) < 0 || status <= 0)
+			status = ERR_MSG;
+		else if(status == OVERLOAD_MSG)
+			read_int_from_socket(&hint, &peer);
+
+		close_socket(&peer);
+
+		if(status != OVERLOAD_MSG) {
+			semaphore_wait(conf->sem);
+			conf->peers.offloaded++;
+			semaphore_signal(conf->sem);
+			return status;
+		}
 	}
 
-	free(message);
-	return 0;
+	return -1;
 }
 
-void handle_requests(io_interface *target) {
 
-	char *received = malloc(SOCK_PACKET_SIZE);
+/*
+* Function used by the server to execute a single request, whatever the protocol used by the client is.
+* ARGUMENTS:
+*	-received:	the request string (e.g. "ENCR seed path"), it is modified while parsing it
+*	-out:		out_stream where the status and the result of the request are written
+*	-conf:		listener_job of the thread which is executing the request
+*	-arrived:	when the request arrived (see current_time_ms), deadlines given with TIME_REQ start from it
+* RETURN VALUE:
+*	REQUEST_HANDED_OFF if the connection now belongs to a job of the bulk lane, otherwise 0
+*/
+int execute_request(char *received, out_stream *out, listener_job *conf, long arrived) {
+
+	char client[ADDRESS_LENGTH];
+	int retry_after;
+	long deadline = 0;
+	int background = 0;
+	int from_peer = 0;
+
+	peer_address(out->target, client, ADDRESS_LENGTH);
+
+	if(strncmp(TIME_REQ " ", received, strlen(TIME_REQ) + 1) == 0) {
+
+		char *request = strchr(received + strlen(TIME_REQ) + 1, ' ');
+
+		if(request == NULL) {
+			stream_status(out, ERR_MSG);
+			return 0;
+		}
 
-	read_string_from_socket(received, target);
+		deadline = arrived + parse_int(received + strlen(TIME_REQ) + 1);
+		received = request + 1;
 
-	if(strcmp(LSTF_REQ, received) == 0) {
-		write_int_to_socket(MORE_MSG, target);
-		LSTF(".", target);
+		//the request waited too long in the queue, the client already gave up
+		if(current_time_ms() >= deadline) {
+			stream_status(out, TIMEOUT_MSG);
+			return 0;
+		}
 	}
 
-	else if(strcmp(LSTR_REQ, received) == 0) {
-		write_int_to_socket(MORE_MSG, target);
+	//the encryption is paced by the bandwidth of background jobs and its I/O gets the lowest priority
+	if(strncmp(BGND_REQ " ", received, strlen(BGND_REQ) + 1) == 0) {
+		received	+= strlen(BGND_REQ) + 1;
+		background	= 1;
+	}
 
-		//wait_for_ack(target);
-		LSTR(".", target);
+	if(strncmp(PEER_REQ " ", received, strlen(PEER_REQ) + 1) == 0) {
+		received	+= strlen(PEER_REQ) + 1;
+		from_peer	= 1;
 	}
 
-	else{
+	if((strncmp(LSTF_REQ, received, strlen(LSTF_REQ)) == 0 || strncmp(LSTR_REQ, received, strlen(LSTR_REQ)) == 0) &&
+		(received[strlen(LSTF_REQ)] == '\0' || received[strlen(LSTF_REQ)] == ' ')) {
+
+		int recursive = strncmp(LSTR_REQ, received, strlen(LSTR_REQ)) == 0;
+		listing_filter *filter = NULL;
+		listing_query query;
+
+		//filters, sorting and pages are applied while the directories are read
+		if(received[strlen(LSTF_REQ)] == ' ') {
+
+			if(parse_listing_query(&query, received + strlen(LSTF_REQ) + 1, recursive) < 0) {
+				stream_status(out, ERR_MSG);
+				return 0;
+			}
+
+			//binary listings could contain FINISH_MESSAGE and compressed ones are sent as flagged frames, they need frames
+			if((query.filter.format == LISTING_BINARY || query.compress) && out->protocol == PROTOCOL_V1) {
+				free_listing_query(&query);
+				stream_status(out, ERR_MSG);
+				return 0;
+			}
+
+			filter = &query.filter;
+		}
+
+		if(admit_request(conf->limits, client, 0, &retry_after) < 0) {
+			if(filter != NULL)
+				free_listing_query(&query);
+			stream_status_hint(out, OVERLOAD_MSG, retry_after);
+			return 0;
+		}
+
+		char *directory = malloc(MAX_PATH_LENGTH * 2);
+
+		if(directory == NULL) {
+			if(filter != NULL)
+				free_listing_query(&query);
+			release_request(conf->limits, client, 0, 0);
+			stream_status(out, ERR_MSG);
+			return 0;
+		}
+
+		resolve_request_path(conf, ".", directory);
+
+		//every line of a listing is small: collect them in a buffer of the pool and send them in big writes
+		char *batch = acquire_buffer(conf->buffers);
+
+		stream_status(out, MORE_MSG);
+		stream_start_batch(out, batch, FRAME_BUFFER_SIZE);
 
-		char *message		= received;
-		char *seed		= NULL;
-		char *path		= NULL;
+		if(filter != NULL && query.compress)
+			stream_compress_batch(out);
 
-		char *sp1 = strchr(received, ' ');
-		if(sp1 != NULL) {
-			*sp1 = '\0';
-			seed = sp1 + 1;
+		if(filter != NULL && filter->format == LISTING_BINARY) {
+			char header[16];
+			stream_write(out, header, format_listing_header(header, filter->fields));
 		}
-		char *sp2 = strchr(seed, ' ');
-		if(sp2 != NULL) {
-			*sp2 = '\0';
-			path = sp2 + 1;
+
+		//the cache answers at once when it's ready, otherwise the disk is read
+		metadata_cache *cache = use_listing_cache(conf);
+		int token = filter != NULL && query.token;
+
+		if(cache == NULL || list_from_cache(cache, out, recursive, filter, token) < 0) {
+
+			//only the cache keeps generations: "0" asks CHNG for a full listing
+			if(token)
+				stream_write(out, "generation\t0\r\n", strlen("generation\t0\r\n"));
+
+			if(recursive)
+				LSTR(directory, out, filter);
+			else
+				LSTF(directory, out, filter);
 		}
 
-		if(sp1 == NULL || sp2 == NULL)
+		release_listing_cache(conf, cache);
+
+		stream_end_batch(out);
+
+		if(batch != NULL)
+			release_buffer(conf->buffers, batch);
+
+		free(directory);
+
+		if(filter != NULL)
+			free_listing_query(&query);
+
+		release_request(conf->limits, client, 0, 0);
+	}
+
+	else if(strcmp(STAT_REQ, received) == 0) {
+		execute_stats_request(out, conf);
+	}
+
+	else if(strncmp(CHNG_REQ, received, strlen(CHNG_REQ)) == 0 && (received[strlen(CHNG_REQ)] == '\0' || received[strlen(CHNG_REQ)] == ' ')) {
+		execute_changes_request(received[strlen(CHNG_REQ)] == ' ' ? received + strlen(CHNG_REQ) + 1 : NULL, out, conf, client);
+	}
+
+	else if(strncmp(DU_REQ, received, strlen(DU_REQ)) == 0 && (received[strlen(DU_REQ)] == '\0' || received[strlen(DU_REQ)] == ' ')) {
+		execute_usage_request(received[strlen(DU_REQ)] == ' ' ? parse_int(received + strlen(DU_REQ) + 1) : DEFAULT_USAGE_DEPTH, out, conf, client);
+	}
+
+	else if(strncmp(SUBM_REQ " ", received, 5) == 0 || strncmp(STAT_REQ " ", received, 5) == 0 ||
+		strncmp(WAIT_REQ " ", received, 5) == 0 || strncmp(CANC_REQ " ", received, 5) == 0) {
+		execute_job_request(received, out, conf, deadline, background);
+	}
+
+	else{
+
+		char *verb;
+		char *path;
+		unsigned int seed;
+		job_action action = NULL;
+		int offloaded = -1;
+
+		int parsed	= parse_request(received, &verb, &seed, &path) == 0 && (action = find_action(verb)) != NULL;
+		long size	= parsed ? file_size(path) : -1;
+
+		if(!parsed) {
 			printf("A message was received but not recognized: \n\n\t%s\n\n", received);
-		else {
-			int result = 0;
+			stream_status(out, ERR_MSG);
+		}
+		//the peers answer for this server when it's overloaded, what they offload is executed here
+		else if(!from_peer && (offloaded = offload_request(conf, verb, seed, path, size, deadline, background)) > 0) {
+			stream_status(out, offloaded);
+		}
+		else if(admit_request(conf->limits, client, size, &retry_after) < 0) {
+			stream_status_hint(out, OVERLOAD_MSG, retry_after);
+		}
+		//big files would keep this listener busy for a long time: the bulk lane answers the client when it's done
+		else if(size > conf->bulk_limit) {
+
+			job *new_job = create_request_job(action, seed, path, out, conf);
+
+			if(new_job != NULL) {
+				new_job->reply		= 1;
+				new_job->reply_to	= *out->target;
+				new_job->reply_protocol	= out->protocol;
+				new_job->reply_owner	= out->sink != NULL ? out->sink_param : NULL;
+				new_job->admitted	= 1;
+				new_job->cost		= size;
+				new_job->control.deadline = deadline;
+				new_job->control.background = background;
+			}
 
-			if(result != -1) {
-				if(strcmp(ENCR_REQ, message) == 0)
-					result = ENCR(parse_int_unsigned(seed), path);
-				else if(strcmp(DECR_REQ, message) == 0)
-					result = DECR(parse_int_unsigned(seed), path);
+			if(new_job == NULL || submit_job(conf->jobs, new_job) < 0) {
+				release_request(conf->limits, client, size, 0);
+				stream_status(out, BUSY_MSG);
 			}
+			else
+				return REQUEST_HANDED_OFF;
+		}
+		else {
+			char *full_path = malloc(MAX_PATH_LENGTH * 2);
+			long started = current_time_ms();
+			int result = -1;
+			job_control control;
+
+			bzero(&control, sizeof(job_control));
+			control.deadline	= deadline;
+			control.throttle	= conf->throttle;
+			control.background	= background;
+
+			if(full_path != NULL) {
+				resolve_request_path(conf, path, full_path);
+				spare_decrypted_file(conf, action, full_path);
+				result = action(seed, full_path, &control);
+				free(full_path);
+			}
+
+			release_request(conf->limits, client, size, current_time_ms() - started);
 
 			if(result == 0)
-				write_int_to_socket(FIN_MSG, target);
-			else if(result == -1)
-				write_int_to_socket(ERR_MSG, target);
+				stream_status(out, FIN_MSG);
 			else if(result == -2)
-				write_int_to_socket(BUSY_MSG, target);
+				stream_status(out, BUSY_MSG);
+			else if(result == XOR_EXPIRED)
+				stream_status(out, TIMEOUT_MSG);
+			else
+				stream_status(out, ERR_MSG);
+
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used by the server to serve a connection which switched to the v2 protocol. Every CMD frame is
+* executed just like a v1 request and the connection is kept open until an END frame is received or it's closed.
+* ARGUMENTS:
+*	-target:	the connection to serve
+*	-buffer:	buffer of at least FRAME_BUFFER_SIZE+1 bytes used to receive the commands
+*	-conf:		listener_job of the thread which is serving the connection
+* RETURN VALUE:
+*	REQUEST_HANDED_OFF if the connection now belongs to a job, otherwise 0
+*/
+int handle_frames(io_interface *target, char *buffer, listener_job *conf) {
+
+	out_stream out;
+	out.target	= target;
+	out.protocol	= PROTOCOL_V2;
+	out.sink	= NULL;
+	out.batch	= NULL;
+
+	frame_header header;
+
+	while(read_frame_from_socket(&header, buffer, FRAME_BUFFER_SIZE, target) == 0) {
+
+		if(header.type == FRAME_END)
+			break;
+
+		if(header.type != FRAME_CMD) {
+			stream_status(&out, ERR_MSG);
+			continue;
+		}
+
+		buffer[header.length] = '\0';
+
+		if(execute_request(buffer, &out, conf, current_time_ms()) == REQUEST_HANDED_OFF)
+			return REQUEST_HANDED_OFF;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used by a listener to serve a connection of the local socket: the client hands over its open file and
+* the output file it created (path_enc, or path without ENCR_EXT) together with "ENCR seed path" or "DECR seed path"
+* (optionally preceded by "TIME ms" and "BGND"), the file is encrypted into the output and the status is answered like
+* a v1 request. The path only tells which file it is: it's never resolved, so neither the directory of the server nor
+* the peers are involved, and deleting the file which isn't wanted anymore is left to the client.
+* ARGUMENTS:
+*	-target:	the connection to serve
+*	-received:	buffer of at least SOCK_PACKET_SIZE bytes used to receive the request
+*	-conf:		listener_job of the thread
+*	-queued:	when the connection was queued
+* RETURN VALUE:
+*	Always 0, the connection can be closed
+*/
+int handle_local_request(io_interface *target, char *received, listener_job *conf, long queued) {
+
+	io_interface file;
+	io_interface output;
+	char *request;
+	char *verb;
+	char *path;
+	unsigned int seed;
+	long deadline = 0;
+	int background = 0;
+	int retry_after;
+
+	if(read_file_from_socket(received, &file, &output, target) < 0)
+		return 0;
+
+	request = received;
+
+	if(strncmp(TIME_REQ " ", request, strlen(TIME_REQ) + 1) == 0 && (request = strchr(received + strlen(TIME_REQ) + 1, ' ')) != NULL) {
+		deadline = queued + parse_int(received + strlen(TIME_REQ) + 1);
+		request++;
+	}
+
+	if(request != NULL && strncmp(BGND_REQ " ", request, strlen(BGND_REQ) + 1) == 0) {
+		request		+= strlen(BGND_REQ) + 1;
+		background	= 1;
+	}
+
+	long size = open_file_size(&file);
+
+	//only the encryptions carry files, the other requests go through the TCP socket
+	if(request == NULL || parse_request(request, &verb, &seed, &path) < 0 || (strcmp(verb, ENCR_REQ) != 0 && strcmp(verb, DECR_REQ) != 0) || size < 0) {
+		close_interface(&file);
+		close_interface(&output);
+		write_int_to_socket(ERR_MSG, target);
+		return 0;
+	}
+
+	if(admit_request(conf->limits, LOCAL_CLIENT, size, &retry_after) < 0) {
+		close_interface(&file);
+		close_interface(&output);
+		write_int_to_socket(OVERLOAD_MSG, target);
+		write_int_to_socket(retry_after, target);
+		return 0;
+	}
+
+	long started = current_time_ms();
+	job_control control;
+
+	bzero(&control, sizeof(job_control));
+	control.deadline	= deadline;
+	control.throttle	= conf->throttle;
+	control.background	= background;
+
+	//encrypting and decrypting are the same XOR, the verb only says which name the client gave the output
+	int result = XOR_open_file(seed, &file, &output, &control);
+
+	release_request(conf->limits, LOCAL_CLIENT, size, current_time_ms() - started);
+
+	semaphore_wait(conf->sem);
+	conf->stats.local++;
+	semaphore_signal(conf->sem);
+
+	if(result == 0)
+		write_int_to_socket(FIN_MSG, target);
+	else if(result == -2)
+		write_int_to_socket(BUSY_MSG, target);
+	else if(result == XOR_EXPIRED)
+		write_int_to_socket(TIMEOUT_MSG, target);
+	else
+		write_int_to_socket(ERR_MSG, target);
+
+	return 0;
+}
+
+
+/*
+* Function used by a listener to serve a connection taken from the queue.
+* ARGUMENTS:
+*	-target:	the connection to serve
+*	-protocol:	PROTOCOL_V1 for a new connection, PROTOCOL_V2 if it already switched to frames,
+*			PROTOCOL_LOCAL for a connection of the local socket
+*	-conf:		listener_job of the thread
+*	-queued:	when the connection was queued, a v1 client sends its request as soon as it connects
+* RETURN VALUE:
+*	REQUEST_HANDED_OFF if the connection now belongs to a job, otherwise 0
+*/
+int handle_requests(io_interface *target, int protocol, listener_job *conf, long queued) {
 
+	char *received = acquire_buffer(conf->buffers);
+	int result = 0;
+
+	if(received == NULL)
+		return 0;
+
+	if(protocol == PROTOCOL_V2)
+		result = handle_frames(target, received, conf);
+
+	else if(protocol == PROTOCOL_LOCAL)
+		result = handle_local_request(target, received, conf, queued);
+
+	else if(read_string_from_socket(received, target) < 0)
+		result = 0;
+
+	//a newer client is asking to switch protocol, answer with the version which will be used from now on
+	else if(strncmp(PROTO_REQ " ", received, strlen(PROTO_REQ) + 1) == 0) {
+
+		int version = parse_int(received + strlen(PROTO_REQ) + 1);
+
+		if(version >= PROTOCOL_V2) {
+			write_int_to_socket(PROTO_MSG, target);
+			write_int_to_socket(version >= PROTOCOL_V4 ? PROTOCOL_V4 : version, target);
+			result = handle_frames(target, received, conf);
 		}
+		else
+			write_int_to_socket(ERR_MSG, target);
+	}
+	else {
+		out_stream out;
+		out.target	= target;
+		out.protocol	= PROTOCOL_V1;
+		out.sink	= NULL;
+		out.batch	= NULL;
+
+		result = execute_request(received, &out, conf, queued);
 	}
 
-	free(received);
+	release_buffer(conf->buffers, received);
+
+	return result;
 }
 
 /*
@@ -568,9 +2727,12 @@ void handle_requests(io_interface *target) {
 */
 void *listener_startup(void *params) {
 
-	listener_job *conf = (listener_job *)params;
+	pool_thread_conf *pool_conf = (pool_thread_conf *)params;
+	listener_job *conf = (listener_job *)pool_conf->param;
+	int index = pool_conf->index;
 	io_interface *accepted_sock = NULL;
 
+	free(pool_conf);
 
 	while(1) {
 
@@ -579,13 +2741,18 @@ void *listener_startup(void *params) {
 		//Gain mutex access
 		semaphore_wait(conf->rr);
 
-		//check if the main thread is actually asking to restart instead of processing a request
-		if (*(conf->restart))
+		//check if the main thread is actually asking to stop instead of processing a request
+		if (conf->stop)
 			break;
 
 		//gain mutex access to the queue
 		semaphore_wait(conf->sem);
-		
+
+		//a reload made the pool smaller, this wake up was meant to let a listener go
+		if (leave_thread_pool(&conf->listeners, index)) {
+			semaphore_signal(conf->sem);
+			break;
+		}
 	
 		//save the request on a local variable (so that you can release lock on the queue)
 		io_interface_node *temp = dequeue(conf->queue);
@@ -604,15 +2771,24 @@ void *listener_startup(void *params) {
 			continue;
 		}
 
+		//the autoscaler uses the number of busy listeners to know how many of them are needed
+		conf->busy++;
+		if(conf->busy > conf->peak_busy)
+			conf->peak_busy = conf->busy;
 
 		//access to the shared variable is over, release the lock before going further
 		semaphore_signal(conf->sem);
 
-		//handle the locally-saved request
-		handle_requests(accepted_sock);
+		//handle the locally-saved request, then close the fd (or HANDLE) unless a job took it.
+		//Requests read by the event loop are only executed, the event loop sends the response
+		if(temp->conn != NULL)
+			serve_connection(temp->conn, conf);
+		else if(handle_requests(accepted_sock, temp->protocol, conf, temp->queued) != REQUEST_HANDED_OFF)
+			close_socket(accepted_sock);
 
-		//close the fd (or HANDLE) of the request
-		close_socket(accepted_sock);
+		semaphore_wait(conf->sem);
+		conf->busy--;
+		semaphore_signal(conf->sem);
 
 		//free memory allocated for the node before its reference is lost forever
 		free(temp);
@@ -624,6 +2800,45 @@ void *listener_startup(void *params) {
 }
 
 
+/*
+* Function used by the client to connect to the server and to agree on the protocol of the connection: protocol,
+* binary_listings and compressed_listings of conf are set to what the server can do.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1: if the server refused the connection because it's overloaded
+*	*retry_after is set to the seconds to wait, otherwise to 0
+*/
+int client_connect(client_configuration *conf, io_interface *server, int *retry_after) {
+
+	*retry_after = 0;
+
+	if(connect_to_server(conf->address, conf->port, server) < 0)
+		return -1;
+
+	//try to use the framed protocol, older servers close the connection after refusing it so connect again
+	conf->protocol			= client_negotiate_protocol(server, retry_after);
+	conf->binary_listings		= 0;
+	conf->compressed_listings	= 0;
+
+	//v3 is v2 with binary listings, v4 can also compress them
+	if(conf->protocol == PROTOCOL_V3 || conf->protocol == PROTOCOL_V4) {
+		conf->compressed_listings	= conf->protocol == PROTOCOL_V4;
+		conf->protocol			= PROTOCOL_V2;
+		conf->binary_listings		= 1;
+	}
+
+	if(conf->protocol == PROTOCOL_V2)
+		return 0;
+
+	close_socket(server);
+	conf->protocol = PROTOCOL_V1;
+
+	if(*retry_after > 0 || connect_to_server(conf->address, conf->port, server) < 0)
+		return -1;
+
+	return 0;
+}
+
+
 /*
 * Function called by a new thread when client sends its request
 */
@@ -633,38 +2848,190 @@ void *client_startup(void *conf_ptr) {
 
 	//save server connection
 	io_interface server;
+	int retry_after = 0;
+	int connected = -1;
+
+	//a server of this host encrypts the file itself through the local socket, decryptions need an encrypted name
+	int local = conf->local_socket != NULL && (conf->action == ENC_ACTION || (conf->action == DEC_ACTION &&
+		strlen(conf->target) > strlen(ENCR_EXT) && strcmp(conf->target + strlen(conf->target) - strlen(ENCR_EXT), ENCR_EXT) == 0));
+
+	if(local && (connected = connect_to_local_server(conf->local_socket, &server)) == 0)
+		conf->protocol = PROTOCOL_LOCAL;
+
+	//with several servers, the first one which can be reached executes the command
+	for(int i=0; i<conf->no_servers && connected < 0; i++) {
+		conf->address	= conf->addresses[i];
+		conf->port	= conf->ports[i];
+		connected	= client_connect(conf, &server, &retry_after);
+	}
 
-	if(connect_to_server(conf->address, conf->port, &server) < 0) {
-		printf("Could not connect to the given server. Please check the ip for errors and retry.\nApplication will now close...\n\n");
+	if(connected < 0) {
+		if(retry_after > 0)
+			printf("The server is overloaded, please retry in %i seconds...\n\nApplication will now close, have a good day!\n\n", retry_after);
+		else
+			printf("Could not connect to the given server. Please check the ip for errors and retry.\nApplication will now close...\n\n");
 		exit(1);
 	}
 
 	//handle given commands
 	client_handle_command(conf, &server);
 
+	close_socket(&server);
+
 	return NULL;
 }
 
 
 /*
-* Function used to start no_listeners of listeners on a given port,
-* all the created listeners will be a unique thread which will listen 
-* to the given port number.
-* Arguments:
-* 	-no_listener:		number of listeners to start
-*	-conf:			pointer to a listener_job confiuration, the number of configurations should be equal to no_listeners
-*	-save_to:		pointer to the location to use to save the threads structure
+* Function used to refuse a connection because too many requests are already waiting for a listener:
+* the client is told when to retry and the connection is closed.
+* ARGUMENTS:
+*	-conf:		listener_job of the listeners
+*	-target:	the accepted connection
+*	-queued:	requests waiting for a listener
+*	-active:	number of listeners
+*/
+void refuse_connection(listener_job *conf, io_interface *target, int queued, int active) {
+
+	int retry_after = 1 + queued / (active > 0 ? active : 1);
+
+	if(retry_after > MAX_RETRY_AFTER)
+		retry_after = MAX_RETRY_AFTER;
+
+	discard_input(target);
+	write_int_to_socket(OVERLOAD_MSG, target);
+	write_int_to_socket(retry_after, target);
+	close_socket(target);
+	count_rejected(conf->limits);
+}
+
+
+/*
+* Function used to change the number of listeners while they're running: new ones are started at once,
+* the ones in excess exit after serving their current request.
+* ARGUMENTS:
+* 	-no_listeners:		number of listeners which should be running
+*	-conf:			pointer to the listener_job shared by the listeners
 * Return value:
-*	On success 0 is returned, -1 otherwise (?)
+*	On success 0 is returned, -1 otherwise
 */
+int resize_listeners(int no_listeners, listener_job *conf) {
 
-int start_listeners(int no_listeners, listener_job *confs, thread *save_to) {
+	semaphore_wait(conf->sem);
+	int to_wake = resize_thread_pool(&conf->listeners, no_listeners, listener_startup, (void *)conf);
+	semaphore_signal(conf->sem);
 
-	for(int i=0; i<no_listeners; i++) {
-		if(create_thread(&save_to[i], listener_startup, (void *)confs) < 0)
-			return -1;
+	for(int i=0; i<to_wake; i++)
+		semaphore_signal(conf->rr);
+
+	return to_wake < 0 ? -1 : 0;
+}
+
+
+/*
+* Function called periodically by the main thread to adapt the number of listeners to the load. Listeners are
+* added when the oldest queued connection waited more than scale_wait or when more connections are queued
+* than there are listeners, and removed when fewer of them were busy during the last idle_timeout.
+* Every decision is logged.
+*/
+void autoscale_listeners(listener_job *conf) {
+
+	long now = current_time_ms();
+	int to_wake = 0;
+
+	semaphore_wait(conf->sem);
+
+	int active	= active_threads(&conf->listeners);
+	int depth	= conf->queue->length;
+	long waited	= conf->queue->head != NULL ? now - conf->queue->head->queued : 0;
+	int target	= active;
+
+	if(depth > 0 && (waited >= conf->scale_wait || depth > active) && active < conf->max_listeners) {
+
+		//enough listeners to serve at once everything which is queued now
+		target = conf->busy + depth;
+		if(target <= active)
+			target = active + 1;
+		if(target > conf->max_listeners)
+			target = conf->max_listeners;
+
+		printf("\tAutoscaler: %i -> %i listeners (%i queued connections, the oldest waited %ld ms)\n", active, target, depth, waited);
+
+		conf->window_start	= now;
+		conf->peak_busy		= conf->busy;
 	}
+	else if(now - conf->window_start >= conf->idle_timeout) {
 
-	return 0;
+		if(active > conf->min_listeners && conf->peak_busy < active) {
+
+			target = conf->peak_busy > conf->min_listeners ? conf->peak_busy : conf->min_listeners;
+
+			printf("\tAutoscaler: %i -> %i listeners (at most %i were busy in the last %ld s)\n", active, target, conf->peak_busy, conf->idle_timeout / 1000);
+		}
+
+		conf->window_start	= now;
+		conf->peak_busy		= conf->busy;
+	}
+
+	if(target != active && (to_wake = resize_thread_pool(&conf->listeners, target, listener_startup, (void *)conf)) < 0) {
+		printf("\tAutoscaler: could not start new listeners\n");
+		to_wake = 0;
+	}
+
+	semaphore_signal(conf->sem);
+
+	for(int i=0; i<to_wake; i++)
+		semaphore_signal(conf->rr);
+}
+
+
+/*
+* Function used to change the bounds of the autoscaler. The number of listeners is brought inside the new bounds at once.
+* ARGUMENTS:
+*	-conf:		pointer to the listener_job shared by the listeners
+*	-min:		listeners which are always running
+*	-max:		max number of listeners
+*	-scale_wait:	ms waited by the oldest queued connection which makes the listeners grow
+*	-idle_timeout:	seconds after which listeners which were not needed are stopped
+* Return value:
+*	On success 0 is returned, -1 otherwise
+*/
+int set_listener_bounds(listener_job *conf, int min, int max, long scale_wait, int idle_timeout) {
+
+	semaphore_wait(conf->sem);
+
+	conf->min_listeners	= min;
+	conf->max_listeners	= max > min ? max : min;
+	conf->scale_wait	= scale_wait;
+	conf->idle_timeout	= (long)idle_timeout * 1000;
+	conf->window_start	= current_time_ms();
+
+	int target = active_threads(&conf->listeners);
+
+	if(target < conf->min_listeners)
+		target = conf->min_listeners;
+	if(target > conf->max_listeners)
+		target = conf->max_listeners;
+
+	semaphore_signal(conf->sem);
+
+	return resize_listeners(target, conf);
+}
+
+
+/*
+* Function used to stop every listener and wait for them to finish their current request.
+*/
+void stop_listeners(listener_job *conf) {
+
+	semaphore_wait(conf->sem);
+	int running = conf->listeners.running;
+	conf->stop = 1;
+	semaphore_signal(conf->sem);
+
+	for(int i=0; i<running; i++)
+		semaphore_signal(conf->rr);
+
+	stop_thread_pool(&conf->listeners);
 }
 
@@ -0,0 +1,119 @@
+#ifndef ENCRYPTER_H
+#define ENCRYPTER_H
+
+/*
+* Client library of the remote encrypter, built by build_library.sh as libencrypter.a and libencrypter.so.
+*
+* An encrypter_client keeps a pool of connections to a server, each one served by its own thread. Commands are
+* written like the arguments of the client ("-e 1234 path", "-R sort=size", "-t 500 -S"...) and are executed in the
+* order they are submitted by the first connection which is free. Connections are opened with the first command
+* they execute and are kept open for the next ones (servers which only speak v1 need a new one for every command).
+*
+* Submitting never blocks: the caller is told a command is over by a callback, or asks for it with encrypter_poll
+* and encrypter_wait. Nothing is printed and the process is never terminated, errors are statuses.
+*/
+
+#if defined(_WIN32) && defined(ENCRYPTER_SHARED)
+	#ifdef ENCRYPTER_BUILD
+		#define ENCRYPTER_API __declspec(dllexport)
+	#else
+		#define ENCRYPTER_API __declspec(dllimport)
+	#endif
+#elif defined(__GNUC__)
+	#define ENCRYPTER_API __attribute__((visibility("default")))
+#else
+	#define ENCRYPTER_API
+#endif
+
+
+/*
+* Statuses of a command. The positive ones are answered by the server, the negative ones by the library.
+*/
+#define ENCRYPTER_PENDING	0		//the command is not over yet
+#define ENCRYPTER_DONE		200		//the command was executed
+#define ENCRYPTER_NOT_MODIFIED	220		//nothing changed since the generation given to -g
+#define ENCRYPTER_BODY		300		//the command was executed and answered with a body
+#define ENCRYPTER_FAILED	400		//the server couldn't execute the command (e.g. the file doesn't exist)
+#define ENCRYPTER_BUSY		500		//the file is being used by someone else
+#define ENCRYPTER_OVERLOADED	600		//the server refused the command, retry after encrypter_hint seconds
+#define ENCRYPTER_TIMEOUT	700		//the deadline of the command was over, the file was left untouched
+#define ENCRYPTER_INVALID	-1		//the command is not valid
+#define ENCRYPTER_UNREACHABLE	-2		//the server couldn't be reached
+#define ENCRYPTER_LOST		-3		//the connection broke before the whole answer arrived
+#define ENCRYPTER_NO_MEMORY	-4		//there was no memory for the body of the answer
+
+
+typedef struct encrypter_client encrypter_client;
+typedef struct encrypter_call encrypter_call;
+
+/*
+* Function given the body of an answer as it arrives (e.g. the lines of a listing), split in parts which don't
+* follow the lines. It returns 0 to go on reading, -1 to stop (the command is then over with ENCRYPTER_LOST).
+*/
+typedef int (*encrypter_data_callback)(void *param, const char *data, int length);
+
+/*
+* Function called once the command is over. It's called by a thread of the encrypter_client (or by
+* encrypter_submit itself for invalid commands), it can release the call.
+*/
+typedef void (*encrypter_done_callback)(void *param, encrypter_call *call);
+
+
+/*
+* Function used to create a client of the server at address:port with a pool of connections.
+* RETURN VALUE:
+*	The client, NULL if it couldn't be created
+*/
+ENCRYPTER_API encrypter_client *encrypter_open(const char *address, int port, int connections);
+
+/*
+* Function used to close a client, once every command submitted to it is over.
+*/
+ENCRYPTER_API void encrypter_close(encrypter_client *client);
+
+/*
+* Function used to submit a command. If on_data is NULL the body of the answer is kept by the call (see
+* encrypter_body), on_done can be NULL too.
+* RETURN VALUE:
+*	The call, which must be given to encrypter_release. NULL if there's no memory for it
+*/
+ENCRYPTER_API encrypter_call *encrypter_submit(encrypter_client *client, const char *command, encrypter_data_callback on_data, encrypter_done_callback on_done, void *param);
+
+/*
+* Function used to know if a command is over without waiting.
+* RETURN VALUE:
+*	The status of the command, ENCRYPTER_PENDING if it's not over yet
+*/
+ENCRYPTER_API int encrypter_poll(encrypter_call *call);
+
+/*
+* Function used to wait for a command to be over.
+* RETURN VALUE:
+*	The status of the command
+*/
+ENCRYPTER_API int encrypter_wait(encrypter_call *call);
+
+/*
+* Function used to read the integer the server sent after the status (e.g. the seconds to wait with
+* ENCRYPTER_OVERLOADED), 0 if none.
+*/
+ENCRYPTER_API int encrypter_hint(encrypter_call *call);
+
+/*
+* Function used to read the body of the answer to a command which is over, when it was submitted without on_data.
+* RETURN VALUE:
+*	The body, which stays valid until the call is released (NULL and 0 if there's none)
+*/
+ENCRYPTER_API const char *encrypter_body(encrypter_call *call, int *length);
+
+/*
+* Function used to free a call, which can still be running (it's then freed once it's over).
+*/
+ENCRYPTER_API void encrypter_release(encrypter_call *call);
+
+/*
+* Function used to describe a status.
+*/
+ENCRYPTER_API const char *encrypter_status_string(int status);
+
+#endif
@@ -0,0 +1,32 @@
+#define _GNU_SOURCE			//statx, before any system header (see unix/io.c)
+#define ENCRYPTER_BUILD
+#include "encrypter.h"
+
+#include "cross/compress.c"
+
+#ifdef _WIN32
+	#include "win/io.c"
+	#include "win/startup.c"
+#endif
+
+#ifdef __unix__
+	#include "unix/io.c"
+	#include "unix/startup.c"
+#endif
+
+
+#include "cross/queue.c"
+#include "cross/pool.c"
+#include "cross/admission.c"
+#include "cross/requests.c"
+#include "cross/jobs.c"
+#include "cross/listing.c"
+#include "cross/metadata.c"
+#include "cross/seedlog.c"
+#include "cross/dropfolder.c"
+#include "cross/startup.c"
+#include "cross/reactor.c"
+#include "cross/library.c"
+
+void restart_application(int s) {}
+void stop_application(int s) {}
@@ -1,3 +1,7 @@
+#define _GNU_SOURCE			//statx, before any system header (see unix/io.c)
+
+#include "cross/compress.c"
+
 #ifdef _WIN32
 	#include "win/io.c"
 	#include "win/startup.c"
@@ -9,154 +13,454 @@
 #endif
 
 #include "cross/queue.c"
+#include "cross/pool.c"
+#include "cross/admission.c"
 #include "cross/requests.c"
+#include "cross/jobs.c"
+#include "cross/listing.c"
+#include "cross/metadata.c"
+#include "cross/seedlog.c"
+#include "cross/dropfolder.c"
 #include "cross/startup.c"
+#include "cross/reactor.c"
 
 #define QUEUE_MAX_LENGTH 65536
+#define MAX_FREE_BUFFERS 64
+#define SCALE_TICK 100		//ms between two decisions of the autoscaler when no connection arrives
 
 server_configuration conf;
+job_table jobs;
+admission limits;
+reactor events;
+io_interface local_sock;
+drop_box drops;
+io_throttle throttle;
+
+/*
+* Function used to start, change or stop the metadata cache of the listeners so that it matches the
+* configuration. A cache of the same directory saved to the same file is kept as it is.
+*/
+void update_listing_cache(listener_job *job) {
+
+	char file[MAX_PATH_LENGTH * 2];
+	metadata_cache *cache = NULL;
+
+	if(conf.cache_file != NULL) {
+
+		//the working directory of the listeners changes, the file is relative to the one the server started from
+		if(conf.cache_file[0] == '/')
+			snprintf(file, sizeof(file), "%s", conf.cache_file);
+		else
+			snprintf(file, sizeof(file), "%s/%s", conf.starting_directory, conf.cache_file);
 
-int main(int argc, char *args[]) {
+		if(job->cache != NULL && strcmp(job->cache->path, job->directory) == 0 && strcmp(job->cache->file, file) == 0)
+			return;
 
-	conf.run = 1;
+		if((cache = (metadata_cache *)malloc(sizeof(metadata_cache))) == NULL || start_metadata_cache(cache, job->directory, file) != 0) {
+			printf("\tMetadata cache not available, listings will read the disk\n");
+			free(cache);
+			cache = NULL;
+		}
+	}
 
-	while(conf.run) {
+	metadata_cache *old = set_listing_cache(job, cache);
 
-		//display a welcome message, different if you're running on Unix or Windows
-		if(!conf.restart)
-			welcome_message();
+	if(old != NULL) {
+		stop_metadata_cache(old);
+		free(old);
+	}
+}
 
-		//configure application parameters
-		server_read_and_set_arguments(argc, args, &conf);
 
-		if(conf.no_threads == 0) {
-			printf("Error: number of threads must be at least one!\nApplication will now close...\n\n");
-			exit(1);
-		}
+/*
+* Function used to apply the configuration read on a reload to the running server. The listening socket is
+* kept unless the port changed, running requests and jobs are not interrupted. When event_driven is set the
+* event loop is moved to the new socket too.
+*/
+void reload_server(io_interface **sock_ptr, listener_job *job, int old_port, int event_driven) {
 
-		//call start-up function, this will be a different implementation wether the program is running either on Unix or Windows
-		//For unix: application will be started on a daemon process, becoming invisible to the user
-		//For windows: application will launch normally (empty function which always returns 0)
-		//Startup may also be called (under Unix system) to relaunch the application and read configuration file again. FREE MEMORY, CLOSE SOCKET AND JOIN ALL THREADS BEFORE CALLING IT!
-		
-		//NOTE: DAEMON-STARTUP IS DISABLED WHILE DEBUGGING (HOW CAN YOU DEBUG A DAEMON APPLICATION?)
-		if(startup(conf.directory) != 0) {
-			printf("There was an error while trying to start the server, please retry...\n\n");
-			exit(1);
-		}
+	//the new socket is opened, and watched by the event loop, before closing the old one, so that no connection
+	//is refused in between and a failure leaves the server listening on the old port
+	if(conf.port != old_port) {
 
-		//allocate space for listeners, so that can be joined later
-		thread *saved_listeners;
+		io_interface *new_sock = (io_interface *)malloc(sizeof(io_interface));
+		int hosted = new_sock != NULL && host_server(conf.port, new_sock) == 0;
 
-		if((saved_listeners = (thread *)malloc(conf.no_threads * sizeof(thread))) == NULL) {
-			printf("There was an erorr while trying to allocate resources for the application, please retry...\n\n");
-			exit(1);
+		if(!hosted || (event_driven && reactor_listen(&events, new_sock) < 0)) {
+			printf("\tError while trying to host server on port %i, still listening on port %i\n", conf.port, old_port);
+			if(hosted)
+				close_socket(new_sock);
+			free(new_sock);
+			conf.port = old_port;
 		}
+		else {
+			close_socket(*sock_ptr);
+			free(*sock_ptr);
+			*sock_ptr = new_sock;
+			printf("\tNow listening on port %i\n", conf.port);
+		}
+	}
 
-		//allocate space for socket_interface so that other threads can read it
-		io_interface *sock_ptr;
+	if(set_listener_directory(job, conf.directory) != 0)
+		printf("\tCould not use directory %s, new requests still use %s\n", conf.directory, job->directory);
 
-		if ((sock_ptr = (io_interface *)malloc(sizeof(io_interface))) == NULL) {
-			printf("There was an error while trying to allocate resources for the application, please retry...\n\n");
-			exit(1);
-		 }
+	update_listing_cache(job);
 
-		//start server and listen on the chosen port	
-		if(host_server(conf.port, sock_ptr) < 0) {
-			printf("Error while trying to host server on port %i\n\n", conf.port);
-			exit(1);
-		}
+	if(set_listener_peers(job, conf.peers, conf.offload_depth) != 0)
+		printf("\tCould not read the peers %s, the current ones are kept\n", conf.peers);
+
+	job->bulk_limit = conf.bulk_limit;
 
+	semaphore_wait(&limits.sem);
+	limits.max_inflight	= conf.max_inflight;
+	limits.max_per_client	= conf.max_per_client;
+	semaphore_signal(&limits.sem);
 
-		io_interface_queue *accepted_socks			= malloc(sizeof(io_interface_queue));
-		semaphore *remaining_accept				= malloc(sizeof(semaphore));
-		semaphore *sem						= malloc(sizeof(semaphore));
+	//running encryptions are paced by the new bandwidth from their next chunk
+	set_io_throttle(&throttle, conf.total_rate, conf.background_rate, conf.job_rate);
 
-		if(accepted_socks == NULL || remaining_accept == NULL || sem == NULL) {
-			printf("Error while trying to allocate space for queue!\n\n");
-			exit(1);
+	if(conf.no_threads <= 0 || set_listener_bounds(job, conf.no_threads, conf.max_threads, conf.scale_wait, conf.idle_timeout) != 0)
+		printf("\tCould not resize listeners to %i - %i threads\n", conf.no_threads, conf.max_threads);
+
+	if(conf.no_jobs <= 0 || conf.no_small_jobs <= 0 || resize_job_table(&jobs, conf.no_small_jobs, conf.no_jobs, conf.bulk_limit) != 0)
+		printf("\tCould not resize job workers to %i small and %i bulk ones\n", conf.no_small_jobs, conf.no_jobs);
+}
+
+
+/*
+* Function used to give an accepted connection to the listeners, unless too many clients are already waiting:
+* that one is then refused at once instead of letting it wait forever.
+* ARGUMENTS:
+*	-job:		listener_job of the listeners
+*	-accepted:	the connection
+*	-protocol:	PROTOCOL_V1 for the TCP socket, PROTOCOL_LOCAL for the local one
+*/
+void queue_connection(listener_job *job, io_interface *accepted, int protocol) {
+
+	semaphore_wait(job->sem);
+
+	if(job->queue->length >= conf.max_queued) {
+		int queued = job->queue->length;
+		int active = active_threads(&job->listeners);
+
+		semaphore_signal(job->sem);
+
+		refuse_connection(job, accepted, queued, active);
+		return;
+	}
+
+	//allocate space for queue node. It will be freed by a listener after it has been used
+	io_interface_node *temp;
+	if ((temp = malloc(sizeof(io_interface_node))) == NULL) {
+		printf("Error allocating resources for a client, request will be discarded...\n");
+		semaphore_signal(job->sem);
+		close_socket(accepted);
+		return;
+	}
+
+	//without the event loop only the read and write timeouts can be enforced, by the socket itself
+	set_socket_timeouts(accepted, (long)conf.read_timeout * 1000, (long)conf.write_timeout * 1000);
+
+	temp->current = *accepted;
+	temp->protocol = protocol;
+	temp->conn = NULL;
+
+	enqueue(job->queue, temp);
+	semaphore_signal(job->sem);
+	semaphore_signal(job->rr);
+}
+
+
+/*
+* Function executed by the thread which accepts the connections of the local socket, until the server stops.
+* They are served by the listeners like the others (see handle_local_request).
+*/
+void *local_acceptor(void *params) {
+
+	listener_job *job = (listener_job *)params;
+	io_interface accepted;
+
+	while(conf.run) {
+		if(listen_to_sock_non_block(&local_sock, &accepted, SCALE_TICK) == 0)
+			queue_connection(job, &accepted, PROTOCOL_LOCAL);
+	}
+
+	return NULL;
+}
+
+
+int main(int argc, char *args[]) {
+
+	conf.run = 1;
+
+	//display a welcome message, different if you're running on Unix or Windows
+	welcome_message();
+
+	//configure application parameters
+	server_read_and_set_arguments(argc, args, &conf);
+
+	if(conf.no_threads <= 0) {
+		printf("Error: number of threads must be at least one!\nApplication will now close...\n\n");
+		exit(1);
+	}
+
+	if(conf.no_jobs <= 0 || conf.no_small_jobs <= 0) {
+		printf("Error: number of job workers must be at least one!\nApplication will now close...\n\n");
+		exit(1);
+	}
+
+	//job workers are started only once: submitted jobs keep running while the server reloads
+	if(start_admission(&limits) != 0 || start_job_table(&jobs, conf.no_small_jobs, conf.no_jobs, conf.bulk_limit) != 0 ||
+		start_io_throttle(&throttle, conf.total_rate, conf.background_rate, conf.job_rate) != 0) {
+		printf("Error while trying to start job workers, please retry...\n\n");
+		exit(1);
+	}
+
+	jobs.limits = &limits;
+
+	semaphore_wait(&limits.sem);
+	limits.max_inflight	= conf.max_inflight;
+	limits.max_per_client	= conf.max_per_client;
+	semaphore_signal(&limits.sem);
+
+	//call start-up function, this will be a different implementation wether the program is running either on Unix or Windows
+	//For unix: application will be started on a daemon process, becoming invisible to the user
+	//For windows: application will launch normally (empty function which always returns 0)
+	//Startup is called only once: on SIGHUP the configuration file is read again and applied to the running server
+
+	//NOTE: DAEMON-STARTUP IS DISABLED WHILE DEBUGGING (HOW CAN YOU DEBUG A DAEMON APPLICATION?)
+	if(startup(conf.directory) != 0) {
+		printf("There was an error while trying to start the server, please retry...\n\n");
+		exit(1);
+	}
+
+	//allocate space for socket_interface so that other threads can read it
+	io_interface *sock_ptr;
+
+	if ((sock_ptr = (io_interface *)malloc(sizeof(io_interface))) == NULL) {
+		printf("There was an error while trying to allocate resources for the application, please retry...\n\n");
+		exit(1);
+	 }
+
+	//start server and listen on the chosen port	
+	if(host_server(conf.port, sock_ptr) < 0) {
+		printf("Error while trying to host server on port %i\n\n", conf.port);
+		exit(1);
+	}
+
+
+	io_interface_queue *accepted_socks			= malloc(sizeof(io_interface_queue));
+	semaphore *remaining_accept				= malloc(sizeof(semaphore));
+	semaphore *sem						= malloc(sizeof(semaphore));
+	buffer_pool *buffers					= malloc(sizeof(buffer_pool));
+	listener_job *job					= malloc(sizeof(listener_job));
+
+	if(accepted_socks == NULL || remaining_accept == NULL || sem == NULL || buffers == NULL || job == NULL) {
+		printf("Error while trying to allocate space for queue!\n\n");
+		exit(1);
+	}
+
+	bzero(accepted_socks, sizeof(io_interface_queue));
+	bzero(job, sizeof(listener_job));
+
+	start_semaphore_ex(sem);
+	start_semaphore(remaining_accept, 0, QUEUE_MAX_LENGTH);
+	start_buffer_pool(buffers, FRAME_BUFFER_SIZE + 1, MAX_FREE_BUFFERS);
+
+	//listener conf, shared by every listener
+	job->queue			= accepted_socks;
+	job->rr 			= remaining_accept;
+	job->sem			= sem;
+	job->buffers			= buffers;
+	job->jobs			= &jobs;
+	job->bulk_limit			= conf.bulk_limit;
+	job->limits			= &limits;
+	job->throttle			= &throttle;
+
+	start_thread_pool(&job->listeners);
+
+	if(set_listener_directory(job, ".") != 0) {
+		printf("Error while trying to read the working directory, please retry...\n\n");
+		exit(1);
+	}
+
+	update_listing_cache(job);
+
+	if(set_listener_peers(job, conf.peers, conf.offload_depth) != 0) {
+		printf("Error: peers must be given as address:port[,address:port...], at most %i of them!\n\n", MAX_PEERS);
+		exit(1);
+	}
+
+	//jobs which took a v2 connection give it back to these listeners
+	semaphore_wait(&jobs.sem);
+	jobs.on_reply		= reply_to_request;
+	jobs.on_reply_param	= job;
+	semaphore_signal(&jobs.sem);
+
+	//start all listening threads, the autoscaler will add or remove them between the given bounds
+	if(set_listener_bounds(job, conf.no_threads, conf.max_threads, conf.scale_wait, conf.idle_timeout) != 0) {
+		printf("Error while trying to create new threads, please retry...\n\n");
+		exit(1);
+	}
+
+
+	//where available, connections are served by an event loop run by this thread and listeners only execute
+	//the requests, so that slow clients don't keep them busy. Otherwise listeners serve the connections
+	int event_driven = start_reactor(&events, sock_ptr, job) == 0;
+
+	if(event_driven)
+		set_reactor_deadlines(&events, conf.read_timeout, conf.write_timeout, conf.total_timeout);
+	else
+		printf("\tEvent loop not available, listeners will serve the connections directly\n\n");
+
+	//clients of this host hand over their open files on the local socket, skipping TCP and the paths
+	char local_path[MAX_PATH_LENGTH * 2];
+	thread local_thread;
+	int local_served = 0;
+
+	if(conf.local_socket != NULL) {
+
+		//the working directory changed, the socket is relative to the one the server started from
+		if(conf.local_socket[0] == '/')
+			snprintf(local_path, sizeof(local_path), "%s", conf.local_socket);
+		else
+			snprintf(local_path, sizeof(local_path), "%s/%s", conf.starting_directory, conf.local_socket);
+
+		if(host_local_server(local_path, &local_sock) < 0)
+			printf("\tLocal socket %s not available, local clients will connect over TCP\n\n", local_path);
+		else if(create_thread(&local_thread, local_acceptor, (void *)job) < 0) {
+			printf("\tError while trying to serve the local socket, local clients will connect over TCP\n\n");
+			close_socket(&local_sock);
+			delete_file(local_path);
 		}
+		else
+			local_served = 1;
+	}
 
-		bzero(accepted_socks, sizeof(io_interface_queue));
+	//files written to the drop folders are encrypted by the job workers as they arrive, without any client
+	int dropping = 0;
 
-		start_semaphore_ex(sem);
-		start_semaphore(remaining_accept, 0, QUEUE_MAX_LENGTH);
+	if(conf.drop_folders != NULL) {
 
-		//allocate space for listener conf
-		listener_job *job		= malloc(sizeof(listener_job));
-		job->queue			= accepted_socks;
-		job->rr 			= remaining_accept;
-		job->sem			= sem;
-		job->restart 			= &conf.restart;
-		
-		 
+		if(start_drop_box(&drops, conf.drop_folders, conf.starting_directory, job->directory, &jobs, conf.bulk_limit, &throttle) < 0)
+			printf("\tDrop folders not available, their files won't be encrypted\n\n");
+		else {
+			dropping = 1;
 
-		//start all listening threads
-		if(start_listeners(conf.no_threads, job, saved_listeners) != 0) {
-			printf("Error while trying to create new threads, please retry...\n\n");
-			exit(1);
+			semaphore_wait(job->sem);
+			job->drops = &drops;
+			semaphore_signal(job->sem);
 		}
+	}
 
+	io_interface accepted_sock;
 
-		io_interface accepted_sock;
+	while(conf.run) {
 
 		while(!conf.restart) {
 
-			if(listen_to_sock_non_block(sock_ptr, &accepted_sock, 2) == 0) {
-				semaphore_wait(job->sem);
+			if(event_driven) {
+				run_reactor(&events, SCALE_TICK, conf.max_queued);
+			}
+			else if(listen_to_sock_non_block(sock_ptr, &accepted_sock, SCALE_TICK) == 0) {
+				queue_connection(job, &accepted_sock, PROTOCOL_V1);
+			}
+
+			autoscale_listeners(job);
+		}
+
+		if(!conf.run)
+			break;
+
+		//SIGHUP: read the configuration file again and apply it without stopping anything
+		printf("\tReloading configuration...\n");
 
-				//allocate space for queue node. It will be freed by a listener after it has been used
-				io_interface_node *temp;
-				if ((temp = malloc(sizeof(io_interface_node))) == NULL) {
-					printf("Error allocating resources for a client, request will be discarded...\n");
-					semaphore_signal(job->sem);
-					continue;
-				}
+		int old_port = conf.port;
 
-				temp->current = accepted_sock;
+		if(server_read_and_set_arguments(argc, args, &conf) == 0) {
 
-				enqueue(job->queue, temp);
-				semaphore_signal(job->sem);
-				semaphore_signal(job->rr);
+			reload_server(&sock_ptr, job, old_port, event_driven);
 
+			if(dropping) {
+				semaphore_wait(&drops.sem);
+				drops.bulk_limit = conf.bulk_limit;
+				semaphore_signal(&drops.sem);
 			}
-		}
 
-		//fake signal to wake up every thread and let them join to this thread later
-		for (int i = 0; i < conf.no_threads; i++) {
-			semaphore_signal(job->rr);
+			if(event_driven)
+				set_reactor_deadlines(&events, conf.read_timeout, conf.write_timeout, conf.total_timeout);
 		}
 
-		//close socket
-		close_socket(sock_ptr);
-		printf("\tSocket closed, requests from port %i are no longer accepted!\n", conf.port);
-
-		
-		//join all threads
-		printf("\tWaiting for every thread to finish its task...\n");
-		for(int i=0; i<conf.no_threads; i++)
-			join_thread(&saved_listeners[i], NULL);
-		if (conf.run)
-			printf("\tDone! Now restarting...\n\n");
-		else
-			printf("\tDone! Now closing application...\n\n");
-		
-		//stop semaphores
-		stop_semaphore(sem);
-		stop_semaphore(remaining_accept);
-
-		//free space before closing
-		free(saved_listeners);
-		free(sock_ptr);
-		free(accepted_socks);
-		free(remaining_accept);
-		free(sem);
-		free(job);
-
-	}		
-
+		conf.restart = 0;
+
+		printf("\tDone! Serving %i - %i listeners and %i + %i job workers from %s\n\n", conf.no_threads, conf.max_threads, conf.no_small_jobs, conf.no_jobs, job->directory);
+	}
+
+	//close socket
+	close_socket(sock_ptr);
+	printf("\tSocket closed, requests from port %i are no longer accepted!\n", conf.port);
+
+	if(local_served) {
+		join_thread(&local_thread, NULL);
+		close_socket(&local_sock);
+		delete_file(local_path);
+	}
+
+	
+	//no more files are submitted, the ones already submitted are stopped with the other jobs
+	if(dropping)
+		stop_drop_box(&drops);
+
+	//listeners are going away, jobs can't give connections back to them anymore
+	semaphore_wait(&jobs.sem);
+	jobs.on_reply_param = NULL;
+	semaphore_signal(&jobs.sem);
+
+	//stop the jobs first so that listeners waiting for one of them can finish
+	printf("\tStopping submitted jobs...\n");
+	stop_job_table(&jobs);
+
+	//join all threads
+	printf("\tWaiting for every thread to finish its task...\n");
+	stop_listeners(job);
+
+	//no job and no STAT uses the drop folders anymore
+	if(dropping) {
+		printf("\tDrop folders: %ld files encrypted, %ld could not be\n", drops.encrypted, drops.failed);
+		free_drop_box(&drops);
+	}
+
+	//listings are over, the metadata cache can be saved and stopped
+	free(conf.cache_file);
+	conf.cache_file = NULL;
+	update_listing_cache(job);
+
+	//nobody uses the connections of the event loop anymore
+	if(event_driven)
+		stop_reactor(&events);
+	printf("\tDone! Now closing application...\n\n");
+	
+	//stop semaphores
+	stop_semaphore(sem);
+	stop_semaphore(remaining_accept);
+	stop_buffer_pool(buffers);
+
+	//free space before closing
+	free(sock_ptr);
+	free(accepted_socks);
+	free(remaining_accept);
+	free(sem);
+	free(buffers);
+	free(job);
+
+	free_job_table(&jobs);
+	stop_admission(&limits);
+	stop_io_throttle(&throttle);
 	free(conf.starting_directory);
 	free(conf.directory);
+	free(conf.peers);
+	free(conf.local_socket);
+	free(conf.drop_folders);
 
 
 	//end
@@ -1,5 +1,12 @@
+//statx: it only works if it comes before the first system header, so server.c, client.c and library.c define it too
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
@@ -11,18 +18,45 @@
 
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/mman.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <time.h>
 
 #define SOCK_MAX_QUEUE_LENGTH		64
 #define SOCK_PACKET_SIZE		5120		//5mb
 #define ACK_SIGNAL			1024
 #define SINGLE_THREAD_FILE_LIMIT	262144 		//256 kb
 #define FINISH_MESSAGE			"\r\n.\r\n"
+#define FRAME_HEADER_SIZE		8
+#define FRAME_BUFFER_SIZE		65536		//64 kb, max payload of a single v2 frame
+
+//wire formats, v1 is the original text protocol and v2 the framed one (negotiated by the client)
+#define PROTOCOL_V1			1
+#define PROTOCOL_V2			2
+#define PROTOCOL_V3			3		//PROTOCOL_V2 frames, listings can be asked in the binary format
+#define PROTOCOL_V4			4		//PROTOCOL_V3, listings can be asked compressed
+#define PROTOCOL_LOCAL			-1		//connection of the local socket: a single request with an open file, never negotiated
+
+//frame types of the v2 protocol
+#define FRAME_CMD			1
+#define FRAME_STATUS			2
+#define FRAME_DATA			3
+#define FRAME_END			4
+
+#define FRAME_COMPRESSED		1		//flag of DATA frames whose payload is a block of compress_block
+#define STREAM_FIRST_BATCH		4096		//bytes of the first batch of a response, the next ones double up to the batch size
 
 /*
 * Union which symbolizes an input/output structre which can be read or written (i.e. a given file or a connected server)
@@ -62,6 +96,109 @@ typedef struct {
 } mapped_file;
 
 
+/*
+* Structure which symbolizes the state of a random number generator. Unix implementation.
+* It produces the same sequence of srand/rand but every encryption can own its state, so that
+* different threads don't steal numbers to each other.
+*/
+typedef struct {
+	struct random_data data;
+	char state[128];
+} random_state;
+
+
+/*
+* Structure which defines the header of a v2 frame. On the wire it is sent as FRAME_HEADER_SIZE bytes:
+* type (1 byte), flags (1 byte), two reserved bytes and the length of the payload (4 bytes, network order).
+*/
+typedef struct {
+	int type;
+	int flags;
+	int length;
+} frame_header;
+
+
+/*
+* Structure which symbolizes the output of a request, so that LSTF and LSTR don't need to know which protocol
+* the client is speaking. With PROTOCOL_V1 bytes are printed as they are and closed by FINISH_MESSAGE,
+* with PROTOCOL_V2 they are sent as DATA frames and closed by an END frame.
+* If sink is not NULL the bytes are given to it (with sink_param) instead of being written to target,
+* target is then only used to know who the client is.
+* If batch is not NULL (see stream_start_batch), stream_write collects up to batch_limit bytes there and sends
+* them at once: batched bytes are waiting in it. If packed is not NULL (see stream_compress_batch), batches
+* are compressed there before being sent.
+*/
+typedef struct {
+	io_interface *target;
+	int protocol;
+	int (*sink)(void *param, char *source, int length);
+	void *sink_param;
+	char *batch;
+	int batched;
+	int batch_size;
+	int batch_limit;
+	char *packed;
+} out_stream;
+
+
+/*
+* Structure which defines what a listing must contain (LSTF and LSTR list everything when it's NULL).
+*	-max_depth:	files deeper than this are not listed and their directories are not opened, 0 for no limit.
+*			The files of the listed directory are at depth 1
+*	-format:	LISTING_TEXT or LISTING_BINARY (see format_listing_record)
+*	-fields:	LISTING_FIELD_ flags of what binary records carry besides sizes, they need the disk to be read
+*	-accept:	called with param for every file found, possibly by several threads at once: the file is
+*			listed in place only if it returns 1. path is relative to the listed directory ("/dir/file"
+*			for LSTR, the name for LSTF), mtime and mode are only known if fields asks for them
+*	-finish:	called with param once every file was seen, before the listing is finished
+*/
+typedef struct {
+	int max_depth;
+	int format;
+	int fields;
+	int (*accept)(void *param, int directory, intmax_t size, long mtime, int mode, int depth, char *path);
+	int (*finish)(void *param, out_stream *target);
+	void *param;
+} listing_filter;
+
+
+#define LISTING_SIZE_WIDTH	15		//characters of the size column of a listing
+#define LISTING_TEXT		0		//lines of text, see format_listing_line
+#define LISTING_BINARY		1		//records, see format_listing_record
+#define LISTING_MAGIC		"LSTB"		//first bytes of a binary listing, followed by its version and its fields
+#define LISTING_VERSION		1
+#define LISTING_FIELD_MTIME	1		//records carry the last modification time of the file (seconds)
+#define LISTING_FIELD_MODE	2		//records carry the type and the permissions of the file
+#define LISTING_RECORD_DIRECTORY 1		//flags of a record
+#define LISTING_RECORD_NEXT	2		//the record is the cursor of the next page, not a file
+#define LISTING_RECORD_PARENT	4		//the directory is not listed, it's only sent because some of its files are
+#define LISTING_RECORD_SIZE	64		//max bytes of a record besides its name
+
+
+#define POLL_READ	1		//the socket can be read (or it was closed)
+#define POLL_WRITE	2		//the socket can be written
+
+/*
+* Structure which symbolizes a set of sockets watched by a single thread. Unix implementation (epoll).
+* The wake pipe lets other threads interrupt poller_wait.
+*/
+typedef struct {
+	int id;
+	int wake[2];
+} poller;
+
+
+/*
+* Structure which symbolizes a socket ready to be used, returned by poller_wait.
+*	-events:	POLL_READ and/or POLL_WRITE
+*	-data:		the pointer given when the socket was added
+*/
+typedef struct {
+	int events;
+	void *data;
+} poll_event;
+
+
 /*
 * Structure which defines a XOR_job for encrypting/decrypting files in parallel.
 */
@@ -117,6 +254,211 @@ int delete_file(char *path) {
 }
 
 
+/*
+* Function used to move a file to path in a single step, replacing the file which is there (if any).
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int replace_file(char *source, char *path) {
+	return rename(source, path) < 0 ? -1 : 0;
+}
+
+
+
+/*
+* Function used to read the size of a file without opening it. Unix implementation.
+* ARGUMENTS:
+*	-path:		path of the file
+* RETURN VALUE:
+*	The size of the file, -1 if it can't be read
+*/
+long file_size(char *path) {
+
+	struct stat st;
+
+	if(stat(path, &st) < 0)
+		return -1;
+
+	return (long)st.st_size;
+}
+
+
+
+/*
+* Function used to read the size of a file which is already open. Unix implementation.
+* ARGUMENTS:
+*	-source:	the open file
+* RETURN VALUE:
+*	The size of the file, -1 if it can't be read
+*/
+long open_file_size(io_interface *source) {
+
+	struct stat st;
+
+	if(fstat(source->id, &st) < 0)
+		return -1;
+
+	return (long)st.st_size;
+}
+
+
+/*
+* Function used to create a new file, opened for writing. A file which is already there is never overwritten.
+* Unix implementation.
+* ARGUMENTS:
+*	-path:		path of the file to create
+*	-target:	pointer to the io_interface where the open file is saved
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1 (also if the file exists)
+*/
+int create_new_file(char *path, io_interface *target) {
+
+	int id;
+
+	if((id = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666)) < 0)
+		return -1;
+
+	target->id = id;
+	return 0;
+}
+
+
+/*
+* Function used to lock a file which is already open, like map_file_to_memory does. The lock is released when the
+* file is closed. Unix implementation.
+* RETURN VALUE:
+*	On success 0 is returned, -2 if the file is locked by someone else
+*/
+int lock_file(io_interface *target) {
+	return flock(target->id, LOCK_EX | LOCK_NB) < 0 ? -2 : 0;
+}
+
+
+/*
+* Function used to open (creating it if it's missing) a file which is only used to be locked, see wait_file_lock.
+* Unix implementation.
+* RETURN VALUE:
+*	On success 0 is returned and target is set, otherwise -1
+*/
+int open_lock_file(char *path, io_interface *target) {
+
+	int id;
+
+	if((id = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) < 0)
+		return -1;
+
+	target->id = id;
+	return 0;
+}
+
+
+/*
+* Function used to lock an open file, waiting while someone else holds it. Shared locks are held by many at once,
+* an exclusive one by a single holder. Unix implementation.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int wait_file_lock(io_interface *target, int exclusive) {
+
+	while(flock(target->id, exclusive ? LOCK_EX : LOCK_SH) < 0) {
+		if(errno != EINTR)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+int unlock_file(io_interface *target) {
+	return flock(target->id, LOCK_UN) < 0 ? -1 : 0;
+}
+
+
+/*
+* Function used to know if path still names the file of an open stream, i.e. it was not replaced (or deleted)
+* since the stream was opened. Unix implementation.
+* RETURN VALUE:
+*	1 if it does, otherwise 0
+*/
+int same_file_stream(FILE *stream, char *path) {
+
+	struct stat opened, named;
+
+	if(fstat(fileno(stream), &opened) < 0 || stat(path, &named) < 0)
+		return 0;
+
+	return opened.st_dev == named.st_dev && opened.st_ino == named.st_ino;
+}
+
+
+/*
+* Function used to read length bytes of an open file, starting at offset. Unix implementation.
+* RETURN VALUE:
+*	The number of bytes read (less than length only if the file ends before), -1 on failure
+*/
+long read_file_at(io_interface *source, char *dest, long length, long offset) {
+
+	long done = 0;
+
+	while(done < length) {
+
+		ssize_t result = pread(source->id, dest + done, length - done, offset + done);
+
+		if(result < 0 && errno == EINTR)
+			continue;
+		if(result < 0)
+			return -1;
+		if(result == 0)
+			break;
+
+		done += result;
+	}
+
+	return done;
+}
+
+
+/*
+* Function used to write length bytes to an open file, starting at offset. Unix implementation.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int write_file_at(io_interface *target, char *source, long length, long offset) {
+
+	long done = 0;
+
+	while(done < length) {
+
+		ssize_t result = pwrite(target->id, source + done, length - done, offset + done);
+
+		if(result < 0 && errno == EINTR)
+			continue;
+		if(result <= 0)
+			return -1;
+
+		done += result;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to write to the disk what was written to a stream. Unix implementation.
+* ARGUMENTS:
+*	-target:	the stream
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int sync_file_stream(FILE *target) {
+
+	if(fflush(target) != 0 || fsync(fileno(target)) < 0)
+		return -1;
+
+	return 0;
+}
+
+
 
 /*
 * Function used to close a file.
@@ -152,33 +494,35 @@ int close_socket(io_interface *target) {
 }
 
 /*
-* Function used to map a given file to memory. Unix implementation.
+* Function used to map a file which is already open to memory, e.g. one received from a local client. The file
+* then belongs to target: it's closed by unmap_file_from_memory, or here on failure. Unix implementation.
 * ARGUMENTS:
-*	-path:		char path of the file in the file system
+*	-source:	the file, opened for reading and writing
 *	-target:	mapped_file which the mapped file wants to be saved
 * RETURN VALUE:
 *	On success 0 is returned and target is correctly set, otherwise:
-*		-1 if there was an error while trying to open the file
+*		-1 if the file could not be mapped
 *		-2 if the lock could not be granted on the chosen file
 */
-int map_file_to_memory(char *path, mapped_file *target) {
+int map_interface_to_memory(io_interface *source, mapped_file *target) {
 
-	//open file (just use personal library for comfort)
-	io_interface temp;
-	
-	if(open_file(path, &temp) != 0) 
-		return -1;
+	io_interface temp = *source;
 
 	//put non-blocking lock on file
-	if (flock(temp.id, LOCK_EX | LOCK_NB) < 0) 
+	if (flock(temp.id, LOCK_EX | LOCK_NB) < 0) {
+		close(temp.id);
 		return -2;
+	}
 
 	//calculate memory to be allocated
 	off_t fsize = lseek(temp.id, 0, SEEK_END);
 
-	//allocate memory
-	if((target->id = (char *)mmap(NULL, fsize, PROT_READ | PROT_WRITE, MAP_SHARED, temp.id, 0)) == MAP_FAILED) {
+	//allocate memory (empty files can't be mapped, but there's nothing to read from them anyway)
+	if(fsize == 0)
+		target->id = NULL;
+	else if((target->id = (char *)mmap(NULL, fsize, PROT_READ | PROT_WRITE, MAP_SHARED, temp.id, 0)) == MAP_FAILED) {
 		flock(temp.id, LOCK_UN);
+		close(temp.id);
 		return -1;		
 	}
 
@@ -190,6 +534,68 @@ int map_file_to_memory(char *path, mapped_file *target) {
 }
 
 
+/*
+* Function used to map a given file to memory. Unix implementation.
+* ARGUMENTS:
+*	-path:		char path of the file in the file system
+*	-target:	mapped_file which the mapped file wants to be saved
+* RETURN VALUE:
+*	On success 0 is returned and target is correctly set, otherwise:
+*		-1 if there was an error while trying to open the file
+*		-2 if the lock could not be granted on the chosen file
+*/
+int map_file_to_memory(char *path, mapped_file *target) {
+
+	//open file (just use personal library for comfort)
+	io_interface temp;
+	
+	if(open_file(path, &temp) != 0) 
+		return -1;
+
+	return map_interface_to_memory(&temp, target);
+}
+
+
+
+/*
+* Function used to create a file of the given size and map it to memory, so that it can be written by more threads at once.
+* If the file already exists nothing is touched and the call fails. Unix implementation.
+* ARGUMENTS:
+*	-path:		char path of the file to create
+*	-size:		size of the new file
+*	-target:	mapped_file which the mapped file wants to be saved
+* RETURN VALUE:
+*	On success 0 is returned and target is correctly set, otherwise -1
+*/
+int create_mapped_file(char *path, long size, mapped_file *target) {
+
+	int fd;
+
+	if((fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666)) < 0)
+		return -1;
+
+	//the file is ours, it's removed so that a new try doesn't find it
+	if(ftruncate(fd, size) < 0) {
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	if(size == 0)
+		target->id = NULL;
+	else if((target->id = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	target->size	= size;
+	target->fd	= fd;
+
+	return 0;
+}
+
+
 
 /*
 * Function used to remove a mapped_file from memory.
@@ -201,7 +607,7 @@ int map_file_to_memory(char *path, mapped_file *target) {
 int unmap_file_from_memory(mapped_file *target) {
 	
 	//munmap allocated memory
-	if(munmap(target->id, target->size) < 0)
+	if(target->size > 0 && munmap(target->id, target->size) < 0)
 		return -1;
 
 	//remove lock
@@ -252,6 +658,75 @@ int join_thread(thread *target, void *res) {
 
 
 
+/*
+* Function used to read a monotonic clock. Unix implementation.
+* RETURN VALUE:
+*	Milliseconds passed from an arbitrary point, only useful to compute intervals
+*/
+long current_time_ms() {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/*
+* Function used to make the calling thread wait. Unix implementation.
+* ARGUMENTS:
+*	-ms:		milliseconds to wait
+*/
+void sleep_ms(long ms) {
+
+	struct timespec wait;
+	wait.tv_sec	= ms / 1000;
+	wait.tv_nsec	= (ms % 1000) * 1000000;
+
+	while(nanosleep(&wait, &wait) < 0 && errno == EINTR);
+}
+
+
+#define IO_PRIORITY_WHO_THREAD	1			//IOPRIO_WHO_PROCESS, which is the calling thread with id 0
+#define IO_PRIORITY_BACKGROUND	((2 << 13) | 7)		//lowest level of the best effort class: it's served last, but never starves
+#define IO_PRIORITY_DEFAULT	0			//no class: the priority follows the nice value of the thread
+
+/*
+* Function used to give the disk I/O of the calling thread the lowest priority, or to give it back the default
+* one. Unix implementation, it needs ioprio_set (Linux).
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int set_background_io(int background) {
+#ifdef SYS_ioprio_set
+	return syscall(SYS_ioprio_set, IO_PRIORITY_WHO_THREAD, 0, background ? IO_PRIORITY_BACKGROUND : IO_PRIORITY_DEFAULT) < 0 ? -1 : 0;
+#else
+	return -1;
+#endif
+}
+
+
+
+/*
+* Functions used to seed and read a random_state. Unix implementation, see random_state.
+*/
+int seed_random(random_state *target, unsigned int seed) {
+
+	memset(target, 0, sizeof(random_state));
+
+	return initstate_r(seed, target->state, sizeof(target->state), &target->data);
+}
+
+int next_random(random_state *target) {
+
+	int32_t result;
+	random_r(&target->data, &result);
+
+	return result;
+}
+
+
+
 /*
 * Function used to host a server.
 * After the sock_interface is correctly created, listen_to_sock(...) must be used in order to listen to the new sock_interface
@@ -292,7 +767,58 @@ int host_server(int portno, io_interface *target) {
 
 
 /*
-* Function used to listen to a previously created sock_interface, which writes to the given target the new io_interface to communicate with.
+* Function used to host a server on a local (Unix domain) socket, which clients of the same host use to hand over
+* their open files. A socket file left at path by a previous server is replaced.
+* ARGUMENTS:
+*	-path:		path of the socket file
+*	-target:	pointer to the io_interface structure which wants to be saved
+* RETURN VALUE:
+*	On success 0 is returned and target is correctly set, otherwise -1
+*/
+int host_local_server(char *path, io_interface *target) {
+
+	struct sockaddr_un server_addr;
+	int local_socket;
+
+	if(strlen(path) >= sizeof(server_addr.sun_path) || (local_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	bzero((char *) &server_addr, sizeof(server_addr));
+
+	server_addr.sun_family = AF_UNIX;
+	strcpy(server_addr.sun_path, path);
+
+	unlink(path);
+
+	if(bind(local_socket, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0 || listen(local_socket, SOCK_MAX_QUEUE_LENGTH) < 0) {
+		close(local_socket);
+		return -1;
+	}
+
+	target->id = local_socket;
+
+	return 0;
+}
+
+
+
+/*
+* Function used to send the small writes of a socket at once instead of waiting for the previous ones to be
+* acknowledged: a status frame followed by a short body would otherwise wait for the delayed ack of the other side.
+* Long responses are still sent as full segments by the batches of out_stream.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int set_socket_nodelay(io_interface *target) {
+
+	int nodelay = 1;
+
+	return setsockopt(target->id, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0 ? -1 : 0;
+}
+
+
+/*
+* Function used to listen to a previously created sock_interface, which writes to the given target the new io_interface to communicate with.
 * NOTE: this listen operates just as Unix's listen and will block the current process until a client communicates
 * ARGUMENTS:
 * 	-interface: 	sock_interface which wants to be listened
@@ -316,6 +842,7 @@ int listen_to_sock(io_interface *interface, io_interface *target) {
 		return -2;
 
 	target->id = new_sock_fd;	
+	set_socket_nodelay(target);
 	return 0;
 }
 
@@ -325,7 +852,7 @@ int listen_to_sock(io_interface *interface, io_interface *target) {
 * ARGUMENTS:
 * 	-interface: 	sock_interface which wants to be listened
 *	-target:	pointer to the io_interface which the accepted connection wants to be saved
-*	-timeout:	seconds to wait for a connection
+*	-timeout:	milliseconds to wait for a connection
 * RETURN VALUE:
 *	On succes 0 is returned and target is correctly set, otherwise -1
 */
@@ -346,8 +873,8 @@ int listen_to_sock_non_block(io_interface *interface, io_interface *target, int
 	FD_SET(interface->id, &fds);
 
 	//set time value
-	time_conf.tv_sec  = timeout;
-	time_conf.tv_usec = 0;
+	time_conf.tv_sec  = timeout / 1000;
+	time_conf.tv_usec = (timeout % 1000) * 1000;
 
 	//select!
 	int result = select(interface->id+1, &fds, NULL, NULL, &time_conf);
@@ -357,7 +884,10 @@ int listen_to_sock_non_block(io_interface *interface, io_interface *target, int
 		struct sockaddr_in client_addr;
 		socklen_t cli_len = sizeof(client_addr);
 
-		target->id = accept(interface->id, (struct sockaddr *)&client_addr, &cli_len);
+		if((target->id = accept(interface->id, (struct sockaddr *)&client_addr, &cli_len)) < 0)
+			return -1;
+
+		set_socket_nodelay(target);
 	}
 	else {
 		return -1;
@@ -368,549 +898,2323 @@ int listen_to_sock_non_block(io_interface *interface, io_interface *target, int
 
 
 /*
-* Function used to connect to a remote server through sockets.
+* Function used to connect to a remote server through sockets, giving up after timeout_ms if it doesn't answer.
 * ARGUMENTS:
 * 	-addr: 		the address of the server to connect
 *	-portno: 	port number to start the connection
+*	-timeout_ms:	ms the connection can take (0 means the timeout of the system)
 *	-target: 	pointer to the io_interface where the new established connection wants to be saved
 * RETURN VALUE:
 *	On success 0 is returned and target is correctly set.
 *	On failure:	-1 is returned if the address given is invalid
-*			-2 is returned if there was a problem connecting to the given address
+*			-2 is returned if there was a problem connecting to the given address, or if it took too long
 */
-int connect_to_server(char *address, int portno, io_interface *target) {
-	
-	struct sockaddr_in server_addr;
-	struct hostent *server;
+int connect_to_server_timeout(char *address, int portno, long timeout_ms, io_interface *target) {
+
+	struct addrinfo hints;
+	struct addrinfo *server;
+	char port[16];
 	int sockfd;
-	
-	if((server = gethostbyname(address)) == NULL) 
+
+	//getaddrinfo can be called by several threads at once (e.g. the connections of a batch)
+	bzero(&hints, sizeof(hints));
+	hints.ai_family		= AF_INET;
+	hints.ai_socktype	= SOCK_STREAM;
+
+	snprintf(port, sizeof(port), "%i", portno);
+
+	if(getaddrinfo(address, port, &hints, &server) != 0)
 		return -1;
-	
-	if((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+
+	if((sockfd = socket(server->ai_family, server->ai_socktype, server->ai_protocol)) < 0) {
+		freeaddrinfo(server);
 		return -2;
+	}
 
-	//configure protocol
-	bzero((char *) &server_addr, sizeof(server_addr));
-	server_addr.sin_family = AF_INET;
-	bcopy((char *) server->h_addr, (char *)&server_addr.sin_addr.s_addr, server->h_length);
-	server_addr.sin_port = htons(portno);
+	int flags = fcntl(sockfd, F_GETFL, 0);
+
+	//the connection is waited for with poll, then the socket is blocking again
+	if(timeout_ms > 0 && (flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+		close(sockfd);
+		freeaddrinfo(server);
+		return -2;
+	}
+
+	int connected = connect(sockfd, server->ai_addr, server->ai_addrlen);
+
+	if(connected < 0 && errno == EINPROGRESS && timeout_ms > 0) {
+
+		struct pollfd waiting = { sockfd, POLLOUT, 0 };
+		int error = -1;
+		socklen_t length = sizeof(error);
 
-	if(connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0)
-		return -2; 
+		if(poll(&waiting, 1, (int)timeout_ms) == 1 && getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0)
+			connected = 0;
+	}
+
+	freeaddrinfo(server);
+
+	if(connected < 0 || (timeout_ms > 0 && fcntl(sockfd, F_SETFL, flags) < 0)) {
+		close(sockfd);
+		return -2;
+	}
 
 	target->id=sockfd;
+	set_socket_nodelay(target);
 	
 	return 0;
 }
 
 
+
 /*
-* Function used to write an integer to the given socket io_interface.
+* Function used to connect to a server hosted with host_local_server.
 * ARGUMENTS:
-*	-int_to_write:	integer to write to the socket
-*	-target:	io_interface socket to write the int to
+*	-path:		path of the socket file
+*	-target:	pointer to the io_interface where the new established connection wants to be saved
 * RETURN VALUE:
-*	On success 0 is returned, otherwise -1
+*	On success 0 is returned and target is correctly set, otherwise -1
 */
-int write_int_to_socket(int int_to_write, io_interface *target) {
+int connect_to_local_server(char *path, io_interface *target) {
 
-	int32_t converted = htonl(int_to_write);
-	char *data = (char*)&converted;
-	int left = sizeof(converted);
-	int written;
-	
-	do {
-		written = write(target->id, data, left);
-		if (written < 0) {
-			return -1;
-		}
-		else {
-			data += written;
-			left -= written;
-		}
+	struct sockaddr_un server_addr;
+	int local_socket;
+
+	if(strlen(path) >= sizeof(server_addr.sun_path) || (local_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	bzero((char *) &server_addr, sizeof(server_addr));
+
+	server_addr.sun_family = AF_UNIX;
+	strcpy(server_addr.sun_path, path);
+
+	if(connect(local_socket, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+		close(local_socket);
+		return -1;
 	}
-	while (left > 0);	
+
+	target->id = local_socket;
 
 	return 0;
 }
 
 
 /*
-* Function used to read an integer from the given socket io_interface.
+* Function used to connect to a remote server through sockets.
 * ARGUMENTS:
-*	-int_ptr:	pointer to the integer where the received int wants to be written
-*	-source:	io_interface socket to read the int from
+* 	-addr: 		the address of the server to connect
+*	-portno: 	port number to start the connection
+*	-target: 	pointer to the io_interface where the new established connection wants to be saved
 * RETURN VALUE:
-*	On success 0 is returned and int_ptr is correctly set, otherwise -1
+*	On success 0 is returned and target is correctly set.
+*	On failure:	-1 is returned if the address given is invalid
+*			-2 is returned if there was a problem connecting to the given address
 */
-int read_int_from_socket(int *int_ptr, io_interface *source) {
+int connect_to_server(char *address, int portno, io_interface *target) {
+	return connect_to_server_timeout(address, portno, 0, target);
+}
 
-	int32_t ret;
-	char *data = (char *)&ret;
-	int left = sizeof(ret);
-	int written;
 
-	do {
-		written = read(source->id, data, left);
-		if (written < 0) {
-			return -1;
-		}
-		else {
-			data += written;
-			left -= written;
-		}
-	}
-	while (left > 0);
+/*
+* Function used to write the address of the client connected to the given socket io_interface.
+* ARGUMENTS:
+*	-source:	the connected socket
+*	-save_to:	string where the address is written
+*	-length:	size of save_to
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1 (and save_to is set to an empty string)
+*/
+int peer_address(io_interface *source, char *save_to, int length) {
 
-	*int_ptr = ntohl(ret);
+	struct sockaddr_in client_addr;
+	socklen_t cli_len = sizeof(client_addr);
+
+	save_to[0] = '\0';
+
+	if(getpeername(source->id, (struct sockaddr *)&client_addr, &cli_len) < 0 || client_addr.sin_family != AF_INET)
+		return -1;
+
+	if(inet_ntop(AF_INET, &client_addr.sin_addr, save_to, length) == NULL)
+		return -1;
 
 	return 0;
 }
 
 
 /*
-* Function used to write a string to the given socket io_interface.
+* Function used to throw away what a client already sent on a connection which is going to be refused,
+* so that closing it doesn't reset the connection before the client reads the answer. It never blocks.
 * ARGUMENTS:
-*	-source:	pointer to the string which wants to be written to the socket
-*	-target:	io_interface socket to write the string to
+*	-source:	the connected socket
+*/
+void discard_input(io_interface *source) {
+
+	char buffer[512];
+
+	while(recv(source->id, buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+}
+
+
+/*
+* Function used to limit how long blocking reads and writes of a socket can wait.
+* ARGUMENTS:
+*	-target:	the socket
+*	-read_ms:	ms a read can wait for data (0 means forever)
+*	-write_ms:	ms a write can wait for the client (0 means forever)
 * RETURN VALUE:
 *	On success 0 is returned, otherwise -1
 */
-int write_string_to_socket(char *source, io_interface *target) {
+int set_socket_timeouts(io_interface *target, long read_ms, long write_ms) {
 
-	int left = strlen(source)+1;
-	int written;
-	char *index = source;
+	struct timeval read_time	= { read_ms / 1000, (read_ms % 1000) * 1000 };
+	struct timeval write_time	= { write_ms / 1000, (write_ms % 1000) * 1000 };
 
-	do {
-		written = write(target->id, index, left);
-		if (written < 0) {
-			return -1;
-		}
-		else {
-			index	+= written;
-			left	-= written;
-		}
-	}
-	while (left > 0);
+	if(setsockopt(target->id, SOL_SOCKET, SO_RCVTIMEO, &read_time, sizeof(read_time)) < 0 ||
+		setsockopt(target->id, SOL_SOCKET, SO_SNDTIMEO, &write_time, sizeof(write_time)) < 0)
+		return -1;
 
 	return 0;
 }
 
 
 /*
-* Function used to read a string from the given socket io_interface.
-* ARGUMENTS:
-*	-save_to:	pointer to the location where to save the received string
-*	-source:	io_interface socket to read the string from
+* Function used to hold back (or to release) the partial TCP segments of a socket, so that many small
+* writes leave as full segments.
 * RETURN VALUE:
-*	On success 0 is returned and save_to is correctly set, otherwise -1
+*	On success 0 is returned, otherwise -1
 */
-int read_string_from_socket(char *save_to,  io_interface *source) {
+int set_socket_cork(io_interface *target, int cork) {
+	return setsockopt(target->id, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)) < 0 ? -1 : 0;
+}
 
-	int rb = 0; //read bytes
-	char last_char = '*'; //just choose a char different from \0
 
+/*
+* Function used to set a socket as non-blocking, so that reads and writes return at once when they can't go on.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int set_non_blocking(io_interface *target) {
+
+	int flags;
 
-	while(last_char != '\0') {
-		rb += read(source->id, save_to + rb, SOCK_PACKET_SIZE);
-		last_char = *(save_to + rb - 1);
-	}
+	if((flags = fcntl(target->id, F_GETFL, 0)) < 0 || fcntl(target->id, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -1;
 
 	return 0;
 }
 
 
 /*
-* Function used to print a string to a given socket io_interface.
-* ARGUMENTS:
-*	-source:	pointer to the string which wants to be sent
-*	-target:	io_interface socket which string wants to be printed to
+* Function used to make a hosted server socket ready for accept_from_sock.
 * RETURN VALUE:
-*	On success 0 is returned and save_to is correctly set, otherwise -1
+*	On success 0 is returned, otherwise -1
 */
-int print_string_to_socket(char *source, io_interface *target) {
-
-	int left = strlen(source);
-	int written;
-	char *index = source;
+int start_listening(io_interface *interface) {
 
-	do {
-		written = write(target->id, index, left);
-		if (written < 0) {
-			return -1;
-		}
-		else {
-			index	+= written;
-			left	-= written;
-		}
-	}
-	while (left > 0);
+	if(listen(interface->id, SOMAXCONN) < 0)
+		return -1;
 
-	return 0;
+	return set_non_blocking(interface);
 }
 
+
 /*
-* Function used to print a string received by a given socket io_interface.
-* ARGUMENTS:
-*	-source:	io_interface socket which string wants to be printed from
-*	-string_end:	the string which defines the end of the print loop. After this string is received the function returns 0
+* Function used to accept a connection from a socket prepared with start_listening, without blocking.
+* The accepted connection is blocking, just like the ones returned by listen_to_sock.
 * RETURN VALUE:
-*	On success 0 is returned and save_to is correctly set, otherwise -1
+*	On success 0 is returned and target is set, -1 if no connection is waiting
 */
-int print_string_from_socket(io_interface *source, char *string_end) {
-	
-	int rb = 0;
-	char *buffer = malloc(SOCK_PACKET_SIZE);
-	char *end_buffer = malloc(strlen(string_end)+1);
-	int going = 1;
+int accept_from_sock(io_interface *interface, io_interface *target) {
 
-	while(going) {
-		rb = read(source->id, buffer, SOCK_PACKET_SIZE);
+	int new_sock_fd;
 
-		if(rb < 0)
-			return -1;
-	
-		int string_end_index = rb - (strlen(string_end));
+	if((new_sock_fd = accept(interface->id, NULL, NULL)) < 0)
+		return -1;
 
-		//if the string received is really small (because TCP is a scumbag and decided to split it), end_buffer must be handled correctly
-		//and the current value should be shifted left until there is space for the new received string
-		if(string_end_index < 0) {
-			
-			int bytes_to_shift = -string_end_index;
-			char *to_shift = end_buffer + strlen(string_end) - bytes_to_shift;
+	target->id = new_sock_fd;
+	set_socket_nodelay(target);
+	return 0;
+}
 
-			//allocate space for temporary string which will be the new end_buffer string
-			char *temp = malloc(sizeof(string_end)+1);
 
-			//put char termination on the buffer so that the next methods will work correctly
-			//this direct assignment is safe as long that string_end is not as big as the entire buffer (why should it be?)
-			buffer[rb] = '\0';
+/*
+* Function used to read from a non-blocking socket what is already available.
+* RETURN VALUE:
+*	The number of bytes read, 0 if nothing is available yet, -1 if the connection was closed or broken
+*/
+int read_available(char *save_to, int length, io_interface *source) {
 
-			//save the new string to temp and copy it to the end_buffer
-			sprintf(temp, "%s%s", to_shift, buffer);
-			strcpy(end_buffer, temp);
+	ssize_t result = recv(source->id, save_to, length, 0);
 
-			//free allocated space for temp
-			free(temp);
+	if(result > 0)
+		return (int)result;
 
+	if(result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
 
-		}
-		//if you received a long string, just copy the last strlen(string_end) bytes to the buffer and check them!
-		else {
-			memcpy(end_buffer, buffer + string_end_index, strlen(string_end));
-			end_buffer[strlen(string_end)] = '\0';
+	return -1;
+}
 
-		}
 
-		//if you received string_end mark change the exit flag and remove the last bytes of the message
-		//from printing (you should not print string_end if you can avoid it)
-		if(strcmp(string_end, end_buffer) == 0) {
+/*
+* Function used to write to a non-blocking socket as much as it can take now.
+* RETURN VALUE:
+*	The number of bytes written (0 if the socket is full), -1 if the connection is broken
+*/
+int write_available(char *source, int length, io_interface *target) {
 
-			going = 0;
-			//if you can delete the end string because it was all transmitted in a single packet do it,
-			//otherwise just dump what you can
-			rb = rb - strlen(string_end) < 0 ? 0 : rb - strlen(string_end);
+	ssize_t result = send(target->id, source, length, MSG_NOSIGNAL);
 
-		}
+	if(result >= 0)
+		return (int)result;
 
-		//print the string
-		printf("%.*s", rb, buffer);
+	if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		return 0;
 
+	return -1;
+}
+
+
+/*
+* Function used to start a poller. Unix implementation.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int start_poller(poller *target) {
+
+	if((target->id = epoll_create1(0)) < 0)
+		return -1;
+
+	if(pipe(target->wake) < 0) {
+		close(target->id);
+		return -1;
+	}
+
+	fcntl(target->wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(target->wake[1], F_SETFL, O_NONBLOCK);
+
+	struct epoll_event event;
+	event.events	= EPOLLIN;
+	event.data.ptr	= target->wake;
+
+	if(epoll_ctl(target->id, EPOLL_CTL_ADD, target->wake[0], &event) < 0) {
+		close(target->id);
+		close(target->wake[0]);
+		close(target->wake[1]);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to add a socket to a poller or to change what it is watched for.
+* ARGUMENTS:
+*	-target:	the poller
+*	-source:	the socket
+*	-events:	POLL_READ and/or POLL_WRITE, 0 to stop watching it for a while
+*	-data:		pointer returned by poller_wait when the socket is ready
+*	-added:		0 the first time the socket is given to the poller, 1 to change it
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int poller_watch(poller *target, io_interface *source, int events, void *data, int added) {
+
+	struct epoll_event event;
+	event.events	= ((events & POLL_READ) ? EPOLLIN | EPOLLRDHUP : 0) | ((events & POLL_WRITE) ? EPOLLOUT : 0);
+	event.data.ptr	= data;
+
+	return epoll_ctl(target->id, added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, source->id, &event);
+}
+
+
+/*
+* Function used to remove a socket from a poller, before closing it.
+*/
+int poller_forget(poller *target, io_interface *source) {
+
+	struct epoll_event event;
+
+	return epoll_ctl(target->id, EPOLL_CTL_DEL, source->id, &event);
+}
+
+
+/*
+* Function used to wait until some of the watched sockets are ready or poller_wake is called.
+* ARGUMENTS:
+*	-target:	the poller
+*	-events:	array where the ready sockets are saved
+*	-max:		size of events
+*	-timeout:	milliseconds to wait at most
+* RETURN VALUE:
+*	The number of ready sockets saved in events (0 on timeout or wake up), -1 on error
+*/
+int poller_wait(poller *target, poll_event *events, int max, int timeout) {
+
+	struct epoll_event ready[max];
+	int count = epoll_wait(target->id, ready, max, timeout);
+	int saved = 0;
+
+	if(count < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for(int i=0; i<count; i++) {
+
+		if(ready[i].data.ptr == target->wake) {
+			char buffer[64];
+			while(read(target->wake[0], buffer, sizeof(buffer)) > 0);
+			continue;
+		}
+
+		events[saved].data	= ready[i].data.ptr;
+		events[saved].events	= 0;
+
+		if(ready[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			events[saved].events |= POLL_READ;
+		if(ready[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			events[saved].events |= POLL_WRITE;
+
+		saved++;
+	}
+
+	return saved;
+}
+
+
+/*
+* Function used by any thread to interrupt poller_wait.
+*/
+void poller_wake(poller *target) {
+	if(write(target->wake[1], "w", 1) < 0)
+		return;
+}
+
+
+/*
+* Function used to stop a poller, its sockets are not closed.
+*/
+void stop_poller(poller *target) {
+	close(target->id);
+	close(target->wake[0]);
+	close(target->wake[1]);
+}
+
+
+/*
+* Function used to write an integer to the given socket io_interface.
+* ARGUMENTS:
+*	-int_to_write:	integer to write to the socket
+*	-target:	io_interface socket to write the int to
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int write_int_to_socket(int int_to_write, io_interface *target) {
+
+	int32_t converted = htonl(int_to_write);
+	char *data = (char*)&converted;
+	int left = sizeof(converted);
+	int written;
+	
+	do {
+		written = send(target->id, data, left, MSG_NOSIGNAL);
+		if (written < 0) {
+			return -1;
+		}
+		else {
+			data += written;
+			left -= written;
+		}
+	}
+	while (left > 0);	
+
+	return 0;
+}
+
+
+/*
+* Function used to read an integer from the given socket io_interface.
+* ARGUMENTS:
+*	-int_ptr:	pointer to the integer where the received int wants to be written
+*	-source:	io_interface socket to read the int from
+* RETURN VALUE:
+*	On success 0 is returned and int_ptr is correctly set, otherwise -1
+*/
+int read_int_from_socket(int *int_ptr, io_interface *source) {
+
+	int32_t ret;
+	char *data = (char *)&ret;
+	int left = sizeof(ret);
+	int written;
+
+	do {
+		written = read(source->id, data, left);
+		//the connection was closed before the whole int arrived
+		if (written <= 0) {
+			return -1;
+		}
+		else {
+			data += written;
+			left -= written;
+		}
+	}
+	while (left > 0);
+
+	*int_ptr = ntohl(ret);
+
+	return 0;
+}
+
+
+/*
+* Function used to write a string to the given socket io_interface.
+* ARGUMENTS:
+*	-source:	pointer to the string which wants to be written to the socket
+*	-target:	io_interface socket to write the string to
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int write_string_to_socket(char *source, io_interface *target) {
+
+	int left = strlen(source)+1;
+	int written;
+	char *index = source;
+
+	do {
+		written = send(target->id, index, left, MSG_NOSIGNAL);
+		if (written < 0) {
+			return -1;
+		}
+		else {
+			index	+= written;
+			left	-= written;
+		}
+	}
+	while (left > 0);
+
+	return 0;
+}
+
+
+/*
+* Function used to read a string from the given socket io_interface.
+* ARGUMENTS:
+*	-save_to:	pointer to the location where to save the received string
+*	-source:	io_interface socket to read the string from
+* RETURN VALUE:
+*	On success 0 is returned and save_to is correctly set, otherwise -1
+*/
+int read_string_from_socket(char *save_to,  io_interface *source) {
+
+	int rb = 0; //read bytes
+	int result;
+
+	//read until the string termination char is received, but never more than SOCK_PACKET_SIZE bytes
+	while(rb == 0 || save_to[rb - 1] != '\0') {
+
+		if(rb == SOCK_PACKET_SIZE)
+			return -1;
+
+		result = read(source->id, save_to + rb, SOCK_PACKET_SIZE - rb);
+
+		if(result <= 0)
+			return -1;
+
+		rb += result;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to send a request together with two open files over a local socket: the files are handed over as
+* descriptors (SCM_RIGHTS) with a single byte, then the request is written like write_string_to_socket does.
+* ARGUMENTS:
+*	-source:	the request
+*	-file:		the open file the request reads, it stays open here too
+*	-output:	the open file the request writes, it stays open here too
+*	-target:	a connection made with connect_to_local_server
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int write_file_to_socket(char *source, io_interface *file, io_interface *output, io_interface *target) {
+
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	int descriptors[2] = { file->id, output->id };
+	char marker = 0;
+	struct iovec data;
+	struct msghdr message;
+
+	bzero(control, sizeof(control));
+	bzero(&message, sizeof(message));
+
+	data.iov_base		= &marker;
+	data.iov_len		= 1;
+	message.msg_iov		= &data;
+	message.msg_iovlen	= 1;
+	message.msg_control	= control;
+	message.msg_controllen	= sizeof(control);
+
+	struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+
+	header->cmsg_level	= SOL_SOCKET;
+	header->cmsg_type	= SCM_RIGHTS;
+	header->cmsg_len	= CMSG_LEN(sizeof(descriptors));
+	memcpy(CMSG_DATA(header), descriptors, sizeof(descriptors));
+
+	if(sendmsg(target->id, &message, MSG_NOSIGNAL) != 1)
+		return -1;
+
+	return write_string_to_socket(source, target);
+}
+
+
+/*
+* Function used to receive a request sent with write_file_to_socket.
+* ARGUMENTS:
+*	-save_to:	where the request is saved, SOCK_PACKET_SIZE bytes at most
+*	-file:		where the file the request reads is saved, it must be closed by the caller
+*	-output:	where the file the request writes is saved, it must be closed by the caller
+*	-source:	the connection of a local client
+* RETURN VALUE:
+*	On success 0 is returned and save_to, file and output are set, otherwise -1 (no file is left open)
+*/
+int read_file_from_socket(char *save_to, io_interface *file, io_interface *output, io_interface *source) {
+
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	int descriptors[2];
+	char marker;
+	struct iovec data;
+	struct msghdr message;
+
+	bzero(&message, sizeof(message));
+
+	data.iov_base		= &marker;
+	data.iov_len		= 1;
+	message.msg_iov		= &data;
+	message.msg_iovlen	= 1;
+	message.msg_control	= control;
+	message.msg_controllen	= sizeof(control);
+
+	if(recvmsg(source->id, &message, MSG_CMSG_CLOEXEC) != 1)
+		return -1;
+
+	struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+
+	if(header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+		return -1;
+
+	//whatever was handed over is closed if it's not exactly two files
+	int count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+	if(count != 2) {
+		for(int i=0; i<count && i<2; i++) {
+			memcpy(descriptors, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+			close(descriptors[0]);
+		}
+		return -1;
+	}
+
+	memcpy(descriptors, CMSG_DATA(header), sizeof(descriptors));
+
+	file->id	= descriptors[0];
+	output->id	= descriptors[1];
+
+	if(read_string_from_socket(save_to, source) < 0) {
+		close(file->id);
+		close(output->id);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to print a string to a given socket io_interface.
+* ARGUMENTS:
+*	-source:	pointer to the string which wants to be sent
+*	-target:	io_interface socket which string wants to be printed to
+* RETURN VALUE:
+*	On success 0 is returned and save_to is correctly set, otherwise -1
+*/
+int print_string_to_socket(char *source, io_interface *target) {
+
+	int left = strlen(source);
+	int written;
+	char *index = source;
+
+	do {
+		written = send(target->id, index, left, MSG_NOSIGNAL);
+		if (written < 0) {
+			return -1;
+		}
+		else {
+			index	+= written;
+			left	-= written;
+		}
+	}
+	while (left > 0);
+
+	return 0;
+}
+
+/*
+* Function used to print a string received by a given socket io_interface.
+* ARGUMENTS:
+*	-source:	io_interface socket which string wants to be printed from
+*	-string_end:	the string which defines the end of the print loop. After this string is received the function returns 0
+* RETURN VALUE:
+*	On success 0 is returned and save_to is correctly set, otherwise -1
+*/
+int print_string_from_socket(io_interface *source, char *string_end) {
+	
+	int rb = 0;
+	char *buffer = malloc(SOCK_PACKET_SIZE);
+	char *end_buffer = malloc(strlen(string_end)+1);
+	int going = 1;
+
+	while(going) {
+		rb = read(source->id, buffer, SOCK_PACKET_SIZE);
+
+		if(rb < 0)
+			return -1;
+	
+		int string_end_index = rb - (strlen(string_end));
+
+		//if the string received is really small (because TCP is a scumbag and decided to split it), end_buffer must be handled correctly
+		//and the current value should be shifted left until there is space for the new received string
+		if(string_end_index < 0) {
+			
+			int bytes_to_shift = -string_end_index;
+			char *to_shift = end_buffer + strlen(string_end) - bytes_to_shift;
+
+			//allocate space for temporary string which will be the new end_buffer string
+			char *temp = malloc(sizeof(string_end)+1);
+
+			//put char termination on the buffer so that the next methods will work correctly
+			//this direct assignment is safe as long that string_end is not as big as the entire buffer (why should it be?)
+			buffer[rb] = '\0';
+
+			//save the new string to temp and copy it to the end_buffer
+			sprintf(temp, "%s%s", to_shift, buffer);
+			strcpy(end_buffer, temp);
+
+			//free allocated space for temp
+			free(temp);
+
+
+		}
+		//if you received a long string, just copy the last strlen(string_end) bytes to the buffer and check them!
+		else {
+			memcpy(end_buffer, buffer + string_end_index, strlen(string_end));
+			end_buffer[strlen(string_end)] = '\0';
+
+		}
+
+		//if you received string_end mark change the exit flag and remove the last bytes of the message
+		//from printing (you should not print string_end if you can avoid it)
+		if(strcmp(string_end, end_buffer) == 0) {
+
+			going = 0;
+			//if you can delete the end string because it was all transmitted in a single packet do it,
+			//otherwise just dump what you can
+			rb = rb - strlen(string_end) < 0 ? 0 : rb - strlen(string_end);
+
+		}
+
+		//print the string
+		printf("%.*s", rb, buffer);
+
+	}
+
+	free(buffer);
+	free(end_buffer);
+	return 0;
+}
+
+
+/*
+* Function used to write a given number of bytes to the given socket io_interface.
+* ARGUMENTS:
+*	-source:	pointer to the bytes which want to be written
+*	-length:	number of bytes to write
+*	-target:	io_interface socket to write the bytes to
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int write_bytes_to_socket(char *source, int length, io_interface *target) {
+
+	int written;
+
+	while(length > 0) {
+		written = send(target->id, source, length, MSG_NOSIGNAL);
+		if(written < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		source += written;
+		length -= written;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to read exactly the given number of bytes from the given socket io_interface.
+* ARGUMENTS:
+*	-save_to:	pointer to the location where to save the received bytes
+*	-length:	number of bytes to read
+*	-source:	io_interface socket to read the bytes from
+* RETURN VALUE:
+*	On success 0 is returned and save_to is correctly set, otherwise -1 (also when the connection is closed)
+*/
+int read_bytes_from_socket(char *save_to, int length, io_interface *source) {
+
+	int rb;
+
+	while(length > 0) {
+		rb = read(source->id, save_to, length);
+		if(rb < 0 && errno == EINTR)
+			continue;
+		if(rb <= 0)
+			return -1;
+		save_to += rb;
+		length -= rb;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to read what a socket io_interface received, waiting until something arrives.
+* RETURN VALUE:
+*	The number of bytes read, 0 if the connection was closed, -1 on error
+*/
+int read_some_from_socket(char *save_to, int length, io_interface *source) {
+
+	int rb;
+
+	while((rb = read(source->id, save_to, length)) < 0 && errno == EINTR);
+
+	return rb;
+}
+
+
+/*
+* Function used to know if a connection which is not being used was closed by the other side, before sending a new
+* request over it (e.g. servers close the connections which stay idle for too long).
+* RETURN VALUE:
+*	1 if it was closed (or something nobody asked for arrived), 0 if it can be used
+*/
+int is_connection_closed(io_interface *target) {
+
+	char byte;
+	int rb = recv(target->id, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+	return !(rb < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+
+/*
+* Function used to write a v2 frame to the given socket io_interface. Header and payload are sent with a single writev.
+* ARGUMENTS:
+*	-type:		FRAME_* type of the frame
+*	-flags:		flags of the frame (0 if none)
+*	-payload:	pointer to the payload (can be NULL if length is 0)
+*	-length:	length of the payload, it must not be bigger than FRAME_BUFFER_SIZE
+*	-target:	io_interface socket to write the frame to
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int write_frame_to_socket(int type, int flags, char *payload, int length, io_interface *target) {
+
+	unsigned char header[FRAME_HEADER_SIZE];
+	uint32_t converted = htonl(length);
+
+	header[0] = (unsigned char)type;
+	header[1] = (unsigned char)flags;
+	header[2] = 0;
+	header[3] = 0;
+	memcpy(header + 4, &converted, sizeof(converted));
+
+	struct iovec parts[2];
+	parts[0].iov_base = header;
+	parts[0].iov_len  = FRAME_HEADER_SIZE;
+	parts[1].iov_base = payload;
+	parts[1].iov_len  = length;
+
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov	   = parts;
+	message.msg_iovlen = length > 0 ? 2 : 1;
+	ssize_t written;
+
+	//most of the times everything is sent at the first try, otherwise fall back to plain writes for what is left
+	while((written = sendmsg(target->id, &message, MSG_NOSIGNAL)) < 0) {
+		if(errno != EINTR)
+			return -1;
+	}
+
+	if(written < FRAME_HEADER_SIZE) {
+		if(write_bytes_to_socket((char *)header + written, FRAME_HEADER_SIZE - written, target) < 0)
+			return -1;
+		written = FRAME_HEADER_SIZE;
+	}
+
+	return write_bytes_to_socket(payload + (written - FRAME_HEADER_SIZE), length - (written - FRAME_HEADER_SIZE), target);
+}
+
+
+/*
+* Function used to read a v2 frame from the given socket io_interface.
+* ARGUMENTS:
+*	-header:	pointer to the frame_header to save the header of the frame to
+*	-save_to:	pointer to the buffer where the payload will be saved
+*	-max_length:	size of save_to, frames bigger than it are treated as an error
+*	-source:	io_interface socket to read the frame from
+* RETURN VALUE:
+*	On success 0 is returned and both header and save_to are correctly set, otherwise -1
+*/
+int read_frame_from_socket(frame_header *header, char *save_to, int max_length, io_interface *source) {
+
+	unsigned char raw[FRAME_HEADER_SIZE];
+	uint32_t length;
+
+	if(read_bytes_from_socket((char *)raw, FRAME_HEADER_SIZE, source) < 0)
+		return -1;
+
+	memcpy(&length, raw + 4, sizeof(length));
+
+	header->type	= raw[0];
+	header->flags	= raw[1];
+	header->length	= ntohl(length);
+
+	if(header->length < 0 || header->length > max_length)
+		return -1;
+
+	return read_bytes_from_socket(save_to, header->length, source);
+}
+
+
+/*
+* Function used to read the next DATA frame of a response, compressed frames are expanded.
+* ARGUMENTS:
+*	-header:	pointer to the frame_header to save the header of the frame to, its length is the expanded one
+*	-buffer:	buffer of at least FRAME_BUFFER_SIZE bytes where the payload is saved
+*	-expanded:	pointer to a buffer of FRAME_BUFFER_SIZE bytes used for compressed frames, allocated the first
+*			time one is received (the caller must free it)
+*	-payload:	set to buffer or to *expanded, where the bytes of the frame are
+*	-source:	io_interface socket to read the frame from
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int read_data_frame_from_socket(frame_header *header, char *buffer, char **expanded, char **payload, io_interface *source) {
+
+	if(read_frame_from_socket(header, buffer, FRAME_BUFFER_SIZE, source) < 0)
+		return -1;
+
+	*payload = buffer;
+
+	if(header->type != FRAME_DATA || (header->flags & FRAME_COMPRESSED) == 0)
+		return 0;
+
+	if(*expanded == NULL && (*expanded = malloc(FRAME_BUFFER_SIZE)) == NULL)
+		return -1;
+
+	if((header->length = expand_block(buffer, header->length, *expanded, FRAME_BUFFER_SIZE)) < 0)
+		return -1;
+
+	*payload = *expanded;
+
+	return 0;
+}
+
+
+/*
+* Function used to print every DATA frame received by a given socket io_interface, until an END frame is received.
+* ARGUMENTS:
+*	-source:	io_interface socket which frames want to be printed from
+*	-buffer:	buffer of at least FRAME_BUFFER_SIZE bytes used to receive the frames
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int print_frames_from_socket(io_interface *source, char *buffer) {
+
+	frame_header header;
+	char *expanded = NULL;
+	char *payload;
+	int result = -1;
+
+	while(read_data_frame_from_socket(&header, buffer, &expanded, &payload, source) == 0) {
+
+		if(header.type == FRAME_END) {
+			result = 0;
+			break;
+		}
+
+		//frames are printed as they arrive, the first entries of a listing don't wait for the others
+		if(header.type == FRAME_DATA) {
+			fwrite(payload, 1, header.length, stdout);
+			fflush(stdout);
+		}
+	}
+
+	free(expanded);
+
+	return result;
+}
+
+
+/*
+* Function used to write raw bytes to an out_stream, either to its socket or to its sink.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int stream_bytes(out_stream *out, char *source, int length) {
+
+	if(out->sink != NULL)
+		return out->sink(out->sink_param, source, length);
+
+	return write_bytes_to_socket(source, length, out->target);
+}
+
+
+/*
+* Function used to write a frame with the given flags to an out_stream, either to its socket or to its sink.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int stream_frame_ex(out_stream *out, int type, int flags, char *payload, int length) {
+
+	if(out->sink == NULL)
+		return write_frame_to_socket(type, flags, payload, length, out->target);
+
+	unsigned char header[FRAME_HEADER_SIZE];
+	uint32_t converted = htonl(length);
+
+	header[0] = (unsigned char)type;
+	header[1] = (unsigned char)flags;
+	header[2] = 0;
+	header[3] = 0;
+	memcpy(header + 4, &converted, sizeof(converted));
+
+	if(out->sink(out->sink_param, (char *)header, FRAME_HEADER_SIZE) < 0)
+		return -1;
+
+	return length > 0 ? out->sink(out->sink_param, payload, length) : 0;
+}
+
+
+/*
+* Function used to write a frame without flags to an out_stream (see stream_frame_ex).
+*/
+int stream_frame(out_stream *out, int type, char *payload, int length) {
+	return stream_frame_ex(out, type, 0, payload, length);
+}
+
+
+/*
+* Function used to send the bytes collected in the batch of an out_stream, as a single write (or a single
+* DATA frame, compressed if it was asked and it makes it smaller).
+* The first batches are small and pushed out of the cork at once, so that the client sees the first
+* entries of a listing quickly: every one of them is twice as big as the previous one, up to batch_size.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int stream_flush(out_stream *out) {
+
+	if(out->batch == NULL || out->batched == 0)
+		return 0;
+
+	int length = out->batched;
+	int result;
+
+	out->batched = 0;
+
+	if(out->protocol == PROTOCOL_V1)
+		result = stream_bytes(out, out->batch, length);
+	else {
+
+		int packed_length = out->packed != NULL ? compress_block(out->batch, length, out->packed, length - 1) : -1;
+
+		if(packed_length > 0)
+			result = stream_frame_ex(out, FRAME_DATA, FRAME_COMPRESSED, out->packed, packed_length);
+		else
+			result = stream_frame(out, FRAME_DATA, out->batch, length);
+	}
+
+	if(out->batch_limit < out->batch_size) {
+
+		out->batch_limit = out->batch_limit * 2 < out->batch_size ? out->batch_limit * 2 : out->batch_size;
+
+		if(out->sink == NULL) {
+			set_socket_cork(out->target, 0);
+			set_socket_cork(out->target, 1);
+		}
+	}
+
+	return result;
+}
+
+
+/*
+* Function used to make stream_write collect the bytes of a response in a buffer instead of sending them one
+* write at a time. Writes to a socket are also corked until stream_end_batch.
+* ARGUMENTS:
+*	-out:		out_stream of the request
+*	-buffer:	buffer of size bytes (at most FRAME_BUFFER_SIZE), NULL to keep writing every time
+*	-size:		size of buffer
+*/
+void stream_start_batch(out_stream *out, char *buffer, int size) {
+
+	out->batch		= buffer;
+	out->batched		= 0;
+	out->batch_size		= size;
+	out->batch_limit	= size < STREAM_FIRST_BATCH ? size : STREAM_FIRST_BATCH;
+	out->packed		= NULL;
+
+	if(buffer != NULL && out->sink == NULL)
+		set_socket_cork(out->target, 1);
+}
+
+
+/*
+* Function used to make the batches of an out_stream be sent as compressed DATA frames (see FRAME_COMPRESSED),
+* it must be called after stream_start_batch. Only clients which asked for it can read them.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1 and the batches are sent as they are
+*/
+int stream_compress_batch(out_stream *out) {
+
+	if(out->batch == NULL || out->protocol == PROTOCOL_V1)
+		return -1;
+
+	if(out->packed == NULL && (out->packed = malloc(out->batch_size)) == NULL)
+		return -1;
+
+	return 0;
+}
+
+
+/*
+* Function used to send what is left in the batch of an out_stream and to stop using it, the buffer can
+* be reused after this.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int stream_end_batch(out_stream *out) {
+
+	if(out->batch == NULL)
+		return 0;
+
+	int result = stream_flush(out);
+
+	if(out->sink == NULL)
+		set_socket_cork(out->target, 0);
+
+	free(out->packed);
+
+	out->batch	= NULL;
+	out->packed	= NULL;
+
+	return result;
+}
+
+
+/*
+* Function used to send the status of a request to the given out_stream.
+* ARGUMENTS:
+*	-out:		out_stream of the request
+*	-status:	status to send (FIN_MSG, MORE_MSG...)
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int stream_status(out_stream *out, int status) {
+
+	int32_t converted = htonl(status);
+
+	if(stream_flush(out) < 0)
+		return -1;
+
+	if(out->protocol == PROTOCOL_V1)
+		return stream_bytes(out, (char *)&converted, sizeof(converted));
+
+	return stream_frame(out, FRAME_STATUS, (char *)&converted, sizeof(converted));
+}
+
+
+/*
+* Function used to send the status of a request followed by an integer hint (e.g. the seconds to wait before retrying).
+* ARGUMENTS:
+*	-out:		out_stream of the request
+*	-status:	status to send
+*	-hint:		integer sent after the status
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int stream_status_hint(out_stream *out, int status, int hint) {
+
+	int32_t converted[2];
+	converted[0] = htonl(status);
+	converted[1] = htonl(hint);
+
+	if(stream_flush(out) < 0)
+		return -1;
+
+	if(out->protocol == PROTOCOL_V1)
+		return stream_bytes(out, (char *)converted, sizeof(converted));
+
+	return stream_frame(out, FRAME_STATUS, (char *)converted, sizeof(converted));
+}
+
+
+/*
+* Function used to write some bytes of a response to the given out_stream.
+* ARGUMENTS:
+*	-out:		out_stream of the request
+*	-source:	bytes to write
+*	-length:	number of bytes to write
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int stream_write(out_stream *out, char *source, int length) {
+
+	if(out->batch != NULL) {
+
+		if(out->batched + length > out->batch_limit && stream_flush(out) < 0)
+			return -1;
+
+		if(length <= out->batch_size) {
+			memcpy(out->batch + out->batched, source, length);
+			out->batched += length;
+			return 0;
+		}
+	}
+
+	if(out->protocol == PROTOCOL_V1)
+		return stream_bytes(out, source, length);
+
+	while(length > FRAME_BUFFER_SIZE) {
+		if(stream_frame(out, FRAME_DATA, source, FRAME_BUFFER_SIZE) < 0)
+			return -1;
+		source += FRAME_BUFFER_SIZE;
+		length -= FRAME_BUFFER_SIZE;
+	}
+
+	return stream_frame(out, FRAME_DATA, source, length);
+}
+
+
+/*
+* Function used to close the response written to the given out_stream.
+* ARGUMENTS:
+*	-out:		out_stream of the request
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int stream_finish(out_stream *out) {
+
+	if(stream_flush(out) < 0)
+		return -1;
+
+	if(out->protocol == PROTOCOL_V1)
+		return stream_bytes(out, FINISH_MESSAGE, strlen(FINISH_MESSAGE));
+
+	return stream_frame(out, FRAME_END, NULL, 0);
+}
+
+
+/*
+* Function used to wait for an ACK from the given io_interface. NOT USED
+* ARGUMENTS:
+*	-source:	io_interface which wants to be listened
+* RETURN VALUE:
+*	Always returns 0, but only after ACK is received
+*/
+int wait_for_ack(io_interface *source) {
+	int save_to = 0;
+	while(save_to != ACK_SIGNAL) {
+		read_int_from_socket(&save_to, source);
+	}
+	return 0;
+}
+
+/*
+* Functin used to send an ACK to the given io_interface. NOT USED
+* ARGUMENTS:
+*	-target:	io_interface which the signal wants to be sent to
+* RETURN VALUE:
+*	On success 0 is returned and int is sent, otherwise -1
+*/
+int send_ack(io_interface *target) {
+	return write_int_to_socket(ACK_SIGNAL, target);
+}
+
+
+/*
+* Function used to format a line of a listing: the size of the file right aligned on LISTING_SIZE_WIDTH
+* characters ("-" for directories), tabs, prefix and the name of the file.
+* ARGUMENTS:
+*	-dest:		where the line is written, it must have room for LISTING_SIZE_WIDTH + 24 + tabs + the strings
+*	-directory:	set if the file is a directory
+*	-size:		size of the file
+*	-tabs:		number of tabs between the size and the name
+*	-prefix:	string written before the name
+*	-name:		name of the file
+* RETURN VALUE:
+*	The length of the line
+*/
+int format_listing_line(char *dest, int directory, intmax_t size, int tabs, char *prefix, char *name) {
+
+	char digits[24];
+	int count = 0;
+	char *index = dest;
+
+	if(directory)
+		digits[count++] = '-';
+	else {
+		uintmax_t value = size > 0 ? (uintmax_t)size : 0;
+		do {
+			digits[count++] = '0' + value % 10;
+			value /= 10;
+		}
+		while(value > 0);
+	}
+
+	for(int i=count; i<LISTING_SIZE_WIDTH; i++)
+		*index++ = ' ';
+
+	while(count > 0)
+		*index++ = digits[--count];
+
+	for(int i=0; i<tabs; i++)
+		*index++ = '\t';
+
+	int length = strlen(prefix);
+	memcpy(index, prefix, length);
+	index += length;
+
+	length = strlen(name);
+	memcpy(index, name, length);
+	index += length;
+
+	*index++ = '\r';
+	*index++ = '\n';
+
+	return (int)(index - dest);
+}
+
+
+/*
+* Function used to write a number as a varint: 7 bits at a time, the 8th bit set if more bytes follow.
+* RETURN VALUE:
+*	The number of bytes written, 10 at most
+*/
+int write_varint(char *dest, uint64_t value) {
+
+	int length = 0;
+
+	do {
+		dest[length] = (char)(value & 0x7F);
+		value >>= 7;
+		if(value != 0)
+			dest[length] |= (char)0x80;
+		length++;
+	}
+	while(value != 0);
+
+	return length;
+}
+
+
+/*
+* Function used to format a record of a binary listing: a byte of LISTING_RECORD_ flags, the depth of the file,
+* the bytes its path shares with the previous record (depth 0 only), its size (not for directories), its mtime
+* and mode (if fields has them), the length of its name and its name. Numbers are varints.
+* A file at depth 1 or more is in the last directory sent at depth - 1 (the listed one for depth 1), so its path
+* is never repeated: records must be sent depth-first. Depth 0 records carry their whole path instead, minus the
+* bytes it shares with the previous one, and can be sent in any order.
+* ARGUMENTS:
+*	-dest:		where the record is written, it must have room for LISTING_RECORD_SIZE + the name
+*	-fields:	LISTING_FIELD_ flags of the listing
+*	-flags:		LISTING_RECORD_DIRECTORY for directories, with LISTING_RECORD_PARENT if they're not listed
+*	-depth:		depth of the file, or 0
+*	-shared:	bytes shared with the path of the previous record, for depth 0
+*	-name:		name of the file, or what's left of its path for depth 0
+* RETURN VALUE:
+*	The length of the record
+*/
+int format_listing_record(char *dest, int fields, int flags, intmax_t size, long mtime, int mode, int depth, int shared, char *name) {
+
+	int length = 0;
+	int name_length = strlen(name);
+	int directory = flags & LISTING_RECORD_DIRECTORY;
+
+	dest[length++] = (char)flags;
+	length += write_varint(dest + length, (uint64_t)depth);
+
+	if(depth == 0)
+		length += write_varint(dest + length, (uint64_t)shared);
+	if(!directory)
+		length += write_varint(dest + length, (uint64_t)(size > 0 ? size : 0));
+	if(fields & LISTING_FIELD_MTIME)
+		length += write_varint(dest + length, (uint64_t)(mtime > 0 ? mtime : 0));
+	if(fields & LISTING_FIELD_MODE)
+		length += write_varint(dest + length, (uint64_t)(unsigned int)mode);
+
+	length += write_varint(dest + length, (uint64_t)name_length);
+	memcpy(dest + length, name, name_length);
+
+	return length + name_length;
+}
+
+
+/*
+* Function used to list all the files in the given directory to the given socket io_interface.
+* ARGUMENTS:
+*	-path:		char pointer with the directory which wants to be listed
+*	-target:	out_stream which directory list wants to be sent to
+*	-filter:	what the listing must contain, NULL for everything
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int LSTF(char *path, out_stream *target, listing_filter *filter) {
+
+	//open given directory
+	DIR *d;
+	struct dirent *dir;
+	if((d = opendir(path)) == NULL)
+		return -1;
+
+	//allocate space for the buffer which will be sent
+	char *to_send = (char *)malloc(SOCK_PACKET_SIZE);
+
+	//while there are files to be read in the directory, read them and send the value to the target
+	while((dir = readdir(d)) != NULL) {
+	
+		//ignore . and .. directories
+		if(strcmp(dir->d_name, ".") != 0 && strcmp(dir->d_name, "..")) {
+			
+			//the directory may not be the working one: stat the file through its path
+			struct stat st;
+			snprintf(to_send, SOCK_PACKET_SIZE, "%s/%s", path, dir->d_name);
+			if(stat(to_send, &st) != 0)
+				continue;
+
+			if(filter != NULL && !filter->accept(filter->param, S_ISDIR(st.st_mode), (intmax_t)st.st_size, (long)st.st_mtime, (int)st.st_mode, 1, dir->d_name))
+				continue;
+
+			int length = filter != NULL && filter->format == LISTING_BINARY ?
+				format_listing_record(to_send, filter->fields, S_ISDIR(st.st_mode) ? LISTING_RECORD_DIRECTORY : 0, (intmax_t)st.st_size, (long)st.st_mtime, (int)st.st_mode, 1, 0, dir->d_name) :
+				format_listing_line(to_send, S_ISDIR(st.st_mode), (intmax_t)st.st_size, 2, "", dir->d_name);
+
+			//send the string to the out_stream
+			stream_write(target, to_send, length);
+
+
+
+		}
+	}
+
+
+	//close directory and free allocated space
+	closedir(d);
+	free(to_send);
+
+	if(filter != NULL)
+		filter->finish(filter->param, target);
+
+	//write finish message to the target
+	stream_finish(target);
+
+	return 0;
+
+}
+
+
+/*
+* Function used by the client to print the body of a response (everything after MORE_MSG), whatever the protocol is.
+* ARGUMENTS:
+*	-source:	socket io_interface which wants to be listened
+*	-protocol:	PROTOCOL_V1 or PROTOCOL_V2, the protocol negotiated with the server
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int print_body_from_socket(io_interface *source, int protocol) {
+
+	if(protocol == PROTOCOL_V1)
+		return print_string_from_socket(source, FINISH_MESSAGE);
+
+	char *buffer = malloc(FRAME_BUFFER_SIZE);
+	if(buffer == NULL)
+		return -1;
+
+	int result = print_frames_from_socket(source, buffer);
+
+	free(buffer);
+
+	return result;
+}
+
+
+/*
+* Function used by the client to handle a LSTF or a LSTR call
+* ARGUMENTS:
+*	-source:	socket io_interface which wants to be listened
+*	-protocol:	PROTOCOL_V1 or PROTOCOL_V2, the protocol negotiated with the server
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int LST_receive(io_interface *source, int protocol) {
+
+	int result;
+
+	printf("\nSize (in bytes):\tFile name:\n\n");
+	
+	result = print_body_from_socket(source, protocol);
+	
+	printf("\n");
+
+	return result;
+}
+
+
+/*
+* Function used by a thread to XOR a file parallelized.
+*/
+void *XOR_task(void *params) {
+
+	XOR_job *job = (XOR_job *)params;
+
+	for(int i=0; i<job->length; i+=4) {
+
+		//generate new random number from seed
+		int r = rand_r(&job->seed);
+		char *rand_chr = (char *)&r;
+		
+		for(int j=0; j<4; j++) {
+			
+			if(i + j >= job->length)
+				break;
+			
+			//XOR single byte
+			job->target[i+j] = job->source[i+j] ^ rand_chr[j];
+		}
+			
+	}
+
+	return NULL;
+}
+
+typedef struct {
+	sem_t id;
+} semaphore;
+
+
+/*
+* Start a semaphre with the given value
+* ARGUMENTS:
+*	-sem:		semaphore structure to save the semaphore to
+*	-value:		starting value of the semaphore
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int start_semaphore(semaphore *sem, int value, int _not_used) {
+	return sem_init(&sem->id, 0, value);
+}
+
+
+/*
+* Start a semaphre with value 1 for mutex access to critical sections.
+* ARGUMENTS:
+*	-sem:		semaphore structure to save the semaphore to
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int start_semaphore_ex(semaphore *sem) {
+	return sem_init(&sem->id, 1, 1);
+}
+
+
+/*
+* Wait for a semaphore function.
+* ARGUMENTS:
+*	-sem:		semaphore structure to wait for
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int semaphore_wait(semaphore *sem) {
+	return sem_wait(&sem->id);
+}
+
+
+/*
+* Signal a semaphore function.
+* ARGUMENTS:
+*	-sem:		semaphore structure to send signal to
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int semaphore_signal(semaphore *sem) {
+	return sem_post(&sem->id);
+}
+
+
+
+int stop_semaphore(semaphore *sem) {
+	return sem_destroy(&sem->id);
+}
+
+
+
+#define WALK_THREADS		4		//threads which read the directories of a recursive listing
+#define WALK_MAX_AHEAD		64		//directories of a listing the workers read before the output stage writes them
+
+
+/*
+* Structure which defines a line of the listing of a directory: length bytes at line in the text of the
+* directory (none if the filter of the walk didn't accept the file), followed by the listing of child if the
+* line is a subdirectory.
+*/
+typedef struct {
+	int line;
+	int length;
+	struct walk_dir *child;
+} walk_item;
+
+
+/*
+* Structure which defines a directory found by a tree walk.
+*	-path:		path of the directory relative to the root of the walk, "" for the root and "/a/b" below it
+*	-depth:		tabs written before the paths of its files
+*	-text, items:	lines of its files, in the order readdir returned them
+*	-done:		set once the directory was read (protected by the mutex of the walk)
+*	-ahead:		set if a worker read it: it holds a place of the read-ahead window until it's written
+*	-parent:	the directory which contains it
+*	-next_item:	next item to write, used by the output stage
+*	-next:		list of the directories waiting to be read
+*/
+typedef struct walk_dir {
+	char *path;
+	int depth;
+	char *text;
+	int text_length;
+	int text_capacity;
+	walk_item *items;
+	int count;
+	int capacity;
+	int done;
+	int ahead;
+	struct walk_dir *parent;
+	int next_item;
+	struct walk_dir *next;
+} walk_dir;
+
+
+/*
+* Structure shared by the threads of a tree walk. Directories are read by the workers in any order, but the
+* output stage writes them in the same order as a depth-first walk would: it waits for every directory
+* it reaches which is being read, and reads itself the ones no worker took yet.
+*	-root:		fd of the listed directory, every other directory is opened relative to it (every thread
+*			opens one directory at a time, so at most WALK_THREADS + 1 fds are used)
+*	-pending:	stack of the directories to read (protected by sem), queued is signalled for each one
+*			pushed (the output stage takes some from the middle, so it can count more)
+*	-waiting:	directory the output stage is waiting for, ready is signalled when it's done
+*	-ahead:		counts the directories the workers can still read before the output stage writes the
+*			ones they read, so that a big tree is never held in memory at once
+*	-stop:		set when the output can't be written anymore, directories left are not read
+*	-finished:	set when the output stage is over, the workers exit
+*	-filter:	what the listing must contain, NULL for everything
+*/
+typedef struct {
+	int root;
+	listing_filter *filter;
+	walk_dir *pending;
+	walk_dir *waiting;
+	int stop;
+	int finished;
+	semaphore queued;
+	semaphore ready;
+	semaphore ahead;
+	semaphore sem;
+} tree_walk;
+
+
+walk_dir *create_walk_dir(walk_dir *parent, char *name) {
+
+	walk_dir *target = (walk_dir *)malloc(sizeof(walk_dir));
+	if(target == NULL)
+		return NULL;
+
+	bzero(target, sizeof(walk_dir));
+
+	int length = parent != NULL ? strlen(parent->path) + strlen(name) + 2 : 1;
+
+	if((target->path = (char *)malloc(length)) == NULL) {
+		free(target);
+		return NULL;
+	}
+
+	if(parent != NULL)
+		snprintf(target->path, length, "%s/%s", parent->path, name);
+	else
+		target->path[0] = '\0';
+
+	target->parent	= parent;
+	target->depth	= parent != NULL ? parent->depth + 1 : 2;
+
+	return target;
+}
+
+
+void free_walk_dir(walk_dir *target) {
+	free(target->path);
+	free(target->text);
+	free(target->items);
+	free(target);
+}
+
+
+/*
+* Function used to add a line (or a record, for binary listings) to a directory of a walk.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int add_walk_item(walk_dir *target, listing_filter *filter, int directory, intmax_t size, long mtime, int mode, char *path, walk_dir *child, int listed) {
+
+	//the line is formatted in place: make room for the longest line it can be
+	int needed = LISTING_SIZE_WIDTH + LISTING_RECORD_SIZE + target->depth + strlen(path) + 4;
+
+	if(target->text_length + needed > target->text_capacity) {
+
+		int capacity = target->text_capacity > 0 ? target->text_capacity : 4096;
+
+		while(capacity < target->text_length + needed)
+			capacity *= 2;
+
+		char *text = (char *)realloc(target->text, capacity);
+		if(text == NULL)
+			return -1;
+
+		target->text		= text;
+		target->text_capacity	= capacity;
+	}
+
+	if(target->count == target->capacity) {
+
+		int capacity = target->capacity > 0 ? target->capacity * 2 : 64;
+		walk_item *items = (walk_item *)realloc(target->items, capacity * sizeof(walk_item));
+
+		if(items == NULL)
+			return -1;
+
+		target->items		= items;
+		target->capacity	= capacity;
+	}
+
+	walk_item *item = &target->items[target->count++];
+
+	item->line	= target->text_length;
+	item->length	= 0;
+	item->child	= child;
+
+	//binary records of files only say which directory they're in: directories which are not listed are sent anyway
+	if((listed || child != NULL) && filter != NULL && filter->format == LISTING_BINARY)
+		item->length = format_listing_record(target->text + target->text_length, filter->fields,
+			(directory ? LISTING_RECORD_DIRECTORY : 0) | (listed ? 0 : LISTING_RECORD_PARENT), size, mtime, mode, target->depth - 1, 0, strrchr(path, '/') + 1);
+	else if(listed)
+		item->length = format_listing_line(target->text + target->text_length, directory, size, target->depth, ".", path);
+
+	target->text_length += item->length;
+
+	return 0;
+}
+
+
+/*
+* Function used to know the type and the size of a file of a directory opened with fd. d_type tells which
+* files are directories without asking the filesystem again, the others are asked only for their type and
+* size. Links are followed, just like stat does.
+* If mtime is not NULL every file is asked for its last modification time and its mode too.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int walk_stat(int fd, struct dirent *entry, int *directory, intmax_t *size, long *mtime, int *mode) {
+
+	if(entry->d_type == DT_DIR && mtime == NULL) {
+		*directory	= 1;
+		*size		= 0;
+		return 0;
+	}
+
+#ifdef STATX_SIZE
+	struct statx st;
+
+	if(statx(fd, entry->d_name, AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_SIZE | (mtime != NULL ? STATX_MTIME | STATX_MODE : 0), &st) != 0)
+		return -1;
+
+	*directory	= S_ISDIR(st.stx_mode);
+	*size		= (intmax_t)st.stx_size;
+
+	if(mtime != NULL) {
+		*mtime	= (long)st.stx_mtime.tv_sec;
+		*mode	= (int)st.stx_mode;
+	}
+#else
+	struct stat st;
+
+	if(fstatat(fd, entry->d_name, &st, 0) != 0)
+		return -1;
+
+	*directory	= S_ISDIR(st.st_mode);
+	*size		= (intmax_t)st.st_size;
+
+	if(mtime != NULL) {
+		*mtime	= (long)st.st_mtime;
+		*mode	= (int)st.st_mode;
 	}
+#endif
 
-	free(buffer);
-	free(end_buffer);
 	return 0;
 }
 
 
 /*
-* Function used to wait for an ACK from the given io_interface. NOT USED
-* ARGUMENTS:
-*	-source:	io_interface which wants to be listened
-* RETURN VALUE:
-*	Always returns 0, but only after ACK is received
+* Function used to read a directory of a walk: its lines are saved and its subdirectories are given to the
+* other workers. A directory which can't be read is left empty, just like a failed opendir.
 */
-int wait_for_ack(io_interface *source) {
-	int save_to = 0;
-	while(save_to != ACK_SIGNAL) {
-		read_int_from_socket(&save_to, source);
+void read_walk_dir(tree_walk *walk, walk_dir *target) {
+
+	if(walk->stop)
+		return;
+
+	int fd = openat(walk->root, target->path[0] != '\0' ? target->path + 1 : ".", O_RDONLY | O_DIRECTORY);
+	DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+
+	if(d == NULL) {
+		if(fd >= 0)
+			close(fd);
+		return;
 	}
-	return 0;
-}
 
-/*
-* Functin used to send an ACK to the given io_interface. NOT USED
-* ARGUMENTS:
-*	-target:	io_interface which the signal wants to be sent to
-* RETURN VALUE:
-*	On success 0 is returned and int is sent, otherwise -1
-*/
-int send_ack(io_interface *target) {
-	return write_int_to_socket(ACK_SIGNAL, target);
+	struct dirent *entry;
+	walk_dir *children = NULL;
+	walk_dir *last = NULL;
+	int found = 0;
+	int length = strlen(target->path);
+	char *file_path = (char *)malloc(length + sizeof(entry->d_name) + 2);
+
+	if(file_path == NULL) {
+		closedir(d);
+		return;
+	}
+
+	memcpy(file_path, target->path, length);
+	file_path[length] = '/';
+
+	while((entry = readdir(d)) != NULL && !walk->stop) {
+
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		listing_filter *filter = walk->filter;
+		int directory;
+		intmax_t size;
+		long mtime = 0;
+		int mode = 0;
+
+		if(walk_stat(fd, entry, &directory, &size, filter != NULL && filter->fields != 0 ? &mtime : NULL, &mode) < 0)
+			continue;
+
+		//the files of a directory are one level deeper than it (the listed one has depth 2 for its tabs)
+		int depth = target->depth - 1;
+
+		walk_dir *child = NULL;
+
+		//subdirectories which would only hold files too deep are not even opened
+		if(directory && (filter == NULL || filter->max_depth == 0 || depth < filter->max_depth) &&
+			(child = create_walk_dir(target, entry->d_name)) == NULL)
+			continue;
+
+		strcpy(file_path + length + 1, entry->d_name);
+
+		int listed = filter == NULL || filter->accept(filter->param, directory, size, mtime, mode, depth, file_path);
+
+		if(add_walk_item(target, filter, directory, size, mtime, mode, file_path, child, listed) < 0) {
+			if(child != NULL)
+				free_walk_dir(child);
+			continue;
+		}
+
+		//the list keeps the order of the items, so that the first subdirectory (the first one written) ends up on top of the stack
+		if(child != NULL) {
+			child->next = NULL;
+			if(last != NULL)
+				last->next = child;
+			else
+				children = child;
+			last = child;
+			found++;
+		}
+	}
+
+	//closing the directory closes fd too
+	closedir(d);
+	free(file_path);
+
+	if(found == 0)
+		return;
+
+	semaphore_wait(&walk->sem);
+
+	last->next	= walk->pending;
+	walk->pending	= children;
+
+	semaphore_signal(&walk->sem);
+
+	for(int i=0; i<found; i++)
+		semaphore_signal(&walk->queued);
 }
 
 
 /*
-* Function used to list all the files in the given directory to the given socket io_interface.
-* ARGUMENTS:
-*	-path:		char pointer with the directory which wants to be listed
-*	-target:	socket io_interface which directory list wants to be sent to
-* RETURN VALUE:
-*	On success 0 is returned, otherwise -1
+* Function executed by the workers of a tree walk.
 */
-int LSTF(char *path, io_interface *target) {
+void *walk_worker(void *params) {
 
-	//open given directory
-	DIR *d;
-	struct dirent *dir;
-	if((d = opendir(path)) == NULL)
-		return -1;
+	tree_walk *walk = (tree_walk *)params;
 
-	//allocate space for the buffer which will be sent
-	char *to_send = (char *)malloc(SOCK_PACKET_SIZE);
+	while(1) {
 
-	//while there are files to be read in the directory, read them and send the value to the target
-	while((dir = readdir(d)) != NULL) {
-	
-		//ignore . and .. directories
-		if(strcmp(dir->d_name, ".") != 0 && strcmp(dir->d_name, "..")) {
-			
-			struct stat st;
-			if(stat(dir->d_name, &st) != 0)
-				continue;
+		//a place in the window is taken before the directory, so that the output stage can read it if it's needed first
+		semaphore_wait(&walk->ahead);
+		semaphore_wait(&walk->queued);
+		semaphore_wait(&walk->sem);
 
-			char *index = to_send;
+		if(walk->finished) {
+			semaphore_signal(&walk->sem);
+			break;
+		}
 
-			if(S_ISDIR(st.st_mode))
-				index += snprintf(index, SOCK_PACKET_SIZE, "%15s", "-");
-			else
-				index += snprintf(index, SOCK_PACKET_SIZE, "%15jd", (intmax_t)st.st_size);
+		walk_dir *target = walk->pending;
 
-			index += snprintf(index, SOCK_PACKET_SIZE, "\t\t%s\r\n", dir->d_name);
+		if(target == NULL) {
+			semaphore_signal(&walk->sem);
+			semaphore_signal(&walk->ahead);
+			continue;
+		}
+
+		walk->pending	= target->next;
+		target->ahead	= 1;
 
-			//send the string with write_string_to_socket function
-			print_string_to_socket(to_send, target);
+		semaphore_signal(&walk->sem);
 
+		read_walk_dir(walk, target);
 
+		semaphore_wait(&walk->sem);
 
+		target->done = 1;
+		if(walk->waiting == target) {
+			walk->waiting = NULL;
+			semaphore_signal(&walk->ready);
 		}
+
+		semaphore_signal(&walk->sem);
 	}
 
+	return NULL;
+}
+
 
-	//close directory and free allocated space
-	closedir(d);
-	free(to_send);
+/*
+* Function used by the output stage to wait until a directory of the walk has been read. If no worker took it yet
+* it's read here: the workers may be waiting for the window, which only moves when this directory is written.
+*/
+void wait_walk_dir(tree_walk *walk, walk_dir *target) {
 
-	//write finish message to the target
-	print_string_to_socket(FINISH_MESSAGE, target);
+	semaphore_wait(&walk->sem);
 
-	return 0;
+	walk_dir **pending = &walk->pending;
+
+	while(!target->done && *pending != NULL && *pending != target)
+		pending = &(*pending)->next;
+
+	if(!target->done && *pending == target) {
+
+		*pending = target->next;
+		semaphore_signal(&walk->sem);
+
+		read_walk_dir(walk, target);
+
+		semaphore_wait(&walk->sem);
+		target->done = 1;
+	}
+
+	while(!target->done) {
+		walk->waiting = target;
+		semaphore_signal(&walk->sem);
+		semaphore_wait(&walk->ready);
+		semaphore_wait(&walk->sem);
+	}
 
+	semaphore_signal(&walk->sem);
 }
 
 
 /*
 * List all files in the directory given by path recursively. Result is printed on the given io_interface target.
+* Directories are read by WALK_THREADS threads at once, at most WALK_MAX_AHEAD of them before they are written and
+* always relative to the listed directory (so the depth of the tree doesn't matter), while this thread writes
+* the result in the same order as a single depth-first walk.
 * ARGUMENTS:
 *	-path:		the path of the directory which content wants to be listed
-*	-target:	the io_interface which results want to be written to
+*	-target:	the out_stream which results want to be written to
+*	-filter:	what the listing must contain, NULL for everything
 * RETURN VALUE:
 *	On succes 0 is returned and result is written on target, otherwise -1
 */
+int LSTR(char *path, out_stream *target, listing_filter *filter) {
 
+	tree_walk walk;
+	thread workers[WALK_THREADS];
+	int started = 0;
+	int result = 0;
 
-/*
-* Inner function used by the recursion, scroll down for the real one
-*/
-int LSTR_inner(char *path, io_interface *target, int indentation) {
+	bzero(&walk, sizeof(tree_walk));
+	walk.filter = filter;
 
-	//open given path
-	DIR *d;
-	struct dirent *dir;
-	d = opendir(path);
-	if (d == NULL)
-		return -1;
+	walk_dir *root = create_walk_dir(NULL, NULL);
 
-	//allocate space for recursive calls on child directories
-	char *s_path;
-	if((s_path = (char *)malloc(SOCK_PACKET_SIZE)) == NULL)
+	if(root == NULL || (walk.root = open(path, O_RDONLY | O_DIRECTORY)) < 0) {
+		if(root != NULL)
+			free_walk_dir(root);
+		stream_finish(target);
 		return -1;
+	}
 
-	snprintf(s_path, SOCK_PACKET_SIZE, "%s", path);
-
-	//allocate space for the buffer which will be sent
-	char *to_send = (char *)malloc(SOCK_PACKET_SIZE);
-	if(to_send == NULL)
-		return -1;
-	
-	//while there are files to be read in the directory, read them and send the value to the target
-	while((dir = readdir(d)) != NULL) {
+	start_semaphore_ex(&walk.sem);
+	start_semaphore(&walk.queued, 1, 0);
+	start_semaphore(&walk.ready, 0, 0);
+	start_semaphore(&walk.ahead, WALK_MAX_AHEAD, 0);
 
-		//ignore . and .. directories
-		if(strcmp(dir->d_name, ".") != 0 && strcmp(dir->d_name, "..") != 0) {
-			
-			snprintf(s_path, SOCK_PACKET_SIZE, "%s/%s", path, dir->d_name);
+	walk.pending = root;
 
-			struct stat st;
-			if(stat(s_path, &st) != 0)
-				continue;
+	while(started < WALK_THREADS && create_thread(&workers[started], walk_worker, (void *)&walk) == 0)
+		started++;
 
+	//write the directories depth-first, freeing them once they're written (without workers, every directory is
+	//read by wait_walk_dir when it's reached)
+	walk_dir *current = root;
+	wait_walk_dir(&walk, current);
 
-			char *index = to_send;
-	
-			if(!S_ISDIR(st.st_mode))
-				index += snprintf(index, SOCK_PACKET_SIZE, "%15jd", (intmax_t)st.st_size);
-			else
-				index += snprintf(index, SOCK_PACKET_SIZE, "%15s", "-");
+	while(current != NULL) {
 
-			for(int i=0; i<indentation; i++)
-				index += snprintf(index, SOCK_PACKET_SIZE, "\t");
-			
-			index += snprintf(index, SOCK_PACKET_SIZE, "%s\r\n", s_path);
-	
-			if(print_string_to_socket(to_send, target) < 0)
-				return -1;
+		if(current->next_item == current->count) {
+			walk_dir *parent = current->parent;
+			if(current->ahead)
+				semaphore_signal(&walk.ahead);
+			free_walk_dir(current);
+			current = parent;
+			continue;
+		}
 
-			//if the current file is a directory, recursively call LSTR_inner on its path
-			if(S_ISDIR(st.st_mode)) { 
-				LSTR_inner(s_path, target, indentation + 1);
-			}
+		walk_item *item = &current->items[current->next_item++];
 
+		if(!walk.stop && item->length > 0 && stream_write(target, current->text + item->line, item->length) < 0) {
+			walk.stop	= 1;
+			result		= -1;
+		}
 
+		if(item->child != NULL) {
+			current = item->child;
+			wait_walk_dir(&walk, current);
 		}
-	
 	}
-	
-	//close directory and free allocated space
-	closedir(d);
-	free(to_send);
-	free(s_path);
 
-	return 0;
-}
+	//every directory was written, so none is left to read
+	semaphore_wait(&walk.sem);
+	walk.finished = 1;
+	semaphore_signal(&walk.sem);
+
+	for(int i=0; i<started; i++) {
+		semaphore_signal(&walk.ahead);
+		semaphore_signal(&walk.queued);
+	}
 
-int LSTR(char *path, io_interface *target) {
+	for(int i=0; i<started; i++)
+		join_thread(&workers[i], NULL);
 
-	//initialize count to enumerate files
+	close(walk.root);
 
-	//call recursive function
-	LSTR_inner(path, target, 2);
+	stop_semaphore(&walk.sem);
+	stop_semaphore(&walk.queued);
+	stop_semaphore(&walk.ready);
+	stop_semaphore(&walk.ahead);
 
-	//send FINISH_MESSAGE to the client
-	print_string_to_socket(FINISH_MESSAGE, target);
+	if(filter != NULL && !walk.stop)
+		filter->finish(filter->param, target);
 
-	return 0;
+	//send FINISH_MESSAGE (or the END frame) to the client
+	stream_finish(target);
+
+	return result;
 }
 
 
+
+#define WATCH_CREATED		1		//a file appeared in a watched directory
+#define WATCH_DELETED		2		//a file left a watched directory
+#define WATCH_CHANGED		3		//a file of a watched directory changed
+#define WATCH_OVERFLOW		4		//events were lost, everything must be checked again
+#define WATCH_GONE		5		//the watched directory doesn't exist anymore
+
+#define WATCH_MASK		(IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_ONLYDIR)
+#define WATCH_WRITTEN_MASK	(IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR)
+
+
 /*
-* Function used by the client to handle a LSTF or a LSTR call
-* ARGUMENTS:
-*	-source:	socket io_interface which wants to be listened
-* RETURN VALUE:
-*	On success 0 is returned, otherwise -1
+* Structure which defines a file found by read_directory.
+*	-name:		name of the file
+*	-directory:	set if the file is a directory (links to directories included)
+*	-link:		set if the file is a symbolic link
+*	-size:		size of the file
 */
-int LST_receive(io_interface *source) {
+typedef struct {
+	char *name;
+	int directory;
+	int link;
+	intmax_t size;
+} dir_entry;
 
-	char *buffer = malloc(SOCK_PACKET_SIZE);
 
-	printf("\nSize (in bytes):\tFile name:\n\n");
-	
-	print_string_from_socket(source, FINISH_MESSAGE);
-	
-	printf("\n");
+/*
+* Structure which defines something that happened to a watched directory.
+*	-id:		id of the directory, as returned by watch_directory
+*	-kind:		WATCH_* kind of the event
+*	-name:		name of the file the event is about, NULL if it's about the directory
+*/
+typedef struct {
+	int id;
+	int kind;
+	char *name;
+} watch_event;
 
-	free(buffer);
 
-	return 0;
-}
+/*
+* Structure which defines a watcher of directories.
+*/
+typedef struct {
+	int id;
+} watcher;
 
 
 /*
-* Function used by a thread to XOR a file parallelized.
+* Function used to read every file of a directory with its type and size. Links are followed, just like stat does.
+* ARGUMENTS:
+*	-path:		the directory to read
+*	-entries:	where the array of the files is saved, it must be freed with free_directory
+* RETURN VALUE:
+*	The number of files found, -1 if the directory can't be read
 */
-void *XOR_task(void *params) {
+int read_directory(char *path, dir_entry **entries) {
 
-	XOR_job *job = (XOR_job *)params;
+	DIR *d = opendir(path);
+	if(d == NULL)
+		return -1;
 
-	for(int i=0; i<job->length; i+=4) {
+	int fd = dirfd(d);
+	int count = 0;
+	int capacity = 64;
+	struct dirent *entry;
+	dir_entry *result = (dir_entry *)malloc(capacity * sizeof(dir_entry));
 
-		//generate new random number from seed
-		int r = rand_r(&job->seed);
-		char *rand_chr = (char *)&r;
-		
-		for(int j=0; j<4; j++) {
-			
-			if(i + j >= job->length)
+	if(result == NULL) {
+		closedir(d);
+		return -1;
+	}
+
+	while((entry = readdir(d)) != NULL) {
+
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		int directory;
+		intmax_t size;
+
+		if(walk_stat(fd, entry, &directory, &size, NULL, NULL) < 0)
+			continue;
+
+		if(count == capacity) {
+
+			dir_entry *bigger = (dir_entry *)realloc(result, capacity * 2 * sizeof(dir_entry));
+			if(bigger == NULL)
 				break;
-			
-			//XOR single byte
-			job->target[i+j] = job->source[i+j] ^ rand_chr[j];
+
+			result = bigger;
+			capacity *= 2;
 		}
-			
+
+		if((result[count].name = strdup(entry->d_name)) == NULL)
+			break;
+
+		result[count].directory	= directory;
+		result[count].link	= entry->d_type == DT_LNK;
+		result[count].size	= size;
+
+		//d_type may not be known, ask the filesystem
+		if(entry->d_type == DT_UNKNOWN) {
+			struct stat st;
+			result[count].link = fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(st.st_mode);
+		}
+
+		count++;
 	}
 
-	return NULL;
+	closedir(d);
+
+	*entries = result;
+
+	return count;
 }
 
-typedef struct {
-	sem_t id;
-} semaphore;
+
+void free_directory(dir_entry *entries, int count) {
+
+	for(int i=0; i<count; i++)
+		free(entries[i].name);
+
+	free(entries);
+}
 
 
 /*
-* Start a semaphre with the given value
-* ARGUMENTS:
-*	-sem:		semaphore structure to save the semaphore to
-*	-value:		starting value of the semaphore
+* Function used to know the type and the size of a file, links are followed.
 * RETURN VALUE:
-*	On success 0 is returned, otherwise -1
+*	On success 0 is returned, otherwise -1 (e.g. the file doesn't exist)
 */
-int start_semaphore(semaphore *sem, int value, int _not_used) {
-	return sem_init(&sem->id, 0, value);
+int stat_entry(char *path, int *directory, int *link, intmax_t *size) {
+
+	struct stat st;
+
+	if(stat(path, &st) != 0)
+		return -1;
+
+	*directory	= S_ISDIR(st.st_mode);
+	*size		= (intmax_t)st.st_size;
+	*link		= lstat(path, &st) == 0 && S_ISLNK(st.st_mode);
+
+	return 0;
 }
 
 
 /*
-* Start a semaphre with value 1 for mutex access to critical sections.
-* ARGUMENTS:
-*	-sem:		semaphore structure to save the semaphore to
+* Function used to start a watcher of directories.
 * RETURN VALUE:
 *	On success 0 is returned, otherwise -1
 */
-int start_semaphore_ex(semaphore *sem) {
-	return sem_init(&sem->id, 1, 1);
+int start_watcher(watcher *target) {
+	return (target->id = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 ? -1 : 0;
 }
 
 
 /*
-* Wait for a semaphore function.
-* ARGUMENTS:
-*	-sem:		semaphore structure to wait for
+* Function used to start watching the files of a directory (not the ones of its subdirectories).
 * RETURN VALUE:
-*	On success 0 is returned, otherwise -1
+*	The id of the watched directory, -1 if it can't be watched (e.g. too many directories are watched)
 */
-int semaphore_wait(semaphore *sem) {
-	return sem_wait(&sem->id);
+int watch_directory(watcher *target, char *path) {
+	return inotify_add_watch(target->id, path, WATCH_MASK);
 }
 
 
 /*
-* Signal a semaphore function.
+* Function used to watch only the files which are complete: written and closed, or moved into the directory.
+* Their events are WATCH_CHANGED and WATCH_CREATED respectively, a file which is still being written gives none.
+* RETURN VALUE:
+*	The id of the watched directory, -1 if it can't be watched
+*/
+int watch_written_files(watcher *target, char *path) {
+	return inotify_add_watch(target->id, path, WATCH_WRITTEN_MASK);
+}
+
+
+void forget_directory(watcher *target, int id) {
+	inotify_rm_watch(target->id, id);
+}
+
+
+/*
+* Function used to wait for the events of a watcher.
 * ARGUMENTS:
-*	-sem:		semaphore structure to send signal to
+*	-target:	the watcher
+*	-buffer:	where the events are saved, they are read with next_watch_event
+*	-size:		size of buffer
+*	-timeout:	milliseconds to wait at most
 * RETURN VALUE:
-*	On success 0 is returned, otherwise -1
+*	The number of bytes saved in buffer, 0 if nothing happened, -1 on error
 */
-int semaphore_signal(semaphore *sem) {
-	return sem_post(&sem->id);
+int read_watcher(watcher *target, char *buffer, int size, int timeout) {
+
+	struct pollfd waiting;
+	waiting.fd	= target->id;
+	waiting.events	= POLLIN;
+
+	if(poll(&waiting, 1, timeout) <= 0)
+		return 0;
+
+	int result = read(target->id, buffer, size);
+
+	if(result < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+	return result;
 }
 
 
+/*
+* Function used to get the events saved by read_watcher one by one.
+* ARGUMENTS:
+*	-buffer, length:	what read_watcher saved
+*	-offset:		position of the next event, it must start from 0
+*	-event:			where the event is saved
+* RETURN VALUE:
+*	1 if an event was saved in event, 0 if there are no more events
+*/
+int next_watch_event(char *buffer, int length, int *offset, watch_event *event) {
+
+	while(*offset + (int)sizeof(struct inotify_event) <= length) {
+
+		struct inotify_event *current = (struct inotify_event *)(buffer + *offset);
+		*offset += sizeof(struct inotify_event) + current->len;
+
+		event->id	= current->wd;
+		event->name	= current->len > 0 ? current->name : NULL;
+
+		if(current->mask & IN_Q_OVERFLOW)
+			event->kind = WATCH_OVERFLOW;
+		else if(current->mask & (IN_IGNORED | IN_DELETE_SELF | IN_UNMOUNT))
+			event->kind = WATCH_GONE;
+		else if(current->mask & (IN_CREATE | IN_MOVED_TO))
+			event->kind = WATCH_CREATED;
+		else if(current->mask & (IN_DELETE | IN_MOVED_FROM))
+			event->kind = WATCH_DELETED;
+		else if(event->name != NULL)
+			event->kind = WATCH_CHANGED;
+		else
+			continue;
+
+		return 1;
+	}
+
+	return 0;
+}
+
 
-int stop_semaphore(semaphore *sem) {
-	return sem_destroy(&sem->id);
-}
\ No newline at end of file
+void stop_watcher(watcher *target) {
+	close(target->id);
+}
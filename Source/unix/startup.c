@@ -12,16 +12,21 @@ void welcome_message() {
 void restart_application(int s);
 void stop_application(int s);
 
+
 /*
 * Start the application, Unix implementation. Save all the configuration specifications on the given startup structure
 */
 int startup(char *dir) {
 
+	//handlers are installed only once, flags must be clean so that they are not reset after the first signal
 	struct sigaction reset_action;
+	memset(&reset_action, 0, sizeof(struct sigaction));
 	reset_action.sa_handler = restart_application;
 	struct sigaction stop_action;
+	memset(&stop_action, 0, sizeof(struct sigaction));
 	stop_action.sa_handler = stop_application;
 	struct sigaction ignore_action;
+	memset(&ignore_action, 0, sizeof(struct sigaction));
 	ignore_action.sa_handler = SIG_IGN;
 
 	
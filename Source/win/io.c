@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <io.h>
 
 
 #include <winsock2.h>
@@ -21,6 +22,22 @@
 #define SINGLE_THREAD_FILE_LIMIT	262144 		//256 kb
 #define FINISH_MESSAGE				"\r\n.\r\n"
 #define MAX_CHAR_PORT				6			//max number of bytes a port can occupy when represtend as string
+#define FRAME_HEADER_SIZE			8
+#define FRAME_BUFFER_SIZE			65536		//64 kb, max payload of a single v2 frame
+
+#define PROTOCOL_V1					1
+#define PROTOCOL_V2					2
+#define PROTOCOL_V3					3			//PROTOCOL_V2 frames, listings can be asked in the binary format
+#define PROTOCOL_V4					4			//PROTOCOL_V3, listings can be asked compressed
+#define PROTOCOL_LOCAL				-1			//connection of the local socket, never used under Windows
+
+#define FRAME_CMD					1
+#define FRAME_STATUS				2
+#define FRAME_DATA					3
+#define FRAME_END					4
+
+#define FRAME_COMPRESSED			1			//flag of DATA frames whose payload is a block of compress_block
+#define STREAM_FIRST_BATCH			4096		//bytes of the first batch of a response, the next ones double up to the batch size
 
 
 typedef union {
@@ -48,6 +65,82 @@ typedef struct {
 	unsigned int seed;
 } XOR_job;
 
+
+typedef struct {
+	unsigned int seed;
+} random_state;
+
+
+typedef struct {
+	int type;
+	int flags;
+	int length;
+} frame_header;
+
+
+typedef struct {
+	io_interface *target;
+	int protocol;
+	int (*sink)(void *param, char *source, int length);
+	void *sink_param;
+	char *batch;
+	int batched;
+	int batch_size;
+	int batch_limit;
+	char *packed;
+} out_stream;
+
+
+/*
+* Structure which defines what a listing must contain (LSTF and LSTR list everything when it's NULL).
+*	-max_depth:	files deeper than this are not listed and their directories are not opened, 0 for no limit.
+*			The files of the listed directory are at depth 1
+*	-format:	LISTING_TEXT or LISTING_BINARY (see format_listing_record)
+*	-fields:	LISTING_FIELD_ flags of what binary records carry besides sizes
+*	-accept:	called with param for every file found: the file is listed in place only if it returns 1.
+*			path is relative to the listed directory ("\dir\file" for LSTR, the name for LSTF)
+*	-finish:	called with param once every file was seen, before the listing is finished
+*/
+typedef struct {
+	int max_depth;
+	int format;
+	int fields;
+	int (*accept)(void *param, int directory, intmax_t size, long mtime, int mode, int depth, char *path);
+	int (*finish)(void *param, out_stream *target);
+	void *param;
+} listing_filter;
+
+
+#define LISTING_SIZE_WIDTH	15		//characters of the size column of a listing
+#define LISTING_TEXT		0		//lines of text, see format_listing_line
+#define LISTING_BINARY		1		//records, see format_listing_record
+#define LISTING_MAGIC		"LSTB"		//first bytes of a binary listing, followed by its version and its fields
+#define LISTING_VERSION		1
+#define LISTING_FIELD_MTIME	1		//records carry the last modification time of the file (seconds)
+#define LISTING_FIELD_MODE	2		//records carry the type and the permissions of the file
+#define LISTING_RECORD_DIRECTORY 1		//flags of a record
+#define LISTING_RECORD_NEXT	2		//the record is the cursor of the next page, not a file
+#define LISTING_RECORD_PARENT	4		//the directory is not listed, it's only sent because some of its files are
+#define LISTING_RECORD_SIZE	64		//max bytes of a record besides its name
+#define WINDOWS_TO_UNIX_EPOCH	11644473600LL	//seconds between 1601 and 1970
+
+
+#define POLL_READ	1
+#define POLL_WRITE	2
+
+/*
+* Structure which symbolizes a set of sockets watched by a single thread. Not available on Windows:
+* start_poller always fails and the server keeps serving connections with blocking listeners.
+*/
+typedef struct {
+	int id;
+} poller;
+
+typedef struct {
+	int events;
+	void *data;
+} poll_event;
+
 /*
 * Function used to create a file, implementation for the windows system.
 * Arguments:
@@ -114,6 +207,16 @@ int delete_file(char *path) {
 	return DeleteFile((LPCTSTR)path);
 }
 
+/*
+* Moves a file to path in a single step, replacing the file which is there (if any): rename fails when the
+* target exists on Windows.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int replace_file(char *source, char *path) {
+	return MoveFileEx((LPCTSTR)source, (LPCTSTR)path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : -1;
+}
+
 /*
 * Close a given io_interface. Windows implementation.
 * ARGUMENTS:
@@ -125,6 +228,17 @@ int close_file(io_interface *target) {
 	return CloseHandle(target->id);
 }
 
+/*
+* Close a given file, with the name the Unix implementation uses. Windows implementation.
+* ARGUMENTS:
+*	-target:	io_interface to close
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int close_interface(io_interface *target) {
+	return CloseHandle(target->id) ? 0 : -1;
+}
+
 /*
 * Close a given socket. Windows implementation
 * ARGUMENTS:
@@ -185,29 +299,208 @@ void bzero(void *target, int size) {
 }
 
 /*
-* Function used to map a given file to memory. Windows implementation.
+* Function used to read the size of a file without opening it. Windows implementation.
 * ARGUMENTS:
-*	-path:		string of the file location to map to memory
-*	-target:	mapped_file to save the result to
+*	-path:		path of the file
 * RETURN VALUE:
-*	On succes 0 is returned, on failure:
-*		-2 if the requested file is currently being used by someone else
-*		-1 otherwise
+*	The size of the file, -1 if it can't be read
 */
-int map_file_to_memory(char *path, mapped_file *target) {
+long file_size(char *path) {
 
-	//oopen file and check size
-	io_interface temp;
+	WIN32_FILE_ATTRIBUTE_DATA data;
 
-	if (open_file(path, &temp) < 0) {
+	if (GetFileAttributesEx((LPCTSTR)path, GetFileExInfoStandard, &data) == 0)
+		return -1;
 
-		//if last error is equal to 32 it means that the file is currently being used by someone else! (Which is equal to ERROR_SHARING_VIOLATION)
-		if (GetLastError() == ERROR_SHARING_VIOLATION)
-			return -2;
-		else
+	return get_file_size(data.nFileSizeHigh, data.nFileSizeLow);
+}
+
+/*
+* Function used to read the size of a file which is already open. Windows implementation.
+* ARGUMENTS:
+*	-source:	the open file
+* RETURN VALUE:
+*	The size of the file, -1 if it can't be read
+*/
+long open_file_size(io_interface *source) {
+
+	DWORD size_high = 0;
+	DWORD size_low = GetFileSize(source->id, &size_high);
+
+	if (size_low == INVALID_FILE_SIZE && GetLastError() != NO_ERROR)
+		return -1;
+
+	return get_file_size(size_high, size_low);
+}
+
+
+/*
+* Function used to create a new file, opened for writing. A file which is already there is never overwritten.
+* Windows implementation.
+* ARGUMENTS:
+*	-path:		path of the file to create
+*	-target:	pointer to the io_interface where the open file is saved
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1 (also if the file exists)
+*/
+int create_new_file(char *path, io_interface *target) {
+
+	HANDLE handle = CreateFile((LPCTSTR)path, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (handle == INVALID_HANDLE_VALUE)
+		return -1;
+
+	target->id = handle;
+	return 0;
+}
+
+
+/*
+* Function used to lock a file which is already open. Files are opened without sharing on Windows, so it's
+* locked already.
+*/
+int lock_file(io_interface *target) {
+	return 0;
+}
+
+
+/*
+* Function used to open (creating it if it's missing) a file which is only used to be locked, see wait_file_lock.
+* Windows implementation.
+* RETURN VALUE:
+*	On success 0 is returned and target is set, otherwise -1
+*/
+int open_lock_file(char *path, io_interface *target) {
+
+	HANDLE handle = CreateFile((LPCTSTR)path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (handle == INVALID_HANDLE_VALUE)
+		return -1;
+
+	target->id = handle;
+	return 0;
+}
+
+
+/*
+* Function used to lock an open file, waiting while someone else holds it. Shared locks are held by many at once,
+* an exclusive one by a single holder. Windows implementation.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int wait_file_lock(io_interface *target, int exclusive) {
+
+	OVERLAPPED position;
+	ZeroMemory(&position, sizeof(position));
+
+	return LockFileEx(target->id, exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, 1, 0, &position) ? 0 : -1;
+}
+
+
+int unlock_file(io_interface *target) {
+
+	OVERLAPPED position;
+	ZeroMemory(&position, sizeof(position));
+
+	return UnlockFileEx(target->id, 0, 1, 0, &position) ? 0 : -1;
+}
+
+
+/*
+* Function used to know if path still names the file of an open stream. Files which are open can't be replaced on
+* Windows, so it always does.
+*/
+int same_file_stream(FILE *stream, char *path) {
+	return 1;
+}
+
+
+/*
+* Function used to read length bytes of an open file, starting at offset. Windows implementation.
+* RETURN VALUE:
+*	The number of bytes read (less than length only if the file ends before), -1 on failure
+*/
+long read_file_at(io_interface *source, char *dest, long length, long offset) {
+
+	long done = 0;
+
+	while (done < length) {
+
+		OVERLAPPED position;
+		DWORD result;
+
+		ZeroMemory(&position, sizeof(position));
+		position.Offset		= (DWORD)(offset + done);
+		position.OffsetHigh	= (DWORD)((unsigned long long)(offset + done) >> 32);
+
+		if (!ReadFile(source->id, dest + done, (DWORD)(length - done), &result, &position))
+			return GetLastError() == ERROR_HANDLE_EOF ? done : -1;
+		if (result == 0)
+			break;
+
+		done += result;
+	}
+
+	return done;
+}
+
+
+/*
+* Function used to write length bytes to an open file, starting at offset. Windows implementation.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int write_file_at(io_interface *target, char *source, long length, long offset) {
+
+	long done = 0;
+
+	while (done < length) {
+
+		OVERLAPPED position;
+		DWORD result;
+
+		ZeroMemory(&position, sizeof(position));
+		position.Offset		= (DWORD)(offset + done);
+		position.OffsetHigh	= (DWORD)((unsigned long long)(offset + done) >> 32);
+
+		if (!WriteFile(target->id, source + done, (DWORD)(length - done), &result, &position) || result == 0)
 			return -1;
+
+		done += result;
 	}
 
+	return 0;
+}
+
+
+/*
+* Function used to write to the disk what was written to a stream. Windows implementation.
+* ARGUMENTS:
+*	-target:	the stream
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int sync_file_stream(FILE *target) {
+
+	if (fflush(target) != 0 || _commit(_fileno(target)) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+* Function used to map a file which is already open to memory. The file then belongs to target: it's closed by
+* unmap_file_from_memory, or here on failure. Windows implementation.
+* ARGUMENTS:
+*	-source:	the file, opened for reading and writing
+*	-target:	mapped_file to save the result to
+* RETURN VALUE:
+*	On succes 0 is returned, otherwise -1
+*/
+int map_interface_to_memory(io_interface *source, mapped_file *target) {
+
+	io_interface temp = *source;
+
 	DWORD size_high = 0;
 	DWORD size_low = GetFileSize(temp.id, &size_high);
 
@@ -243,6 +536,79 @@ int map_file_to_memory(char *path, mapped_file *target) {
 	return 0;
 }
 
+
+/*
+* Function used to map a given file to memory. Windows implementation.
+* ARGUMENTS:
+*	-path:		string of the file location to map to memory
+*	-target:	mapped_file to save the result to
+* RETURN VALUE:
+*	On succes 0 is returned, on failure:
+*		-2 if the requested file is currently being used by someone else
+*		-1 otherwise
+*/
+int map_file_to_memory(char *path, mapped_file *target) {
+
+	//oopen file and check size
+	io_interface temp;
+
+	if (open_file(path, &temp) < 0) {
+
+		//if last error is equal to 32 it means that the file is currently being used by someone else! (Which is equal to ERROR_SHARING_VIOLATION)
+		if (GetLastError() == ERROR_SHARING_VIOLATION)
+			return -2;
+		else
+			return -1;
+	}
+
+	return map_interface_to_memory(&temp, target);
+}
+
+/*
+* Function used to create a file of the given size and map it to memory. Windows implementation.
+* ARGUMENTS:
+*	-path:		string of the file location to create (the call fails if it exists)
+*	-size:		size of the new file
+*	-target:	mapped_file to save the result to
+* RETURN VALUE:
+*	On succes 0 is returned, otherwise -1
+*/
+int create_mapped_file(char *path, long size, mapped_file *target) {
+
+	HANDLE handle;
+	handle = CreateFile((LPCTSTR)path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (handle == INVALID_HANDLE_VALUE)
+		return -1;
+
+	HANDLE mapped_file = NULL;
+	char *view = NULL;
+
+	if (size > 0) {
+
+		//the file is ours, it's removed so that a new try doesn't find it
+		if ((mapped_file = CreateFileMapping(handle, NULL, PAGE_READWRITE, 0, size, NULL)) == NULL) {
+			CloseHandle(handle);
+			DeleteFile((LPCTSTR)path);
+			return -1;
+		}
+
+		if ((view = (char *)MapViewOfFile(mapped_file, FILE_MAP_ALL_ACCESS, 0, 0, size)) == NULL) {
+			CloseHandle(mapped_file);
+			CloseHandle(handle);
+			DeleteFile((LPCTSTR)path);
+			return -1;
+		}
+	}
+
+	target->id   = view;
+	target->fd   = handle;
+	target->map  = mapped_file;
+	target->size = size;
+
+	return 0;
+}
+
 /*
 * Function used to unmap a given mapped_file from memory. Windows implementation
 * ARGUMENTS:
@@ -252,13 +618,17 @@ int map_file_to_memory(char *path, mapped_file *target) {
 */
 int unmap_file_from_memory(mapped_file *target) {
 
-	//unmap view
-	if(UnmapViewOfFile(target->id) == 0)
-		return -1;
+	//empty files have no view
+	if (target->size > 0) {
 
-	//close map handle
-	if(CloseHandle(target->map) == 0)
-		return -1;
+		//unmap view
+		if(UnmapViewOfFile(target->id) == 0)
+			return -1;
+
+		//close map handle
+		if(CloseHandle(target->map) == 0)
+			return -1;
+	}
 
 	//close file handle
 	if(CloseHandle(target->fd) == 0)
@@ -355,6 +725,48 @@ int join_thread(thread *target, void *res) {
 }
 
 
+/*
+* Function used to read a monotonic clock. Windows implementation.
+* RETURN VALUE:
+*	Milliseconds passed from an arbitrary point, only useful to compute intervals
+*/
+long current_time_ms() {
+	return (long)GetTickCount64();
+}
+
+
+/*
+* Function used to make the calling thread wait. Windows implementation.
+*/
+void sleep_ms(long ms) {
+	Sleep((DWORD)ms);
+}
+
+
+/*
+* Function used to give the disk I/O of the calling thread the lowest priority, or to give it back the default
+* one. Windows implementation: background mode also lowers the priority of the thread.
+*/
+int set_background_io(int background) {
+	return SetThreadPriority(GetCurrentThread(), background ? THREAD_MODE_BACKGROUND_BEGIN : THREAD_MODE_BACKGROUND_END) ? 0 : -1;
+}
+
+
+/*
+* Functions used to seed and read a random_state. Windows implementation: the CRT already keeps
+* the state of rand for every thread, so they just call srand and rand.
+*/
+int seed_random(random_state *target, unsigned int seed) {
+	target->seed = seed;
+	srand(seed);
+	return 0;
+}
+
+int next_random(random_state *target) {
+	return rand();
+}
+
+
 /*
 * Function used to host a server.
 * After the sock_interface is correctly created, listen_to_sock(...) must be used in order to listen to the new sock_interface
@@ -416,11 +828,23 @@ int host_server(int portno, io_interface *target) {
 
 
 /*
-* Function used to listen to a previously created sock_interface, which writes to the given target the new io_interface to communicate with.
-* NOTE: this listen operates just as Unix's listen and will block the current process until a client communicates
-* ARGUMENTS:
-* 	-interface: 	sock_interface which wants to be listened
-*	-target:		pointer to the io_interface which the accepted connection wants to be saved
+* Function used to send the small writes of a socket at once instead of waiting for the previous ones to be
+* acknowledged. Windows implementation.
+*/
+int set_socket_nodelay(io_interface *target) {
+
+	BOOL nodelay = TRUE;
+
+	return setsockopt(target->sock, IPPROTO_TCP, TCP_NODELAY, (char *)&nodelay, sizeof(nodelay)) == SOCKET_ERROR ? -1 : 0;
+}
+
+
+/*
+* Function used to listen to a previously created sock_interface, which writes to the given target the new io_interface to communicate with.
+* NOTE: this listen operates just as Unix's listen and will block the current process until a client communicates
+* ARGUMENTS:
+* 	-interface: 	sock_interface which wants to be listened
+*	-target:		pointer to the io_interface which the accepted connection wants to be saved
 * RETURN VALUE:
 *	On succes 0 is returned and target is correctly set.
 *	On failure:	
@@ -447,11 +871,89 @@ int listen_to_sock(io_interface *listen_to, io_interface *target) {
 	}
 	
 	target->sock = client_socket;
+	set_socket_nodelay(target);
+
+	return 0;
+}
+
+
+/*
+* Function used to limit how long blocking reads and writes of a socket can wait.
+* ARGUMENTS:
+*	-target:	the socket
+*	-read_ms:	ms a read can wait for data (0 means forever)
+*	-write_ms:	ms a write can wait for the client (0 means forever)
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int set_socket_timeouts(io_interface *target, long read_ms, long write_ms) {
+
+	DWORD read_time		= (DWORD)read_ms;
+	DWORD write_time	= (DWORD)write_ms;
+
+	if(setsockopt(target->sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&read_time, sizeof(read_time)) == SOCKET_ERROR ||
+		setsockopt(target->sock, SOL_SOCKET, SO_SNDTIMEO, (const char *)&write_time, sizeof(write_time)) == SOCKET_ERROR)
+		return -1;
 
 	return 0;
 }
 
 
+/*
+* Function used to hold back (or to release) the partial TCP segments of a socket. Corking is not
+* available on Windows, segments are sent as they are.
+*/
+int set_socket_cork(io_interface *target, int cork) {
+	return 0;
+}
+
+
+/*
+* Event-driven connections are not available on Windows, these functions always fail.
+*/
+int set_non_blocking(io_interface *target) {
+	return -1;
+}
+
+int start_listening(io_interface *interface) {
+	return -1;
+}
+
+int accept_from_sock(io_interface *interface, io_interface *target) {
+	return -1;
+}
+
+int read_available(char *save_to, int length, io_interface *source) {
+	return -1;
+}
+
+int write_available(char *source, int length, io_interface *target) {
+	return -1;
+}
+
+int start_poller(poller *target) {
+	return -1;
+}
+
+int poller_watch(poller *target, io_interface *source, int events, void *data, int added) {
+	return -1;
+}
+
+int poller_forget(poller *target, io_interface *source) {
+	return -1;
+}
+
+int poller_wait(poller *target, poll_event *events, int max, int timeout) {
+	return -1;
+}
+
+void poller_wake(poller *target) {
+}
+
+void stop_poller(poller *target) {
+}
+
+
 /*
 * UNUSED FUNCTION, IT WILL JUST CALL LISTEN_TO_SOCK
 */
@@ -461,15 +963,17 @@ int listen_to_sock_non_block(io_interface *interface, io_interface *target, int
 
 
 /*
-* Function used to connect to a remote server through sockets. Windows implementation
+* Function used to connect to a remote server through sockets, giving up after timeout_ms if it doesn't answer.
+* Windows implementation
 * ARGUMENTS:
 * 	-addr: 		the address of the server to connect
 *	-portno: 	port number to start the connection
+*	-timeout_ms:	ms the connection can take (0 means the timeout of the system)
 *	-target: 	pointer to the io_interface where the new established connection wants to be saved
 * RETURN VALUE:
 *	On success 0 is returned and target is correctly set, otherwise -1
 */
-int connect_to_server(char* address, int portno, io_interface *target) {
+int connect_to_server_timeout(char* address, int portno, long timeout_ms, io_interface *target) {
 
 	WSADATA wsa_data;
 	target->sock = INVALID_SOCKET;
@@ -500,16 +1004,80 @@ int connect_to_server(char* address, int portno, io_interface *target) {
 		return -1;
 	}
 
-	if ((i_result = connect(target->sock, result->ai_addr, (int)result->ai_addrlen)) != 0) {
+	u_long non_blocking = timeout_ms > 0;
+
+	//the connection is waited for with select, then the socket is blocking again
+	if (non_blocking)
+		ioctlsocket(target->sock, FIONBIO, &non_blocking);
+
+	i_result = connect(target->sock, result->ai_addr, (int)result->ai_addrlen);
+
+	if (i_result != 0 && timeout_ms > 0 && WSAGetLastError() == WSAEWOULDBLOCK) {
+
+		fd_set writable, failed;
+		struct timeval wait = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+
+		FD_ZERO(&writable);
+		FD_ZERO(&failed);
+		FD_SET(target->sock, &writable);
+		FD_SET(target->sock, &failed);
+
+		if (select(0, NULL, &writable, &failed, &wait) == 1 && FD_ISSET(target->sock, &writable))
+			i_result = 0;
+	}
+
+	freeaddrinfo(result);
+
+	if (i_result != 0) {
 		closesocket(target->sock);
 		WSACleanup();
 		return -1;
 	}
 
+	non_blocking = 0;
+	ioctlsocket(target->sock, FIONBIO, &non_blocking);
+
+	set_socket_nodelay(target);
+
 	return 0;
 }
 
 
+/*
+* Function used to connect to a remote server through sockets. Windows implementation
+* ARGUMENTS:
+* 	-addr: 		the address of the server to connect
+*	-portno: 	port number to start the connection
+*	-target: 	pointer to the io_interface where the new established connection wants to be saved
+* RETURN VALUE:
+*	On success 0 is returned and target is correctly set, otherwise -1
+*/
+int connect_to_server(char* address, int portno, io_interface *target) {
+	return connect_to_server_timeout(address, portno, 0, target);
+}
+
+
+/*
+* Local sockets hand over open files as descriptors, which Windows sockets can't carry: local clients connect
+* over TCP like the remote ones. Windows implementation.
+*/
+int host_local_server(char *path, io_interface *target) {
+	return -1;
+}
+
+int connect_to_local_server(char *path, io_interface *target) {
+	return -1;
+}
+
+int write_file_to_socket(char *source, io_interface *file, io_interface *output, io_interface *target) {
+	return -1;
+}
+
+int read_file_from_socket(char *save_to, io_interface *file, io_interface *output, io_interface *source) {
+	return -1;
+}
+
+
 /*
 * Function used to write an integer to the given socket io_interface.
 * ARGUMENTS:
@@ -556,7 +1124,8 @@ int read_int_from_socket(int *int_ptr, io_interface *source) {
 
 	do {
 		written = recv(source->sock, data, left, (int)NULL);
-		if (written < 0) {
+		//the connection was closed before the whole int arrived
+		if (written <= 0) {
 			return -1;
 		}
 		else {
@@ -571,6 +1140,43 @@ int read_int_from_socket(int *int_ptr, io_interface *source) {
 }
 
 
+/*
+* Function used to write the address of the client connected to the given socket io_interface. Windows implementation.
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1 (and save_to is set to an empty string)
+*/
+int peer_address(io_interface *source, char *save_to, int length) {
+
+	struct sockaddr_in client_addr;
+	int cli_len = sizeof(client_addr);
+
+	save_to[0] = '\0';
+
+	if (getpeername(source->sock, (struct sockaddr *)&client_addr, &cli_len) != 0 || client_addr.sin_family != AF_INET)
+		return -1;
+
+	if (inet_ntop(AF_INET, &client_addr.sin_addr, save_to, length) == NULL)
+		return -1;
+
+	return 0;
+}
+
+
+/*
+* Function used to throw away what a client already sent on a connection which is going to be refused. Windows implementation.
+*/
+void discard_input(io_interface *source) {
+
+	char buffer[512];
+	u_long available = 0;
+
+	while (ioctlsocket(source->sock, FIONREAD, &available) == 0 && available > 0) {
+		if (recv(source->sock, buffer, sizeof(buffer), (int)NULL) <= 0)
+			break;
+	}
+}
+
+
 /*
 * Function used to write a string to the given socket io_interface.
 * ARGUMENTS:
@@ -611,11 +1217,19 @@ int write_string_to_socket(char *source, io_interface *target) {
 int read_string_from_socket(char *save_to, io_interface *source) {
 	
 	int written = 0;
-	char last_char = '*'; //just choose a char different from \0
+	int result;
+
+	while (written == 0 || save_to[written - 1] != '\0') {
+
+		if (written == SOCK_PACKET_SIZE)
+			return -1;
+
+		result = recv(source->sock, save_to + written, SOCK_PACKET_SIZE - written, (int)NULL);
+
+		if (result <= 0)
+			return -1;
 
-	while (last_char != '\0') {
-		written += recv(source->sock, save_to + written, SOCK_PACKET_SIZE, (int)NULL);
-		last_char = *(save_to + written - 1);
+		written += result;
 	}
 
 	return 0;
@@ -728,6 +1342,377 @@ int print_string_from_socket(io_interface *source, char *string_end) {
 	return 0;
 }
 
+
+/*
+* Function used to write a given number of bytes to the given socket io_interface. Windows implementation.
+* ARGUMENTS:
+*	-source:	pointer to the bytes which want to be written
+*	-length:	number of bytes to write
+*	-target:	io_interface socket to write the bytes to
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int write_bytes_to_socket(char *source, int length, io_interface *target) {
+
+	int written;
+
+	while (length > 0) {
+		written = send(target->sock, source, length, (int)NULL);
+		if (written < 0)
+			return -1;
+		source += written;
+		length -= written;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to read exactly the given number of bytes from the given socket io_interface. Windows implementation.
+* ARGUMENTS:
+*	-save_to:	pointer to the location where to save the received bytes
+*	-length:	number of bytes to read
+*	-source:	io_interface socket to read the bytes from
+* RETURN VALUE:
+*	On success 0 is returned and save_to is correctly set, otherwise -1
+*/
+int read_bytes_from_socket(char *save_to, int length, io_interface *source) {
+
+	int rb;
+
+	while (length > 0) {
+		rb = recv(source->sock, save_to, length, (int)NULL);
+		if (rb <= 0)
+			return -1;
+		save_to += rb;
+		length -= rb;
+	}
+
+	return 0;
+}
+
+
+/*
+* Function used to read what a socket io_interface received, waiting until something arrives.
+* RETURN VALUE:
+*	The number of bytes read, 0 if the connection was closed, -1 on error
+*/
+int read_some_from_socket(char *save_to, int length, io_interface *source) {
+
+	int rb = recv(source->sock, save_to, length, 0);
+
+	return rb < 0 ? -1 : rb;
+}
+
+
+/*
+* Function used to know if a connection which is not being used was closed by the other side. Windows implementation.
+* RETURN VALUE:
+*	1 if it was closed (or something nobody asked for arrived), 0 if it can be used
+*/
+int is_connection_closed(io_interface *target) {
+
+	char byte;
+	u_long mode = 1;
+
+	ioctlsocket(target->sock, FIONBIO, &mode);
+
+	int rb		= recv(target->sock, &byte, 1, MSG_PEEK);
+	int error	= WSAGetLastError();
+
+	mode = 0;
+	ioctlsocket(target->sock, FIONBIO, &mode);
+
+	return !(rb == SOCKET_ERROR && error == WSAEWOULDBLOCK);
+}
+
+
+/*
+* Function used to write a v2 frame to the given socket io_interface. Windows implementation.
+* ARGUMENTS:
+*	-type:		FRAME_* type of the frame
+*	-flags:		flags of the frame (0 if none)
+*	-payload:	pointer to the payload (can be NULL if length is 0)
+*	-length:	length of the payload, it must not be bigger than FRAME_BUFFER_SIZE
+*	-target:	io_interface socket to write the frame to
+* RETURN VALUE:
+*	On success 0 is returned, otherwise -1
+*/
+int write_frame_to_socket(int type, int flags, char *payload, int length, io_interface *target) {
+
+	unsigned char header[FRAME_HEADER_SIZE];
+	uint32_t converted = htonl(length);
+
+	header[0] = (unsigned char)type;
+	header[1] = (unsigned char)flags;
+	header[2] = 0;
+	header[3] = 0;
+	memcpy(header + 4, &converted, sizeof(converted));
+
+	if (write_bytes_to_socket((char *)header, FRAME_HEADER_SIZE, target) < 0)
+		return -1;
+
+	return write_bytes_to_socket(payload, length, target);
+}
+
+
+/*
+* Function used to read a v2 frame from the given socket io_interface. Windows implementation.
+* ARGUMENTS:
+*	-header:	pointer to the frame_header to save the header of the frame to
+*	-save_to:	pointer to the buffer where the payload will be saved
+*	-max_length:	size of save_to, frames bigger than it are treated as an error
+*	-source:	io_interface socket to read the frame from
+* RETURN VALUE:
+*	On success 0 is returned and both header and save_to are correctly set, otherwise -1
+*/
+int read_frame_from_socket(frame_header *header, char *save_to, int max_length, io_interface *source) {
+
+	unsigned char raw[FRAME_HEADER_SIZE];
+	uint32_t length;
+
+	if (read_bytes_from_socket((char *)raw, FRAME_HEADER_SIZE, source) < 0)
+		return -1;
+
+	memcpy(&length, raw + 4, sizeof(length));
+
+	header->type = raw[0];
+	header->flags = raw[1];
+	header->length = ntohl(length);
+
+	if (header->length < 0 || header->length > max_length)
+		return -1;
+
+	return read_bytes_from_socket(save_to, header->length, source);
+}
+
+
+/*
+* Function used to read the next DATA frame of a response, compressed frames are expanded in *expanded.
+*/
+int read_data_frame_from_socket(frame_header *header, char *buffer, char **expanded, char **payload, io_interface *source) {
+
+	if (read_frame_from_socket(header, buffer, FRAME_BUFFER_SIZE, source) < 0)
+		return -1;
+
+	*payload = buffer;
+
+	if (header->type != FRAME_DATA || (header->flags & FRAME_COMPRESSED) == 0)
+		return 0;
+
+	if (*expanded == NULL && (*expanded = malloc(FRAME_BUFFER_SIZE)) == NULL)
+		return -1;
+
+	if ((header->length = expand_block(buffer, header->length, *expanded, FRAME_BUFFER_SIZE)) < 0)
+		return -1;
+
+	*payload = *expanded;
+
+	return 0;
+}
+
+
+/*
+* Function used to print every DATA frame received by a given socket io_interface, until an END frame is received.
+*/
+int print_frames_from_socket(io_interface *source, char *buffer) {
+
+	frame_header header;
+	char *expanded = NULL;
+	char *payload;
+	int result = -1;
+
+	while (read_data_frame_from_socket(&header, buffer, &expanded, &payload, source) == 0) {
+
+		if (header.type == FRAME_END) {
+			result = 0;
+			break;
+		}
+
+		if (header.type == FRAME_DATA) {
+			fwrite(payload, 1, header.length, stdout);
+			fflush(stdout);
+		}
+	}
+
+	free(expanded);
+
+	return result;
+}
+
+
+/*
+* Functions used to write the status, some bytes and the end of a response to the given out_stream.
+*/
+int stream_bytes(out_stream *out, char *source, int length) {
+
+	if (out->sink != NULL)
+		return out->sink(out->sink_param, source, length);
+
+	return write_bytes_to_socket(source, length, out->target);
+}
+
+int stream_frame_ex(out_stream *out, int type, int flags, char *payload, int length) {
+
+	if (out->sink == NULL)
+		return write_frame_to_socket(type, flags, payload, length, out->target);
+
+	unsigned char header[FRAME_HEADER_SIZE];
+	uint32_t converted = htonl(length);
+
+	header[0] = (unsigned char)type;
+	header[1] = (unsigned char)flags;
+	header[2] = 0;
+	header[3] = 0;
+	memcpy(header + 4, &converted, sizeof(converted));
+
+	if (out->sink(out->sink_param, (char *)header, FRAME_HEADER_SIZE) < 0)
+		return -1;
+
+	return length > 0 ? out->sink(out->sink_param, payload, length) : 0;
+}
+
+int stream_frame(out_stream *out, int type, char *payload, int length) {
+	return stream_frame_ex(out, type, 0, payload, length);
+}
+
+int stream_flush(out_stream *out) {
+
+	if (out->batch == NULL || out->batched == 0)
+		return 0;
+
+	int length = out->batched;
+	int result;
+
+	out->batched = 0;
+
+	if (out->protocol == PROTOCOL_V1)
+		result = stream_bytes(out, out->batch, length);
+	else {
+
+		int packed_length = out->packed != NULL ? compress_block(out->batch, length, out->packed, length - 1) : -1;
+
+		if (packed_length > 0)
+			result = stream_frame_ex(out, FRAME_DATA, FRAME_COMPRESSED, out->packed, packed_length);
+		else
+			result = stream_frame(out, FRAME_DATA, out->batch, length);
+	}
+
+	//the first batches are small, so that the first entries of a listing arrive quickly
+	if (out->batch_limit < out->batch_size)
+		out->batch_limit = out->batch_limit * 2 < out->batch_size ? out->batch_limit * 2 : out->batch_size;
+
+	return result;
+}
+
+void stream_start_batch(out_stream *out, char *buffer, int size) {
+
+	out->batch		= buffer;
+	out->batched		= 0;
+	out->batch_size		= size;
+	out->batch_limit	= size < STREAM_FIRST_BATCH ? size : STREAM_FIRST_BATCH;
+	out->packed		= NULL;
+
+	if (buffer != NULL && out->sink == NULL)
+		set_socket_cork(out->target, 1);
+}
+
+int stream_compress_batch(out_stream *out) {
+
+	if (out->batch == NULL || out->protocol == PROTOCOL_V1)
+		return -1;
+
+	if (out->packed == NULL && (out->packed = malloc(out->batch_size)) == NULL)
+		return -1;
+
+	return 0;
+}
+
+int stream_end_batch(out_stream *out) {
+
+	if (out->batch == NULL)
+		return 0;
+
+	int result = stream_flush(out);
+
+	if (out->sink == NULL)
+		set_socket_cork(out->target, 0);
+
+	free(out->packed);
+
+	out->batch	= NULL;
+	out->packed	= NULL;
+
+	return result;
+}
+
+int stream_status(out_stream *out, int status) {
+
+	int32_t converted = htonl(status);
+
+	if (stream_flush(out) < 0)
+		return -1;
+
+	if (out->protocol == PROTOCOL_V1)
+		return stream_bytes(out, (char *)&converted, sizeof(converted));
+
+	return stream_frame(out, FRAME_STATUS, (char *)&converted, sizeof(converted));
+}
+
+int stream_status_hint(out_stream *out, int status, int hint) {
+
+	int32_t converted[2];
+	converted[0] = htonl(status);
+	converted[1] = htonl(hint);
+
+	if (stream_flush(out) < 0)
+		return -1;
+
+	if (out->protocol == PROTOCOL_V1)
+		return stream_bytes(out, (char *)converted, sizeof(converted));
+
+	return stream_frame(out, FRAME_STATUS, (char *)converted, sizeof(converted));
+}
+
+int stream_write(out_stream *out, char *source, int length) {
+
+	if (out->batch != NULL) {
+
+		if (out->batched + length > out->batch_limit && stream_flush(out) < 0)
+			return -1;
+
+		if (length <= out->batch_size) {
+			memcpy(out->batch + out->batched, source, length);
+			out->batched += length;
+			return 0;
+		}
+	}
+
+	if (out->protocol == PROTOCOL_V1)
+		return stream_bytes(out, source, length);
+
+	while (length > FRAME_BUFFER_SIZE) {
+		if (stream_frame(out, FRAME_DATA, source, FRAME_BUFFER_SIZE) < 0)
+			return -1;
+		source += FRAME_BUFFER_SIZE;
+		length -= FRAME_BUFFER_SIZE;
+	}
+
+	return stream_frame(out, FRAME_DATA, source, length);
+}
+
+int stream_finish(out_stream *out) {
+
+	if (stream_flush(out) < 0)
+		return -1;
+
+	if (out->protocol == PROTOCOL_V1)
+		return stream_bytes(out, FINISH_MESSAGE, (int)strlen(FINISH_MESSAGE));
+
+	return stream_frame(out, FRAME_END, NULL, 0);
+}
+
 /*
 * Function used to wait for an ACK from the given io_interface. NOT USED
 * ARGUMENTS:
@@ -755,15 +1740,124 @@ int send_ack(io_interface *target) {
 }
 
 
+/*
+* Function used to format a line of a listing: the size of the file right aligned on LISTING_SIZE_WIDTH
+* characters ("-" for directories), tabs, prefix and the name of the file. Returns the length of the line.
+*/
+int format_listing_line(char *dest, int directory, long long size, int tabs, char *prefix, char *name) {
+
+	char digits[24];
+	int count = 0;
+	char *index = dest;
+
+	if (directory)
+		digits[count++] = '-';
+	else {
+		unsigned long long value = size > 0 ? (unsigned long long)size : 0;
+		do {
+			digits[count++] = '0' + value % 10;
+			value /= 10;
+		} while (value > 0);
+	}
+
+	for (int i = count; i < LISTING_SIZE_WIDTH; i++)
+		*index++ = ' ';
+
+	while (count > 0)
+		*index++ = digits[--count];
+
+	for (int i = 0; i < tabs; i++)
+		*index++ = '\t';
+
+	int length = (int)strlen(prefix);
+	memcpy(index, prefix, length);
+	index += length;
+
+	length = (int)strlen(name);
+	memcpy(index, name, length);
+	index += length;
+
+	*index++ = '\r';
+	*index++ = '\n';
+
+	return (int)(index - dest);
+}
+
+
+/*
+* Function used to write a number as a varint: 7 bits at a time, the 8th bit set if more bytes follow.
+* Returns the number of bytes written, 10 at most.
+*/
+int write_varint(char *dest, uint64_t value) {
+
+	int length = 0;
+
+	do {
+		dest[length] = (char)(value & 0x7F);
+		value >>= 7;
+		if (value != 0)
+			dest[length] |= (char)0x80;
+		length++;
+	} while (value != 0);
+
+	return length;
+}
+
+
+/*
+* Function used to format a record of a binary listing, see the Unix implementation. Returns its length.
+*/
+int format_listing_record(char *dest, int fields, int flags, intmax_t size, long mtime, int mode, int depth, int shared, char *name) {
+
+	int length = 0;
+	int name_length = (int)strlen(name);
+	int directory = flags & LISTING_RECORD_DIRECTORY;
+
+	dest[length++] = (char)flags;
+	length += write_varint(dest + length, (uint64_t)depth);
+
+	if (depth == 0)
+		length += write_varint(dest + length, (uint64_t)shared);
+	if (!directory)
+		length += write_varint(dest + length, (uint64_t)(size > 0 ? size : 0));
+	if (fields & LISTING_FIELD_MTIME)
+		length += write_varint(dest + length, (uint64_t)(mtime > 0 ? mtime : 0));
+	if (fields & LISTING_FIELD_MODE)
+		length += write_varint(dest + length, (uint64_t)(unsigned int)mode);
+
+	length += write_varint(dest + length, (uint64_t)name_length);
+	memcpy(dest + length, name, name_length);
+
+	return length + name_length;
+}
+
+
+/*
+* Function used to get the Unix time and a Unix-like mode of a file found by FindFirstFile: directories are
+* 040755, files 0100644 (0100444 if they're read-only).
+*/
+void find_data_times(WIN32_FIND_DATA *data, long *mtime, int *mode) {
+
+	ULARGE_INTEGER time;
+
+	time.LowPart	= data->ftLastWriteTime.dwLowDateTime;
+	time.HighPart	= data->ftLastWriteTime.dwHighDateTime;
+
+	*mtime	= (long)(time.QuadPart / 10000000 - WINDOWS_TO_UNIX_EPOCH);
+	*mode	= data->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ? 040755 : data->dwFileAttributes & FILE_ATTRIBUTE_READONLY ? 0100444 : 0100644;
+}
+
+
 /*
 * Function used to list all the files in the given directory to the given socket io_interface.
 * ARGUMENTS:
 *	-path:		char pointer with the directory which wants to be listed
 *	-target:	socket io_interface which directory list wants to be sent to
+*	-filter:	what the listing must contain, NULL for everything
 * RETURN VALUE:
 *	On success 0 is returned, otherwise -1
 */
-int LSTF(char *path, io_interface *target) {
+int LSTF(char *path, out_stream *target, listing_filter *filter) {
 	WIN32_FIND_DATA fd_file;
 	HANDLE h_find = NULL;
 
@@ -787,30 +1881,36 @@ int LSTF(char *path, io_interface *target) {
 			char to_send[SOCK_PACKET_SIZE];
 
 			long file_size = get_file_size(fd_file.nFileSizeHigh, fd_file.nFileSizeLow);
+			int directory = (fd_file.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+			long mtime;
+			int mode;
 
-			char *index = to_send;
+			find_data_times(&fd_file, &mtime, &mode);
 
-			if (fd_file.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-				index += sprintf(to_send, "%15s\t\t", "-");
-			else
-				index += sprintf(to_send, "%15ld\t\t", file_size);
+			if (filter != NULL && !filter->accept(filter->param, directory, file_size, mtime, mode, 1, (char *)fd_file.cFileName))
+				continue;
 
-			sprintf(index, "%s\r\n", s_path);
+			int length = filter != NULL && filter->format == LISTING_BINARY ?
+				format_listing_record(to_send, filter->fields, directory ? LISTING_RECORD_DIRECTORY : 0, file_size, mtime, mode, 1, 0, (char *)fd_file.cFileName) :
+				format_listing_line(to_send, directory, file_size, 2, "", (char *)fd_file.cFileName);
 
-			print_string_to_socket(to_send, target);
+			stream_write(target, to_send, length);
 
 		}
 	} while (FindNextFile(h_find, &fd_file));
 
 
-	print_string_to_socket(FINISH_MESSAGE, target);
+	if (filter != NULL)
+		filter->finish(filter->param, target);
+
+	stream_finish(target);
 
 	FindClose(h_find);
 
 	return 0;
 }
 
-int LSTR_inner(char *path, io_interface *target,  int indentation) {
+int LSTR_inner(char *path, out_stream *target,  int indentation, int root_length, listing_filter *filter) {
 
 	WIN32_FIND_DATA fd_file;
 	HANDLE h_find = NULL;
@@ -832,27 +1932,32 @@ int LSTR_inner(char *path, io_interface *target,  int indentation) {
 
 			sprintf(s_path, "%s\\%s", path, (char *)fd_file.cFileName);
 
-			char to_send[SOCK_PACKET_SIZE];
+			char to_send[SOCK_PACKET_SIZE * 2];
 
 			long file_size = get_file_size(fd_file.nFileSizeHigh, fd_file.nFileSizeLow);
+			int directory = (fd_file.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+			long mtime;
+			int mode;
 
-			char *index = to_send;
+			find_data_times(&fd_file, &mtime, &mode);
 
-			if (fd_file.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-				index += sprintf(to_send, "%15s", "-");
-			else
-				index += sprintf(to_send, "%15ld", file_size);
-			
-			for (int i = 0; i < indentation; i++)
-				index += sprintf(index, "\t");
+			//directories which would only hold files too deep are not opened
+			int descend = directory && (filter == NULL || filter->max_depth == 0 || indentation - 1 < filter->max_depth);
+			int listed = filter == NULL || filter->accept(filter->param, directory, file_size, mtime, mode, indentation - 1, s_path + root_length);
+			int length = 0;
 
-			sprintf(index, "%s\r\n", s_path);
+			//binary records of files only say which directory they're in: directories which are not listed are sent anyway
+			if (filter != NULL && filter->format == LISTING_BINARY && (listed || descend))
+				length = format_listing_record(to_send, filter->fields, (directory ? LISTING_RECORD_DIRECTORY : 0) | (listed ? 0 : LISTING_RECORD_PARENT),
+					file_size, mtime, mode, indentation - 1, 0, (char *)fd_file.cFileName);
+			else if (listed)
+				length = format_listing_line(to_send, directory, file_size, indentation, ".", s_path + root_length);
 
-			if(print_string_to_socket(to_send, target) < 0)
+			if (length > 0 && stream_write(target, to_send, length) < 0)
 				return -1;
 
-			if (fd_file.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-				LSTR_inner(s_path, target, indentation + 1);
+			if (descend)
+				LSTR_inner(s_path, target, indentation + 1, root_length, filter);
 			
 		}
 	} while (FindNextFile(h_find, &fd_file));
@@ -863,30 +1968,43 @@ int LSTR_inner(char *path, io_interface *target,  int indentation) {
 	return 0;
 }
 
-int LSTR(char *path, io_interface* target) {
+int LSTR(char *path, out_stream* target, listing_filter *filter) {
+
+	LSTR_inner(path, target, 2, (int)strlen(path), filter);
 
-	LSTR_inner(path, target, 2);
+	if (filter != NULL)
+		filter->finish(filter->param, target);
 
-	print_string_to_socket(FINISH_MESSAGE, target);
+	stream_finish(target);
 
 	return 0;
 }
 
-int LST_receive(io_interface *source) {
+int print_body_from_socket(io_interface *source, int protocol) {
+
+	if (protocol == PROTOCOL_V1)
+		return print_string_from_socket(source, FINISH_MESSAGE);
 
 	char *buffer;
 
-	if ((buffer = malloc(SOCK_PACKET_SIZE)) == NULL)
+	if ((buffer = malloc(FRAME_BUFFER_SIZE)) == NULL)
 		return -1;
 
+	int result = print_frames_from_socket(source, buffer);
+
+	free(buffer);
+
+	return result;
+}
+
+int LST_receive(io_interface *source, int protocol) {
+
 	printf("\nSize (in bytes):\tFile name:\n\n");
 
-	int result = print_string_from_socket(source, FINISH_MESSAGE);
+	int result = print_body_from_socket(source, protocol);
 
 	printf("\n");
 
-	free(buffer);
-
 	return result;
 }
 
@@ -948,4 +2066,74 @@ int semaphore_signal(semaphore *sem) {
 
 int stop_semaphore(semaphore *sem) {
 	return CloseHandle(sem->id) == 0 ? -1 : 0;
-}
\ No newline at end of file
+}
+
+
+
+#define WATCH_CREATED		1
+#define WATCH_DELETED		2
+#define WATCH_CHANGED		3
+#define WATCH_OVERFLOW		4
+#define WATCH_GONE		5
+
+
+typedef struct {
+	char *name;
+	int directory;
+	int link;
+	intmax_t size;
+} dir_entry;
+
+
+typedef struct {
+	int id;
+	int kind;
+	char *name;
+} watch_event;
+
+
+typedef struct {
+	HANDLE id;
+} watcher;
+
+
+/*
+* Watching directories is not available on Windows, these functions always fail (so the metadata
+* cache is never used and listings always read the disk).
+*/
+int read_directory(char *path, dir_entry **entries) {
+	return -1;
+}
+
+void free_directory(dir_entry *entries, int count) {
+}
+
+int stat_entry(char *path, int *directory, int *link, intmax_t *size) {
+	return -1;
+}
+
+int start_watcher(watcher *target) {
+	return -1;
+}
+
+int watch_directory(watcher *target, char *path) {
+	return -1;
+}
+
+int watch_written_files(watcher *target, char *path) {
+	return -1;
+}
+
+void forget_directory(watcher *target, int id) {
+}
+
+int read_watcher(watcher *target, char *buffer, int size, int timeout) {
+	return -1;
+}
+
+int next_watch_event(char *buffer, int length, int *offset, watch_event *event) {
+	return 0;
+}
+
+void stop_watcher(watcher *target) {
+}